@@ -0,0 +1,480 @@
+/*
+ * SUMMARY:      Func_Batch.c
+ * USAGE:        the similarity of a block of target days, in tiles of target x candidate days
+ * AUTHOR:       Xiaoxiang Guan
+ * ORG:          Section Hydrology, GFZ
+ * E-MAIL:       guan@gfz-potsdam.de
+ * ORIG-DATE:    Oct-2024
+ * DESCRIPTION:  the target days of a block are grouped by their class (and window):
+ *               all the days of a group are compared with the same candidate pool, the
+ *               daily similarities of the group are a dense matrix of (target, library day)
+ *               pairs, computed in tiles of TILE_ROWS x TILE_COLS images (they stay in the
+ *               cache while each is used TILE_COLS or TILE_ROWS times), each tile by the
+ *               blocked kernels SSIM_cross_tile() and Manhattan_tile();
+ *               the tiles are shared out among the threads;
+ *               kNN_day_select() then takes the similarity of its candidates from the row
+ *               of its target day instead of computing them one pair at a time
+ * DESCRIP-END.
+ * FUNCTIONS:    SIMI_batch_init(); SIMI_batch_free(); SIMI_batch_block();
+ *
+ * COMMENTS:
+ * - the values (and their rounding) are those of SIMI_pair() and kNN_SSIM_similarity():
+ *   the selection does not change; Manhattan distance: those of Manhattan_distance()
+ *   at any SIMD level (see Func_MD.c)
+ * - CONTINUITY 3 or 5: the window of target day t compares day t + s with library day c + s;
+ *   if the days t + s and c + s of a group overlap enough, each pair is computed once (one
+ *   matrix of the distinct days t + s and c + s), otherwise one matrix per offset s
+ * - HAVE_BLAS (cmake -DKNN_BLAS=ON): the SSIM covariances of a tile by dgemm of the centred
+ *   images; faster for many stations, but summed in another order: the last digits of
+ *   the similarity, and then rarely the selection, can differ from the default build
+ * - VAR 5 (solar radiation) is not batched: its candidates depend on Solar_MAX_lump_filter()
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "def_struct.h"
+#include "Func_SSIM.h"
+#include "Func_MD.h"
+#include "Func_Fragments.h"
+#include "Func_Initialize.h"
+#include "Func_Disaggregate.h"
+#include "Func_Batch.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#define THREAD_ID omp_get_thread_num()
+#else
+#define THREAD_ID 0
+#endif
+
+#ifdef HAVE_BLAS
+/* BLAS (Fortran interface) */
+void dgemm_(
+    const char *transa, const char *transb, const int *m, const int *n, const int *k,
+    const double *alpha, const double *a, const int *lda, const double *b, const int *ldb,
+    const double *beta, double *c, const int *ldc
+);
+#endif
+
+static void *batch_grow(
+    void *p,
+    size_t *cap,
+    size_t n,
+    size_t size
+) {
+    /* at least n elements of size bytes; NULL: out of memory */
+    if (n <= *cap)
+    {
+        return p;
+    }
+    free(p);
+    p = malloc(size * n);
+    *cap = (p != NULL) ? n : 0;
+    return p;
+}
+
+int SIMI_batch_init(
+    struct SIMI_batch *p_bt,
+    struct Para_global *p_gp,
+    int n_block,
+    size_t n_lib,
+    int n_threads
+) {
+    /**************
+     * Description:
+     *      the buffers of the batched similarity of n_block target days
+     * Parameters:
+     *      n_lib: the library days
+     * Return:
+     *      0; -1: out of memory (nothing allocated)
+     * ***********/
+    int skip = (int)((p_gp->CONTINUITY - 1) / 2);
+    int i;
+    memset(p_bt, 0, sizeof(struct SIMI_batch));
+    p_bt->n_block = n_block;
+    p_bt->n_threads = n_threads;
+    n_lib = (n_lib > 0) ? n_lib : 1;
+    p_bt->sim = (double **)calloc(n_block, sizeof(double *));
+    p_bt->tgt = (int *)malloc(sizeof(int) * n_block);
+    p_bt->row = (int *)malloc(sizeof(int) * n_block * p_gp->CONTINUITY);
+    p_bt->row_map = (int *)malloc(sizeof(int) * (n_block + 2 * skip));
+    p_bt->col = (int *)malloc(sizeof(int) * n_lib);
+    p_bt->col_map = (int *)malloc(sizeof(int) * n_lib);
+    p_bt->pack = (double *)malloc(sizeof(double) * (TILE_ROWS + TILE_COLS) * p_gp->N_STATION * n_threads);
+    if (p_bt->sim == NULL || p_bt->tgt == NULL || p_bt->row == NULL || p_bt->row_map == NULL ||
+        p_bt->col == NULL || p_bt->col_map == NULL || p_bt->pack == NULL)
+    {
+        SIMI_batch_free(p_bt);
+        return -1;
+    }
+    for (i = 0; i < n_block + 2 * skip; i++)
+    {
+        p_bt->row_map[i] = -1;
+    }
+    for (i = 0; i < n_lib; i++)
+    {
+        p_bt->col_map[i] = -1;
+    }
+    return 0;
+}
+
+void SIMI_batch_free(
+    struct SIMI_batch *p_bt
+) {
+    free(p_bt->sim);
+    free(p_bt->S);
+    free(p_bt->B);
+    free(p_bt->tgt);
+    free(p_bt->row);
+    free(p_bt->row_map);
+    free(p_bt->col);
+    free(p_bt->col_map);
+    free(p_bt->pack);
+    memset(p_bt, 0, sizeof(struct SIMI_batch));
+}
+
+static void batch_tile(
+    struct df_rr_d *p_rrd,
+    struct df_rr_h *p_rrh,
+    struct Para_global *p_gp,
+    int order,
+    const int *row,
+    int n_row,
+    const int *col,
+    int n_col,
+    double *B,
+    int ldb,
+    double *pack
+) {
+    /**************
+     * Description:
+     *      the daily similarities of the target days row[] and the library days col[]
+     *      (at most TILE_ROWS x TILE_COLS), as SIMI_pair(): B[r][c];
+     *      NAN: an empty image (SSIM), reported if the pair is used
+     * ***********/
+    int N = p_gp->N_STATION;
+    int f_pre = (p_gp->PREPROCESS != 0);
+    double *img1[TILE_ROWS], *img2[TILE_COLS];
+    struct SSIM_stats *st1[TILE_ROWS], *st2[TILE_COLS];
+    double mean1[TILE_ROWS], mean2[TILE_COLS];
+    int r, c;
+    for (r = 0; r < n_row; r++)
+    {
+        img1[r] = f_pre ? (p_rrd + row[r])->p_rr_pre : (p_rrd + row[r])->p_rr;
+        st1[r] = f_pre ? &(p_rrd + row[r])->stats_pre : &(p_rrd + row[r])->stats;
+        mean1[r] = st1[r]->mean;
+    }
+    for (c = 0; c < n_col; c++)
+    {
+        img2[c] = f_pre ? (p_rrh + col[c])->p_rr_pre : (p_rrh + col[c])->rr_d;
+        st2[c] = f_pre ? &(p_rrh + col[c])->stats_pre : &(p_rrh + col[c])->stats;
+        mean2[c] = st2[c]->mean;
+    }
+    if (order == 0)
+    {
+        // Manhattan distance
+        Manhattan_tile(img1, n_row, img2, n_col, p_gp->NODATA, N, B, ldb, pack);
+        return;
+    }
+
+    /* SSIM: the covariances of the tile, then the index of each pair */
+#ifdef HAVE_BLAS
+    double *X = pack, *Y = pack + (size_t)TILE_ROWS * N;
+    for (r = 0; r < n_row; r++)
+    {
+        for (int j = 0; j < N; j++)
+        {
+            X[(size_t)r * N + j] = (isNODATA(img1[r][j], p_gp->NODATA) == 0) ? img1[r][j] - mean1[r] : 0.0;
+        }
+    }
+    for (c = 0; c < n_col; c++)
+    {
+        for (int j = 0; j < N; j++)
+        {
+            Y[(size_t)c * N + j] = img2[c][j] - mean2[c];
+        }
+    }
+    const double one = 1.0, zero = 0.0;
+    dgemm_("T", "N", &n_col, &n_row, &N, &one, Y, &N, X, &N, &zero, B, &ldb);
+#else
+    SSIM_cross_tile(img1, mean1, n_row, img2, mean2, n_col, p_gp->NODATA, N, B, ldb);
+#endif
+    int dark1[TILE_ROWS], dark2[TILE_COLS];
+    for (r = 0; r < n_row; r++)
+    {
+        dark1[r] = (p_gp->VAR == 4 && SUN_dark(N, (p_rrd + row[r])->p_rr) == 1);
+    }
+    for (c = 0; c < n_col; c++)
+    {
+        dark2[c] = (p_gp->VAR == 4 && SUN_dark(N, (p_rrh + col[c])->rr_d) == 1);
+    }
+    for (r = 0; r < n_row; r++)
+    {
+        double *p_B = B + (size_t)r * ldb;
+        for (c = 0; c < n_col; c++)
+        {
+            if (dark1[r] || dark2[c])
+            {
+                p_B[c] = 0.0;   // a dark day (sunshine duration)
+            }
+            else if (st1[r]->counts <= 1 || st2[c]->counts <= 1)
+            {
+                p_B[c] = NAN;
+            } else {
+                double L = (st1[r]->max > st2[c]->max) ? st1[r]->max : st2[c]->max;
+                double image_cov = 1 / ((double) st1[r]->counts - 1) * p_B[c];
+                p_B[c] = SSIM_combine(
+                    st1[r]->mean, st2[c]->mean, st1[r]->sd, st2[c]->sd, image_cov, L, p_gp->k, p_gp->power);
+            }
+        }
+    }
+}
+
+static void batch_matrix(
+    struct df_rr_d *p_rrd,
+    struct df_rr_h *p_rrh,
+    struct Para_global *p_gp,
+    int order,
+    const int *row,
+    int n_row,
+    const int *col,
+    int n_col,
+    double *B,
+    struct SIMI_batch *p_bt
+) {
+    /**************
+     * Description:
+     *      the daily similarities of the target days row[] and the library days col[]:
+     *      B[n_row][n_col], tile by tile in parallel
+     * ***********/
+    int n_rt = (n_row + TILE_ROWS - 1) / TILE_ROWS;
+    int n_ct = (n_col + TILE_COLS - 1) / TILE_COLS;
+    size_t n_pack = (size_t)(TILE_ROWS + TILE_COLS) * p_gp->N_STATION;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 1) num_threads(p_bt->n_threads) if (n_rt * n_ct > 1)
+#endif
+    for (int t = 0; t < n_rt * n_ct; t++)
+    {
+        int r0 = (t / n_ct) * TILE_ROWS, c0 = (t % n_ct) * TILE_COLS;
+        int nr = (n_row - r0 < TILE_ROWS) ? n_row - r0 : TILE_ROWS;
+        int nc = (n_col - c0 < TILE_COLS) ? n_col - c0 : TILE_COLS;
+        batch_tile(
+            p_rrd, p_rrh, p_gp, order, row + r0, nr, col + c0, nc,
+            B + (size_t)r0 * n_col + c0, n_col,
+            p_bt->pack + THREAD_ID * n_pack);
+    }
+}
+
+static int batch_group(
+    struct df_rr_d *p_rrd,
+    struct df_rr_h *p_rrh,
+    struct Para_global *p_gp,
+    int order,
+    int base,
+    int m,
+    const int *pool,
+    int p,
+    int skip,
+    double *S,
+    struct SIMI_batch *p_bt
+) {
+    /**************
+     * Description:
+     *      the windowed similarity of the m target days tgt[] to the p candidates pool[]:
+     *      S[m][p], as kNN_SSIM_similarity()
+     * Parameters:
+     *      base: the first target day of the block
+     *      skip: the window of the group (skip_temp of kNN_day_select())
+     * Return:
+     *      0; -1: out of memory (S not computed)
+     * ***********/
+    double w_image[5];
+    SIMI_window_weights(skip, w_image);
+    int *tgt = p_bt->tgt;
+    int n_row = 0, n_col = 0;
+    int i, j, s;
+    size_t n_pair = (size_t)m * p;
+
+    /* the distinct target days t + s and library days c + s of the windows */
+    int *row_map = p_bt->row_map + skip - base;     // row_map[a]: day a of p_rrd
+    for (i = 0; i < m; i++)
+    {
+        for (s = 0 - skip; s < 1 + skip; s++)
+        {
+            if (row_map[tgt[i] + s] < 0)
+            {
+                row_map[tgt[i] + s] = n_row;
+                p_bt->row[n_row++] = tgt[i] + s;
+            }
+        }
+    }
+    for (j = 0; j < p; j++)
+    {
+        for (s = 0 - skip; s < 1 + skip; s++)
+        {
+            if (p_bt->col_map[pool[j] + s] < 0)
+            {
+                p_bt->col_map[pool[j] + s] = n_col;
+                p_bt->col[n_col++] = pool[j] + s;
+            }
+        }
+    }
+
+    int f_union = ((size_t)n_row * n_col <= (size_t)(2 * skip + 1) * n_pair);
+    p_bt->B = (double *)batch_grow(
+        p_bt->B, &p_bt->B_cap, f_union ? (size_t)n_row * n_col : n_pair, sizeof(double));
+    /* out of memory (B: NULL): nothing computed, the maps are cleared below */
+    if (p_bt->B != NULL && f_union)
+    {
+        /* each pair once: the matrix of the distinct days */
+        batch_matrix(p_rrd, p_rrh, p_gp, order, p_bt->row, n_row, p_bt->col, n_col, p_bt->B, p_bt);
+        for (i = 0; i < m; i++)
+        {
+            double *p_S = S + (size_t)i * p;
+            for (j = 0; j < p; j++)
+            {
+                p_S[j] = 0.0;
+                for (s = 0 - skip; s < 1 + skip; s++)
+                {
+                    double SIMI_temp = w_image[s + skip] * p_bt->B[
+                        (size_t)row_map[tgt[i] + s] * n_col + p_bt->col_map[pool[j] + s]];
+                    p_S[j] += SIMI_temp;
+                }
+            }
+        }
+    } else if (p_bt->B != NULL) {
+        /* one matrix per offset s: the pairs (t + s, c + s) */
+        for (size_t k = 0; k < n_pair; k++)
+        {
+            S[k] = 0.0;
+        }
+        for (s = 0 - skip; s < 1 + skip; s++)
+        {
+            for (i = 0; i < m; i++)
+            {
+                p_bt->row[i] = tgt[i] + s;
+            }
+            for (j = 0; j < p; j++)
+            {
+                p_bt->col[j] = pool[j] + s;
+            }
+            batch_matrix(p_rrd, p_rrh, p_gp, order, p_bt->row, m, p_bt->col, p, p_bt->B, p_bt);
+            for (size_t k = 0; k < n_pair; k++)
+            {
+                double SIMI_temp = w_image[s + skip] * p_bt->B[k];
+                S[k] += SIMI_temp;
+            }
+        }
+    }
+
+    /* clear the maps for the next group */
+    for (i = 0; i < m; i++)
+    {
+        for (s = 0 - skip; s < 1 + skip; s++)
+        {
+            row_map[tgt[i] + s] = -1;
+        }
+    }
+    for (j = 0; j < p; j++)
+    {
+        for (s = 0 - skip; s < 1 + skip; s++)
+        {
+            p_bt->col_map[pool[j] + s] = -1;
+        }
+    }
+    return (p_bt->B != NULL) ? 0 : -1;
+}
+
+int SIMI_batch_block(
+    struct df_rr_d *p_rrd,
+    struct df_rr_h *p_rrh,
+    struct Para_global *p_gp,
+    struct class_index *p_ci,
+    double *Solar_MAX,
+    int b0,
+    int b1,
+    int nrow_rr_d,
+    int order,
+    int skip,
+    struct SIMI_batch *p_bt
+) {
+    /**************
+     * Description:
+     *      the similarity of the target days b0, ..., b1 - 1 (at most n_block days)
+     *      to the candidate pools of their classes: sim[d - b0] (kNN_day_select());
+     *      called outside of a parallel region, the tiles are computed in parallel
+     * Parameters:
+     *      nrow_rr_d: the number of days in p_rrd
+     *      skip: (CONTINUITY - 1) / 2
+     * Return:
+     *      0; -1: out of memory
+     * ***********/
+    int d, c, g, n_can;
+    int *pool;
+    size_t n_S = 0;
+    for (d = b0; d < b1; d++)
+    {
+        p_bt->sim[d - b0] = NULL;
+    }
+    if (Solar_MAX != NULL)
+    {
+        return 0;
+    }
+    /* dark days are not selected (kNN_day_select()) */
+    for (d = b0; d < b1; d++)
+    {
+        if (p_gp->VAR == 4 && SUN_dark(p_gp->N_STATION, (p_rrd + d)->p_rr) == 1)
+        {
+            continue;
+        }
+        n_S += class_pool(p_ci, (p_rrd + d)->class, &pool);
+    }
+    p_bt->S = (double *)batch_grow(p_bt->S, &p_bt->S_cap, n_S, sizeof(double));
+    if (p_bt->S == NULL)
+    {
+        return -1;
+    }
+
+    /* the groups: the days of one class with the same window */
+    size_t off = 0;
+    for (c = 0; c < p_ci->n_class; c++)
+    {
+        n_can = class_pool(p_ci, c, &pool);
+        if (n_can == 0)
+        {
+            continue;
+        }
+        for (g = 0; g < ((skip > 0) ? 2 : 1); g++)
+        {
+            int skip_g = (g == 0) ? 0 : skip;
+            int m = 0;
+            for (d = b0; d < b1; d++)
+            {
+                int skip_temp = (d >= skip && d < nrow_rr_d - skip) ? skip : 0;
+                if ((p_rrd + d)->class != c || skip_temp != skip_g ||
+                    (p_gp->VAR == 4 && SUN_dark(p_gp->N_STATION, (p_rrd + d)->p_rr) == 1))
+                {
+                    continue;
+                }
+                p_bt->tgt[m++] = d;
+            }
+            if (m == 0)
+            {
+                continue;
+            }
+            if (batch_group(p_rrd, p_rrh, p_gp, order, b0, m, pool, n_can, skip_g, p_bt->S + off, p_bt) != 0)
+            {
+                return -1;
+            }
+            for (int i = 0; i < m; i++)
+            {
+                p_bt->sim[p_bt->tgt[i] - b0] = p_bt->S + off + (size_t)i * n_can;
+            }
+            off += (size_t)m * n_can;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,30 @@
+#ifndef FUNC_BATCH
+#define FUNC_BATCH
+
+int SIMI_batch_init(
+    struct SIMI_batch *p_bt,
+    struct Para_global *p_gp,
+    int n_block,
+    size_t n_lib,
+    int n_threads
+);
+
+void SIMI_batch_free(
+    struct SIMI_batch *p_bt
+);
+
+int SIMI_batch_block(
+    struct df_rr_d *p_rrd,
+    struct df_rr_h *p_rrh,
+    struct Para_global *p_gp,
+    struct class_index *p_ci,
+    double *Solar_MAX,
+    int b0,
+    int b1,
+    int nrow_rr_d,
+    int order,
+    int skip,
+    struct SIMI_batch *p_bt
+);
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef FUNC_BINARY
+#define FUNC_BINARY
+
+void Bin_out_open(
+    struct Para_global *p_gp,
+    struct Bin_out *p_bo
+);
+
+void Bin_out_day(
+    struct Bin_out *p_bo,
+    struct df_rr_h *p_rrh,
+    struct Para_global *p_gp,
+    struct df_rr_d *p_rrd_day,
+    struct kNN_day *p_day,
+    int day,
+    struct df_rr_h *p_out,
+    unsigned char *rec
+);
+
+void Bin_out_date(
+    struct Bin_out *p_bo,
+    struct Date date
+);
+
+void Bin_out_close(
+    struct Bin_out *p_bo
+);
+
+int Bin_file_open(
+    char fname[],
+    struct Bin_file *p_bf
+);
+
+int Bin_file_day(
+    struct Bin_file *p_bf,
+    struct Date date
+);
+
+double Bin_file_value(
+    struct Bin_file *p_bf,
+    int day,
+    int run,
+    int hour,
+    int station
+);
+
+void Bin_file_close(
+    struct Bin_file *p_bf
+);
+
+void Bin_to_CSV(
+    struct Bin_file *p_bf,
+    FILE *fp_out
+);
+
+int Bin_command(
+    int argc,
+    char *argv[]
+);
+
+#endif
@@ -0,0 +1,88 @@
+/*
+ * SUMMARY:      Func_CPU.c
+ * USAGE:        runtime detection of the CPU features (SIMD instruction sets)
+ * AUTHOR:       Xiaoxiang Guan
+ * ORG:          Section Hydrology, GFZ
+ * E-MAIL:       guan@gfz-potsdam.de
+ * ORIG-DATE:    Oct-2024
+ * DESCRIPTION:  the vectorized kernels (SSIM, Manhattan distance) come in
+ *               scalar, AVX2 and AVX-512 variants;
+ *               the variant is chosen at runtime based on the detected CPU features,
+ *               so that the same executable runs on any x86-64 machine
+ * DESCRIP-END.
+ * FUNCTIONS:    CPU_SIMD_level(); CPU_SIMD_limit(); CPU_SIMD_name();
+ *
+ * COMMENTS:
+ * the detection relies on the GCC / Clang builtins;
+ * other compilers or architectures always use the scalar code;
+ * CPU_SIMD_limit() lowers the level, so that the variants can be compared (test_SSIM.c, test_MD.c)
+ *
+ */
+
+#include <stdio.h>
+#include "Func_CPU.h"
+
+static int simd_detected = -1;  // detected once, then only read
+static int simd_level = -1;     // the level in use: at most the detected one
+
+int CPU_SIMD_level()
+{
+    /*************
+     * Description:
+     *      the best SIMD level supported by both the compiler and the CPU
+     *      call it once at startup (before any thread is created)
+     * **********/
+    if (simd_detected < 0)
+    {
+        simd_detected = SIMD_SCALAR;
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f"))
+        {
+            simd_detected = SIMD_AVX512;
+        }
+        else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        {
+            simd_detected = SIMD_AVX2;
+        }
+#endif
+        simd_level = simd_detected;
+    }
+    return simd_level;
+}
+
+int CPU_SIMD_limit(
+    int level
+)
+{
+    /*************
+     * Description:
+     *      use the SIMD level (SIMD_SCALAR, SIMD_AVX2, SIMD_AVX512), 
+     *      or the detected one if the CPU does not support it;
+     *      like CPU_SIMD_level(), call it before any thread is created
+     * Return:
+     *      the level in use
+     * **********/
+    CPU_SIMD_level();
+    simd_level = (level < simd_detected) ? level : simd_detected;
+    if (simd_level < SIMD_SCALAR)
+    {
+        simd_level = SIMD_SCALAR;
+    }
+    return simd_level;
+}
+
+const char *CPU_SIMD_name(
+    int level
+)
+{
+    switch (level)
+    {
+    case SIMD_AVX512:
+        return "AVX-512";
+    case SIMD_AVX2:
+        return "AVX2";
+    default:
+        return "scalar";
+    }
+}
@@ -0,0 +1,24 @@
+#ifndef FUNC_CPU
+#define FUNC_CPU
+
+/*********
+ * SIMD instruction set levels, detected at runtime:
+ * 0: portable scalar code
+ * 1: AVX2 (with FMA)
+ * 2: AVX-512F
+ * *****/
+#define SIMD_SCALAR 0
+#define SIMD_AVX2 1
+#define SIMD_AVX512 2
+
+int CPU_SIMD_level();
+
+int CPU_SIMD_limit(
+    int level
+);
+
+const char *CPU_SIMD_name(
+    int level
+);
+
+#endif
@@ -0,0 +1,399 @@
+/*
+ * SUMMARY:      Func_CSV.c
+ * USAGE:        fast access to large comma-separated text files (daily and hourly data)
+ * AUTHOR:       Xiaoxiang Guan
+ * ORG:          Section Hydrology, GFZ
+ * E-MAIL:       guan@gfz-potsdam.de
+ * ORIG-DATE:    Oct-2024
+ * DESCRIPTION:  the file is mapped into memory (mmap) in one go, and the start of
+ *               every row is indexed; the rows can then be parsed independently,
+ *               in any order and in parallel, without a limit on the line length
+ *               - CSV_int(), CSV_double(): parse the next field of a row,
+ *                 with the same result as the former strtok() and atoi() / atof()
+ *               - CSV_double() converts short decimal numbers exactly
+ *                 (Clinger's fast path) and falls back to strtod() otherwise
+ * DESCRIP-END.
+ * FUNCTIONS:    CSV_open(); CSV_close(); CSV_int(); CSV_double();
+ *
+ * COMMENTS:
+ * - fields are separated by ","; like strtok(), empty fields are skipped
+ * - on _WIN32 (no mmap) the file is read into a memory block instead
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "def_struct.h"
+#include "Func_CSV.h"
+
+static int CSV_load(
+    char fname[],
+    struct CSV_file *p_csv)
+{
+    /**************
+     * Description:
+     *      map (or read) the whole file into memory
+     * Return:
+     *      0: done; -1: the file cannot be opened or read
+     * ************/
+    p_csv->data = NULL;
+    p_csv->size = 0;
+    p_csv->mapped = 0;
+#ifndef _WIN32
+    int fd;
+    struct stat st;
+    if ((fd = open(fname, O_RDONLY)) < 0)
+    {
+        return -1;
+    }
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    p_csv->size = (size_t)st.st_size;
+    if (p_csv->size > 0)
+    {
+        void *m = mmap(NULL, p_csv->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (m != MAP_FAILED)
+        {
+#ifdef MADV_SEQUENTIAL
+            madvise(m, p_csv->size, MADV_SEQUENTIAL);
+#endif
+            p_csv->data = (char *)m;
+            p_csv->mapped = 1;
+        }
+    }
+    close(fd);
+    if (p_csv->size == 0 || p_csv->mapped)
+    {
+        return 0;
+    }
+#endif
+    /* no mmap: read the file into a memory block */
+    FILE *fp;
+    long n;
+    if ((fp = fopen(fname, "rb")) == NULL)
+    {
+        return -1;
+    }
+    fseek(fp, 0, SEEK_END);
+    n = ftell(fp);
+    rewind(fp);
+    p_csv->size = (n > 0) ? (size_t)n : 0;
+    p_csv->data = (char *)malloc(p_csv->size + 1);
+    if (p_csv->data == NULL || fread(p_csv->data, 1, p_csv->size, fp) != p_csv->size)
+    {
+        fclose(fp);
+        free(p_csv->data);
+        p_csv->data = NULL;
+        return -1;
+    }
+    fclose(fp);
+    return 0;
+}
+
+int CSV_open(
+    char fname[],
+    struct CSV_file *p_csv)
+{
+    /**************
+     * Description:
+     *      load a text file into memory and index its rows
+     * Parameters:
+     *      fname: the file path and name
+     *      p_csv: the loaded file
+     * Return:
+     *      0: done; -1: the file cannot be opened or read; -2: out of memory
+     * COMMENTS:
+     *      the rows are counted with memchr() over the mapping:
+     *      the number of "\n", plus the last row if it is not terminated
+     * ************/
+    const char *p, *end, *nl;
+    int n;
+    if (CSV_load(fname, p_csv) != 0)
+    {
+        return -1;
+    }
+    p = p_csv->data;
+    end = p_csv->data + p_csv->size;
+    n = 0;
+    while (p < end && (nl = memchr(p, '\n', end - p)) != NULL)
+    {
+        n++;
+        p = nl + 1;
+    }
+    if (p < end)
+    {
+        n++;  // the last row without "\n"
+    }
+    p_csv->nrow = n;
+    p_csv->row = (size_t *)malloc(sizeof(size_t) * (n + 1));
+    if (p_csv->row == NULL)
+    {
+        CSV_close(p_csv);
+        return -2;
+    }
+    p = p_csv->data;
+    n = 0;
+    while (n < p_csv->nrow)
+    {
+        p_csv->row[n++] = p - p_csv->data;
+        nl = memchr(p, '\n', end - p);
+        p = (nl != NULL) ? nl + 1 : end;
+    }
+    p_csv->row[n] = p_csv->size;
+    return 0;
+}
+
+void CSV_close(
+    struct CSV_file *p_csv)
+{
+    /**************
+     * Description:
+     *      release the file content and the row index
+     * ************/
+#ifndef _WIN32
+    if (p_csv->mapped)
+    {
+        munmap(p_csv->data, p_csv->size);
+    }
+    else
+#endif
+    {
+        free(p_csv->data);
+    }
+    free(p_csv->row);
+    p_csv->data = NULL;
+    p_csv->row = NULL;
+    p_csv->size = 0;
+    p_csv->nrow = 0;
+}
+
+static const char *field_start(
+    const char *p,
+    const char *end)
+{
+    /* skip the separators before the field (strtok() skips empty fields) */
+    while (p < end && *p == ',')
+    {
+        p++;
+    }
+    return p;
+}
+
+static const char *field_end(
+    const char *p,
+    const char *end)
+{
+    /* the end of the field: the next "," or the end of the row */
+    const char *c = memchr(p, ',', end - p);
+    return (c != NULL) ? c : end;
+}
+
+static int field_done(
+    const char *q,
+    const char *end)
+{
+    /* 1: q is at the end of the field (nothing left for atoi() / atof() to read) */
+    return q >= end || *q == ',' || *q == '\n' || *q == '\r';
+}
+
+const char *CSV_int(
+    const char *p,
+    const char *end,
+    int *value)
+{
+    /**************
+     * Description:
+     *      parse the next field of a row as an integer, as atoi() does
+     * Parameters:
+     *      p: the current position in the row
+     *      end: the end of the row
+     *      value: the parsed integer
+     * Return:
+     *      the position after the field; NULL if there is no further field
+     * ************/
+    const char *s, *e;
+    long v = 0;
+    int neg = 0;
+    s = field_start(p, end);
+    if (s >= end || *s == '\n' || *s == '\r')
+    {
+        return NULL;
+    }
+    e = s;
+    while (e < end && isspace((unsigned char)*e) && *e != '\n')
+    {
+        e++;
+    }
+    if (e < end && (*e == '-' || *e == '+'))
+    {
+        neg = (*e == '-');
+        e++;
+    }
+    while (e < end && *e >= '0' && *e <= '9')
+    {
+        v = v * 10 + (*e - '0');
+        e++;
+    }
+    *value = (int)(neg ? -v : v);
+    return field_done(e, end) ? e : field_end(e, end);
+}
+
+static const double pow10_exact[23] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+static double parse_double_slow(
+    const char *s,
+    const char *e)
+{
+    /* strtod() on a null-terminated copy of the field */
+    char tmp[128];
+    char *buf = tmp;
+    size_t n = e - s;
+    double v;
+    if (n >= sizeof(tmp))
+    {
+        buf = (char *)malloc(n + 1);
+        if (buf == NULL)
+        {
+            buf = tmp;      // out of memory: the first characters of the field
+            n = sizeof(tmp) - 1;
+        }
+    }
+    memcpy(buf, s, n);
+    buf[n] = '\0';
+    v = strtod(buf, NULL);
+    if (buf != tmp)
+    {
+        free(buf);
+    }
+    return v;
+}
+
+const char *CSV_double(
+    const char *p,
+    const char *end,
+    double *value)
+{
+    /**************
+     * Description:
+     *      parse the next field of a row as a floating-point number,
+     *      with the same result as atof() (correctly rounded)
+     * Parameters:
+     *      p: the current position in the row
+     *      end: the end of the row
+     *      value: the parsed number
+     * Return:
+     *      the position after the field; NULL if there is no further field
+     * COMMENTS:
+     *      [sign] digits [. digits] [e [sign] digits] with at most 19 digits,
+     *      a mantissa below 2^53 and a decimal exponent within +-22 is converted
+     *      by one exact IEEE multiplication or division (correctly rounded);
+     *      anything else (long mantissa, inf, nan, hex) goes through strtod()
+     * ************/
+    const char *s, *e, *q, *d;
+    unsigned long long m = 0;
+    int neg = 0, n_dig = 0, exp10 = 0;
+    s = field_start(p, end);
+    if (s >= end || *s == '\n' || *s == '\r')
+    {
+        return NULL;
+    }
+    e = end;  // the field ends where the number ends, unless junk follows (see below)
+    q = s;
+    if ((unsigned)(*q - '0') > 9 && *q != '-' && *q != '.')
+    {
+        while (q < e && isspace((unsigned char)*q) && *q != '\n')
+        {
+            q++;
+        }
+        if (q < e && (*q == '-' || *q == '+'))
+        {
+            neg = (*q == '-');
+            q++;
+        }
+    }
+    else if (*q == '-')
+    {
+        neg = 1;
+        q++;
+    }
+    d = q;
+    while (q < e && (unsigned)(*q - '0') <= 9)
+    {
+        m = m * 10 + (unsigned)(*q - '0');
+        q++;
+    }
+    n_dig = (int)(q - d);
+    if (q < e && *q == '.')
+    {
+        d = ++q;
+        while (q < e && (unsigned)(*q - '0') <= 9)
+        {
+            m = m * 10 + (unsigned)(*q - '0');
+            q++;
+        }
+        exp10 = -(int)(q - d);
+        n_dig -= exp10;
+    }
+    if (q < e && (*q == 'e' || *q == 'E'))
+    {
+        const char *t = q + 1;
+        int neg_e = 0, x = 0;
+        if (t < e && (*t == '-' || *t == '+'))
+        {
+            neg_e = (*t == '-');
+            t++;
+        }
+        if (t < e && *t >= '0' && *t <= '9')
+        {
+            while (t < e && *t >= '0' && *t <= '9')
+            {
+                if (x < 10000)
+                {
+                    x = x * 10 + (*t - '0');
+                }
+                t++;
+            }
+            exp10 += neg_e ? -x : x;
+            q = t;
+        }
+    }
+    if (!field_done(q, end))
+    {
+        e = field_end(q, end);  // inf, nan, hex or trailing junk: leave it to strtod()
+        n_dig = 0;
+    }
+    else
+    {
+        e = q;
+    }
+    if (n_dig == 0 || n_dig > 19 || m > (1ULL << 53) || exp10 < -22 || exp10 > 22)
+    {
+        *value = parse_double_slow(s, e);
+        return e;
+    }
+    double v = (double)m;
+    if (exp10 < 0)
+    {
+        v /= pow10_exact[-exp10];
+    }
+    else
+    {
+        v *= pow10_exact[exp10];
+    }
+    *value = neg ? -v : v;
+    return e;
+}
@@ -0,0 +1,25 @@
+#ifndef FUNC_CSV
+#define FUNC_CSV
+
+int CSV_open(
+    char fname[],
+    struct CSV_file *p_csv
+);
+
+void CSV_close(
+    struct CSV_file *p_csv
+);
+
+const char *CSV_int(
+    const char *p,
+    const char *end,
+    int *value
+);
+
+const char *CSV_double(
+    const char *p,
+    const char *end,
+    double *value
+);
+
+#endif
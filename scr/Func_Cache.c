@@ -0,0 +1,564 @@
+/*
+ * SUMMARY:      Func_Cache.c
+ * USAGE:        binary cache of the hourly fragment library
+ * AUTHOR:       Xiaoxiang Guan
+ * ORG:          Section Hydrology, GFZ
+ * E-MAIL:       guan@gfz-potsdam.de
+ * ORIG-DATE:    Oct-2024
+ * DESCRIPTION:  the parsed hourly library and the data derived from it are saved
+ *               into one binary file (FP_CACHE), which is mapped back (mmap) in the
+ *               following runs instead of parsing and deriving everything again:
+ *               - dates, cp, SM (season or month) and class of each library day
+ *               - SSIM statistics of the daily aggregates
+ *               - daily aggregates [ndays][N_STATION]
+ *               - hourly values [ndays][N_STATION][24]
+ *               - maxima of solar radiation (VAR: 5)
+ *               - the CP series (T_CP: TRUE)
+ *               the cache is only used when its key matches: a hash of the
+ *               source files (hourly data, CP series) and of the parameters
+ *               the library depends on (VAR, N_STATION, NODATA, T_CP, MONTH, SEASON, SUMMER_*);
+ *               FP_CACHE SHM: the cache is a POSIX shared-memory segment named by the key
+ *               (/dev/shm/kNN_MOF_m.<key>), published by the first process of a library
+ *               and attached read-only by all later ones
+ * DESCRIP-END.
+ * FUNCTIONS:    Lib_cache_key(); Lib_cache_load(); Lib_cache_unload(); Lib_cache_save();
+ *
+ * COMMENTS:
+ * - layout: struct Lib_cache_header, then the sections, each aligned to ALIGN_BYTES
+ * - the preprocessed vectors (PREP) are not cached: the normalization and
+ *   standardization constants are pooled over the daily data to be disaggregated,
+ *   which differs from run to run; they are cheap to derive from the daily aggregates
+ * - a source file is identified by its device, inode, size and modification time,
+ *   so that checking the key does not read the (large) file
+ * - the mapping is shared (MAP_SHARED, read-only): processes of the same library,
+ *   e.g. several configurations run at once, hold one copy of it in memory
+ * - the shared-memory segments stay until the machine restarts or they are removed
+ *   (rm /dev/shm/kNN_MOF_m.*); a segment of a changed source gets a new key
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/mman.h>
+#else
+#include <malloc.h>
+#include <process.h>
+#define getpid _getpid
+#endif
+
+#include "def_struct.h"
+#include "Func_dataIO.h"
+#include "Func_Cache.h"
+
+#define LIB_CACHE_MAGIC "kNNMOFlb"
+
+static unsigned long long hash_bytes(
+    unsigned long long h,
+    const void *data,
+    size_t n)
+{
+    /* FNV-1a, 64 bits */
+    const unsigned char *p = (const unsigned char *)data;
+    for (size_t i = 0; i < n; i++)
+    {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static unsigned long long hash_file(
+    unsigned long long h,
+    char fname[])
+{
+    /* the identity of a file: device, inode, size and modification time */
+    struct stat st;
+    long long id[5] = {0, 0, -1, 0, 0};
+    if (stat(fname, &st) == 0)
+    {
+        id[0] = (long long)st.st_dev;
+        id[1] = (long long)st.st_ino;
+        id[2] = (long long)st.st_size;
+        id[3] = (long long)st.st_mtime;
+#if defined(__linux__)
+        id[4] = (long long)st.st_mtim.tv_nsec;
+#endif
+    }
+    return hash_bytes(h, id, sizeof(id));
+}
+
+unsigned long long Lib_cache_key(
+    struct Para_global *p_gp)
+{
+    /**************
+     * Description:
+     *      the key of the library cache: a hash of the source files and the
+     *      global parameters the library (and its derived data) depends on
+     * ************/
+    unsigned long long h = 0xcbf29ce484222325ULL;
+    int version = LIB_CACHE_VERSION;
+    h = hash_bytes(h, &version, sizeof(int));
+    h = hash_file(h, p_gp->FP_HOURLY);
+    h = hash_bytes(h, &p_gp->VAR, sizeof(int));
+    h = hash_bytes(h, &p_gp->N_STATION, sizeof(int));
+    h = hash_bytes(h, &p_gp->NODATA, sizeof(double));
+    h = hash_bytes(h, p_gp->MONTH, 4);
+    h = hash_bytes(h, p_gp->SEASON, 4);
+    if (strncmp(p_gp->SEASON, "TRUE", 4) == 0)
+    {
+        h = hash_bytes(h, &p_gp->SUMMER_FROM, sizeof(int));
+        h = hash_bytes(h, &p_gp->SUMMER_TO, sizeof(int));
+    }
+    h = hash_bytes(h, p_gp->T_CP, 4);
+    if (strncmp(p_gp->T_CP, "TRUE", 4) == 0)
+    {
+        h = hash_file(h, p_gp->FP_CP);
+    }
+    return h;
+}
+
+static unsigned long long section(
+    unsigned long long *offset,
+    size_t bytes)
+{
+    /* place a section of the given size at the current offset (aligned) */
+    unsigned long long at = *offset;
+    *offset = (at + bytes + ALIGN_BYTES - 1) / ALIGN_BYTES * ALIGN_BYTES;
+    return at;
+}
+
+static void layout(
+    struct Lib_cache_header *p_hd,
+    int ndays,
+    int N,
+    int VAR,
+    int nrow_cp)
+{
+    /* the header fields and the offsets of all sections */
+    memset(p_hd, 0, sizeof(struct Lib_cache_header));
+    memcpy(p_hd->magic, LIB_CACHE_MAGIC, 8);
+    p_hd->version = LIB_CACHE_VERSION;
+    p_hd->byte_order = 0x01020304;
+    p_hd->size_date = sizeof(struct Date);
+    p_hd->size_stats = sizeof(struct SSIM_stats);
+    p_hd->ndays = ndays;
+    p_hd->N = N;
+    p_hd->nrow_cp = nrow_cp;
+    unsigned long long offset = 0;
+    section(&offset, sizeof(struct Lib_cache_header));
+    p_hd->off_date = section(&offset, sizeof(struct Date) * ndays);
+    p_hd->off_cp = section(&offset, sizeof(int) * ndays);
+    p_hd->off_SM = section(&offset, sizeof(int) * ndays);
+    p_hd->off_class = section(&offset, sizeof(int) * ndays);
+    p_hd->off_stats = section(&offset, sizeof(struct SSIM_stats) * ndays);
+    p_hd->off_rr_d = section(&offset, sizeof(double) * ndays * N);
+    p_hd->off_rr_h = section(&offset, sizeof(double) * ndays * N * 24);
+    p_hd->off_solar = section(&offset, (VAR == 5) ? sizeof(double) * N : 0);
+    p_hd->off_cps = section(&offset, sizeof(struct df_cp) * nrow_cp);
+    p_hd->size = offset;
+}
+
+static int cache_valid(
+    struct Para_global *p_gp,
+    struct Lib_cache_header *p_hd,
+    unsigned long long size)
+{
+    /* 1: the header belongs to a complete cache of this library (size: bytes available) */
+    struct Lib_cache_header ref;
+    int nrow_cp = (p_hd->nrow_cp > 0) ? p_hd->nrow_cp : 0;
+    layout(&ref, p_hd->ndays, p_gp->N_STATION, p_gp->VAR, nrow_cp);
+    return memcmp(p_hd->magic, LIB_CACHE_MAGIC, 8) == 0 && p_hd->version == LIB_CACHE_VERSION &&
+        p_hd->byte_order == ref.byte_order && p_hd->size_date == ref.size_date &&
+        p_hd->size_stats == ref.size_stats && p_hd->key == Lib_cache_key(p_gp) &&
+        p_hd->N == p_gp->N_STATION && p_hd->ndays >= 1 && p_hd->size == ref.size &&
+        size == ref.size;
+}
+
+#ifndef _WIN32
+static int cache_shm(
+    struct Para_global *p_gp,
+    char name[],
+    size_t n)
+{
+    /* FP_CACHE SHM: 1, with the name of the shared-memory segment (by the key); otherwise 0 */
+    if (strncmp(p_gp->FP_CACHE, "SHM", 3) != 0 || strlen(p_gp->FP_CACHE) != 3)
+    {
+        return 0;
+    }
+    snprintf(name, n, "%s%016llx", LIB_SHM_PREFIX, Lib_cache_key(p_gp));
+    return 1;
+}
+#endif
+
+int Lib_cache_load(
+    struct Para_global *p_gp,
+    struct df_rr_h **p_rr_h,
+    int *ndays_h,
+    double **Solar_MAX,
+    struct df_cp **p_cp,
+    int *nrow_cp)
+{
+    /**************
+     * Description:
+     *      map the library cache (FP_CACHE: a file, or SHM: the shared-memory segment
+     *      of this library) into memory and point the library at it
+     * Parameters:
+     *      p_rr_h: the hourly library (struct array, allocated here)
+     *      ndays_h: the number of library days (output)
+     *      Solar_MAX: maxima of solar radiation (output; VAR 5, otherwise NULL)
+     *      p_cp, nrow_cp: the CP series, in the mapping (output; NULL: not wanted)
+     * Return:
+     *      1: loaded; 0: no valid cache (missing, outdated, another version, still being written)
+     * COMMENTS:
+     *      the hourly values, daily aggregates and the CP series stay in the (read-only)
+     *      mapping, shared by all processes of the same library;
+     *      only the per-day fields of df_rr_h are copied
+     * ************/
+    struct Lib_cache_header hd;
+    char *base;
+    size_t size;
+
+#ifndef _WIN32
+    char name[64];
+    struct stat st;
+    void *m;
+    int fd;
+    if (cache_shm(p_gp, name, sizeof(name)))
+    {
+        fd = shm_open(name, O_RDONLY, 0);
+    } else {
+        fd = open(p_gp->FP_CACHE, O_RDONLY);
+    }
+    if (fd < 0)
+    {
+        return 0;
+    }
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(hd))
+    {
+        close(fd);
+        return 0;
+    }
+    size = (size_t)st.st_size;
+    m = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED)
+    {
+        return 0;
+    }
+    base = (char *)m;
+    memcpy(&hd, base, sizeof(hd));
+    if (!cache_valid(p_gp, &hd, size))
+    {
+        munmap(m, size);
+        return 0;
+    }
+#else
+    FILE *fp;
+    if (strncmp(p_gp->FP_CACHE, "SHM", 3) == 0 || (fp = fopen(p_gp->FP_CACHE, "rb")) == NULL)
+    {
+        return 0;
+    }
+    if (fread(&hd, sizeof(hd), 1, fp) != 1 || !cache_valid(p_gp, &hd, hd.size))
+    {
+        fclose(fp);
+        return 0;
+    }
+    size = (size_t)hd.size;
+    base = (char *)calloc_aligned(size, 1);
+    rewind(fp);
+    if (base == NULL)
+    {
+        fclose(fp);
+        return 0;
+    }
+    if (fread(base, 1, size, fp) != size)
+    {
+        fclose(fp);
+        _aligned_free(base);
+        return 0;
+    }
+    fclose(fp);
+#endif
+
+    int N = hd.N;
+    struct Date *date = (struct Date *)(base + hd.off_date);
+    int *cp = (int *)(base + hd.off_cp);
+    int *SM = (int *)(base + hd.off_SM);
+    int *class = (int *)(base + hd.off_class);
+    struct SSIM_stats *stats = (struct SSIM_stats *)(base + hd.off_stats);
+    double *lib_d = (double *)(base + hd.off_rr_d);
+    double *lib_h = (double *)(base + hd.off_rr_h);
+    *p_rr_h = (struct df_rr_h *)calloc_aligned(hd.ndays, sizeof(struct df_rr_h));
+    if (*p_rr_h == NULL)
+    {
+#ifndef _WIN32
+        munmap(base, size);
+#else
+        _aligned_free(base);
+#endif
+        return 0;   // out of memory: imported from the sources instead
+    }
+    for (int i = 0; i < hd.ndays; i++)
+    {
+        struct df_rr_h *p_day = *p_rr_h + i;
+        p_day->date = date[i];
+        p_day->cp = cp[i];
+        p_day->SM = SM[i];
+        p_day->class = class[i];
+        p_day->stats = stats[i];
+        p_day->rr_d = lib_d + (size_t)i * N;
+        p_day->rr_h = (double (*)[24])(lib_h + (size_t)i * N * 24);
+    }
+    *Solar_MAX = (p_gp->VAR == 5) ? (double *)(base + hd.off_solar) : NULL;
+    *ndays_h = hd.ndays;
+    if (p_cp != NULL)
+    {
+        *p_cp = (hd.nrow_cp > 0) ? (struct df_cp *)(base + hd.off_cps) : NULL;
+        *nrow_cp = hd.nrow_cp;
+    }
+    return 1;
+}
+
+void Lib_cache_unload(
+    struct Para_global *p_gp,
+    struct df_rr_h *p_rr_h,
+    int ndays_h)
+{
+    /**************
+     * Description:
+     *      release a library loaded by Lib_cache_load(): the mapping and the struct array
+     *      (e.g. before loading it again, kNN_MOF_m serve)
+     * ************/
+    struct Lib_cache_header hd;
+    layout(&hd, ndays_h, p_gp->N_STATION, p_gp->VAR, 0);
+    char *base = (char *)p_rr_h->rr_d - hd.off_rr_d;
+#ifndef _WIN32
+    munmap(base, (size_t)((struct Lib_cache_header *)base)->size);
+    free(p_rr_h);
+#else
+    _aligned_free(base);
+    _aligned_free(p_rr_h);
+#endif
+}
+
+static void write_section(
+    FILE *fp,
+    char *base,
+    unsigned long long offset,
+    const void *data,
+    size_t bytes,
+    int *ok)
+{
+    /* zero padding up to the offset of the section, then the section;
+     * base: copy into this mapping instead of writing into fp */
+    static const char zeros[ALIGN_BYTES] = {0};
+    if (base != NULL)
+    {
+        if (bytes > 0)
+        {
+            memcpy(base + offset, data, bytes);  // the mapping is zero-filled
+        }
+        return;
+    }
+    long pos = ftell(fp);
+    if (pos < 0 || (unsigned long long)pos > offset)
+    {
+        *ok = 0;
+        return;
+    }
+    if (fwrite(zeros, 1, (size_t)(offset - pos), fp) != (size_t)(offset - pos) ||
+        (bytes > 0 && fwrite(data, 1, bytes, fp) != bytes))
+    {
+        *ok = 0;
+    }
+}
+
+#ifndef _WIN32
+static char *shm_create(
+    char name[],
+    size_t size)
+{
+    /**************
+     * Description:
+     *      create the shared-memory segment of a library and map it for writing
+     * Return:
+     *      the mapping; NULL if the segment exists (published, or being written by
+     *      another process) or cannot be created
+     * COMMENTS:
+     *      a segment left incomplete by a process that no longer runs is removed first
+     * ************/
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0 && errno == EEXIST)
+    {
+        struct Lib_cache_header hd;
+        int fd_old = shm_open(name, O_RDONLY, 0);
+        if (fd_old >= 0 && read(fd_old, &hd, sizeof(hd)) == (ssize_t)sizeof(hd) &&
+            memcmp(hd.magic, LIB_CACHE_MAGIC, 8) != 0 && hd.pid > 0 &&
+            kill((pid_t)hd.pid, 0) != 0 && errno == ESRCH)
+        {
+            shm_unlink(name);
+            fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+        }
+        if (fd_old >= 0)
+        {
+            close(fd_old);
+        }
+    }
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    void *m = MAP_FAILED;
+    if (ftruncate(fd, (off_t)size) == 0)
+    {
+        m = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (m == MAP_FAILED)
+    {
+        shm_unlink(name);
+        return NULL;
+    }
+    return (char *)m;
+}
+#endif
+
+int Lib_cache_save(
+    struct Para_global *p_gp,
+    struct df_rr_h *p_rr_h,
+    int ndays_h,
+    double *Solar_MAX,
+    struct df_cp *df_cps,
+    int nrow_cp)
+{
+    /**************
+     * Description:
+     *      write the hourly library and its derived data into the cache (FP_CACHE);
+     *      the file is written under a temporary name and then renamed,
+     *      so that a concurrent run never maps a half-written cache;
+     *      FP_CACHE SHM: the library is published into a shared-memory segment
+     *      named by its key, the magic written last
+     * Parameters:
+     *      p_rr_h: the hourly library, classes and SSIM statistics assigned
+     *      ndays_h: the number of library days
+     *      Solar_MAX: maxima of solar radiation (VAR 5)
+     *      df_cps, nrow_cp: the CP series (T_CP: TRUE; otherwise NULL, 0)
+     * Return:
+     *      0: written, or skipped (out of memory, or published by another process meanwhile);
+     *      -1: the cache cannot be written; -2: FP_CACHE SHM not available on this platform
+     * COMMENTS:
+     *      a failure only skips the cache; the warning is left to the caller
+     * ************/
+    struct Lib_cache_header hd;
+    int N = p_gp->N_STATION;
+    int ok = 1;
+    int status = 0;
+    int i;
+    char fname_tmp[220];
+    FILE *fp = NULL;
+    char *base = NULL;
+
+    layout(&hd, ndays_h, N, p_gp->VAR, nrow_cp);
+    hd.key = Lib_cache_key(p_gp);
+    hd.pid = (int)getpid();
+
+    /* the per-day fields, gathered into arrays */
+    struct Date *date = (struct Date *)malloc(sizeof(struct Date) * ndays_h);
+    int *ids = (int *)malloc(sizeof(int) * ndays_h * 3);
+    struct SSIM_stats *stats = (struct SSIM_stats *)malloc(sizeof(struct SSIM_stats) * ndays_h);
+    if (date == NULL || ids == NULL || stats == NULL)
+    {
+        ok = 0;     // out of memory: no cache
+    }
+#ifndef _WIN32
+    char name[64];
+    if (ok && cache_shm(p_gp, name, sizeof(name)))
+    {
+        if ((base = shm_create(name, (size_t)hd.size)) == NULL)
+        {
+            ok = 0;     // published by another process meanwhile (or no shared memory)
+        }
+    }
+#else
+    if (ok && strncmp(p_gp->FP_CACHE, "SHM", 3) == 0)
+    {
+        status = -2;
+        ok = 0;
+    }
+#endif
+    if (ok && base == NULL)
+    {
+        snprintf(fname_tmp, sizeof(fname_tmp), "%s.tmp%ld", p_gp->FP_CACHE, (long)getpid());
+        if ((fp = fopen(fname_tmp, "wb")) == NULL)
+        {
+            status = -1;
+            ok = 0;
+        }
+    }
+    if (!ok)
+    {
+        free(date);
+        free(ids);
+        free(stats);
+        return status;
+    }
+
+    for (i = 0; i < ndays_h; i++)
+    {
+        date[i] = (p_rr_h + i)->date;
+        ids[i] = (p_rr_h + i)->cp;
+        ids[ndays_h + i] = (p_rr_h + i)->SM;
+        ids[2 * ndays_h + i] = (p_rr_h + i)->class;
+        stats[i] = (p_rr_h + i)->stats;
+    }
+
+    /* the segment: the header without the magic first, the magic once all is in place */
+    char magic[8];
+    memcpy(magic, hd.magic, 8);
+    if (base != NULL)
+    {
+        memset(hd.magic, 0, 8);
+    }
+    write_section(fp, base, 0, &hd, sizeof(hd), &ok);
+    write_section(fp, base, hd.off_date, date, sizeof(struct Date) * ndays_h, &ok);
+    write_section(fp, base, hd.off_cp, ids, sizeof(int) * ndays_h, &ok);
+    write_section(fp, base, hd.off_SM, ids + ndays_h, sizeof(int) * ndays_h, &ok);
+    write_section(fp, base, hd.off_class, ids + 2 * ndays_h, sizeof(int) * ndays_h, &ok);
+    write_section(fp, base, hd.off_stats, stats, sizeof(struct SSIM_stats) * ndays_h, &ok);
+    /* the library blocks are contiguous (import_dfrr_h()): one write each */
+    write_section(fp, base, hd.off_rr_d, p_rr_h->rr_d, sizeof(double) * ndays_h * N, &ok);
+    write_section(fp, base, hd.off_rr_h, p_rr_h->rr_h, sizeof(double) * ndays_h * N * 24, &ok);
+    if (p_gp->VAR == 5)
+    {
+        write_section(fp, base, hd.off_solar, Solar_MAX, sizeof(double) * N, &ok);
+    }
+    write_section(fp, base, hd.off_cps, df_cps, sizeof(struct df_cp) * nrow_cp, &ok);
+    write_section(fp, base, hd.size, NULL, 0, &ok);
+    free(date);
+    free(ids);
+    free(stats);
+
+#ifndef _WIN32
+    if (base != NULL)
+    {
+        __sync_synchronize();   // the sections are visible before the magic
+        memcpy(base, magic, 8);
+        munmap(base, (size_t)hd.size);
+        return 0;
+    }
+#endif
+    if (fclose(fp) != 0 || !ok || rename(fname_tmp, p_gp->FP_CACHE) != 0)
+    {
+        remove(fname_tmp);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,32 @@
+#ifndef FUNC_CACHE
+#define FUNC_CACHE
+
+unsigned long long Lib_cache_key(
+    struct Para_global *p_gp
+);
+
+int Lib_cache_load(
+    struct Para_global *p_gp,
+    struct df_rr_h **p_rr_h,
+    int *ndays_h,
+    double **Solar_MAX,
+    struct df_cp **p_cp,
+    int *nrow_cp
+);
+
+void Lib_cache_unload(
+    struct Para_global *p_gp,
+    struct df_rr_h *p_rr_h,
+    int ndays_h
+);
+
+int Lib_cache_save(
+    struct Para_global *p_gp,
+    struct df_rr_h *p_rr_h,
+    int ndays_h,
+    double *Solar_MAX,
+    struct df_cp *df_cps,
+    int nrow_cp
+);
+
+#endif
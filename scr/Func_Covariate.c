@@ -2,11 +2,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <string.h>
 #include "def_struct.h"
 #include "Func_kNN.h"
 #include "Func_Covariate.h"
 #include "Func_Fragments.h"
 #include "Func_dataIO.h"
+#include "Func_Writer.h"
+#include "Func_Initialize.h"
 #include "Func_SSIM.h"
 
 extern 
@@ -16,6 +19,7 @@ void kNN_MOF_cov(
     struct df_rr_h *p_rrh_cov,
     struct df_rr_d *p_rrd_cov,
     struct Para_global *p_gp,
+    struct class_index *p_ci,
     int nrow_rr_d,
     int ndays_h
 ) {
@@ -24,11 +28,11 @@ void kNN_MOF_cov(
      *  algorithm: k-nearest neighbouring sampling, method-of-fragments, based on seasonality
      *  scale: daily2hourly, multiple stations simultaneously
      * Parameters:
+     *  p_ci: the class index of the hourly library (candidate pools)
      *  nrow_rr_d: the number of rows in daily data file
      *  ndays_h: the number of observations of hourly data
      * *****************/
     int i, j, h;
-    int class_t, class_c;
 
     /*********
      * order: 
@@ -46,7 +50,8 @@ void kNN_MOF_cov(
      * *************/
     int skip = 0;
     skip = (int)((p_gp->CONTINUITY - 1) / 2);
-    int pool_cans[MAXrow]; // the index of the candidates (a pool); the size is sufficient
+    int *pool_cans;        // the index of the candidates (a pool); at most all library days
+    pool_cans = (int *)malloc(sizeof(int) * (ndays_h > 0 ? ndays_h : 1));
     int n_can;             // the number of candidates after all conditioning
     int fragment;          // the index of df_rr_h structure with the final chosed fragments
 
@@ -56,6 +61,8 @@ void kNN_MOF_cov(
         printf("Program terminated: cannot create or open output file\n");
         exit(1);
     }
+    struct Out_buffer ob;
+    Out_buffer_open(&ob, p_FP_OUT, p_gp->N_STATION);
     for (i = 0; i < nrow_rr_d; i++)
     {
         // iterate each target day
@@ -77,22 +84,15 @@ void kNN_MOF_cov(
             for (size_t t = 0; t < p_gp->RUN; t++)
             {
                 /* write the disaggregation output */
-                Write_df_rr_h(&df_rr_h_out, p_gp, p_FP_OUT, t + 1);
+                Write_df_rr_h(&df_rr_h_out, p_gp, &ob, t + 1);
             }
             break; // next step
         }
 
-        n_can = 0;     // number of candidates
-        class_t = (p_rrd + i)->class;
-        for (j = skip; j < ndays_h - skip; j++)
-        {
-            class_c = (p_rrh + j)->class; // the class of the candidate day
-            if (class_c == class_t)       
-            {
-                pool_cans[n_can] = j;
-                n_can += 1;
-            }
-        }
+        /* candidates: the library days of the same class, a slice of the class index */
+        int *pool_class;
+        n_can = class_pool(p_ci, (p_rrd + i)->class, &pool_class);
+        memcpy(pool_cans, pool_class, sizeof(int) * n_can); // working copy; filtered and sorted in place
         
         int index = 0;  // the number of candidates after class and 0-check 
         if (p_gp->VAR == 4 || p_gp->VAR == 1)
@@ -164,10 +164,10 @@ void kNN_MOF_cov(
          * *****/
         int *index_fragment;
         index_fragment = (int *)malloc(sizeof(int) * p_gp->RUN);
-        kNN_sampling(SSIM, pool_cans, order, n_can, p_gp->RUN, index_fragment);
+        kNN_sampling(SSIM, pool_cans, order, n_can, p_gp->RUN, p_gp->SEED, date_key((p_rrd + i)->date), index_fragment);
 
         int size_pool; // the k in kNN
-        size_pool = (int)sqrt(n_can) + 1;
+        size_pool = kNN_pool_size(n_can);
         for (j = 0; j < size_pool; j++)
         {
             fprintf(p_SSIM, "%d-%02d-%02d,", (p_rrd + i)->date.y, (p_rrd + i)->date.m, (p_rrd + i)->date.d);
@@ -179,14 +179,16 @@ void kNN_MOF_cov(
             /*assign the sampled fragments to target day (disaggregation)*/
             Fragment_assign(p_rrh, &df_rr_h_out, p_gp, index_fragment[t]);
             /* write the disaggregation output */
-            Write_df_rr_h(&df_rr_h_out, p_gp, p_FP_OUT, t + 1);
+            Write_df_rr_h(&df_rr_h_out, p_gp, &ob, t + 1);
         }
 
         printf("%d-%02d-%02d: Done!\n", (p_rrd+i)->date.y, (p_rrd+i)->date.m, (p_rrd+i)->date.d);
         free(df_rr_h_out.rr_h);  // free the memory allocated for disaggregated hourly output
         free(SSIM_cov); free(SSIM_var); free(SSIM);
     }
+    Out_buffer_close(&ob);
     fclose(p_FP_OUT);
+    free(pool_cans);
 }
 
 
@@ -9,6 +9,7 @@ void kNN_MOF_cov(
     struct df_rr_h *p_rrh_cov,
     struct df_rr_d *p_rrd_cov,
     struct Para_global *p_gp,
+    struct class_index *p_ci,
     int nrow_rr_d,
     int ndays_h
 );
@@ -0,0 +1,366 @@
+/*
+ * SUMMARY:      Func_Diag.c
+ * USAGE:        the similarity diagnostics (FP_SSIM) at three levels
+ * AUTHOR:       Xiaoxiang Guan
+ * ORG:          Section Hydrology, GFZ
+ * E-MAIL:       guan@gfz-potsdam.de
+ * ORIG-DATE:    Oct-2024
+ * DESCRIPTION:  SSIM_LEVEL (FP_SSIM,FALSE: off):
+ *               - FULL: the k nearest candidates of every target day,
+ *                 rows target,ID,index_Frag,SIMI,candidate
+ *               - BIN: the same in binary records (struct SIMI_bin_header, struct SIMI_entry),
+ *                 back to the FULL CSV by: kNN_MOF_m convert <FP_SSIM> [out=file]
+ *               - AGG: one row per target day, target,n_can,k,best,kth, and the histograms
+ *                 of the best, the k-th and all k similarities of the run (<FP_SSIM>_hist.csv)
+ *               the diagnostics of a day are formatted by the parallel worker that selected
+ *               the day (Diag_day(), into the day's own buffer, histograms per thread),
+ *               then appended to the buffered FP_SSIM in the date order (Diag_write())
+ * DESCRIP-END.
+ * FUNCTIONS:    Diag_level(); Diag_open(); Diag_day(); Diag_write(); Diag_close();
+ *               Diag_file_open(); Diag_to_CSV();
+ *
+ * COMMENTS:
+ * - dark days (no candidates sampled) are not written at any level
+ * - histogram bins: SSIM, SIMI_BINS bins over [-1, 1]; distance, SIMI_BINS bins of 0.25
+ *   on the log10 scale from 1e-3; plus a bin below and a bin above
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "def_struct.h"
+#include "Func_dataIO.h"
+#include "Func_Writer.h"
+#include "Func_Initialize.h"
+#include "Func_kNN.h"
+#include "Func_Diag.h"
+
+#define SIMI_MAGIC "kNNMOFsm"
+
+int Diag_level(
+    char SSIM_LEVEL[]
+) {
+    /**************
+     * Description:
+     *      the diagnostic level of the SSIM_LEVEL parameter
+     * Return:
+     *      SIMI_AGG, SIMI_FULL or SIMI_BIN; 0: unknown
+     * ************/
+    if (strncmp(SSIM_LEVEL, "FULL", 4) == 0) return SIMI_FULL;
+    if (strncmp(SSIM_LEVEL, "AGG", 3) == 0) return SIMI_AGG;
+    if (strncmp(SSIM_LEVEL, "BIN", 3) == 0) return SIMI_BIN;
+    return 0;
+}
+
+void Diag_open(
+    struct Para_global *p_gp,
+    FILE *fp,
+    int order,
+    int n_threads,
+    struct SIMI_diag *p_dg
+) {
+    /**************
+     * Description:
+     *      start the similarity diagnostics: the header of FP_SSIM and the histograms
+     * Parameters:
+     *      fp: the opened FP_SSIM
+     *      order: 1: SSIM; 0: distance
+     *      n_threads: the parallel workers calling Diag_day()
+     * ************/
+    p_dg->level = Diag_level(p_gp->SSIM_LEVEL);
+    p_dg->order = order;
+    p_dg->n_threads = n_threads;
+    p_dg->hist = NULL;
+    p_dg->fname = p_gp->FP_SSIM;
+    Out_buffer_open(&p_dg->ob, fp, 0);
+    if (p_dg->level == SIMI_BIN)
+    {
+        struct SIMI_bin_header hd;
+        memset(&hd, 0, sizeof(struct SIMI_bin_header));
+        memcpy(hd.magic, SIMI_MAGIC, 8);
+        hd.version = SIMI_VERSION;
+        hd.byte_order = 0x01020304;
+        hd.order = order;
+        Out_buffer_write(&p_dg->ob, &hd, sizeof(struct SIMI_bin_header));
+    }
+    else if (p_dg->level == SIMI_AGG)
+    {
+        Out_buffer_write(&p_dg->ob, "target,n_can,k,best,kth\n", 24);
+        p_dg->hist = (long long *)calloc((size_t)n_threads * (SIMI_BINS + 2) * 3, sizeof(long long));
+    }
+    else
+    {
+        Out_buffer_write(&p_dg->ob, "target,ID,index_Frag,SIMI,candidate\n", 36);
+    }
+}
+
+static int simi_bin(
+    double v,
+    int order
+) {
+    /* the histogram bin of a similarity: 0 below, 1 ... SIMI_BINS, SIMI_BINS + 1 above */
+    double x;
+    if (order == 1)
+    {
+        x = (v + 1.0) / 2.0 * SIMI_BINS;    // SSIM: [-1, 1]
+        if (v == 1.0)
+        {
+            return SIMI_BINS;               // the upper edge belongs to the last bin
+        }
+    } else {
+        if (!(v >= 1e-3))
+        {
+            return (v != v) ? SIMI_BINS + 1 : 0;
+        }
+        x = (log10(v) + 3.0) * 4.0;         // distance: log10 steps of 0.25 from 1e-3
+    }
+    if (!(x >= 0.0))
+    {
+        return (x != x) ? SIMI_BINS + 1 : 0;
+    }
+    if (x >= SIMI_BINS)
+    {
+        return SIMI_BINS + 1;
+    }
+    return (int)x + 1;
+}
+
+static double simi_edge(
+    int b,
+    int order
+) {
+    /* the lower edge of bin b (1 ... SIMI_BINS + 1) */
+    if (order == 1)
+    {
+        return -1.0 + 2.0 * (b - 1) / SIMI_BINS;
+    }
+    return pow(10.0, -3.0 + 0.25 * (b - 1));
+}
+
+static char *day_reserve(
+    struct kNN_day *p_day,
+    size_t n
+) {
+    /* room for n more bytes in the diagnostics buffer of the day */
+    if (p_day->diag_len + n > p_day->diag_cap)
+    {
+        size_t cap = p_day->diag_len + n + p_day->diag_cap / 2;
+        char *b = (char *)realloc(p_day->diag, cap);
+        if (b == NULL)
+        {
+            printf("Program terminated: cannot allocate memory for the similarity diagnostics\n");
+            exit(1);
+        }
+        p_day->diag = b;
+        p_day->diag_cap = cap;
+    }
+    return p_day->diag + p_day->diag_len;
+}
+
+void Diag_day(
+    struct SIMI_diag *p_dg,
+    struct df_rr_h *p_rrh,
+    struct Date target,
+    struct kNN_day *p_day,
+    int tid
+) {
+    /**************
+     * Description:
+     *      the diagnostics of one target day, into its own buffer (p_day->diag);
+     *      safe to call from parallel threads
+     * Parameters:
+     *      target: the date of the target day
+     *      p_day: the candidate selection of the day (kNN_day_select())
+     *      tid: the calling thread (0 ... n_threads - 1), its histograms
+     * ************/
+    int j, k;
+    char *s;
+    p_day->diag_len = 0;
+    if (p_day->n_can < 0)
+    {
+        return;     // dark day
+    }
+    k = kNN_pool_size(p_day->n_can);
+    if (p_dg->level == SIMI_AGG)
+    {
+        s = day_reserve(p_day, 1024);
+        s = Format_SIMI_day(
+            s, target, p_day->n_can, k,
+            (k > 0) ? p_day->SIMI[0] : 0.0, (k > 0) ? p_day->SIMI[k - 1] : 0.0);
+        p_day->diag_len = s - p_day->diag;
+        if (k > 0)
+        {
+            long long *h = p_dg->hist + (size_t)tid * (SIMI_BINS + 2) * 3;
+            h[simi_bin(p_day->SIMI[0], p_dg->order) * 3]++;
+            h[simi_bin(p_day->SIMI[k - 1], p_dg->order) * 3 + 1]++;
+            for (j = 0; j < k; j++)
+            {
+                h[simi_bin(p_day->SIMI[j], p_dg->order) * 3 + 2]++;
+            }
+        }
+    }
+    else if (p_dg->level == SIMI_BIN)
+    {
+        int head[2];
+        head[0] = date_key(target);
+        head[1] = k;
+        s = day_reserve(p_day, sizeof(head) + sizeof(struct SIMI_entry) * k);
+        memcpy(s, head, sizeof(head));
+        s += sizeof(head);
+        for (j = 0; j < k; j++)
+        {
+            struct SIMI_entry e;
+            e.index_frag = p_day->pool[j];
+            e.candidate = date_key((p_rrh + p_day->pool[j])->date);
+            e.SIMI = p_day->SIMI[j];
+            memcpy(s, &e, sizeof(struct SIMI_entry));
+            s += sizeof(struct SIMI_entry);
+        }
+        p_day->diag_len = s - p_day->diag;
+    }
+    else
+    {
+        s = day_reserve(p_day, (size_t)512 * (k > 0 ? k : 1));
+        for (j = 0; j < k; j++)
+        {
+            s = Format_SIMI(s, target, j, p_day->pool[j], p_day->SIMI[j], (p_rrh + p_day->pool[j])->date);
+        }
+        p_day->diag_len = s - p_day->diag;
+    }
+}
+
+void Diag_write(
+    struct SIMI_diag *p_dg,
+    struct kNN_day *p_day
+) {
+    /**************
+     * Description:
+     *      append the diagnostics of a day (Diag_day()) to FP_SSIM, in the date order
+     * ************/
+    if (p_day->diag_len > 0)
+    {
+        Out_buffer_write(&p_dg->ob, p_day->diag, p_day->diag_len);
+    }
+}
+
+void Diag_close(
+    struct SIMI_diag *p_dg
+) {
+    /**************
+     * Description:
+     *      write the rest of FP_SSIM; AGG: the histograms, summed over the threads,
+     *      into <FP_SSIM>_hist.csv (FP_SSIM without the extension .csv)
+     * ************/
+    Out_buffer_close(&p_dg->ob);
+    if (p_dg->level != SIMI_AGG)
+    {
+        return;
+    }
+    char fname[220];
+    size_t n = strlen(p_dg->fname);
+    if (n >= 4 && strcmp(p_dg->fname + n - 4, ".csv") == 0)
+    {
+        n -= 4;
+    }
+    snprintf(fname, sizeof(fname), "%.*s_hist.csv", (int)n, p_dg->fname);
+    FILE *fp;
+    if ((fp = fopen(fname, "w")) == NULL)
+    {
+        printf("Cannot create / open the histogram file: %s\n", fname);
+        exit(1);
+    }
+    fprintf(fp, "lower,upper,best,kth,neighbours\n");
+    for (int b = 0; b < SIMI_BINS + 2; b++)
+    {
+        long long c[3] = {0, 0, 0};
+        for (int t = 0; t < p_dg->n_threads; t++)
+        {
+            for (int i = 0; i < 3; i++)
+            {
+                c[i] += p_dg->hist[((size_t)t * (SIMI_BINS + 2) + b) * 3 + i];
+            }
+        }
+        if (b == 0)
+        {
+            fprintf(fp, "-inf,%f", simi_edge(1, p_dg->order));
+        }
+        else if (b == SIMI_BINS + 1)
+        {
+            fprintf(fp, "%f,inf", simi_edge(b, p_dg->order));
+        } else {
+            fprintf(fp, "%f,%f", simi_edge(b, p_dg->order), simi_edge(b + 1, p_dg->order));
+        }
+        fprintf(fp, ",%lld,%lld,%lld\n", c[0], c[1], c[2]);
+    }
+    fclose(fp);
+    free(p_dg->hist);
+}
+
+FILE *Diag_file_open(
+    char fname[],
+    struct SIMI_bin_header *p_hd
+) {
+    /**************
+     * Description:
+     *      open a binary similarity file (SSIM_LEVEL: BIN) for reading and check its header
+     * Return:
+     *      the file, positioned at the first day; NULL: not a binary similarity file (of this byte order)
+     * ************/
+    FILE *fp = fopen(fname, "rb");
+    if (fp == NULL)
+    {
+        return NULL;
+    }
+    if (fread(p_hd, sizeof(struct SIMI_bin_header), 1, fp) != 1 ||
+        memcmp(p_hd->magic, SIMI_MAGIC, 8) != 0 || p_hd->version != SIMI_VERSION ||
+        p_hd->byte_order != 0x01020304)
+    {
+        fclose(fp);
+        return NULL;
+    }
+    return fp;
+}
+
+static struct Date key_date(
+    int key
+) {
+    struct Date date;
+    date.y = key / 10000;
+    date.m = key / 100 % 100;
+    date.d = key % 100;
+    return date;
+}
+
+void Diag_to_CSV(
+    FILE *fp_in,
+    FILE *fp_out
+) {
+    /**************
+     * Description:
+     *      write a binary similarity file as the FULL CSV (byte-identical)
+     * Parameters:
+     *      fp_in: the binary similarity file after its header (Diag_file_open())
+     * ************/
+    struct Out_buffer ob;
+    int head[2];
+    Out_buffer_open(&ob, fp_out, 0);
+    Out_buffer_write(&ob, "target,ID,index_Frag,SIMI,candidate\n", 36);
+    while (fread(head, sizeof(head), 1, fp_in) == 1)
+    {
+        struct Date target = key_date(head[0]);
+        for (int j = 0; j < head[1]; j++)
+        {
+            struct SIMI_entry e;
+            if (fread(&e, sizeof(struct SIMI_entry), 1, fp_in) != 1)
+            {
+                printf("Program terminated: the binary similarity file is truncated\n");
+                exit(1);
+            }
+            Write_SIMI(&ob, target, j, e.index_frag, e.SIMI, key_date(e.candidate));
+        }
+    }
+    Out_buffer_close(&ob);
+}
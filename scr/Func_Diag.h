@@ -0,0 +1,43 @@
+#ifndef FUNC_DIAG
+#define FUNC_DIAG
+
+int Diag_level(
+    char SSIM_LEVEL[]
+);
+
+void Diag_open(
+    struct Para_global *p_gp,
+    FILE *fp,
+    int order,
+    int n_threads,
+    struct SIMI_diag *p_dg
+);
+
+void Diag_day(
+    struct SIMI_diag *p_dg,
+    struct df_rr_h *p_rrh,
+    struct Date target,
+    struct kNN_day *p_day,
+    int tid
+);
+
+void Diag_write(
+    struct SIMI_diag *p_dg,
+    struct kNN_day *p_day
+);
+
+void Diag_close(
+    struct SIMI_diag *p_dg
+);
+
+FILE *Diag_file_open(
+    char fname[],
+    struct SIMI_bin_header *p_hd
+);
+
+void Diag_to_CSV(
+    FILE *fp_in,
+    FILE *fp_out
+);
+
+#endif
@@ -11,9 +11,16 @@
  *               - the similarity is represented by SSIM (structural Similarity Index Measure)
  *               - kNN is used to consider the uncertainty or variability 
  * DESCRIP-END.
- * FUNCTIONS:    kNN_MOF_SSIM();  kNN_SSIM_sampling(); Rhu_MAX_class_filter();
+ * FUNCTIONS:    kNN_MOF_SSIM(); kNN_MOF_days(); kNN_MOF_stream(); kNN_day_select(); kNN_day_output();
+ *               SIMI_pair(); SIMI_cache_init(); SIMI_cache_reset(); SIMI_cache_free();
+ *               SIMI_window_weights(); kNN_SSIM_similarity(); Rhu_MAX_class_filter();
  * 
  * COMMENTS:
+ * - the similarity of a block of target days is computed before their selection, in tiles
+ *   of target x candidate days (SIMI_batch_block(), Func_Batch.c); not for VAR 5
+ * - CONTINUITY 3 or 5: a daily similarity of a (target day, library day) pair enters the
+ *   windows of up to CONTINUITY consecutive target days; VAR 5: each thread selects DAYS_CHUNK
+ *   consecutive days and keeps the pairs of its last days (struct SIMI_cache)
  * 
  * REFERENCEs:
  * 
@@ -37,39 +44,71 @@
 #include "Func_SSIM.h"
 #include "Func_Disaggregate.h"
 #include "Func_dataIO.h"
+#include "Func_Writer.h"
+#include "Func_Initialize.h"
+#include "Func_Solar.h"
+#include "Func_Prepro.h"
+#include "Func_Binary.h"
+#include "Func_Zip.h"
+#include "Func_Diag.h"
+#include "Func_Batch.h"
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+#ifdef _OPENMP
+#include <omp.h>
+#define THREAD_ID omp_get_thread_num()
+#else
+#define THREAD_ID 0
+#endif
 
 void kNN_MOF_SSIM(
     struct df_rr_h *p_rrh,
     struct df_rr_d *p_rrd,
     struct Para_global *p_gp,
+    struct class_index *p_ci,
     int nrow_rr_d,
-    int ndays_h
+    int ndays_h,
+    FILE *fp_SSIM
 ) {
     /*******************
      * Description:
      *  algorithm: k-nearest neighbouring sampling, method-of-fragments, based on seasonality
      *  scale: daily2hourly, multiple stations simultaneously
      * Parameters:
+     *  p_ci: the class index of the hourly library (candidate pools)
      *  nrow_rr_d: the number of rows in daily data file
      *  ndays_h: the number of observations of hourly data
+     *  fp_SSIM: the similarity file (FP_SSIM), opened; NULL: not written
      * *****************/
-    int i, j, h, k, s;
-    int class_t, class_c;
+    kNN_MOF_days(p_rrh, p_rrd, p_gp, p_ci, NULL, nrow_rr_d, ndays_h, fp_SSIM);
+}
+
+static void kNN_work_open(
+    struct Para_global *p_gp,
+    int ndays_h,
+    FILE *fp_SSIM,
+    struct kNN_work *p_w
+) {
+    /**************
+     * Description:
+     *      set up the disaggregation loop: working buffers, the output file (FP_OUT)
+     *      and its buffered writer, the writer thread
+     * ***********/
+    int i;
 
     /*********
      * order: 
      * - 1: sort the similarity metric in decreasing order: SSIM
      * - 0: sort the similarity metric in increasing order: Distance
      * ******/
-    
-    int order = 1;
     if (strncmp(p_gp->SIMILARITY, "SSIM", 4) == 0)
     {
-        order = 1;   // SSIM
+        p_w->order = 1;   // SSIM
     } else {
-        order = 0;   // Manhattan_distance
+        p_w->order = 0;   // Manhattan_distance
     }
-    struct df_rr_h df_rr_h_out; // this is a struct variable, not a struct array;
 
     /************
      * CONTINUITY and skip
@@ -77,130 +116,830 @@ void kNN_MOF_SSIM(
      * - p_gp->CONTINUITY: 3, skip = 1;
      * - p_gp->CONTINUITY: 5, skip = 2;
      * *************/
-    int skip = 0;
-    skip = (int)((p_gp->CONTINUITY - 1) / 2);
-    int pool_cans[MAXrow]; // the index of the candidates (a pool); the size is sufficient
-    int n_can;             // the number of candidates after all conditioning (cp and seasonality)
-    int fragment;          // the index of df_rr_h structure with the final chosed fragments
-
-    FILE *p_FP_OUT;
-    if ((p_FP_OUT=fopen(p_gp->FP_OUT, "w")) == NULL) {
+    p_w->skip = (int)((p_gp->CONTINUITY - 1) / 2);
+
+    p_w->n_threads = (p_gp->THREADS > 0) ? p_gp->THREADS : 1;
+    p_w->n_block = DAYS_BLOCK * p_w->n_threads;     // target days in one parallel block
+    int size_max = kNN_pool_size(ndays_h);          // the largest possible k
+    p_w->n_lib = (ndays_h > 0) ? ndays_h : 1;
+
+    /* thread-private working buffers: candidate pool and similarity */
+    p_w->pool_cans = (int *)malloc(sizeof(int) * p_w->n_lib * p_w->n_threads);
+    p_w->SIMI = (double *)malloc(sizeof(double) * p_w->n_lib * p_w->n_threads);
+    p_w->sc = NULL;
+    p_w->chunk = 1;
+    if (p_w->skip > 0)
+    {
+        /* windows: each thread selects consecutive days, sharing the similarity of the pairs */
+        p_w->chunk = DAYS_CHUNK;
+        p_w->sc = (struct SIMI_cache *)malloc(sizeof(struct SIMI_cache) * p_w->n_threads);
+        for (i = 0; p_w->sc != NULL && i < p_w->n_threads; i++)
+        {
+            if (SIMI_cache_init(&p_w->sc[i], p_gp->CONTINUITY, p_w->n_lib) != 0)
+            {
+                printf("Program terminated: cannot allocate memory for the similarity cache\n");
+                exit(1);
+            }
+        }
+    }
+
+    if (SIMI_batch_init(&p_w->bt, p_gp, p_w->n_block, p_w->n_lib, p_w->n_threads) != 0)
+    {
+        printf("Program terminated: cannot allocate memory for the batched similarity\n");
+        exit(1);
+    }
+
+    /* the selection of each day in a block: the kNN pool */
+    p_w->days = (struct kNN_day *)malloc(sizeof(struct kNN_day) * p_w->n_block);
+    for (i = 0; i < p_w->n_block; i++)
+    {
+        p_w->days[i].pool = (int *)malloc(sizeof(int) * (size_max > 0 ? size_max : 1));
+        p_w->days[i].SIMI = (double *)malloc(sizeof(double) * (size_max > 0 ? size_max : 1));
+        p_w->days[i].fragment = (int *)malloc(sizeof(int) * p_gp->RUN);
+        p_w->days[i].diag = NULL;
+        p_w->days[i].diag_len = 0;
+        p_w->days[i].diag_cap = 0;
+    }
+
+    p_w->out.rr_h = calloc(p_gp->N_STATION, sizeof(double) * 24);
+    p_w->day_base = 0;
+
+    p_w->f_bin = (strncmp(p_gp->OUT_FORMAT, "BIN", 3) == 0);
+    if (p_w->f_bin)
+    {
+        /* binary records: each thread disaggregates and writes its own days */
+        p_w->fp_out = NULL;
+        Bin_out_open(p_gp, &p_w->bo);
+        p_w->out_t = (struct df_rr_h *)malloc(sizeof(struct df_rr_h) * p_w->n_threads);
+        p_w->rec_t = (unsigned char *)calloc_aligned(p_w->bo.hd.rec_size * p_w->n_threads, 1);
+        if (p_w->out_t == NULL || p_w->rec_t == NULL)
+        {
+            printf("Program terminated: cannot allocate memory for the binary records\n");
+            exit(1);
+        }
+        for (i = 0; i < p_w->n_threads; i++)
+        {
+            p_w->out_t[i].rr_h = calloc(p_gp->N_STATION, sizeof(double) * 24);
+        }
+    }
+    else if ((p_w->fp_out = Out_open(p_gp->FP_OUT)) == NULL) {
         printf("Program terminated: cannot create or open output file\n");
         exit(1);
     }
-    for (i = 0; i < nrow_rr_d; i++)
+    if (strncmp(p_gp->OUT_FORMAT, "INDEX", 5) == 0)
+    {
+        fprintf(p_w->fp_out, "run,y,m,d,index_Frag,candidate\n");
+    }
+    /* buffered output, written by the writer thread while the next block is computed */
+    Writer_start();
+    if (p_w->fp_out != NULL)
     {
-        // iterate each target day
-        df_rr_h_out.date = (p_rrd + i)->date;
-        df_rr_h_out.rr_d = (p_rrd + i)->p_rr; 
-        df_rr_h_out.rr_h = calloc(p_gp->N_STATION, sizeof(double) * 24);  // allocate memory (stack);
-        
-        if (p_gp->VAR == 4)  // sunshine duration
+        Out_buffer_open(&p_w->ob, p_w->fp_out, p_gp->N_STATION);
+    }
+    p_w->f_zip = (strncmp(p_gp->OUT_FORMAT, "ZIP", 3) == 0);
+    if (p_w->f_zip)
+    {
+        /* compressed blocks of days: packed by the threads, written in the date order */
+        p_w->zip_days = Zip_days(p_gp);
+        p_w->zw = (struct Zip_work *)malloc(sizeof(struct Zip_work) * p_w->n_threads);
+        for (i = 0; i < p_w->n_threads; i++)
         {
-            if (SUN_dark(p_gp->N_STATION, (p_rrd + i)->p_rr) == 1)
-            {
-                // this is a fully cloudy day; totally dark for each site
-                n_can = -1;
-                for (j = 0; j < p_gp->N_STATION; j++)
-                {
-                    for (h = 0; h < 24; h++)
-                    {
-                        df_rr_h_out.rr_h[j][h] = 0.0;
-                    }
-                }
-                for (size_t t = 0; t < p_gp->RUN; t++)
-                {
-                    /* write the disaggregation output */
-                    Write_df_rr_h(&df_rr_h_out, p_gp, p_FP_OUT, t + 1);
-                }
-                break; // next day
-            }
+            Zip_work_init(p_gp, p_w->zip_days, &p_w->zw[i]);
+        }
+        p_w->zb = (struct Zip_block *)calloc(p_w->n_block / p_w->zip_days, sizeof(struct Zip_block));
+        for (i = 0; i < p_w->n_block / p_w->zip_days; i++)
+        {
+            p_w->zb[i].date = (int *)malloc(sizeof(int) * p_w->zip_days);
+        }
+        Zip_out_header(p_gp, p_w->zip_days, &p_w->ob);
+    }
+    p_w->f_diag = (fp_SSIM != NULL);
+    if (p_w->f_diag)
+    {
+        Diag_open(p_gp, fp_SSIM, p_w->order, p_w->n_threads, &p_w->dg);
+    }
+}
+
+static void kNN_work_block(
+    struct df_rr_h *p_rrh,
+    struct df_rr_d *p_rrd,
+    struct Para_global *p_gp,
+    struct class_index *p_ci,
+    double *Solar_MAX,
+    int b0,
+    int b1,
+    int nrow_rr_d,
+    struct kNN_work *p_w
+) {
+    /**************
+     * Description:
+     *      disaggregate the target days b0, ..., b1 - 1 (at most n_block days):
+     *      the selection in parallel, then the output in the date order
+     * Parameters:
+     *      nrow_rr_d: the number of days in p_rrd
+     * ***********/
+    /* candidate selection and sampling of the block, in parallel */
+    for (int t = 0; p_w->sc != NULL && t < p_w->n_threads; t++)
+    {
+        SIMI_cache_reset(&p_w->sc[t]);   // the window of the stream mode moves between blocks
+    }
+    /* the similarity of the block, in tiles of target x candidate days */
+    if (SIMI_batch_block(p_rrd, p_rrh, p_gp, p_ci, Solar_MAX, b0, b1, nrow_rr_d, p_w->order, p_w->skip, &p_w->bt) != 0)
+    {
+        printf("Program terminated: cannot allocate memory for the batched similarity\n");
+        exit(1);
+    }
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, p_w->chunk) num_threads(p_w->n_threads)
+#endif
+    for (int d = b0; d < b1; d++)
+    {
+        size_t tid = THREAD_ID;
+        kNN_day_select(
+            p_rrd, p_rrh, p_gp, p_ci, Solar_MAX, d, nrow_rr_d, p_w->order, p_w->skip,
+            p_w->pool_cans + tid * p_w->n_lib, p_w->SIMI + tid * p_w->n_lib, p_w->bt.sim[d - b0],
+            (p_w->sc != NULL) ? &p_w->sc[tid] : NULL, &p_w->days[d - b0]);
+        if (p_w->days[d - b0].n_can == DAY_NO_FIT)
+        {
+            printf("Program terminated: no library day has values at all the sites of the target day %d-%02d-%02d\n",
+                   (p_rrd + d)->date.y, (p_rrd + d)->date.m, (p_rrd + d)->date.d);
+            exit(1);
+        }
+        if (p_w->f_diag)
+        {
+            /* the similarity diagnostics of the day, formatted by this thread */
+            Diag_day(&p_w->dg, p_rrh, (p_rrd + d)->date, &p_w->days[d - b0], (int)tid);
+        }
+        if (p_w->f_bin)
+        {
+            /* binary output: the record of the day at its offset, no ordering needed */
+            Bin_out_day(
+                &p_w->bo, p_rrh, p_gp, p_rrd + d, &p_w->days[d - b0], p_w->day_base + d,
+                p_w->out_t + tid, p_w->rec_t + tid * p_w->bo.hd.rec_size);
+        }
+    }
+    int n_zip = 0;   // compressed blocks of the block
+    if (p_w->f_zip)
+    {
+        /* compressed output: disaggregation and compression of the blocks of days, in parallel */
+        n_zip = (b1 - b0 + p_w->zip_days - 1) / p_w->zip_days;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 1) num_threads(p_w->n_threads)
+#endif
+        for (int z = 0; z < n_zip; z++)
+        {
+            int d = b0 + z * p_w->zip_days;
+            int nd = (b1 - d < p_w->zip_days) ? b1 - d : p_w->zip_days;
+            Zip_block_pack(p_rrh, p_gp, p_rrd + d, &p_w->days[d - b0], nd, &p_w->zw[THREAD_ID], &p_w->zb[z]);
+        }
+    }
+    /* disaggregation and output of the block, in the date order */
+    for (int d = b0; d < b1; d++)
+    {
+        if (p_w->f_bin)
+        {
+            Bin_out_date(&p_w->bo, (p_rrd + d)->date);
+        }
+        kNN_day_output(p_rrd, p_rrh, p_gp, d, &p_w->days[d - b0], &p_w->out, &p_w->ob,
+            p_w->f_diag ? &p_w->dg : NULL);
+    }
+    for (int z = 0; z < n_zip; z++)
+    {
+        Zip_block_write(&p_w->zb[z], &p_w->ob);
+    }
+    Writer_signal_check();  // SIGTERM / SIGINT: end after the block, the output flushed
+}
+
+static void kNN_work_close(
+    struct kNN_work *p_w
+) {
+    /**************
+     * Description:
+     *      write the rest of the output, close FP_OUT and release the working buffers
+     * ***********/
+    int i;
+    if (p_w->fp_out != NULL)
+    {
+        Out_buffer_close(&p_w->ob);
+    }
+    if (p_w->f_zip)
+    {
+        for (i = 0; i < p_w->n_threads; i++)
+        {
+            Zip_work_free(&p_w->zw[i]);
+        }
+        for (i = 0; i < p_w->n_block / p_w->zip_days; i++)
+        {
+            free(p_w->zb[i].date);
+            free(p_w->zb[i].z);
+        }
+        free(p_w->zw);
+        free(p_w->zb);
+    }
+    if (p_w->f_diag)
+    {
+        Diag_close(&p_w->dg);
+    }
+    Writer_stop();
+    if (p_w->f_bin)
+    {
+        Bin_out_close(&p_w->bo);
+        for (i = 0; i < p_w->n_threads; i++)
+        {
+            free(p_w->out_t[i].rr_h);
         }
+        free(p_w->out_t);
+#ifdef _WIN32
+        _aligned_free(p_w->rec_t);
+#else
+        free(p_w->rec_t);
+#endif
+    } else {
+        fclose(p_w->fp_out);
+    }
 
-        n_can = 0;     // number of candidates
-        class_t = (p_rrd + i)->class;
-        for (size_t j = skip; j < ndays_h - skip; j++)
+    for (i = 0; i < p_w->n_block; i++)
+    {
+        free(p_w->days[i].pool);
+        free(p_w->days[i].SIMI);
+        free(p_w->days[i].fragment);
+        free(p_w->days[i].diag);
+    }
+    free(p_w->days);
+    free(p_w->pool_cans);
+    free(p_w->SIMI);
+    for (i = 0; p_w->sc != NULL && i < p_w->n_threads; i++)
+    {
+        SIMI_cache_free(&p_w->sc[i]);
+    }
+    free(p_w->sc);
+    SIMI_batch_free(&p_w->bt);
+    free(p_w->out.rr_h);  // free the memory allocated for disaggregated hourly output
+}
+
+void kNN_MOF_days(
+    struct df_rr_h *p_rrh,
+    struct df_rr_d *p_rrd,
+    struct Para_global *p_gp,
+    struct class_index *p_ci,
+    double *Solar_MAX,
+    int nrow_rr_d,
+    int ndays_h,
+    FILE *fp_SSIM
+) {
+    /*******************
+     * Description:
+     *  the loop over the target days, shared by kNN_MOF_SSIM() and kNN_MOF_solar()
+     *  the target days are processed in blocks:
+     *  - the candidate selection (class pool, filters, similarity, kNN) and the sampling 
+     *    of the days in a block are independent from day to day (the random numbers
+     *    are keyed on the day and run), computed in parallel by THREADS threads;
+     *  - then, in the date order, the fragments are assigned and written,
+     *    so that FP_OUT and FP_SSIM are identical for any number of threads
+     * Parameters:
+     *  Solar_MAX: the solar radiation maxima (kNN_MOF_solar), NULL otherwise
+     *  nrow_rr_d: the number of rows in daily data file
+     *  ndays_h: the number of observations of hourly data
+     *  fp_SSIM: the similarity file (FP_SSIM), opened; NULL: not written
+     * *****************/
+    struct kNN_work w;
+    kNN_work_open(p_gp, ndays_h, fp_SSIM, &w);
+    for (int b0 = 0; b0 < nrow_rr_d; b0 += w.n_block)
+    {
+        int b1 = (b0 + w.n_block < nrow_rr_d) ? b0 + w.n_block : nrow_rr_d;
+        kNN_work_block(p_rrh, p_rrd, p_gp, p_ci, Solar_MAX, b0, b1, nrow_rr_d, &w);
+    }
+    kNN_work_close(&w);
+}
+
+static int stream_fill(
+    struct Day_stream *p_ds,
+    struct Para_global *p_gp,
+    struct CP_calendar *p_cal,
+    struct df_rr_d *p_win,
+    int n,
+    int n_win
+) {
+    /**************
+     * Description:
+     *      read days into the window until it is full or the data end,
+     *      and initialize them as the whole series would be:
+     *      class, preprocessing, SSIM statistics
+     * Parameters:
+     *      p_win: the window; n: days already in it; n_win: its capacity
+     * Return:
+     *      the number of days in the window
+     * ***********/
+    int n0 = n;
+    while (n < n_win && Day_stream_read(p_ds, p_gp->N_STATION, p_win + n) == 1)
+    {
+        n++;
+    }
+    if (n > n0)
+    {
+        initialize_dfrr_d(p_gp, p_win + n0, p_cal, n - n0);
+        if (p_gp->PREPROCESS != 0)
         {
-            class_c = (p_rrh + j)->class; // the class of the candidate day
-            if (class_c == class_t)       
+            Prepro_days(p_gp, p_win + n0, n - n0);  // into win_pre: nothing allocated
+        }
+        initialize_SSIM_stats(p_gp, p_win + n0, NULL, n - n0, 0, 0);
+    }
+    return n;
+}
+
+void kNN_MOF_stream(
+    struct df_rr_h *p_rrh,
+    struct Para_global *p_gp,
+    struct class_index *p_ci,
+    struct CP_calendar *p_cal,
+    double *Solar_MAX,
+    int ndays_h,
+    FILE *fp_SSIM
+) {
+    /*******************
+     * Description:
+     *  the streaming mode (STREAM): the daily data (FP_DAILY, "-": standard input)
+     *  are read, disaggregated and written in blocks, through a window of 
+     *  n_block + 2 * skip days: the block plus the CONTINUITY days before and after;
+     *  the memory does not depend on the length of the daily data,
+     *  and the output is identical to kNN_MOF_days() on the whole series
+     * Parameters:
+     *  p_cal: the CP calendar, to classify the days as they are read
+     *  Solar_MAX: the solar radiation maxima (VAR: 5), NULL otherwise
+     *  ndays_h: the number of observations of hourly data
+     *  fp_SSIM: the similarity file (FP_SSIM), opened; NULL: not written
+     * COMMENTS:
+     *  the window keeps the global indexing of kNN_day_select() valid:
+     *  the first window starts with the first day (index 0), every later one with
+     *  the skip days before its first target day; a target day is only processed
+     *  once its skip days after are read, or the data have ended
+     * *****************/
+    int i, N = p_gp->N_STATION;
+    struct kNN_work w;
+    kNN_work_open(p_gp, ndays_h, fp_SSIM, &w);
+    int skip = w.skip;
+    int n_win = w.n_block + 2 * skip;
+
+    /* the window: days and their values, [n_win][N_STATION] */
+    struct df_rr_d *win, *tmp;
+    double *win_rr, *win_pre = NULL;
+    win = (struct df_rr_d *)calloc_aligned(n_win, sizeof(struct df_rr_d));
+    tmp = (struct df_rr_d *)malloc(sizeof(struct df_rr_d) * n_win);
+    win_rr = (double *)calloc_aligned((size_t)n_win * N, sizeof(double));
+    if (p_gp->PREPROCESS != 0)
+    {
+        win_pre = (double *)calloc_aligned((size_t)n_win * N, sizeof(double));
+    }
+    if (win == NULL || tmp == NULL || win_rr == NULL || (p_gp->PREPROCESS != 0 && win_pre == NULL))
+    {
+        printf("Program terminated: cannot allocate memory for the daily window\n");
+        exit(1);
+    }
+    for (i = 0; i < n_win; i++)
+    {
+        win[i].p_rr = win_rr + (size_t)i * N;
+        win[i].p_rr_pre = (win_pre != NULL) ? win_pre + (size_t)i * N : NULL;
+    }
+
+    struct Day_stream ds;
+    Day_stream_open(p_gp->FP_DAILY, &ds);
+    int n = 0;      // days in the window
+    int t0 = 0;     // the next target day in the window
+    int eof = 0;
+    while (1)
+    {
+        if (!eof)
+        {
+            int n_read = stream_fill(&ds, p_gp, p_cal, win, n, n_win);
+            eof = (n_read < n_win);
+            n = n_read;
+        }
+        /* the target days with all their CONTINUITY days in the window */
+        int t1 = eof ? n : n - skip;
+        if (t1 > t0 + w.n_block)
+        {
+            t1 = t0 + w.n_block;
+        }
+        if (t1 > t0)
+        {
+            kNN_work_block(p_rrh, win, p_gp, p_ci, Solar_MAX, t0, t1, n, &w);
+        }
+        if (eof && t1 >= n)
+        {
+            break;
+        }
+        /* keep the skip days before the next target day (and those after it): 
+         * rotate them to the front, the days (and their values) before are reused */
+        int k0 = t1 - skip;
+        memcpy(tmp, win, sizeof(struct df_rr_d) * k0);
+        memmove(win, win + k0, sizeof(struct df_rr_d) * (n - k0));
+        memcpy(win + n - k0, tmp, sizeof(struct df_rr_d) * k0);
+        n -= k0;
+        w.day_base += k0;
+        t0 = skip;
+    }
+    Day_stream_close(&ds);
+    kNN_work_close(&w);
+    free(tmp);
+#ifdef _WIN32
+    _aligned_free(win);
+    _aligned_free(win_rr);
+    _aligned_free(win_pre);
+#else
+    free(win);
+    free(win_rr);
+    free(win_pre);
+#endif
+}
+
+static int day_candidates(
+    struct df_rr_d *p_target,
+    struct df_rr_h *p_rrh,
+    struct Para_global *p_gp,
+    double *Solar_MAX,
+    const int *pool,
+    int n_pool,
+    const double *SIMI_pool,
+    int *pool_cans,
+    double *SIMI
+) {
+    /**************
+     * Description:
+     *      the candidates of a pool that fit the target day:
+     *      VAR 1, 4: a value (not 0) at each site where the target day has one (SUN_zero_fit());
+     *      solar radiation: below the maxima (Solar_MAX_lump_filter()), unless none is
+     * Parameters:
+     *      pool, n_pool: the library days to filter
+     *      SIMI_pool: the similarity of the pool days (kept with the candidates); NULL: none
+     *      pool_cans, SIMI: the candidates and their similarity (output)
+     * Return:
+     *      the number of candidates
+     * ***********/
+    int j, n_can;
+    if (Solar_MAX == NULL && (p_gp->VAR == 4 || p_gp->VAR == 1))
+    {
+        /* check the 0 and non-zero for sunshine duration and wind speed */
+        n_can = 0;
+        for (j = 0; j < n_pool; j++)
+        {
+            if (SUN_zero_fit(p_gp->N_STATION, p_target->p_rr, (p_rrh + pool[j])->rr_d) == 1)
             {
-                pool_cans[n_can] = j;
+                pool_cans[n_can] = pool[j];
+                if (SIMI_pool != NULL)
+                {
+                    SIMI[n_can] = SIMI_pool[j];
+                }
                 n_can += 1;
             }
         }
-        
-        int index = 0;
-        if (p_gp->VAR == 4 || p_gp->VAR == 1)
+    } else {
+        n_can = n_pool;
+        memcpy(pool_cans, pool, sizeof(int) * n_can); // working copy; filtered and sorted in place
+        if (SIMI_pool != NULL)
+        {
+            memcpy(SIMI, SIMI_pool, sizeof(double) * n_can);
+        }
+    }
+    if (Solar_MAX != NULL)
+    {
+        int n_can_out;
+        // Solar_MAX_class_filter(p_rrh, p_target, p_gp, Solar_MAX, pool_cans, n_can, &n_can_out);
+        Solar_MAX_lump_filter(p_rrh, p_target, p_gp, Solar_MAX, pool_cans, n_can, &n_can_out);
+        if (n_can_out > 0)
         {
-            /* check the 0 and non-zero for sunshine duration and wind speed */
-            for (j = 0; j < n_can; j++)
+            n_can = n_can_out;
+        }
+    }
+    return n_can;
+}
+
+void kNN_day_select(
+    struct df_rr_d *p_rrd,
+    struct df_rr_h *p_rrh,
+    struct Para_global *p_gp,
+    struct class_index *p_ci,
+    double *Solar_MAX,
+    int index_target,
+    int nrow_rr_d,
+    int order,
+    int skip,
+    int *pool_cans,
+    double *SIMI,
+    const double *SIMI_class,
+    struct SIMI_cache *p_sc,
+    struct kNN_day *p_day
+) {
+    /**************
+     * Description:
+     *      the candidate selection of one target day:
+     *      - candidates from the class index, filtered for the variable
+     *      - the similarity (SSIM or Manhattan distance) to the target day
+     *      - the k nearest candidates, sorted
+     *      - RUN fragments sampled from the k nearest candidates
+     *      only reads the shared data: safe to call from parallel threads
+     * Parameters:
+     *      index_target: the index of target day to be disaggregated
+     *      skip: (CONTINUITY - 1) / 2
+     *      pool_cans, SIMI: working buffers (ndays_h), private to the calling thread
+     *      SIMI_class: the similarity to each day of the class pool (SIMI_batch_block());
+     *              NULL: computed here
+     *      p_sc: the similarity of the pairs (CONTINUITY > 1), private to the calling thread;
+     *              NULL: not kept
+     *      p_day: the selection (output); n_can -1: dark day,
+     *              DAY_NO_FIT: no library day fits the target day (VAR 1, 4)
+     * ***********/
+    int i = index_target;
+    int j, n_can;
+
+    if ((Solar_MAX != NULL || p_gp->VAR == 4) && SUN_dark(p_gp->N_STATION, (p_rrd + i)->p_rr) == 1)
+    {
+        // this is a fully cloudy day; totally dark for each site
+        p_day->n_can = -1;
+        return;
+    }
+
+    /* candidates: the library days of the same class, a slice of the class index */
+    int *pool_class;
+    n_can = class_pool(p_ci, (p_rrd + i)->class, &pool_class);
+
+    n_can = day_candidates(p_rrd + i, p_rrh, p_gp, Solar_MAX, pool_class, n_can, SIMI_class, pool_cans, SIMI);
+    if (n_can == 0)
+    {
+        /* no candidate of the class (a cp or month not in the library, or none fits):
+         * the candidates from all the library days, with the same filters */
+        n_can = day_candidates(
+            p_rrd + i, p_rrh, p_gp, Solar_MAX, p_ci->day, p_ci->offset[p_ci->n_class], NULL, pool_cans, SIMI);
+        SIMI_class = NULL;
+    }
+    if (n_can == 0)
+    {
+        // no library day fits the sites of the target day (VAR 1, 4): no fragments
+        p_day->n_can = DAY_NO_FIT;
+        return;
+    }
+
+    /* the first and last several days are disaggregated by assuming CONTUNITY == 1 */
+    int skip_temp;
+    if (i >= skip && i < nrow_rr_d - skip)
+    {
+        skip_temp = skip;
+    } else {
+        skip_temp = 0;
+    }
+    if (SIMI_class != NULL)
+    {
+        /* batched: an empty image gives NAN (SSIM), reported as by meanSSIM_cached() */
+        for (j = 0; order == 1 && j < n_can; j++)
+        {
+            if (isnan(SIMI[j]))
             {
-                if (SUN_zero_fit(p_gp->N_STATION, (p_rrd + i)->p_rr, (p_rrh + pool_cans[j])->rr_d) == 1)
-                {
-                    pool_cans[index] = pool_cans[j];
-                    index += 1;
-                }
+                printf("NULL: an empty image is detected!\n");
+                exit(1);
             }
-            n_can = index;
         }
+    }
+    else if (Solar_MAX != NULL)
+    {
+        similarity_solar(p_rrd, p_rrh, p_gp, i, pool_cans, n_can, skip_temp, order, SIMI, p_sc);
+    } else {
+        kNN_SSIM_similarity(p_rrd, p_rrh, p_gp, i, pool_cans, order, n_can, skip_temp, SIMI, p_sc);
+    }
 
-        int *index_fragment;
-        index_fragment = (int *)malloc(sizeof(int) * p_gp->RUN);
-        if (i >= skip && i < nrow_rr_d - skip)
+    int size_pool;  // the k in kNN
+    size_pool = kNN_pool_size(n_can);
+    similarity_topk(SIMI, pool_cans, order, n_can, size_pool);
+    memcpy(p_day->pool, pool_cans, sizeof(int) * size_pool);
+    memcpy(p_day->SIMI, SIMI, sizeof(double) * size_pool);
+    p_day->n_can = n_can;
+
+    /* sample RUN fragments; random numbers keyed on (SEED, target day, run);
+     * the SIMI working buffer (already copied to p_day) holds the weights */
+    kNN_sampling_topk(
+        p_day->SIMI, p_day->pool, order, n_can, p_gp->RUN,
+        p_gp->SEED, date_key((p_rrd + i)->date), SIMI, p_day->fragment);
+}
+
+void kNN_day_output(
+    struct df_rr_d *p_rrd,
+    struct df_rr_h *p_rrh,
+    struct Para_global *p_gp,
+    int index_target,
+    struct kNN_day *p_day,
+    struct df_rr_h *p_out,
+    struct Out_buffer *p_ob,
+    struct SIMI_diag *p_dg
+) {
+    /**************
+     * Description:
+     *      disaggregate one target day with its RUN sampled fragments,
+     *      write the output (and the similarity);
+     *      OUT_FORMAT INDEX: write only the sampled fragments (Write_index());
+     *      OUT_FORMAT BIN, BIN64: the values are already written (Bin_out_day()), in parallel;
+     *      OUT_FORMAT ZIP: the values are already packed (Zip_block_pack()), in parallel;
+     *      called in the date order
+     * Parameters:
+     *      p_day: the candidate selection of the day (kNN_day_select())
+     *      p_out: the disaggregated hourly output (working struct)
+     *      p_ob: the buffered writer of the output file
+     *      p_dg: the similarity diagnostics (formatted by Diag_day()); NULL: not written
+     * ***********/
+    int i = index_target;
+    int j, h;
+    int f_index = (strncmp(p_gp->OUT_FORMAT, "INDEX", 5) == 0);  // only the sampled fragments
+    int f_bin = (strncmp(p_gp->OUT_FORMAT, "BIN", 3) == 0 ||
+                 strncmp(p_gp->OUT_FORMAT, "ZIP", 3) == 0);      // already written (Bin_out_day(), Zip_block_pack())
+    p_out->date = (p_rrd + i)->date;
+    p_out->rr_d = (p_rrd + i)->p_rr;
+
+    if (p_day->n_can < 0 && f_bin)
+    {
+        printf("%d-%02d-%02d: Done!\n", (p_rrd+i)->date.y, (p_rrd+i)->date.m, (p_rrd+i)->date.d);
+        return;
+    }
+
+    if (p_day->n_can < 0 && f_index)
+    {
+        for (size_t t = 0; t < p_gp->RUN; t++)
         {
-            kNN_SSIM_sampling(p_rrd, p_rrh, p_gp, i, pool_cans, order, n_can, skip, p_gp->RUN, index_fragment);
+            Write_index(p_ob, t + 1, p_out->date, -1, NULL);
         }
-        else
+        printf("%d-%02d-%02d: Done!\n", (p_rrd+i)->date.y, (p_rrd+i)->date.m, (p_rrd+i)->date.d);
+        return;
+    }
+    if (p_day->n_can < 0)
+    {
+        // dark day: no sunshine (or solar radiation) at any site
+        for (j = 0; j < p_gp->N_STATION; j++)
         {
-            kNN_SSIM_sampling(p_rrd, p_rrh, p_gp, i, pool_cans, order, n_can, 0, p_gp->RUN, index_fragment);
+            for (h = 0; h < 24; h++)
+            {
+                p_out->rr_h[j][h] = 0.0;
+            }
         }
-        /*assign the sampled fragments to target day (disaggregation)*/
         for (size_t t = 0; t < p_gp->RUN; t++)
         {
-            Fragment_assign(p_rrh, &df_rr_h_out, p_gp, index_fragment[t]);
             /* write the disaggregation output */
-            Write_df_rr_h(&df_rr_h_out, p_gp, p_FP_OUT, t + 1);
+            Write_df_rr_h(p_out, p_gp, p_ob, t + 1);
         }
+        printf("%d-%02d-%02d: Done!\n", (p_rrd+i)->date.y, (p_rrd+i)->date.m, (p_rrd+i)->date.d);
+        return;
+    }
 
+    /**********
+     * the first k candidates, together with the similarity metric (or their summary)
+     * ********/
+    if (p_dg != NULL)
+    {
+        Diag_write(p_dg, p_day);
+    }
+
+    if (f_bin)
+    {
+        printf("%d-%02d-%02d: Done!\n", (p_rrd+i)->date.y, (p_rrd+i)->date.m, (p_rrd+i)->date.d);
+        return;
+    }
+    if (f_index)
+    {
+        /* the sampled fragments, expanded later by Expand_index() */
+        for (size_t t = 0; t < p_gp->RUN; t++)
+        {
+            Write_index(
+                p_ob, t + 1, p_out->date, p_day->fragment[t],
+                &(p_rrh + p_day->fragment[t])->date);
+        }
         printf("%d-%02d-%02d: Done!\n", (p_rrd+i)->date.y, (p_rrd+i)->date.m, (p_rrd+i)->date.d);
-        free(df_rr_h_out.rr_h);  // free the memory allocated for disaggregated hourly output
+        return;
+    }
+
+    /*assign the sampled fragments to target day (disaggregation)*/
+    for (size_t t = 0; t < p_gp->RUN; t++)
+    {
+        Fragment_assign(p_rrh, p_out, p_gp, p_day->fragment[t]);
+        /* write the disaggregation output */
+        Write_df_rr_h(p_out, p_gp, p_ob, t + 1);
     }
-    fclose(p_FP_OUT);
+    printf("%d-%02d-%02d: Done!\n", (p_rrd+i)->date.y, (p_rrd+i)->date.m, (p_rrd+i)->date.d);
 }
 
 
-void kNN_SSIM_sampling(
+double SIMI_pair(
     struct df_rr_d *p_rrd,
     struct df_rr_h *p_rrh,
     struct Para_global *p_gp,
-    int index_target,
-    int pool_cans[],
     int order,
-    int n_can,
+    int a,
+    int b
+){
+    /**************
+     * Description:
+     *      the daily similarity (SSIM or Manhattan distance) of the target day a
+     *      and the library day b, of the preprocessed data if PREPROCESS
+     * Return:
+     *      the similarity; 0.0 for a dark day (sunshine duration, SSIM)
+     * ***********/
+    if (
+        p_gp->VAR == 4 && order == 1 &&
+        (SUN_dark(p_gp->N_STATION, (p_rrd + a)->p_rr) == 1 ||
+         SUN_dark(p_gp->N_STATION, (p_rrh + b)->rr_d) == 1))
+    {
+        return 0.0;
+    }
+    if (p_gp->PREPROCESS == 0)
+    {
+        if (order == 1)
+        {
+            // SSIM; sorting SIMI in the decreasing order; higher SSIM, better resemblance
+            return meanSSIM_cached(
+                (p_rrd + a)->p_rr, (p_rrh + b)->rr_d, &(p_rrd + a)->stats, &(p_rrh + b)->stats,
+                p_gp->NODATA, p_gp->N_STATION, p_gp->k, p_gp->power);
+        }
+        // order == 0; Manhattan distance, sort SIMI in the increasing order 
+        return Manhattan_distance((p_rrd + a)->p_rr, (p_rrh + b)->rr_d, p_gp->NODATA, p_gp->N_STATION);
+    }
+    // using the data after preprocesssing
+    if (order == 1)
+    {
+        return meanSSIM_cached(
+            (p_rrd + a)->p_rr_pre, (p_rrh + b)->p_rr_pre, &(p_rrd + a)->stats_pre, &(p_rrh + b)->stats_pre,
+            p_gp->NODATA, p_gp->N_STATION, p_gp->k, p_gp->power);
+    }
+    return Manhattan_distance((p_rrd + a)->p_rr_pre, (p_rrh + b)->p_rr_pre, p_gp->NODATA, p_gp->N_STATION);
+}
+
+int SIMI_cache_init(
+    struct SIMI_cache *p_sc,
+    int CONTINUITY,
+    size_t n_lib
+){
+    /**************
+     * Description:
+     *      the rows of CONTINUITY target days, over n_lib library days
+     * Return:
+     *      0; -1: out of memory (nothing allocated)
+     * ***********/
+    p_sc->n_row = CONTINUITY;
+    p_sc->n_lib = (n_lib > 0) ? n_lib : 1;
+    p_sc->day = (int *)malloc(sizeof(int) * p_sc->n_row);
+    p_sc->D = (double *)malloc(sizeof(double) * p_sc->n_row * p_sc->n_lib);
+    if (p_sc->day == NULL || p_sc->D == NULL)
+    {
+        SIMI_cache_free(p_sc);
+        p_sc->day = NULL;
+        p_sc->D = NULL;
+        return -1;
+    }
+    SIMI_cache_reset(p_sc);
+    return 0;
+}
+
+void SIMI_cache_reset(
+    struct SIMI_cache *p_sc
+){
+    /* forget all rows: the indexing of the target days changes (a new block, a new request) */
+    for (int r = 0; r < p_sc->n_row; r++)
+    {
+        p_sc->day[r] = -1;
+    }
+}
+
+void SIMI_cache_free(
+    struct SIMI_cache *p_sc
+){
+    free(p_sc->day);
+    free(p_sc->D);
+}
+
+static double *SIMI_cache_row(
+    struct SIMI_cache *p_sc,
+    int a
+){
+    /* the row of the target day a; a row of an older day is cleared for it */
+    int r = a % p_sc->n_row;
+    double *row = p_sc->D + (size_t)r * p_sc->n_lib;
+    if (p_sc->day[r] != a)
+    {
+        for (size_t b = 0; b < p_sc->n_lib; b++)
+        {
+            row[b] = NAN;
+        }
+        p_sc->day[r] = a;
+    }
+    return row;
+}
+
+void SIMI_window_weights(
     int skip,
-    int run,
-    int *index_fragment
+    double w_image[5]
 ){
     /**************
      * Description:
-     *      - compute the SSIM index of rr between target and candidate days
-     *      - sort the distance in the decreasing order
-     *      - select the sqrt(n_can) largest SSIM
-     *      - weights defined based on SSIM: higher SSIM, heavier weight
-     *      - sample one candidate 
+     *      the weights of the days of the window in the similarity of a target day
      * Parameters:
-     *      p_rrd: the daily rainfall st (structure pointer)
-     *      p_rrh: pointing to the hourly rr obs structure array
-     *      p_gp: pointing to global parameter structure
-     *      index_target: the index of target day to be disaggregated
-     *      pool_cans: the index pool of candidats
-     *      n_can: the number (or size) fo candidates pool
-     *      skip: due to the consideration of days before and after the target day, 
-     *              the first and last several days should be disaggregated by assuming CONTUNITY == 1
-     * Output:
-     *      return a vector (number) of sampled index (fragments source); how many RUNs of sampling
+     *      skip: (CONTINUITY - 1) / 2, the days before and after the target day
+     *      w_image: the weights of the days -skip, ..., skip (output)
      * ***********/
-    double w_image[5] = {0.08333333, 0.1666667, 0.5, 0.1666667, 0.08333333};  // CONTUNITY == 5
+    double w5[5] = {0.08333333, 0.1666667, 0.5, 0.1666667, 0.08333333};  // CONTUNITY == 5
+    memcpy(w_image, w5, sizeof(w5));
     if (skip == 0)
     {
         // CONTUNITY == 1
@@ -214,112 +953,78 @@ void kNN_SSIM_sampling(
         printf("Currently CONTUNITY > 5 is not possible!\n");
         exit(1);
     }
+}
 
-    int i, j, s; // iteration variable
-    double *SIMI;
+void kNN_SSIM_similarity(
+    struct df_rr_d *p_rrd,
+    struct df_rr_h *p_rrh,
+    struct Para_global *p_gp,
+    int index_target,
+    int pool_cans[],
+    int order,
+    int n_can,
+    int skip,
+    double *SIMI,
+    struct SIMI_cache *p_sc
+){
+    /**************
+     * Description:
+     *      - compute the SSIM index (or Manhattan distance) of rr between target and candidate days
+     *      - the days before and after are weighted in, CONTINUITY
+     * Parameters:
+     *      p_rrd: the daily rainfall st (structure pointer)
+     *      p_rrh: pointing to the hourly rr obs structure array
+     *      p_gp: pointing to global parameter structure
+     *      index_target: the index of target day to be disaggregated
+     *      pool_cans: the index pool of candidats
+     *      n_can: the number (or size) fo candidates pool
+     *      skip: due to the consideration of days before and after the target day, 
+     *              the first and last several days should be disaggregated by assuming CONTUNITY == 1
+     *      SIMI: the similarity of each candidate (output)
+     *      p_sc: the similarity of the pairs of the last target days of this thread
+     *              (CONTINUITY > 1); NULL: each pair is computed
+     * ***********/
+    double w_image[5];
+    SIMI_window_weights(skip, w_image);
+
+    int i, s; // iteration variable
     double SIMI_temp;
-    SIMI = (double *)malloc(n_can * sizeof(double));
 
-    /** compute the similarity: SSIM or Manhattan distance **/
-    if (f_prep == 0)
+    if (p_sc == NULL || skip == 0)
     {
-        // using the data after preprocesssing
         for (i = 0; i < n_can; i++)
         {
             *(SIMI + i) = 0.0;
             for (s = 0 - skip; s < 1 + skip; s++)
             {
-                if (
-                    p_gp->VAR == 4 && order == 1 &&
-                    (SUN_dark(p_gp->N_STATION, (p_rrd + index_target + s)->p_rr) == 1 ||
-                     SUN_dark(p_gp->N_STATION, (p_rrh + pool_cans[i] + s)->rr_d) == 1))
-                {
-                    SIMI_temp = 0.0;
-                }
-                else
-                {
-                    if (order == 1)
-                    {
-                        // SSIM; sorting SIMI in the decreasing order; higher SSIM, better resemblance
-                        SIMI_temp = w_image[s + skip] * meanSSIM(
-                                                            (p_rrd + index_target + s)->p_rr,
-                                                            (p_rrh + pool_cans[i] + s)->rr_d,
-                                                            p_gp->NODATA,
-                                                            p_gp->N_STATION,
-                                                            p_gp->k,
-                                                            p_gp->power);
-                    }
-                    else
-                    {
-                        // order == 0; Manhattan distance, sort SIMI in the increasing order 
-                        SIMI_temp = w_image[s + skip] * Manhattan_distance(
-                                                            (p_rrd + index_target + s)->p_rr,
-                                                            (p_rrh + pool_cans[i] + s)->rr_d,
-                                                            p_gp->N_STATION);
-                    }
-                }
+                SIMI_temp = w_image[s + skip] * SIMI_pair(
+                    p_rrd, p_rrh, p_gp, order, index_target + s, pool_cans[i] + s);
                 *(SIMI + i) += SIMI_temp;
             }
         }
+        return;
     }
-    else
+    /* the rows of the window: the pairs (index_target + s, c + s) computed once,
+     * for this and the next target days */
+    double *rows[5];
+    for (s = 0 - skip; s < 1 + skip; s++)
     {
-        // no normalization or standardization
-        for (i = 0; i < n_can; i++)
-        {
-            *(SIMI + i) = 0.0;
-            for (s = 0 - skip; s < 1 + skip; s++)
-            {
-                if (
-                    p_gp->VAR == 4 && order == 1 &&
-                    (SUN_dark(p_gp->N_STATION, (p_rrd + index_target + s)->p_rr) == 1 ||
-                     SUN_dark(p_gp->N_STATION, (p_rrh + pool_cans[i] + s)->rr_d) == 1))
-                {
-                    SIMI_temp = 0.0;
-                }
-                else
-                {
-                    if (order == 1)
-                    {
-                        SIMI_temp = w_image[s + skip] * meanSSIM(
-                                                            (p_rrd + index_target + s)->p_rr_pre,
-                                                            (p_rrh + pool_cans[i] + s)->p_rr_pre,
-                                                            p_gp->NODATA,
-                                                            p_gp->N_STATION,
-                                                            p_gp->k,
-                                                            p_gp->power);
-                    }
-                    else
-                    {
-                        SIMI_temp = w_image[s + skip] * Manhattan_distance(
-                                                            (p_rrd + index_target + s)->p_rr_pre,
-                                                            (p_rrh + pool_cans[i] + s)->p_rr_pre,
-                                                            p_gp->N_STATION);
-                    }
-                }
-                *(SIMI + i) += SIMI_temp;
-            }
-        }
+        rows[s + skip] = SIMI_cache_row(p_sc, index_target + s);
     }
-
-    kNN_sampling(SIMI, pool_cans, order, n_can, run, index_fragment);
-
-    /**********
-     * print the first k candidates, together with the similarity metric
-     * ********/
-    if (p_SSIM != NULL)
+    for (i = 0; i < n_can; i++)
     {
-        int size_pool; // the k in kNN
-        size_pool = (int)sqrt(n_can) + 1;
-        for (i = 0; i < size_pool; i++)
+        *(SIMI + i) = 0.0;
+        for (s = 0 - skip; s < 1 + skip; s++)
         {
-            fprintf(p_SSIM, "%d-%02d-%02d,", (p_rrd + index_target)->date.y, (p_rrd + index_target)->date.m, (p_rrd + index_target)->date.d);
-            fprintf(p_SSIM, "%d,%d,%f,", i, pool_cans[i], SIMI[i]);
-            fprintf(p_SSIM, "%d-%02d-%02d\n", (p_rrh + pool_cans[i])->date.y, (p_rrh + pool_cans[i])->date.m, (p_rrh + pool_cans[i])->date.d);
+            double *p_D = rows[s + skip] + pool_cans[i] + s;
+            if (isnan(*p_D))
+            {
+                *p_D = SIMI_pair(p_rrd, p_rrh, p_gp, order, index_target + s, pool_cans[i] + s);
+            }
+            SIMI_temp = w_image[s + skip] * (*p_D);
+            *(SIMI + i) += SIMI_temp;
         }
     }
-    
-    free(SIMI);
 }
 
 
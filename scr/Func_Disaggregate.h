@@ -1,19 +1,95 @@
 #ifndef FUNC_DISAGGREGATE
 #define FUNC_DISAGGREGATE
 
-extern FILE *p_SSIM;
-extern int f_prep; 
-
 void kNN_MOF_SSIM(
     struct df_rr_h *p_rrh,
     struct df_rr_d *p_rrd,
     struct Para_global *p_gp,
+    struct class_index *p_ci,
     int nrow_rr_d,
-    int ndays_h
+    int ndays_h,
+    FILE *fp_SSIM
+);
+
+
+void kNN_MOF_days(
+    struct df_rr_h *p_rrh,
+    struct df_rr_d *p_rrd,
+    struct Para_global *p_gp,
+    struct class_index *p_ci,
+    double *Solar_MAX,
+    int nrow_rr_d,
+    int ndays_h,
+    FILE *fp_SSIM
+);
+
+void kNN_MOF_stream(
+    struct df_rr_h *p_rrh,
+    struct Para_global *p_gp,
+    struct class_index *p_ci,
+    struct CP_calendar *p_cal,
+    double *Solar_MAX,
+    int ndays_h,
+    FILE *fp_SSIM
+);
+
+void kNN_day_select(
+    struct df_rr_d *p_rrd,
+    struct df_rr_h *p_rrh,
+    struct Para_global *p_gp,
+    struct class_index *p_ci,
+    double *Solar_MAX,
+    int index_target,
+    int nrow_rr_d,
+    int order,
+    int skip,
+    int *pool_cans,
+    double *SIMI,
+    const double *SIMI_class,
+    struct SIMI_cache *p_sc,
+    struct kNN_day *p_day
 );
 
+void kNN_day_output(
+    struct df_rr_d *p_rrd,
+    struct df_rr_h *p_rrh,
+    struct Para_global *p_gp,
+    int index_target,
+    struct kNN_day *p_day,
+    struct df_rr_h *p_out,
+    struct Out_buffer *p_ob,
+    struct SIMI_diag *p_dg
+);
+
+double SIMI_pair(
+    struct df_rr_d *p_rrd,
+    struct df_rr_h *p_rrh,
+    struct Para_global *p_gp,
+    int order,
+    int a,
+    int b
+);
+
+int SIMI_cache_init(
+    struct SIMI_cache *p_sc,
+    int CONTINUITY,
+    size_t n_lib
+);
+
+void SIMI_cache_reset(
+    struct SIMI_cache *p_sc
+);
+
+void SIMI_cache_free(
+    struct SIMI_cache *p_sc
+);
+
+void SIMI_window_weights(
+    int skip,
+    double w_image[5]
+);
 
-void kNN_SSIM_sampling(
+void kNN_SSIM_similarity(
     struct df_rr_d *p_rrd,
     struct df_rr_h *p_rrh,
     struct Para_global *p_gp,
@@ -22,8 +98,8 @@ void kNN_SSIM_sampling(
     int order,
     int n_can,
     int skip,
-    int run,
-    int *index_fragment
+    double *SIMI,
+    struct SIMI_cache *p_sc
 );
 
 
@@ -0,0 +1,744 @@
+/*
+ * SUMMARY:      Func_Engine.c
+ * USAGE:        the disaggregation engine behind the C interface (knnmof.h)
+ * AUTHOR:       Xiaoxiang Guan
+ * ORG:          Section Hydrology, GFZ
+ * E-MAIL:       guan@gfz-potsdam.de
+ * ORIG-DATE:    Oct-2024
+ * DESCRIPTION:  an engine context (struct kNN_engine) holds a configuration,
+ *               the library loaded for it (the CP series, the hourly library or its cache
+ *               FP_CACHE, the class index) and the buffers of the target days;
+ *               the days given to kNN_engine_days() are disaggregated as a daily data file
+ *               with these days: same selection (kNN_day_select()),
+ *               sampling and fragments (Fragment_assign())
+ * DESCRIP-END.
+ * FUNCTIONS:    kNN_engine_create(); kNN_engine_free(); kNN_engine_config();
+ *               kNN_engine_config_file(); kNN_engine_load(); kNN_engine_changed();
+ *               kNN_engine_info(); kNN_engine_days(); kNN_engine_error();
+ *
+ * COMMENTS:
+ * - no global state: the contexts are independent of each other
+ * - the errors of the input (configuration, source files, target days) and an exhausted
+ *   memory are returned as codes, with the message in the context (kNN_engine_error());
+ *   the shared import and initialization functions return them to the engine, the
+ *   front ends (main(), ...) still end the process on them; nothing is printed
+ * - the sources the selection could not use are rejected when loaded (KNN_ERR_FILE):
+ *   library days without cp in FP_CP, a library without spread to preprocess,
+ *   library days with less than 2 sites (SSIM); the selection then never meets them
+ * - PREPROCESS: the normalization (standardization) is derived from the library alone,
+ *   as in the streaming mode
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+#ifdef _OPENMP
+#include <omp.h>
+#define THREAD_ID omp_get_thread_num()
+#else
+#define THREAD_ID 0
+#endif
+
+#include "def_struct.h"
+#include "knnmof.h"
+#include "Func_dataIO.h"
+#include "Func_Initialize.h"
+#include "Func_Prepro.h"
+#include "Func_Fragments.h"
+#include "Func_Disaggregate.h"
+#include "Func_Batch.h"
+#include "Func_Solar.h"
+#include "Func_Cache.h"
+#include "Func_SSIM.h"
+#include "Func_kNN.h"
+
+static int engine_fail(
+    kNN_engine *e,
+    int code,
+    const char *msg)
+{
+    /* keep the message of the error and return its code */
+    snprintf(e->error, sizeof(e->error), "%s", msg);
+    return code;
+}
+
+static int config_check(
+    kNN_engine *e)
+{
+    /**************
+     * Description:
+     *      check the configuration before the library is loaded
+     * Return:
+     *      KNN_OK or KNN_ERR_CONFIG
+     * ************/
+    struct Para_global *p_gp = &e->gp;
+    if (p_gp->N_STATION < 1)
+    {
+        return engine_fail(e, KNN_ERR_CONFIG, "N_STATION: at least 1 site");
+    }
+    if (p_gp->RUN < 1)
+    {
+        return engine_fail(e, KNN_ERR_CONFIG, "RUN: at least 1 run");
+    }
+    if (p_gp->VAR < 0 || p_gp->VAR > 5)
+    {
+        return engine_fail(e, KNN_ERR_CONFIG, "VAR: 0 to 5");
+    }
+    if (p_gp->CONTINUITY != 1 && p_gp->CONTINUITY != 3 && p_gp->CONTINUITY != 5)
+    {
+        return engine_fail(e, KNN_ERR_CONFIG, "CONTINUITY: 1, 3 or 5");
+    }
+    if (strncmp(p_gp->MONTH, "TRUE", 4) == 0 && strncmp(p_gp->SEASON, "TRUE", 4) == 0)
+    {
+        return engine_fail(e, KNN_ERR_CONFIG, "conditioned on either MONTH or SEASON");
+    }
+    if (p_gp->PREPROCESS < 0 || p_gp->PREPROCESS > 2)
+    {
+        return engine_fail(e, KNN_ERR_CONFIG, "PREPROCESS: 0, 1 or 2");
+    }
+    if (p_gp->FP_HOURLY[0] == '\0')
+    {
+        return engine_fail(e, KNN_ERR_CONFIG, "FP_HOURLY: no hourly library");
+    }
+    if (strncmp(p_gp->T_CP, "TRUE", 4) == 0 && p_gp->FP_CP[0] == '\0')
+    {
+        return engine_fail(e, KNN_ERR_CONFIG, "FP_CP: no CP series (T_CP: TRUE)");
+    }
+    return KNN_OK;
+}
+
+static void days_free(
+    kNN_engine *e)
+{
+    /* release the buffers of the target days (their sizes depend on the library) */
+    for (int i = 0; i < e->cap; i++)
+    {
+        free(e->sel[i].pool);
+        free(e->sel[i].SIMI);
+        free(e->sel[i].fragment);
+    }
+    free(e->days);
+    free(e->rr);
+    free(e->rr_pre);
+    free(e->sel);
+    free(e->out.rr_h);
+    e->days = NULL;
+    e->rr = NULL;
+    e->rr_pre = NULL;
+    e->sel = NULL;
+    e->out.rr_h = NULL;
+    e->cap = 0;
+}
+
+static int days_reserve(
+    kNN_engine *e,
+    int n)
+{
+    /* room for n target days; -1: out of memory (the room of before is kept) */
+    int N = e->gp.N_STATION;
+    void *p;
+    if (n <= e->cap)
+    {
+        return 0;
+    }
+    int cap = (e->cap > 0) ? e->cap : 16;
+    while (cap < n)
+    {
+        cap *= 2;
+    }
+    int k = kNN_pool_size(e->lib.ndays_h);
+    if ((p = realloc(e->days, sizeof(struct df_rr_d) * cap)) == NULL)
+    {
+        return -1;
+    }
+    e->days = (struct df_rr_d *)p;
+    if ((p = realloc(e->rr, sizeof(double) * N * cap)) == NULL)
+    {
+        return -1;
+    }
+    e->rr = (double *)p;
+    if ((p = realloc(e->rr_pre, sizeof(double) * N * cap)) == NULL)
+    {
+        return -1;
+    }
+    e->rr_pre = (double *)p;
+    if ((p = realloc(e->sel, sizeof(struct kNN_day) * cap)) == NULL)
+    {
+        return -1;
+    }
+    e->sel = (struct kNN_day *)p;
+    if (e->out.rr_h == NULL && (e->out.rr_h = calloc(N, sizeof(double) * 24)) == NULL)
+    {
+        return -1;
+    }
+    for (int i = e->cap; i < cap; i++)
+    {
+        e->sel[i].pool = (int *)malloc(sizeof(int) * (k > 0 ? k : 1));
+        e->sel[i].SIMI = (double *)malloc(sizeof(double) * (k > 0 ? k : 1));
+        e->sel[i].fragment = (int *)malloc(sizeof(int) * e->gp.RUN);
+        e->sel[i].diag = NULL;
+        e->sel[i].diag_len = 0;
+        e->sel[i].diag_cap = 0;
+        if (e->sel[i].pool == NULL || e->sel[i].SIMI == NULL || e->sel[i].fragment == NULL)
+        {
+            free(e->sel[i].pool);
+            free(e->sel[i].SIMI);
+            free(e->sel[i].fragment);
+            return -1;
+        }
+        e->cap = i + 1;     // the days of before, and this one
+    }
+    return 0;
+}
+
+static void lib_free(
+    kNN_engine *e)
+{
+    /**************
+     * Description:
+     *      release the library of the context and the buffers sized on it
+     * ************/
+    struct Para_global *p_gp = &e->gp;
+    struct kNN_lib *p_lib = &e->lib;
+    int n_threads = (p_gp->THREADS > 0) ? p_gp->THREADS : 1;
+    if (!e->loaded)
+    {
+        return;
+    }
+    days_free(e);
+    if (p_gp->PREPROCESS != 0 && p_lib->ndays_h > 0)
+    {
+        free_aligned(p_lib->df_hly->p_rr_pre);  // one block (Normalize(), Standardize())
+    }
+    if (p_lib->cached)
+    {
+        Lib_cache_unload(p_gp, p_lib->df_hly, p_lib->ndays_h);
+    } else {
+        if (p_lib->ndays_h > 0)
+        {
+            free_aligned(p_lib->df_hly->rr_h);  // the hourly block (import_dfrr_h())
+            free_aligned(p_lib->df_hly->rr_d);  // the daily block
+        }
+        free_aligned(p_lib->df_hly);
+        free(p_lib->Solar_MAX);
+        free(p_lib->df_cps);    // otherwise in the mapping of the cache
+    }
+    free(p_lib->ci.offset);
+    free(p_lib->ci.day);
+    free(p_lib->cal.row);
+    free(p_lib->pool_cans);
+    free(p_lib->SIMI);
+    for (int t = 0; p_lib->sc != NULL && t < n_threads; t++)
+    {
+        SIMI_cache_free(&p_lib->sc[t]);
+    }
+    free(p_lib->sc);
+    SIMI_batch_free(&p_lib->bt);
+    memset(p_lib, 0, sizeof(struct kNN_lib));
+    e->loaded = 0;
+}
+
+static int lib_fail(
+    kNN_engine *e,
+    int code,
+    const char *msg)
+{
+    /* a load failed: release what lib_load() has allocated so far, keep the message */
+    e->loaded = 1;
+    lib_free(e);
+    return engine_fail(e, code, msg);
+}
+
+static int lib_load(
+    kNN_engine *e)
+{
+    /**************
+     * Description:
+     *      load the CP series and the hourly library and derive everything the
+     *      selection needs from them, as main() does
+     * Return:
+     *      KNN_OK, KNN_ERR_FILE or KNN_ERR_MEMORY (nothing loaded)
+     * ************/
+    struct Para_global *p_gp = &e->gp;
+    struct kNN_lib *p_lib = &e->lib;
+    int n_threads = (p_gp->THREADS > 0) ? p_gp->THREADS : 1;
+    char msg[256];
+    memset(p_lib, 0, sizeof(struct kNN_lib));
+    p_lib->key = Lib_cache_key(p_gp);
+    if (strncmp(p_gp->FP_CACHE, "FALSE", 5) != 0 && p_gp->FP_CACHE[0] != '\0')
+    {
+        p_lib->cached = Lib_cache_load(
+            p_gp, &p_lib->df_hly, &p_lib->ndays_h, &p_lib->Solar_MAX, &p_lib->df_cps, &p_lib->nrow_cp);
+    }
+    if (strncmp(p_gp->T_CP, "TRUE", 4) == 0 && !p_lib->cached)
+    {
+        if ((p_lib->nrow_cp = import_df_cp(p_gp->FP_CP, &p_lib->df_cps, msg, sizeof(msg))) < 0)
+        {
+            if (p_lib->nrow_cp == -2)
+            {
+                return lib_fail(e, KNN_ERR_MEMORY, "cannot allocate memory for the CP series");
+            }
+            return lib_fail(e, KNN_ERR_FILE, msg);
+        }
+    }
+    if (!p_lib->cached)
+    {
+        if ((p_lib->ndays_h = import_dfrr_h(
+                p_gp->VAR, p_gp->FP_HOURLY, p_gp->N_STATION, p_gp->THREADS, &p_lib->df_hly, msg, sizeof(msg))) <= 0)
+        {
+            if (p_lib->ndays_h == -2)
+            {
+                return lib_fail(e, KNN_ERR_MEMORY, "cannot allocate memory for the hourly library");
+            }
+            if (p_lib->ndays_h == 0)
+            {
+                snprintf(msg, sizeof(msg), "no days in hourly data file: %s", p_gp->FP_HOURLY);
+            }
+            return lib_fail(e, KNN_ERR_FILE, msg);
+        }
+    }
+    if (initialize_CP_calendar(p_lib->df_cps, p_lib->nrow_cp, &p_lib->cal) != 0)
+    {
+        return lib_fail(e, KNN_ERR_MEMORY, "cannot allocate memory for the CP calendar");
+    }
+    initialize_dfrr_d(p_gp, NULL, &p_lib->cal, 0);  // CLASS_N
+    int i;
+    if (!p_lib->cached && (i = initialize_dfrr_h(p_gp, p_lib->df_hly, &p_lib->cal, p_lib->ndays_h)) < p_lib->ndays_h)
+    {
+        snprintf(msg, sizeof(msg), "no cp for the library day %d-%02d-%02d in FP_CP: %s",
+                 p_lib->df_hly[i].date.y, p_lib->df_hly[i].date.m, p_lib->df_hly[i].date.d, p_gp->FP_CP);
+        return lib_fail(e, KNN_ERR_FILE, msg);
+    }
+    if (initialize_class_index(p_lib->df_hly, p_lib->ndays_h, (int)((p_gp->CONTINUITY - 1) / 2), &p_lib->ci) != 0)
+    {
+        return lib_fail(e, KNN_ERR_MEMORY, "cannot allocate memory for the class index");
+    }
+    if (p_lib->ci.offset[p_lib->ci.n_class] < 1)
+    {
+        snprintf(msg, sizeof(msg), "no candidate days in the hourly library: %s", p_gp->FP_HOURLY);
+        return lib_fail(e, KNN_ERR_FILE, msg);
+    }
+    int status = 0;
+    if (p_gp->PREPROCESS == 1)
+    {
+        status = Normalize(p_gp, NULL, p_lib->df_hly, 0, p_lib->ndays_h);
+    }
+    else if (p_gp->PREPROCESS == 2)
+    {
+        status = Standardize(p_gp, NULL, p_lib->df_hly, 0, p_lib->ndays_h);
+    }
+    if (status == -1)
+    {
+        snprintf(msg, sizeof(msg), "the daily values of the hourly library have no spread to %s (PREPROCESS %d): %s",
+                 (p_gp->PREPROCESS == 1) ? "normalize" : "standardize", p_gp->PREPROCESS, p_gp->FP_HOURLY);
+        return lib_fail(e, KNN_ERR_FILE, msg);
+    }
+    if (status == -2)
+    {
+        return lib_fail(e, KNN_ERR_MEMORY, "cannot allocate memory for the preprocessed library");
+    }
+    initialize_SSIM_stats(p_gp, NULL, p_lib->df_hly, 0, p_lib->ndays_h, !p_lib->cached);
+    for (i = 0; strncmp(p_gp->SIMILARITY, "SSIM", 4) == 0 && i < p_lib->ndays_h; i++)
+    {
+        if (p_lib->df_hly[i].stats.counts < 2)
+        {
+            /* an empty image: rejected here, not when it is compared (meanSSIM_cached()) */
+            snprintf(msg, sizeof(msg), "library day %d-%02d-%02d: less than 2 sites with data (SSIM): %s",
+                     p_lib->df_hly[i].date.y, p_lib->df_hly[i].date.m, p_lib->df_hly[i].date.d, p_gp->FP_HOURLY);
+            return lib_fail(e, KNN_ERR_FILE, msg);
+        }
+    }
+    if (p_gp->VAR == 5 && p_lib->Solar_MAX == NULL)
+    {
+        Solar_MAX_lump_derive(&p_lib->Solar_MAX, p_lib->df_hly, p_gp, p_lib->ndays_h);
+        if (p_lib->Solar_MAX == NULL)
+        {
+            return lib_fail(e, KNN_ERR_MEMORY, "cannot allocate memory for the solar radiation maxima");
+        }
+    }
+    if (!p_lib->cached && strncmp(p_gp->FP_CACHE, "FALSE", 5) != 0 && p_gp->FP_CACHE[0] != '\0')
+    {
+        // a cache that cannot be written is not an error: the next load reads the sources again
+        Lib_cache_save(p_gp, p_lib->df_hly, p_lib->ndays_h, p_lib->Solar_MAX, p_lib->df_cps, p_lib->nrow_cp);
+    }
+    size_t n_lib = (p_lib->ndays_h > 0) ? p_lib->ndays_h : 1;
+    p_lib->pool_cans = (int *)malloc(sizeof(int) * n_lib * n_threads);
+    p_lib->SIMI = (double *)malloc(sizeof(double) * n_lib * n_threads);
+    if (p_lib->pool_cans == NULL || p_lib->SIMI == NULL)
+    {
+        return lib_fail(e, KNN_ERR_MEMORY, "cannot allocate memory for the working buffers");
+    }
+    if (p_gp->CONTINUITY > 1)
+    {
+        p_lib->sc = (struct SIMI_cache *)calloc(n_threads, sizeof(struct SIMI_cache));
+        for (int t = 0; t < n_threads; t++)
+        {
+            if (p_lib->sc == NULL || SIMI_cache_init(&p_lib->sc[t], p_gp->CONTINUITY, n_lib) != 0)
+            {
+                return lib_fail(e, KNN_ERR_MEMORY, "cannot allocate memory for the similarity cache");
+            }
+        }
+    }
+    if (SIMI_batch_init(&p_lib->bt, p_gp, DAYS_BLOCK * n_threads, n_lib, n_threads) != 0)
+    {
+        return lib_fail(e, KNN_ERR_MEMORY, "cannot allocate memory for the batched similarity");
+    }
+    e->loaded = 1;
+    return KNN_OK;
+}
+
+int kNN_engine_create(
+    kNN_engine **p_e)
+{
+    /**************
+     * Description:
+     *      a new engine context with the default configuration and no library
+     * Return:
+     *      KNN_OK; KNN_ERR_ARG: p_e is NULL; KNN_ERR_MEMORY: out of memory (*p_e: NULL)
+     * ************/
+    if (p_e == NULL)
+    {
+        return KNN_ERR_ARG;
+    }
+    *p_e = (kNN_engine *)calloc(1, sizeof(kNN_engine));
+    if (*p_e == NULL)
+    {
+        return KNN_ERR_MEMORY;
+    }
+    Para_global_default(&(*p_e)->gp);
+    return KNN_OK;
+}
+
+void kNN_engine_free(
+    kNN_engine *e)
+{
+    if (e == NULL)
+    {
+        return;
+    }
+    lib_free(e);
+    free(e);
+}
+
+int kNN_engine_config(
+    kNN_engine *e,
+    const char *key,
+    const char *value)
+{
+    /**************
+     * Description:
+     *      set one parameter, as the row "key,value" of the global parameter file;
+     *      a loaded library is released
+     * Return:
+     *      KNN_OK; KNN_ERR_CONFIG: unknown key (the configuration is unchanged)
+     * ************/
+    char row[MAXCHAR];
+    struct Para_global gp;
+    if (e == NULL || key == NULL || value == NULL)
+    {
+        return KNN_ERR_ARG;
+    }
+    if (snprintf(row, sizeof(row), "%s,%s\n", key, value) >= (int)sizeof(row))
+    {
+        return engine_fail(e, KNN_ERR_CONFIG, "the parameter value is too long");
+    }
+    gp = e->gp;
+    if (key[0] == '\0' || key[0] == '#' || Para_global_line(row, &gp) != 0)
+    {
+        snprintf(e->error, sizeof(e->error), "unrecognized parameter: %s", key);
+        return KNN_ERR_CONFIG;
+    }
+    lib_free(e);
+    e->gp = gp;
+    return KNN_OK;
+}
+
+int kNN_engine_config_file(
+    kNN_engine *e,
+    const char *fname)
+{
+    /**************
+     * Description:
+     *      the configuration of a global parameter file (the parameters not in the file:
+     *      the default); a loaded library is released
+     * Return:
+     *      KNN_OK; KNN_ERR_FILE: not readable; KNN_ERR_CONFIG: an unknown parameter
+     *      (the configuration is unchanged)
+     * ************/
+    char row[MAXCHAR];
+    struct Para_global gp;
+    FILE *fp;
+    int n_row = 0;
+    if (e == NULL || fname == NULL)
+    {
+        return KNN_ERR_ARG;
+    }
+    if ((fp = fopen(fname, "r")) == NULL)
+    {
+        snprintf(e->error, sizeof(e->error), "cannot open global parameter file: %s", fname);
+        return KNN_ERR_FILE;
+    }
+    Para_global_default(&gp);
+    while (fgets(row, MAXCHAR, fp) != NULL)
+    {
+        n_row++;
+        if (Para_global_line(row, &gp) != 0)
+        {
+            snprintf(e->error, sizeof(e->error), "%s: row %d: unrecognized parameter field", fname, n_row);
+            fclose(fp);
+            return KNN_ERR_CONFIG;
+        }
+    }
+    fclose(fp);
+    lib_free(e);
+    e->gp = gp;
+    return KNN_OK;
+}
+
+int kNN_engine_load(
+    kNN_engine *e)
+{
+    /**************
+     * Description:
+     *      load the library of the configuration (again, if loaded); the new
+     *      library is loaded next to the previous one, which is kept if it fails
+     * Return:
+     *      KNN_OK; KNN_ERR_CONFIG: invalid configuration; KNN_ERR_FILE: a source file
+     *      cannot be read; KNN_ERR_MEMORY: out of memory (the previous library, if any,
+     *      still loaded)
+     * ************/
+    struct kNN_lib lib_old, lib_new;
+    unsigned long long key;
+    int code, loaded_old;
+    if (e == NULL)
+    {
+        return KNN_ERR_ARG;
+    }
+    if ((code = config_check(e)) != KNN_OK)
+    {
+        return code;
+    }
+    key = Lib_cache_key(&e->gp);
+    lib_old = e->lib;
+    loaded_old = e->loaded;
+    days_free(e);   // sized on the library, allocated again by days_reserve()
+    e->loaded = 0;
+    if ((code = lib_load(e)) != KNN_OK)
+    {
+        e->lib = lib_old;
+        e->loaded = loaded_old;
+        e->key_failed = key;    // kNN_engine_changed(): 0 until the sources change again
+        return code;
+    }
+    e->key_failed = 0;
+    if (loaded_old)
+    {
+        /* release the previous library */
+        lib_new = e->lib;
+        e->lib = lib_old;
+        lib_free(e);
+        e->lib = lib_new;
+        e->loaded = 1;
+    }
+    return KNN_OK;
+}
+
+int kNN_engine_changed(
+    kNN_engine *e)
+{
+    /* 1: the source files of the loaded library have changed (Lib_cache_key()),
+     * and not into the sources whose load failed last */
+    unsigned long long key;
+    if (e == NULL || !e->loaded)
+    {
+        return 0;
+    }
+    key = Lib_cache_key(&e->gp);
+    return key != e->lib.key && key != e->key_failed;
+}
+
+int kNN_engine_info(
+    kNN_engine *e,
+    int *N_STATION,
+    int *RUN,
+    int *ndays_lib)
+{
+    /**************
+     * Description:
+     *      the sizes of the configuration and of the library (any pointer may be NULL)
+     * Return:
+     *      KNN_OK; KNN_ERR_STATE: no library loaded (ndays_lib: 0)
+     * ************/
+    if (e == NULL)
+    {
+        return KNN_ERR_ARG;
+    }
+    if (N_STATION != NULL) *N_STATION = e->gp.N_STATION;
+    if (RUN != NULL) *RUN = e->gp.RUN;
+    if (ndays_lib != NULL) *ndays_lib = e->loaded ? e->lib.ndays_h : 0;
+    if (!e->loaded)
+    {
+        return engine_fail(e, KNN_ERR_STATE, "no library loaded");
+    }
+    return KNN_OK;
+}
+
+int kNN_engine_days(
+    kNN_engine *e,
+    int n,
+    const int *ymd,
+    const int *cp,
+    const double *daily,
+    double *hourly)
+{
+    /**************
+     * Description:
+     *      disaggregate n target days into the buffer of the caller
+     * Parameters:
+     *      ymd: [n][3] the dates
+     *      cp: [n] the cp of each day (T_CP: TRUE; 0: from FP_CP); NULL: all from FP_CP
+     *      daily: [n][N_STATION] the daily values
+     *      hourly: [n][RUN][24][N_STATION] the disaggregated values
+     * Return:
+     *      KNN_OK, or the code of the first invalid day (nothing disaggregated);
+     *      KNN_ERR_MEMORY: out of memory
+     * ************/
+    if (e == NULL || n < 1 || ymd == NULL || daily == NULL || hourly == NULL)
+    {
+        return (e == NULL) ? KNN_ERR_ARG : engine_fail(e, KNN_ERR_ARG, "invalid arguments");
+    }
+    if (!e->loaded)
+    {
+        return engine_fail(e, KNN_ERR_STATE, "no library loaded");
+    }
+    struct Para_global *p_gp = &e->gp;
+    struct kNN_lib *p_lib = &e->lib;
+    int N = p_gp->N_STATION;
+    int n_threads = (p_gp->THREADS > 0) ? p_gp->THREADS : 1;
+    int order = (strncmp(p_gp->SIMILARITY, "SSIM", 4) == 0) ? 1 : 0;
+    int skip = (int)((p_gp->CONTINUITY - 1) / 2);
+    size_t n_lib = (p_lib->ndays_h > 0) ? p_lib->ndays_h : 1;
+    double *Solar_MAX = (p_gp->VAR == 5) ? p_lib->Solar_MAX : NULL;
+
+    if (days_reserve(e, n) != 0)
+    {
+        return engine_fail(e, KNN_ERR_MEMORY, "cannot allocate memory for the target days");
+    }
+    for (int d = 0; d < n; d++)
+    {
+        struct df_rr_d *p_day = e->days + d;
+        int cp_d = 0, counts = 0;
+        p_day->date.y = ymd[d * 3];
+        p_day->date.m = ymd[d * 3 + 1];
+        p_day->date.d = ymd[d * 3 + 2];
+        p_day->p_rr = e->rr + (size_t)d * N;
+        p_day->p_rr_pre = e->rr_pre + (size_t)d * N;
+        memcpy(p_day->p_rr, daily + (size_t)d * N, sizeof(double) * N);
+        if (!date_valid(p_day->date))
+        {
+            snprintf(e->error, sizeof(e->error), "day %d: invalid date", d + 1);
+            return KNN_ERR_DATE;
+        }
+        if (p_lib->cal.n_class > 0)
+        {
+            cp_d = (cp != NULL) ? cp[d] : 0;
+            if (cp_d <= 0 && (cp_d = CP_lookup(p_day->date, &p_lib->cal)) < 0)
+            {
+                snprintf(e->error, sizeof(e->error), "day %d: no cp for %d-%02d-%02d in FP_CP",
+                         d + 1, p_day->date.y, p_day->date.m, p_day->date.d);
+                return KNN_ERR_DATE;
+            }
+            if (cp_d > p_lib->cal.n_class)
+            {
+                snprintf(e->error, sizeof(e->error), "day %d: cp %d out of 1 to %d",
+                         d + 1, cp_d, p_lib->cal.n_class);
+                return KNN_ERR_ARG;
+            }
+        }
+        p_day->cp = cp_d;
+        for (int j = 0; j < N; j++)
+        {
+            counts += (isNODATA(p_day->p_rr[j], p_gp->NODATA) == 0);
+        }
+        if (order == 1 && counts < 2)
+        {
+            // SSIM: an image of less than 2 values
+            snprintf(e->error, sizeof(e->error), "day %d: less than 2 sites with data (SSIM)", d + 1);
+            return KNN_ERR_DATA;
+        }
+    }
+
+    classify_dfrr_d(p_gp, e->days, p_lib->cal.n_class, n);
+    if (p_gp->PREPROCESS != 0)
+    {
+        Prepro_days(p_gp, e->days, n);  // into e->rr_pre: nothing allocated
+    }
+    initialize_SSIM_stats(p_gp, e->days, NULL, n, 0, 0);
+    for (int t = 0; p_lib->sc != NULL && t < n_threads; t++)
+    {
+        SIMI_cache_reset(&p_lib->sc[t]);    // the days of the call
+    }
+    for (int b0 = 0; b0 < n; b0 += p_lib->bt.n_block)
+    {
+        /* a block of days: the similarity in tiles, then the selection of each day */
+        int b1 = (n - b0 < p_lib->bt.n_block) ? n : b0 + p_lib->bt.n_block;
+        if (SIMI_batch_block(e->days, p_lib->df_hly, p_gp, &p_lib->ci, Solar_MAX, b0, b1, n, order, skip, &p_lib->bt) != 0)
+        {
+            return engine_fail(e, KNN_ERR_MEMORY, "cannot allocate memory for the batched similarity");
+        }
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, skip > 0 ? DAYS_CHUNK : 1) num_threads(n_threads) if (b1 - b0 > 1)
+#endif
+        for (int d = b0; d < b1; d++)
+        {
+            size_t tid = THREAD_ID;
+            kNN_day_select(
+                e->days, p_lib->df_hly, p_gp, &p_lib->ci, Solar_MAX, d, n, order, skip,
+                p_lib->pool_cans + tid * n_lib, p_lib->SIMI + tid * n_lib, p_lib->bt.sim[d - b0],
+                (p_lib->sc != NULL) ? &p_lib->sc[tid] : NULL, e->sel + d);
+        }
+    }
+    for (int d = 0; d < n; d++)
+    {
+        if (e->sel[d].n_can == DAY_NO_FIT)
+        {
+            snprintf(e->error, sizeof(e->error), "day %d: no library day has values at all its sites", d + 1);
+            return KNN_ERR_DATA;
+        }
+    }
+    for (int d = 0; d < n; d++)
+    {
+        struct kNN_day *p_sel = e->sel + d;
+        e->out.date = e->days[d].date;
+        e->out.rr_d = e->days[d].p_rr;
+        for (int t = 0; t < p_gp->RUN; t++)
+        {
+            double *rows = hourly + ((size_t)d * p_gp->RUN + t) * 24 * N;
+            if (p_sel->n_can < 0)
+            {
+                // dark day: no sunshine (or solar radiation) at any site
+                memset(rows, 0, sizeof(double) * 24 * N);
+                continue;
+            }
+            Fragment_assign(p_lib->df_hly, &e->out, p_gp, p_sel->fragment[t]);
+            for (int j = 0; j < N; j++)
+            {
+                for (int h = 0; h < 24; h++)
+                {
+                    rows[h * N + j] = e->out.rr_h[j][h];
+                }
+            }
+        }
+    }
+    return KNN_OK;
+}
+
+const char *kNN_engine_error(
+    kNN_engine *e)
+{
+    return (e == NULL) ? "no engine" : e->error;
+}
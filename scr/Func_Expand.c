@@ -0,0 +1,366 @@
+/*
+ * SUMMARY:      Func_Expand.c
+ * USAGE:        expand the index output (OUT_FORMAT: INDEX) into hourly values
+ * AUTHOR:       Xiaoxiang Guan
+ * ORG:          Section Hydrology, GFZ
+ * E-MAIL:       guan@gfz-potsdam.de
+ * ORIG-DATE:    Oct-2024
+ * DESCRIPTION:  each run of a target day is fully determined by its sampled fragment
+ *               (the index of the library day), so the index output keeps only
+ *               run,y,m,d,index_Frag,candidate per day and run;
+ *               the hourly values are rebuilt on demand from the daily data and the
+ *               hourly library, for any runs, stations and date range:
+ *               - Expand_index(): the library function
+ *               - Expand_command(): the command line front end
+ *                 kNN_MOF_m expand <global parameter file> [key=value ...]
+ * DESCRIP-END.
+ * FUNCTIONS:    Expand_index(); Expand_command();
+ *
+ * COMMENTS:
+ * - the expanded output is byte-identical to the CSV output (OUT_FORMAT: CSV)
+ *   of the same selection
+ * - the hourly library must be the one the index was sampled from:
+ *   the date of every fragment is checked
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "def_struct.h"
+#include "Func_dataIO.h"
+#include "Func_CSV.h"
+#include "Func_Writer.h"
+#include "Func_Fragments.h"
+#include "Func_Initialize.h"
+#include "Func_Cache.h"
+#include "Func_Expand.h"
+
+static const char *parse_candidate(
+    const char *p,
+    const char *end,
+    struct Date *date,
+    int *dark)
+{
+    /* the candidate field: yyyy-mm-dd, or "-" for a dark day */
+    char *q;
+    while (p < end && *p == ',')
+    {
+        p++;
+    }
+    if (p >= end || *p == '\n' || *p == '\r')
+    {
+        return NULL;
+    }
+    *dark = (*p == '-');
+    if (*dark)
+    {
+        return p + 1;
+    }
+    date->y = (int)strtol(p, &q, 10);
+    if (q >= end || *q != '-') return NULL;
+    date->m = (int)strtol(q + 1, &q, 10);
+    if (q >= end || *q != '-') return NULL;
+    date->d = (int)strtol(q + 1, &q, 10);
+    return q;
+}
+
+void Expand_index(
+    struct Para_global *p_gp,
+    struct df_rr_h *p_rrh,
+    int ndays_h,
+    struct df_rr_d *p_rrd,
+    int nrow_rr_d,
+    char FP_index[],
+    struct Expand_select *p_sel,
+    FILE *fp_out
+) {
+    /**************
+     * Description:
+     *      rebuild the hourly values of an index output (Write_index())
+     *      for the selected runs, stations and dates, in the CSV output layout
+     * Parameters:
+     *      p_rrh, ndays_h: the hourly library the index was sampled from
+     *      p_rrd, nrow_rr_d: the daily data that were disaggregated
+     *      FP_index: the index output file
+     *      p_sel: the selection
+     *      fp_out: the output (CSV, rows run,y,m,d,h,values of the selected stations)
+     * COMMENTS:
+     *      the rows of the index file follow the order of the daily data,
+     *      the daily values are therefore found by one pass through p_rrd
+     * ************/
+    struct CSV_file csv;
+    int status;
+    if ((status = CSV_open(FP_index, &csv)) != 0)
+    {
+        if (status == -2)
+        {
+            printf("Program terminated: cannot allocate memory for the index file\n");
+        } else {
+            printf("Cannot open the index file: %s\n", FP_index);
+        }
+        exit(1);
+    }
+    int N = p_gp->N_STATION;
+    int n_sel = p_sel->n_station;
+    struct df_rr_h out, out_sel;
+    out.rr_h = calloc(N, sizeof(double) * 24);
+    out_sel.rr_h = calloc(n_sel > 0 ? n_sel : 1, sizeof(double) * 24);
+    struct Out_buffer ob;
+    Out_buffer_open(&ob, fp_out, n_sel);
+
+    int i_d = 0;    // the current day in p_rrd
+    for (int r = 0; r < csv.nrow; r++)
+    {
+        const char *p = csv.data + csv.row[r];
+        const char *end = csv.data + csv.row[r + 1];
+        int run, index_frag, dark = 0;
+        struct Date target, candidate;
+        if (r == 0 && p < end && (*p < '0' || *p > '9'))
+        {
+            continue;  // the header
+        }
+        p = CSV_int(p, end, &run);
+        if (p != NULL) p = CSV_int(p, end, &target.y);
+        if (p != NULL) p = CSV_int(p, end, &target.m);
+        if (p != NULL) p = CSV_int(p, end, &target.d);
+        if (p != NULL) p = CSV_int(p, end, &index_frag);
+        if (p != NULL) p = parse_candidate(p, end, &candidate, &dark);
+        if (p == NULL)
+        {
+            printf("Program terminated: row %d of the index file %s is incomplete\n", r + 1, FP_index);
+            exit(1);
+        }
+        int ord = date_ordinal(target);
+        if (ord < p_sel->from || ord > p_sel->to ||
+            (p_sel->run != NULL && (run < 1 || run > p_sel->RUN || !p_sel->run[run])))
+        {
+            continue;
+        }
+        /* the daily values of the target day */
+        while (i_d < nrow_rr_d && date_ordinal((p_rrd + i_d)->date) != ord)
+        {
+            i_d++;
+        }
+        if (i_d >= nrow_rr_d)
+        {
+            printf(
+                "Program terminated: the day %d-%02d-%02d of the index file is not in the daily data\n",
+                target.y, target.m, target.d);
+            exit(1);
+        }
+        out.date = target;
+        out.rr_d = (p_rrd + i_d)->p_rr;
+        if (dark || index_frag < 0)
+        {
+            for (int j = 0; j < N; j++)
+            {
+                for (int h = 0; h < 24; h++)
+                {
+                    out.rr_h[j][h] = 0.0;
+                }
+            }
+        }
+        else
+        {
+            if (index_frag >= ndays_h || date_key((p_rrh + index_frag)->date) != date_key(candidate))
+            {
+                printf(
+                    "Program terminated: fragment %d (%d-%02d-%02d) is not in the hourly data; "
+                    "the index was sampled from another library\n",
+                    index_frag, candidate.y, candidate.m, candidate.d);
+                exit(1);
+            }
+            Fragment_assign(p_rrh, &out, p_gp, index_frag);
+        }
+        out_sel.date = target;
+        for (int j = 0; j < n_sel; j++)
+        {
+            memcpy(out_sel.rr_h[j], out.rr_h[p_sel->station[j]], sizeof(double) * 24);
+        }
+        Write_df_rr_h(&out_sel, p_gp, &ob, run);
+    }
+    Out_buffer_close(&ob);
+    CSV_close(&csv);
+    free(out.rr_h);
+    free(out_sel.rr_h);
+}
+
+static void parse_list(
+    char *value,
+    int max,
+    char *flag,
+    char *what)
+{
+    /* a list of numbers and ranges, e.g. 1,3,5-8, within 1..max: flag[k] = 1 */
+    char *p = value, *q;
+    while (*p != '\0')
+    {
+        long a = strtol(p, &q, 10), b = a;
+        if (q == p)
+        {
+            printf("Invalid %s: %s\n", what, value);
+            exit(1);
+        }
+        if (*q == '-')
+        {
+            p = q + 1;
+            b = strtol(p, &q, 10);
+            if (q == p)
+            {
+                printf("Invalid %s: %s\n", what, value);
+                exit(1);
+            }
+        }
+        if (a < 1 || b > max || a > b)
+        {
+            printf("Invalid %s: %s (1 to %d)\n", what, value, max);
+            exit(1);
+        }
+        for (long k = a; k <= b; k++)
+        {
+            flag[k] = 1;
+        }
+        p = (*q == ',') ? q + 1 : q;
+        if (*q != ',' && *q != '\0')
+        {
+            printf("Invalid %s: %s\n", what, value);
+            exit(1);
+        }
+    }
+}
+
+static int parse_day(
+    char *value)
+{
+    /* a date yyyy-mm-dd as ordinal day number */
+    struct Date date;
+    if (sscanf(value, "%d-%d-%d", &date.y, &date.m, &date.d) != 3 || !date_valid(date))
+    {
+        printf("Invalid date: %s (yyyy-mm-dd)\n", value);
+        exit(1);
+    }
+    return date_ordinal(date);
+}
+
+int Expand_command(
+    int argc,
+    char *argv[]
+) {
+    /**************
+     * Description:
+     *      the command line front end of Expand_index():
+     *      kNN_MOF_m expand <global parameter file> [key=value ...]
+     *      - the global parameter file of the run that wrote the index output:
+     *        FP_OUT (the index file), FP_DAILY, FP_HOURLY (or FP_CACHE), VAR, N_STATION, RUN
+     *      - keys (all optional):
+     *        index=<file>      the index file, instead of FP_OUT
+     *        out=<file>        the expanded output; default "-": the standard output
+     *        run=1,3-5         the runs (default: all)
+     *        station=2,7-9     the stations, columns of the daily data, kept in their order (default: all)
+     *        from=yyyy-mm-dd, to=yyyy-mm-dd   the date range (default: all)
+     * Return:
+     *      0: done
+     * ************/
+    if (argc < 1)
+    {
+        printf("Usage: kNN_MOF_m expand <global parameter file> "
+               "[index=file] [out=file] [run=1,3-5] [station=1-4] [from=yyyy-mm-dd] [to=yyyy-mm-dd]\n");
+        exit(1);
+    }
+    struct Para_global gp;
+    import_global(argv[0], &gp);
+
+    char *FP_index = gp.FP_OUT;
+    char *FP_expand = "-";
+    char *s_run = NULL, *s_station = NULL;
+    struct Expand_select sel;
+    sel.from = INT_MIN;
+    sel.to = INT_MAX;
+    for (int a = 1; a < argc; a++)
+    {
+        char *v = strchr(argv[a], '=');
+        if (v == NULL)
+        {
+            printf("Invalid argument: %s (key=value)\n", argv[a]);
+            exit(1);
+        }
+        *v++ = '\0';
+        if (strcmp(argv[a], "index") == 0) FP_index = v;
+        else if (strcmp(argv[a], "out") == 0) FP_expand = v;
+        else if (strcmp(argv[a], "run") == 0) s_run = v;
+        else if (strcmp(argv[a], "station") == 0) s_station = v;
+        else if (strcmp(argv[a], "from") == 0) sel.from = parse_day(v);
+        else if (strcmp(argv[a], "to") == 0) sel.to = parse_day(v);
+        else
+        {
+            printf("Invalid argument: %s\n", argv[a]);
+            exit(1);
+        }
+    }
+    if (strcmp(FP_expand, "-") == 0)
+    {
+        Out_stdout_reserve();
+    }
+
+    sel.RUN = gp.RUN;
+    sel.run = NULL;
+    if (s_run != NULL)
+    {
+        sel.run = (char *)calloc(gp.RUN + 1, 1);
+        parse_list(s_run, gp.RUN, sel.run, "run");
+    }
+    char *f_station = (char *)calloc(gp.N_STATION + 1, 1);
+    if (s_station != NULL)
+    {
+        parse_list(s_station, gp.N_STATION, f_station, "station");
+    } else {
+        memset(f_station + 1, 1, gp.N_STATION);
+    }
+    sel.station = (int *)malloc(sizeof(int) * (gp.N_STATION > 0 ? gp.N_STATION : 1));
+    sel.n_station = 0;
+    for (int j = 1; j <= gp.N_STATION; j++)
+    {
+        if (f_station[j])
+        {
+            sel.station[sel.n_station++] = j - 1;
+        }
+    }
+
+    /* the daily data and the hourly library */
+    struct df_rr_d *df_dly;
+    int nrow_rr_d = import_dfrr_d(gp.FP_DAILY, gp.N_STATION, gp.THREADS, &df_dly);
+    struct df_rr_h *df_hly;
+    int ndays_h;
+    double *Solar_MAX = NULL;
+    if (strncmp(gp.FP_CACHE, "FALSE", 5) == 0 || Lib_cache_load(&gp, &df_hly, &ndays_h, &Solar_MAX, NULL, NULL) == 0)
+    {
+        char msg[256];
+        ndays_h = import_dfrr_h(gp.VAR, gp.FP_HOURLY, gp.N_STATION, gp.THREADS, &df_hly, msg, sizeof(msg));
+        if (ndays_h < 0)
+        {
+            if (ndays_h == -2)
+            {
+                printf("Program terminated: cannot allocate memory for the hourly library\n");
+            } else {
+                printf("Program terminated: %s\n", msg);
+            }
+            exit(1);
+        }
+    }
+
+    FILE *fp_out = Out_open(FP_expand);
+    if (fp_out == NULL)
+    {
+        printf("Program terminated: cannot create or open output file: %s\n", FP_expand);
+        exit(1);
+    }
+    Expand_index(&gp, df_hly, ndays_h, df_dly, nrow_rr_d, FP_index, &sel, fp_out);
+    fclose(fp_out);
+    free(sel.run);
+    free(sel.station);
+    free(f_station);
+    return 0;
+}
@@ -0,0 +1,20 @@
+#ifndef FUNC_EXPAND
+#define FUNC_EXPAND
+
+void Expand_index(
+    struct Para_global *p_gp,
+    struct df_rr_h *p_rrh,
+    int ndays_h,
+    struct df_rr_d *p_rrd,
+    int nrow_rr_d,
+    char FP_index[],
+    struct Expand_select *p_sel,
+    FILE *fp_out
+);
+
+int Expand_command(
+    int argc,
+    char *argv[]
+);
+
+#endif
@@ -8,7 +8,9 @@
  * DESCRIPTION:  MOD is based several conditions: seasonality, month
  *               therefore, we assign each day a season (summer or winter) and a month
  * DESCRIP-END.
- * FUNCTIONS:    initialize_dfrr_d(); initialize_dfrr_h(); 
+ * FUNCTIONS:    initialize_dfrr_d(); classify_dfrr_d(); initialize_dfrr_h(); initialize_CP_calendar();
+ *               initialize_class_index(); class_pool(); initialize_SSIM_stats();
+ *               Toogle_CP(); CP_lookup(); CP_classes(); date_key(); date_ordinal(); date_valid();
  * COMMENTS:
  * 
  *
@@ -25,84 +27,42 @@
 #include <math.h>
 #include "def_struct.h"
 #include "Func_Initialize.h"
+#include "Func_SSIM.h"
 
-void initialize_dfrr_d(
+static void classify_day(
     struct Para_global *p_gp,
-    struct df_rr_d *p_rr_d,
-    struct df_cp *p_cp,
-    int nrow_rr_d,
-    int nrow_cp
-)
+    int N_CP_CLASS,
+    int N_SM_CLASS,
+    struct Date date,
+    int *cp,
+    int *SM,
+    int *class)
 {
-    if (strncmp(p_gp->MONTH, "TRUE", 4) == 0 && strncmp(p_gp->SEASON, "TRUE", 4) == 0) 
+    /*************
+     * Description:
+     *      the season (or month) and the class of one day with its cp
+     * Parameters:
+     *      N_CP_CLASS: the number of cp classes (0 if not conditioned on CP)
+     *      N_SM_CLASS: 2: season; 12: month; 0: neither
+     *      cp: the cp value of the day (set to 0 if not conditioned on CP)
+     * **********/
+    if (N_CP_CLASS == 0)
     {
-        printf("The disaggregation can only be conditioned on either MONTH or SEASON!\n");
-        exit(1);
+        *cp = 0;
     }
 
-    /*******
-     * assign each day the cp value
-     */
-    int N_CP_CLASS;
-    int N_SM_CLASS;
-    if (strncmp(p_gp->T_CP, "TRUE", 4) == 0)
-    {
-        N_CP_CLASS = CP_classes(p_cp, nrow_cp);
-        for (size_t i = 0; i < nrow_rr_d; i++)
-        {
-            (p_rr_d + i)->cp = Toogle_CP((p_rr_d + i)->date, p_cp, nrow_cp);
-        }
-    }
-    else
+    /* the season (summer or winter) or month value */
+    if (N_SM_CLASS == 2)
     {
-        N_CP_CLASS = 0;
-        for (size_t i = 0; i < nrow_rr_d; i++)
-        {
-            (p_rr_d + i)->cp = 0;
-        }
+        *SM = (date.m >= p_gp->SUMMER_FROM && date.m <= p_gp->SUMMER_TO) ? 1 : 0; // summer: 1; winter: 0
     }
-
-    /*******
-     * assign each day the season (summer or winter) value
-     */
-    if (strncmp(p_gp->SEASON, "TRUE", 4) == 0) {
-        for (size_t i = 0; i < nrow_rr_d; i++)
-        {
-            if ((p_rr_d + i)->date.m >= p_gp->SUMMER_FROM && (p_rr_d + i)->date.m <= p_gp->SUMMER_TO)
-            {
-                (p_rr_d + i)->SM = 1; // summer
-            } else {
-                (p_rr_d + i)->SM = 0; // winter
-            }
-        }
-        N_SM_CLASS = 2;
-    }
-    else if (strncmp(p_gp->MONTH, "TRUE", 4) == 0)
+    else if (N_SM_CLASS == 12)
     {
-        for (size_t i = 0; i < nrow_rr_d; i++)
-        {
-            (p_rr_d + i)->SM = (p_rr_d + i)->date.m - 1;
-        }
-        N_SM_CLASS = 12;
-    } else {
-        for (size_t i = 0; i < nrow_rr_d; i++)
-        {
-            (p_rr_d + i)->SM = 0;
-        }
-        N_SM_CLASS = 0;
+        *SM = date.m - 1;
     }
-
-    if (N_SM_CLASS > 0 && N_CP_CLASS > 0)
-    {
-        p_gp->CLASS_N = N_SM_CLASS * N_CP_CLASS;
-    } else if (N_SM_CLASS > 0 && N_CP_CLASS == 0)
-    {
-        p_gp->CLASS_N = N_SM_CLASS;
-    } else if (N_SM_CLASS == 0 && N_CP_CLASS > 0)
+    else
     {
-        p_gp->CLASS_N = N_CP_CLASS;
-    } else {
-        p_gp->CLASS_N = 0;
+        *SM = 0;
     }
 
     /******************
@@ -116,298 +76,426 @@ void initialize_dfrr_d(
      * ****/
     if (N_CP_CLASS > 0 && N_SM_CLASS > 0)
     {
-        for (size_t i = 0; i < nrow_rr_d; i++)
-        {
-            (p_rr_d + i)->class = ((p_rr_d + i)->cp - 1) + N_CP_CLASS * (p_rr_d + i)->SM;
-        }
+        *class = (*cp - 1) + N_CP_CLASS * *SM;
     }
     else if (N_CP_CLASS > 0 && N_SM_CLASS == 0)
     {
-        for (size_t i = 0; i < nrow_rr_d; i++)
-        {
-            (p_rr_d + i)->class = (p_rr_d + i)->cp - 1;
-        }
+        *class = *cp - 1;
     }
     else if (N_CP_CLASS == 0 && N_SM_CLASS > 0)
     {
-        for (size_t i = 0; i < nrow_rr_d; i++)
-        {
-            (p_rr_d + i)->class = (p_rr_d + i)->SM;
-        }
+        *class = *SM;
     }
     else
     {
-        for (size_t i = 0; i < nrow_rr_d; i++)
-        {
-            (p_rr_d + i)->class = 0;
-        }
+        *class = 0;
     }
 }
 
-
-void initialize_dfrr_h(
-    struct Para_global *p_gp,
-    struct df_rr_h *p_rr_h,
-    struct df_cp *p_cp,
-    int nrow_rr_d,
-    int nrow_cp
-)
+static int SM_classes(
+    struct Para_global *p_gp)
 {
+    /* number of season / month classes: 2 (SEASON), 12 (MONTH) or 0 */
     if (strncmp(p_gp->MONTH, "TRUE", 4) == 0 && strncmp(p_gp->SEASON, "TRUE", 4) == 0)
     {
         printf("The disaggregation can only be conditioned on either MONTH or SEASON!\n");
         exit(1);
     }
-
-    /*******
-     * assign each day the cp value
-     */
-    int N_CP_CLASS, N_SM_CLASS;
-    if (strncmp(p_gp->T_CP, "TRUE", 4) == 0)
-    {
-        N_CP_CLASS = CP_classes(p_cp, nrow_cp);
-        for (size_t i = 0; i < nrow_rr_d; i++)
-        {
-            (p_rr_h + i)->cp = Toogle_CP((p_rr_h + i)->date, p_cp, nrow_cp);
-        }
-    }
-    else
+    if (strncmp(p_gp->SEASON, "TRUE", 4) == 0)
     {
-        N_CP_CLASS = 0;
-        for (size_t i = 0; i < nrow_rr_d; i++)
-        {
-            (p_rr_h + i)->cp = 0;
-        }
-    }
-
-    /*******
-     * assign each day the season (summer or winter) value
-    */
-    if (strncmp(p_gp->SEASON, "TRUE", 4) == 0) {
-        for (size_t i = 0; i < nrow_rr_d; i++)
-        {
-            if ((p_rr_h + i)->date.m >= p_gp->SUMMER_FROM && (p_rr_h + i)->date.m <= p_gp->SUMMER_TO)
-            {
-                (p_rr_h + i)->SM = 1; // summer
-            } else {
-                (p_rr_h + i)->SM = 0; // winter
-            }
-        }
-        N_SM_CLASS = 2;
+        return 2;
     }
     else if (strncmp(p_gp->MONTH, "TRUE", 4) == 0)
     {
-        for (size_t i = 0; i < nrow_rr_d; i++)
-        {
-            (p_rr_h + i)->SM = (p_rr_h + i)->date.m - 1;
-        }
-        N_SM_CLASS = 12;
-    } else {
-        for (size_t i = 0; i < nrow_rr_d; i++)
-        {
-            (p_rr_h + i)->SM = 0;
-        }
-        N_SM_CLASS = 0;
+        return 12;
     }
+    return 0;
+}
 
-    /******************
-     * time series is classified based on following combinations: 
-     * - month alone
-     * - season alone
-     * - month and cp
-     * - season and cp
-     * - cp alone
-     * - nothing
-     * ****/
+void initialize_dfrr_d(
+    struct Para_global *p_gp,
+    struct df_rr_d *p_rr_d,
+    struct CP_calendar *p_cal,
+    int nrow_rr_d
+)
+{
+    /*************
+     * Description:
+     *      assign each target day the cp, season (or month) and class;
+     *      set the total number of classes (CLASS_N)
+     * Parameters:
+     *      p_cal: the CP calendar (initialize_CP_calendar())
+     * **********/
+    int N_CP_CLASS = p_cal->n_class;
+    int N_SM_CLASS = SM_classes(p_gp);
 
-    if (N_CP_CLASS > 0 && N_SM_CLASS > 0)
+    if (N_SM_CLASS > 0 && N_CP_CLASS > 0)
     {
-        for (size_t i = 0; i < nrow_rr_d; i++)
-        {
-            (p_rr_h + i)->class = ((p_rr_h + i)->cp - 1) + N_CP_CLASS * (p_rr_h + i)->SM;
-        }
-    }
-    else if (N_CP_CLASS > 0 && N_SM_CLASS == 0)
+        p_gp->CLASS_N = N_SM_CLASS * N_CP_CLASS;
+    } else if (N_SM_CLASS > 0 && N_CP_CLASS == 0)
     {
-        for (size_t i = 0; i < nrow_rr_d; i++)
-        {
-            (p_rr_h + i)->class = (p_rr_h + i)->cp - 1;
-        }
-    }
-    else if (N_CP_CLASS == 0 && N_SM_CLASS > 0)
+        p_gp->CLASS_N = N_SM_CLASS;
+    } else if (N_SM_CLASS == 0 && N_CP_CLASS > 0)
     {
-        for (size_t i = 0; i < nrow_rr_d; i++)
-        {
-            (p_rr_h + i)->class = (p_rr_h + i)->SM;
-        }
+        p_gp->CLASS_N = N_CP_CLASS;
+    } else {
+        p_gp->CLASS_N = 0;
     }
-    else
+
+    for (size_t i = 0; i < nrow_rr_d; i++)
     {
-        for (size_t i = 0; i < nrow_rr_d; i++)
-        {
-            (p_rr_h + i)->class = 0;
-        }
+        /* the cp value: O(1) lookup in the calendar */
+        (p_rr_d + i)->cp = (N_CP_CLASS > 0) ? Toogle_CP((p_rr_d + i)->date, p_cal) : 0;
+        classify_day(
+            p_gp, N_CP_CLASS, N_SM_CLASS, (p_rr_d + i)->date,
+            &(p_rr_d + i)->cp, &(p_rr_d + i)->SM, &(p_rr_d + i)->class);
     }
 }
 
+void classify_dfrr_d(
+    struct Para_global *p_gp,
+    struct df_rr_d *p_rr_d,
+    int N_CP_CLASS,
+    int nrow_rr_d
+)
+{
+    /*************
+     * Description:
+     *      assign each target day the season (or month) and class,
+     *      with the cp already given with the day (e.g. a forecast beyond FP_CP)
+     * Parameters:
+     *      N_CP_CLASS: the number of cp classes (CP_calendar n_class)
+     * **********/
+    int N_SM_CLASS = SM_classes(p_gp);
+    for (size_t i = 0; i < nrow_rr_d; i++)
+    {
+        classify_day(
+            p_gp, N_CP_CLASS, N_SM_CLASS, (p_rr_d + i)->date,
+            &(p_rr_d + i)->cp, &(p_rr_d + i)->SM, &(p_rr_d + i)->class);
+    }
+}
 
-int Toogle_CP(
-    struct Date date,
-    struct df_cp *p_cp,
-    int nrow_cp
+int initialize_dfrr_h(
+    struct Para_global *p_gp,
+    struct df_rr_h *p_rr_h,
+    struct CP_calendar *p_cal,
+    int nrow_rr_d
 )
 {
     /*************
      * Description:
-     *      derive the cp value (class) of the day based on date stamp (y-m-d)
+     *      assign each library day the cp, season (or month) and class
      * Parameters:
-     *      date: a Date struct, conaining y, m and d
-     *      p_cp: pointing to the cp data struct array
-     *      nrow_cp: total rows of cp observations
-     * Output:
-     *      return the derived cp value
+     *      p_cal: the CP calendar (initialize_CP_calendar())
+     * Return:
+     *      nrow_rr_d; less: the index of the first library day without cp in the series
+     *      (the days from it on are not classified)
      * **********/
-    int i;
-    int cp = -1;
-    for (i = 0; i < nrow_cp; i++) {
-        if (
-            (p_cp+i)->date.y == date.y && (p_cp+i)->date.m == date.m && (p_cp+i)->date.d == date.d
-        ) {
-            cp = (p_cp+i)->cp;
-            break; // terminate the loop directly
+    int N_SM_CLASS = SM_classes(p_gp);
+    for (int i = 0; i < nrow_rr_d; i++)
+    {
+        (p_rr_h + i)->cp = (p_cal->n_class > 0) ? CP_lookup((p_rr_h + i)->date, p_cal) : 0;
+        if ((p_rr_h + i)->cp < 0)
+        {
+            return i;
         }
+        classify_day(
+            p_gp, p_cal->n_class, N_SM_CLASS, (p_rr_h + i)->date,
+            &(p_rr_h + i)->cp, &(p_rr_h + i)->SM, &(p_rr_h + i)->class);
     }
-    if (cp == -1) {
-        printf(
-            "Program terminated: cannot find the cp class for the date %d-%02d-%02d\n",
-            date.y, date.m, date.d
-        );
-        exit(2);
-    }
-    return cp;
+    return nrow_rr_d;
 }
 
-int CP_classes(
+int initialize_CP_calendar(
     struct df_cp *p_cp,
-    int nrow_cp
+    int nrow_cp,
+    struct CP_calendar *p_cal
 )
 {
-    int cp_max=0;
-    for (size_t i = 0; i < nrow_cp; i++)
+    /*************
+     * Description:
+     *      build the calendar index of the CP series once:
+     *      the row of each day, addressed by its ordinal day number,
+     *      so that the cp of any date is found in O(1) (Toogle_CP())
+     * Parameters:
+     *      p_cp: the cp data struct array (import_df_cp()); NULL if not conditioned on CP
+     *      nrow_cp: total rows of cp observations
+     *      p_cal: the calendar (output)
+     * Return:
+     *      0; -1: out of memory
+     * **********/
+    int i, first, last, ord;
+    p_cal->p_cp = p_cp;
+    p_cal->first = 0;
+    p_cal->n = 0;
+    p_cal->row = NULL;
+    p_cal->n_class = (p_cp != NULL) ? CP_classes(p_cp, nrow_cp) : 0;
+    if (p_cp == NULL || nrow_cp <= 0)
     {
-        if ((p_cp + i)->cp > cp_max)
+        return 0;
+    }
+    first = last = date_ordinal(p_cp->date);
+    for (i = 1; i < nrow_cp; i++)
+    {
+        ord = date_ordinal((p_cp + i)->date);
+        if (ord < first) first = ord;
+        if (ord > last) last = ord;
+    }
+    p_cal->first = first;
+    p_cal->n = last - first + 1;
+    p_cal->row = (int *)malloc(sizeof(int) * p_cal->n);
+    if (p_cal->row == NULL)
+    {
+        return -1;
+    }
+    for (i = 0; i < p_cal->n; i++)
+    {
+        p_cal->row[i] = -1;
+    }
+    for (i = nrow_cp - 1; i >= 0; i--)
+    {
+        // backwards: for a repeated date the first row wins
+        if (date_valid((p_cp + i)->date))
         {
-            cp_max = (p_cp + i)->cp;
+            p_cal->row[date_ordinal((p_cp + i)->date) - first] = i;
         }
     }
-    return cp_max;
+    return 0;
 }
 
-
-void view_class_rrd(
-    struct df_rr_d *p_rr_d,
-    int nrow_rr_d
+int initialize_class_index(
+    struct df_rr_h *p_rr_h,
+    int ndays_h,
+    int skip,
+    struct class_index *p_ci
 )
 {
-    int n_classes = 0;
-    for (size_t i = 0; i < nrow_rr_d; i++)
+    /*************
+     * Description:
+     *      build the class-to-day index of the hourly library once,
+     *      instead of scanning all library days for every target day
+     * Parameters:
+     *      p_rr_h: pointing to the hourly obs structure array (classes assigned)
+     *      ndays_h: the number of hourly observation days
+     *      skip: (CONTINUITY - 1) / 2; the first and last skip days can not be candidates
+     *      p_ci: the class index (output)
+     * Return:
+     *      0; -1: out of memory (nothing allocated)
+     * **********/
+    int n_class = 0;
+    int *fill;
+    for (size_t i = 0; i < ndays_h; i++)
     {
-        if ((p_rr_d + i)->class > n_classes)
+        if ((p_rr_h + i)->class + 1 > n_class)
         {
-            n_classes = (p_rr_d + i)->class;
+            n_class = (p_rr_h + i)->class + 1;
         }
     }
-    n_classes += 1;  // the total number of classes the time series is categorized into. 
-
-    int *counts;
-    counts = (int *)malloc(sizeof(int) * n_classes);
-    for (size_t i = 0; i < n_classes; i++)
+    p_ci->n_class = n_class;
+    p_ci->offset = (int *)calloc(n_class + 1, sizeof(int));
+    p_ci->day = (int *)malloc(sizeof(int) * (ndays_h > 0 ? ndays_h : 1));
+    fill = (int *)malloc(sizeof(int) * (n_class > 0 ? n_class : 1));
+    if (p_ci->offset == NULL || p_ci->day == NULL || fill == NULL)
     {
-        // initialize 
-        *(counts + i) = 0;
+        free(p_ci->offset);
+        free(p_ci->day);
+        free(fill);
+        p_ci->offset = NULL;
+        p_ci->day = NULL;
+        return -1;
     }
 
-    for (size_t t = 0; t < n_classes; t++)
+    /* counts of each class, then prefix sum into offsets */
+    for (int i = skip; i < ndays_h - skip; i++)
     {
-        for (size_t i = 0; i < nrow_rr_d; i++)
-        {
-            if ((p_rr_d + i)->class == t)
-            {
-                *(counts + t) += 1;
-            }
-        }
+        p_ci->offset[(p_rr_h + i)->class + 1] += 1;
     }
-    
-    /**********************************
-     * print the counts of each class to screen
-     */
-    printf("* class-counts:\n   - class: "); fprintf(p_log, "* class-counts:\n   - class: ");
-    for (size_t t = 0; t < n_classes; t++)
+    for (int c = 0; c < n_class; c++)
     {
-        printf("%5d ", t + 1); fprintf(p_log, "%5d ", t + 1);
+        p_ci->offset[c + 1] += p_ci->offset[c];
     }
-    printf("\n"); fprintf(p_log, "\n");
 
-    printf("   - count: "); fprintf(p_log, "   - count: ");
-    for (size_t t = 0; t < n_classes; t++)
+    /* scatter the day indices, keeping the chronological order within a class */
+    for (int c = 0; c < n_class; c++)
+    {
+        fill[c] = p_ci->offset[c];
+    }
+    for (int i = skip; i < ndays_h - skip; i++)
     {
-        printf("%5d ", *(counts + t)); fprintf(p_log, "%5d ", *(counts + t));
+        p_ci->day[fill[(p_rr_h + i)->class]++] = i;
     }
-    printf("\n"); fprintf(p_log, "\n");
-    
+    free(fill);
+    return 0;
 }
 
+int class_pool(
+    struct class_index *p_ci,
+    int class,
+    int **pool
+)
+{
+    /*************
+     * Description:
+     *      candidate pool (library day indices) of one class,
+     *      as a slice of the class index; nothing is copied
+     * Output:
+     *      *pool points to the first candidate; return the number of candidates
+     * **********/
+    if (class < 0 || class >= p_ci->n_class)
+    {
+        *pool = p_ci->day;
+        return 0;
+    }
+    *pool = p_ci->day + p_ci->offset[class];
+    return p_ci->offset[class + 1] - p_ci->offset[class];
+}
 
-void view_class_rrh(
+void initialize_SSIM_stats(
+    struct Para_global *p_gp,
+    struct df_rr_d *p_rr_d,
     struct df_rr_h *p_rr_h,
-    int nrow_rr_d
+    int nrow_rr_d,
+    int ndays_h,
+    int stats_h
 )
 {
-    int n_classes = 0;
+    /*************
+     * Description:
+     *      precompute the SSIM statistics (mean, sd, max and counts) 
+     *      of every target day and every library day, 
+     *      for the raw data and, if preprocessed, for p_rr_pre
+     *      each library day is compared with thousands of target days,
+     *      the statistics are therefore derived only once here
+     * Parameters:
+     *      stats_h: 1: derive the statistics of the raw library days;
+     *               0: already there (loaded from the library cache)
+     * **********/
+    int N = p_gp->N_STATION;
     for (size_t i = 0; i < nrow_rr_d; i++)
     {
-        if ((p_rr_h + i)->class > n_classes)
+        image_stats((p_rr_d + i)->p_rr, p_gp->NODATA, N, &(p_rr_d + i)->stats);
+        if (p_gp->PREPROCESS != 0)
         {
-            n_classes = (p_rr_h + i)->class;
+            image_stats((p_rr_d + i)->p_rr_pre, p_gp->NODATA, N, &(p_rr_d + i)->stats_pre);
         }
     }
-    n_classes += 1;  // the total number of classes the time series is categorized into. 
-
-    int *counts;
-    counts = (int *)malloc(sizeof(int) * n_classes);
-    for (size_t i = 0; i < n_classes; i++)
+    for (size_t i = 0; i < ndays_h; i++)
     {
-        // initialize 
-        *(counts + i) = 0;
-    }
-
-    for (size_t t = 0; t < n_classes; t++)
-    {
-        for (size_t i = 0; i < nrow_rr_d; i++)
+        if (stats_h)
+        {
+            image_stats((p_rr_h + i)->rr_d, p_gp->NODATA, N, &(p_rr_h + i)->stats);
+        }
+        if (p_gp->PREPROCESS != 0)
         {
-            if ((p_rr_h + i)->class == t)
-            {
-                *(counts + t) += 1;
-            }
+            image_stats((p_rr_h + i)->p_rr_pre, p_gp->NODATA, N, &(p_rr_h + i)->stats_pre);
         }
     }
-    
-    /**********************************
-     * print the counts of each class to screen
-     */
-    printf("* class-counts:\n   - class: "); fprintf(p_log, "* class-counts:\n   - class: ");
-    for (size_t t = 0; t < n_classes; t++)
+}
+
+int Toogle_CP(
+    struct Date date,
+    struct CP_calendar *p_cal
+)
+{
+    /*************
+     * Description:
+     *      derive the cp value (class) of the day based on date stamp (y-m-d)
+     * Parameters:
+     *      date: a Date struct, conaining y, m and d
+     *      p_cal: the calendar index of the cp series (initialize_CP_calendar())
+     * Output:
+     *      return the derived cp value
+     * **********/
+    int cp = CP_lookup(date, p_cal);
+    if (cp == -1) {
+        printf(
+            "Program terminated: cannot find the cp class for the date %d-%02d-%02d\n",
+            date.y, date.m, date.d
+        );
+        exit(2);
+    }
+    return cp;
+}
+
+int CP_lookup(
+    struct Date date,
+    struct CP_calendar *p_cal
+)
+{
+    /*************
+     * Description:
+     *      the cp value of the day, as Toogle_CP(), without terminating
+     * Return:
+     *      the cp value; -1: the date is not in the cp series
+     * **********/
+    int k = date_ordinal(date) - p_cal->first;
+    if (date_valid(date) && k >= 0 && k < p_cal->n && p_cal->row[k] >= 0)
     {
-        printf("%5d ", t + 1); fprintf(p_log, "%5d ", t + 1);
+        return (p_cal->p_cp + p_cal->row[k])->cp;
     }
-    printf("\n"); fprintf(p_log, "\n");
+    return -1;
+}
 
-    printf("   - count: "); fprintf(p_log, "   - count: ");
-    for (size_t t = 0; t < n_classes; t++)
+int date_ordinal(
+    struct Date date
+)
+{
+    /*************
+     * Description:
+     *      the date packed into its ordinal day number (days since 0000-03-01,
+     *      proleptic Gregorian calendar); consecutive days differ by 1
+     * **********/
+    int y = date.y - (date.m <= 2);
+    int era = (y >= 0 ? y : y - 399) / 400;
+    int yoe = y - era * 400;
+    int doy = (153 * (date.m + (date.m > 2 ? -3 : 9)) + 2) / 5 + date.d - 1;
+    int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe;
+}
+
+int date_valid(
+    struct Date date
+)
+{
+    /*************
+     * Description:
+     *      1: an existing calendar day; 0: otherwise (e.g. month 13 or Feb 30),
+     *      which must not be mapped onto another day by date_ordinal()
+     * **********/
+    static const int days[12] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+    int leap;
+    if (date.m < 1 || date.m > 12 || date.d < 1)
     {
-        printf("%5d ", *(counts + t)); fprintf(p_log, "%5d ", *(counts + t));
+        return 0;
     }
-    printf("\n"); fprintf(p_log, "\n");
+    leap = (date.y % 4 == 0 && date.y % 100 != 0) || date.y % 400 == 0;
+    return date.d <= days[date.m - 1] + (date.m == 2 && leap);
 }
 
+int date_key(
+    struct Date date
+)
+{
+    /*************
+     * Description:
+     *      the date packed into one integer: yyyymmdd;
+     *      identifies a day independent of its position in the data file
+     * **********/
+    return date.y * 10000 + date.m * 100 + date.d;
+}
 
+int CP_classes(
+    struct df_cp *p_cp,
+    int nrow_cp
+)
+{
+    int cp_max=0;
+    for (size_t i = 0; i < nrow_cp; i++)
+    {
+        if ((p_cp + i)->cp > cp_max)
+        {
+            cp_max = (p_cp + i)->cp;
+        }
+    }
+    return cp_max;
+}
@@ -1,8 +1,6 @@
 #ifndef Func_Initialize
 #define Func_Initialize
 
-extern FILE *p_log;  // file pointer pointing to log file
-
 /*********
  * funcs for time seires classification based possibly on:
  * - cp
@@ -13,43 +11,77 @@ extern FILE *p_log;  // file pointer pointing to log file
 void initialize_dfrr_d(
     struct Para_global *p_gp,
     struct df_rr_d *p_rr_d,
-    struct df_cp *p_cp,
-    int nrow_rr_d,
-    int nrow_cp
+    struct CP_calendar *p_cal,
+    int nrow_rr_d
+);
+
+void classify_dfrr_d(
+    struct Para_global *p_gp,
+    struct df_rr_d *p_rr_d,
+    int N_CP_CLASS,
+    int nrow_rr_d
 );
 
-void initialize_dfrr_h(
+int initialize_dfrr_h(
     struct Para_global *p_gp,
     struct df_rr_h *p_rr_h,
+    struct CP_calendar *p_cal,
+    int nrow_rr_d
+);
+
+int initialize_CP_calendar(
     struct df_cp *p_cp,
+    int nrow_cp,
+    struct CP_calendar *p_cal
+);
+
+int initialize_class_index(
+    struct df_rr_h *p_rr_h,
+    int ndays_h,
+    int skip,
+    struct class_index *p_ci
+);
+
+int class_pool(
+    struct class_index *p_ci,
+    int class,
+    int **pool
+);
+
+void initialize_SSIM_stats(
+    struct Para_global *p_gp,
+    struct df_rr_d *p_rr_d,
+    struct df_rr_h *p_rr_h,
     int nrow_rr_d,
-    int nrow_cp
+    int ndays_h,
+    int stats_h
 );
 
 int Toogle_CP(
     struct Date date,
-    struct df_cp *p_cp,
-    int nrow_cp
+    struct CP_calendar *p_cal
 );
 
-int CP_classes(
-    struct df_cp *p_cp,
-    int nrow_cp
+int CP_lookup(
+    struct Date date,
+    struct CP_calendar *p_cal
 );
 
-/********
- * view (print to screen) the classes of the time series
- * ****/
-void view_class_rrd(
-    struct df_rr_d *p_rr_d,
-    int nrow_rr_d
+int date_key(
+    struct Date date
 );
 
-void view_class_rrh(
-    struct df_rr_h *p_rr_h,
-    int nrow_rr_d
+int date_ordinal(
+    struct Date date
 );
 
+int date_valid(
+    struct Date date
+);
 
+int CP_classes(
+    struct df_cp *p_cp,
+    int nrow_cp
+);
 
 #endif
\ No newline at end of file
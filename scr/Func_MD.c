@@ -1,24 +1,310 @@
+/*
+ * SUMMARY:      Func_MD.c
+ * USAGE:        the Manhattan distance between two images (SIMILARITY: Manhattan)
+ * AUTHOR:       Xiaoxiang Guan
+ * ORG:          Section Hydrology, GFZ
+ * E-MAIL:       guan@gfz-potsdam.de
+ * ORIG-DATE:    Oct-2024
+ * DESCRIPTION:  the sum of the absolute differences of the sites,
+ *               over the sites where both images have a value (not NODATA);
+ *               lower distance, better resemblance
+ * DESCRIP-END.
+ * FUNCTIONS:    Manhattan_distance(); Manhattan_tile();
+ *
+ * COMMENTS:
+ * each with a scalar, an AVX2 and an AVX-512 variant, dispatched at runtime
+ * by CPU_SIMD_level():
+ * - Manhattan_distance(): the sites of one pair in the SIMD lanes
+ * - Manhattan_tile(): the candidates of a tile in the SIMD lanes (packed site by site)
+ * each distance is summed in the site order: the same values on any CPU,
+ * from Manhattan_distance() and from Manhattan_tile() (VAR 5 and the fallback
+ * of kNN_day_select() use the pair, the other days the tile)
+ *
+ */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
 #include "def_struct.h"
 #include "Func_MD.h"
+#include "Func_CPU.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MD_X86
+#include <immintrin.h>
+#endif
 
-double Manhattan_distance(
+/* a NODATA value: as isNODATA() */
+#define MD_NODATA(x, NODATA) ((x) >= (NODATA) - 0.01 && (x) <= (NODATA) + 0.01)
+
+/* the distance of one site: 0 where either value is NODATA;
+ * shared by the scalar code and the tails of the SIMD variants */
+#define MD_TERM(a, b, NODATA) \
+    ((MD_NODATA((a), (NODATA)) || MD_NODATA((b), (NODATA))) ? 0.0 : fabs((a) - (b)))
+
+#define MD_LANES 8  // candidates per packed group of Manhattan_tile()
+
+static double Manhattan_scalar(
     double *target,
     double *candidate,
+    double NODATA,
     int n
-) 
+)
 {
     double dis = 0.0;
     for (size_t i = 0; i < n; i++)
     {
-        dis += abs(*(target + i) - *(candidate + i));
+        dis += MD_TERM(*(target + i), *(candidate + i), NODATA);
     }
-    return(dis);
+    return dis;
 }
 
+static void Manhattan_group_scalar(
+    double *target,
+    double *pack,
+    double NODATA,
+    int size,
+    double *dis
+)
+{
+    /* the distances of one target to a packed group of MD_LANES candidates;
+     * NAN: a NODATA value (or no candidate) */
+    for (int c = 0; c < MD_LANES; c++)
+    {
+        dis[c] = 0.0;
+    }
+    for (size_t i = 0; i < size; i++)
+    {
+        if (MD_NODATA(target[i], NODATA))
+        {
+            continue;
+        }
+        for (int c = 0; c < MD_LANES; c++)
+        {
+            if (!isnan(pack[i * MD_LANES + c]))
+            {
+                dis[c] += fabs(target[i] - pack[i * MD_LANES + c]);
+            }
+        }
+    }
+}
+
+#ifdef MD_X86
+
+__attribute__((target("avx2")))
+static double Manhattan_avx2(
+    double *target,
+    double *candidate,
+    double NODATA,
+    int n
+)
+{
+    /* the terms of 4 sites in the lanes, added to the distance in the site order */
+    __m256d lo = _mm256_set1_pd(NODATA - 0.01);
+    __m256d hi = _mm256_set1_pd(NODATA + 0.01);
+    __m256d sign = _mm256_set1_pd(-0.0);
+    __m256d v1, v2, nd;
+    double term[4];
+    double dis = 0.0;
+    int i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        v1 = _mm256_loadu_pd(target + i);
+        v2 = _mm256_loadu_pd(candidate + i);
+        nd = _mm256_or_pd(
+            _mm256_and_pd(_mm256_cmp_pd(v1, lo, _CMP_GE_OQ), _mm256_cmp_pd(v1, hi, _CMP_LE_OQ)),
+            _mm256_and_pd(_mm256_cmp_pd(v2, lo, _CMP_GE_OQ), _mm256_cmp_pd(v2, hi, _CMP_LE_OQ)));
+        _mm256_storeu_pd(term, _mm256_andnot_pd(nd, _mm256_andnot_pd(sign, _mm256_sub_pd(v1, v2))));
+        dis += term[0];
+        dis += term[1];
+        dis += term[2];
+        dis += term[3];
+    }
+    for (; i < n; i++)
+    {
+        dis += MD_TERM(*(target + i), *(candidate + i), NODATA);
+    }
+    return dis;
+}
 
+__attribute__((target("avx2")))
+static void Manhattan_group_avx2(
+    double *target,
+    double *pack,
+    double NODATA,
+    int size,
+    double *dis
+)
+{
+    /* Manhattan_group_scalar(): the candidates in two vectors of 4 lanes */
+    __m256d sign = _mm256_set1_pd(-0.0);
+    __m256d acc0 = _mm256_setzero_pd();
+    __m256d acc1 = _mm256_setzero_pd();
+    __m256d t, c0, c1;
+    for (size_t i = 0; i < size; i++)
+    {
+        if (MD_NODATA(target[i], NODATA))
+        {
+            continue;
+        }
+        t = _mm256_set1_pd(target[i]);
+        c0 = _mm256_loadu_pd(pack + i * MD_LANES);
+        c1 = _mm256_loadu_pd(pack + i * MD_LANES + 4);
+        acc0 = _mm256_add_pd(acc0, _mm256_and_pd(
+            _mm256_cmp_pd(c0, c0, _CMP_ORD_Q), _mm256_andnot_pd(sign, _mm256_sub_pd(t, c0))));
+        acc1 = _mm256_add_pd(acc1, _mm256_and_pd(
+            _mm256_cmp_pd(c1, c1, _CMP_ORD_Q), _mm256_andnot_pd(sign, _mm256_sub_pd(t, c1))));
+    }
+    _mm256_storeu_pd(dis, acc0);
+    _mm256_storeu_pd(dis + 4, acc1);
+}
 
+__attribute__((target("avx512f")))
+static double Manhattan_avx512(
+    double *target,
+    double *candidate,
+    double NODATA,
+    int n
+)
+{
+    /* the terms of 8 sites in the lanes, added to the distance in the site order */
+    __m512d lo = _mm512_set1_pd(NODATA - 0.01);
+    __m512d hi = _mm512_set1_pd(NODATA + 0.01);
+    __m512d v1, v2;
+    __mmask8 m, ok;
+    double term[8];
+    double dis = 0.0;
+    int l, nl;
+    for (int i = 0; i < n; i += 8)
+    {
+        nl = (n - i >= 8) ? 8 : n - i;
+        m = (nl == 8) ? (__mmask8)0xFF : (__mmask8)((1u << nl) - 1);
+        v1 = _mm512_maskz_loadu_pd(m, target + i);
+        v2 = _mm512_maskz_loadu_pd(m, candidate + i);
+        ok = m & (__mmask8)~(_mm512_cmp_pd_mask(v1, lo, _CMP_GE_OQ) & _mm512_cmp_pd_mask(v1, hi, _CMP_LE_OQ))
+               & (__mmask8)~(_mm512_cmp_pd_mask(v2, lo, _CMP_GE_OQ) & _mm512_cmp_pd_mask(v2, hi, _CMP_LE_OQ));
+        _mm512_storeu_pd(term, _mm512_abs_pd(_mm512_maskz_sub_pd(ok, v1, v2)));
+        for (l = 0; l < nl; l++)
+        {
+            dis += term[l];
+        }
+    }
+    return dis;
+}
+
+__attribute__((target("avx512f")))
+static void Manhattan_group_avx512(
+    double *target,
+    double *pack,
+    double NODATA,
+    int size,
+    double *dis
+)
+{
+    /* Manhattan_group_scalar(): the candidates in one vector of 8 lanes */
+    __m512d acc = _mm512_setzero_pd();
+    __m512d c;
+    for (size_t i = 0; i < size; i++)
+    {
+        if (MD_NODATA(target[i], NODATA))
+        {
+            continue;
+        }
+        c = _mm512_loadu_pd(pack + i * MD_LANES);
+        acc = _mm512_mask_add_pd(
+            acc, _mm512_cmp_pd_mask(c, c, _CMP_ORD_Q), acc,
+            _mm512_abs_pd(_mm512_sub_pd(_mm512_set1_pd(target[i]), c)));
+    }
+    _mm512_storeu_pd(dis, acc);
+}
+
+#endif
+
+double Manhattan_distance(
+    double *target,
+    double *candidate,
+    double NODATA,
+    int n
+)
+{
+    /*************
+     * Description:
+     *      the Manhattan distance of two images: the sum of |target - candidate|
+     *      over the sites where neither is NODATA
+     * Parameters:
+     *      n: the number of sites
+     * ***********/
+#ifdef MD_X86
+    switch (CPU_SIMD_level())
+    {
+    case SIMD_AVX512:
+        return Manhattan_avx512(target, candidate, NODATA, n);
+    case SIMD_AVX2:
+        return Manhattan_avx2(target, candidate, NODATA, n);
+    default:
+        break;
+    }
+#endif
+    return Manhattan_scalar(target, candidate, NODATA, n);
+}
+
+void Manhattan_tile(
+    double **image1,
+    int n1,
+    double **image2,
+    int n2,
+    double NODATA,
+    int size,
+    double *D,
+    int ldd,
+    double *pack
+)
+{
+    /*************
+     * Description:
+     *      the distances of a tile: D[r][c], the distance of image1[r] and image2[c];
+     *      the candidates are packed in groups of MD_LANES, site by site
+     *      (NODATA: NAN), each group compared with all the targets
+     * Parameters:
+     *      image1: n1 target images; image2: n2 candidate images
+     *      D: [n1][ldd] the distances (output)
+     *      pack: [size * MD_LANES] working buffer
+     * ***********/
+    void (*group)(double *, double *, double, int, double *);
+    group = Manhattan_group_scalar;
+#ifdef MD_X86
+    switch (CPU_SIMD_level())
+    {
+    case SIMD_AVX512:
+        group = Manhattan_group_avx512;
+        break;
+    case SIMD_AVX2:
+        group = Manhattan_group_avx2;
+        break;
+    default:
+        break;
+    }
+#endif
+    double dis[MD_LANES];
+    int r, c, l, nl;
+    for (c = 0; c < n2; c += MD_LANES)
+    {
+        nl = (n2 - c < MD_LANES) ? n2 - c : MD_LANES;
+        for (size_t i = 0; i < size; i++)
+        {
+            for (l = 0; l < MD_LANES; l++)
+            {
+                double v = (l < nl) ? *(image2[c + l] + i) : NAN;
+                pack[i * MD_LANES + l] = (l < nl && MD_NODATA(v, NODATA)) ? NAN : v;
+            }
+        }
+        for (r = 0; r < n1; r++)
+        {
+            group(image1[r], pack, NODATA, size, dis);
+            for (l = 0; l < nl; l++)
+            {
+                D[(size_t)r * ldd + c + l] = dis[l];
+            }
+        }
+    }
+}
@@ -4,7 +4,20 @@
 double Manhattan_distance(
     double *target,
     double *candidate,
+    double NODATA,
     int n
 );
 
+void Manhattan_tile(
+    double **image1,
+    int n1,
+    double **image2,
+    int n2,
+    double NODATA,
+    int size,
+    double *D,
+    int ldd,
+    double *pack
+);
+
 #endif 
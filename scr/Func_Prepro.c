@@ -8,11 +8,15 @@
  * DESCRIPTION:  preprocessing: normalization or standardization; 
  *               considering the high skewwness of data
  * DESCRIP-END.
- * FUNCTIONS:    
+ * FUNCTIONS:    Normalize(); Standardize(); Prepro_days();
  *
  * COMMENTS:
  * normalization: transform the date into the range of [0, 1];
  * standardization: scale the values around mean with a unit standard deviation;
+ * streaming (STREAM): the daily data are not known in advance, the parameters
+ * are derived from the hourly library alone (nrow_d: 0), then applied day by day;
+ * Normalize() and Standardize() return 0; -1 if the values have no spread
+ * (nothing to scale); -2 if the preprocessed library or days cannot be allocated;
  * REFERENCEs:
  * 
  */
@@ -28,9 +32,10 @@
 #include <math.h>
 #include "def_struct.h"
 #include "Func_Prepro.h"
+#include "Func_dataIO.h"
 
 
-void Normalize(
+int Normalize(
     struct Para_global *p_gp,
     struct df_rr_d *p_rr_d,
     struct df_rr_h *p_rr_h,
@@ -67,26 +72,21 @@ void Normalize(
     range = max - min;
     if (range <= 0.0)
     {
-        printf("Error: in normalization, max == min! \n");
-        exit(2);
+        return -1;  // max == min
     }
 
-    for (size_t i = 0; i < nrow_d; i++)
+    p_gp->PRE_CENTER = min;
+    p_gp->PRE_SCALE = range;
+    double *lib_pre; // preprocessed library, one contiguous [nrow_h][N] block
+    lib_pre = (double *)calloc_aligned((size_t)nrow_h * N, sizeof(double));
+    if (lib_pre == NULL || Prepro_days(p_gp, p_rr_d, nrow_d) != 0)
     {
-        (p_rr_d + i)->p_rr_pre = (double *)malloc(sizeof(double) * N);
-        for (size_t j = 0; j < N; j++)
-        {
-            if ((p_rr_d + i)->p_rr[j] > 0.0)
-            {
-                (p_rr_d + i)->p_rr_pre[j] = ((p_rr_d + i)->p_rr[j] - min) / range;
-            } else {
-                (p_rr_d + i)->p_rr_pre[j] = 0.0;
-            }
-        }
+        free_aligned(lib_pre);
+        return -2;
     }
     for (size_t i = 0; i < nrow_h; i++)
     {
-        (p_rr_h + i)->p_rr_pre = (double *)malloc(sizeof(double) * N);
+        (p_rr_h + i)->p_rr_pre = lib_pre + i * N;
         for (size_t j = 0; j < N; j++)
         {
             if ((p_rr_h + i)->rr_d[j] > 0.0)
@@ -97,9 +97,10 @@ void Normalize(
             }
         }
     }
+    return 0;
 }
 
-void Standardize(
+int Standardize(
     struct Para_global *p_gp,
     struct df_rr_d *p_rr_d,
     struct df_rr_h *p_rr_h,
@@ -135,7 +136,7 @@ void Standardize(
         }
     }
 
-    mean = (double) (sum / counts);
+    mean = (counts > 0) ? (double) (sum / counts) : 0.0;
 
     sum = 0.0;
     for (size_t i = 0; i < nrow_d; i++)
@@ -160,33 +161,78 @@ void Standardize(
     }
 
     sd = sqrt(sum / (double) counts);
+    if (counts == 0 || !(sd > 0.0))
+    {
+        return -1;  // no positive values, or all equal
+    }
 
-    for (size_t i = 0; i < nrow_d; i++)
+    p_gp->PRE_CENTER = mean;
+    p_gp->PRE_SCALE = sd;
+    double *lib_pre; // preprocessed library, one contiguous [nrow_h][N] block
+    lib_pre = (double *)calloc_aligned((size_t)nrow_h * N, sizeof(double));
+    if (lib_pre == NULL || Prepro_days(p_gp, p_rr_d, nrow_d) != 0)
+    {
+        free_aligned(lib_pre);
+        return -2;
+    }
+    for (size_t i = 0; i < nrow_h; i++)
     {
-        (p_rr_d + i)->p_rr_pre = (double *)malloc(sizeof(double) * N);
+        (p_rr_h + i)->p_rr_pre = lib_pre + i * N;
         for (size_t j = 0; j < N; j++)
         {
-            if ((p_rr_d + i)->p_rr[j] > 0.0)
+            if ((p_rr_h + i)->rr_d[j] > 0.0)
             {
-                (p_rr_d + i)->p_rr_pre[j] = ((p_rr_d + i)->p_rr[j] - mean) / sd;
+                (p_rr_h + i)->p_rr_pre[j] = ((p_rr_h + i)->rr_d[j] - mean) / sd;
             } else {
-                (p_rr_d + i)->p_rr_pre[j] = 0.0;
+                (p_rr_h + i)->p_rr_pre[j] = 0.0;
             }
         }
     }
+    return 0;
+}
 
-    for (size_t i = 0; i < nrow_h; i++)
+
+int Prepro_days(
+    struct Para_global *p_gp,
+    struct df_rr_d *p_rr_d,
+    int nrow_d)
+{
+    /**************
+     * Description:
+     *      preprocess the daily data with the parameters derived by
+     *      Normalize() or Standardize() (PRE_CENTER, PRE_SCALE)
+     * Parameters:
+     *      p_rr_d: the days; p_rr_pre is set by the caller, or, if that of the first day
+     *              is NULL, one [nrow_d][N] block is allocated here for all the days
+     *              (released by free_aligned(p_rr_d->p_rr_pre))
+     *      nrow_d: the number of days
+     * Return:
+     *      0; -1 if the block cannot be allocated (nothing changed)
+     * ************/
+    int N = p_gp->N_STATION;
+    if (nrow_d > 0 && p_rr_d->p_rr_pre == NULL)
+    {
+        double *days_pre = (double *)calloc_aligned((size_t)nrow_d * N, sizeof(double));
+        if (days_pre == NULL)
+        {
+            return -1;
+        }
+        for (size_t i = 0; i < nrow_d; i++)
+        {
+            (p_rr_d + i)->p_rr_pre = days_pre + i * N;
+        }
+    }
+    for (size_t i = 0; i < nrow_d; i++)
     {
-        (p_rr_h + i)->p_rr_pre = (double *)malloc(sizeof(double) * N);
         for (size_t j = 0; j < N; j++)
         {
-            if ((p_rr_h + i)->rr_d[j] > 0.0)
+            if ((p_rr_d + i)->p_rr[j] > 0.0)
             {
-                (p_rr_h + i)->p_rr_pre[j] = ((p_rr_h + i)->rr_d[j] - mean) / sd;
+                (p_rr_d + i)->p_rr_pre[j] = ((p_rr_d + i)->p_rr[j] - p_gp->PRE_CENTER) / p_gp->PRE_SCALE;
             } else {
-                (p_rr_h + i)->p_rr_pre[j] = 0.0;
+                (p_rr_d + i)->p_rr_pre[j] = 0.0;
             }
         }
     }
+    return 0;
 }
-
@@ -1,18 +1,23 @@
 #ifndef FUNC_PREPRO
 #define FUNC_PREPRO
 
-void Normalize(
+int Normalize(
     struct Para_global *p_gp,
     struct df_rr_d *p_rr_d,
     struct df_rr_h *p_rr_h,
     int nrow_d,
     int nrow_h);
 
-void Standardize(
+int Standardize(
     struct Para_global *p_gp,
     struct df_rr_d *p_rr_d,
     struct df_rr_h *p_rr_h,
     int nrow_d,
     int nrow_h);
+
+int Prepro_days(
+    struct Para_global *p_gp,
+    struct df_rr_d *p_rr_d,
+    int nrow_d);
     
 #endif
\ No newline at end of file
@@ -43,6 +43,28 @@ void Print_gp(
         "------ Disaggregation parameters: -----\nVAR: %s\nSIMILARITY: %s\nMONTH: %s\nN_STATION: %d\nCONTINUITY: %d\nSEASON: %s\n",
         VARname, p_gp->SIMILARITY, p_gp->MONTH, p_gp->N_STATION, p_gp->CONTINUITY, p_gp->SEASON
     );
+    if (strncmp(p_gp->FP_CACHE, "FALSE", 5) != 0)
+    {
+        printf("FP_CACHE: %s\n", p_gp->FP_CACHE);
+        fprintf(p_log, "FP_CACHE: %s\n", p_gp->FP_CACHE);
+    }
+    if (strncmp(p_gp->FP_SSIM, "FALSE", 5) != 0 && strncmp(p_gp->SSIM_LEVEL, "FULL", 4) != 0)
+    {
+        printf("SSIM_LEVEL: %s\n", p_gp->SSIM_LEVEL);
+        fprintf(p_log, "SSIM_LEVEL: %s\n", p_gp->SSIM_LEVEL);
+    }
+    if (strncmp(p_gp->OUT_FORMAT, "CSV", 3) != 0)
+    {
+        printf("OUT_FORMAT: %s\n", p_gp->OUT_FORMAT);
+        fprintf(p_log, "OUT_FORMAT: %s\n", p_gp->OUT_FORMAT);
+    }
+    if (strncmp(p_gp->STREAM, "TRUE", 4) == 0)
+    {
+        printf("STREAM: %s\n", p_gp->STREAM);
+        fprintf(p_log, "STREAM: %s\n", p_gp->STREAM);
+    }
+    printf("RUN: %d\nSEED: %llu\nTHREADS: %d\n", p_gp->RUN, p_gp->SEED, p_gp->THREADS);
+    fprintf(p_log, "RUN: %d\nSEED: %llu\nTHREADS: %d\n", p_gp->RUN, p_gp->SEED, p_gp->THREADS);
     if (strncmp(p_gp->SEASON, "TRUE", 4) == 0)
     {
         printf("SUMMER: %d-%d\n", p_gp->SUMMER_FROM, p_gp->SUMMER_TO);
@@ -136,3 +158,109 @@ void Print_hly(
     view_class_rrh(df_hly, ndays_h);
 }
 
+
+void view_class_rrd(
+    struct df_rr_d *p_rr_d,
+    int nrow_rr_d
+)
+{
+    int n_classes = 0;
+    for (size_t i = 0; i < nrow_rr_d; i++)
+    {
+        if ((p_rr_d + i)->class > n_classes)
+        {
+            n_classes = (p_rr_d + i)->class;
+        }
+    }
+    n_classes += 1;  // the total number of classes the time series is categorized into. 
+
+    int *counts;
+    counts = (int *)malloc(sizeof(int) * n_classes);
+    for (size_t i = 0; i < n_classes; i++)
+    {
+        // initialize 
+        *(counts + i) = 0;
+    }
+
+    for (size_t t = 0; t < n_classes; t++)
+    {
+        for (size_t i = 0; i < nrow_rr_d; i++)
+        {
+            if ((p_rr_d + i)->class == t)
+            {
+                *(counts + t) += 1;
+            }
+        }
+    }
+    
+    /**********************************
+     * print the counts of each class to screen
+     */
+    printf("* class-counts:\n   - class: "); fprintf(p_log, "* class-counts:\n   - class: ");
+    for (size_t t = 0; t < n_classes; t++)
+    {
+        printf("%5d ", t + 1); fprintf(p_log, "%5d ", t + 1);
+    }
+    printf("\n"); fprintf(p_log, "\n");
+
+    printf("   - count: "); fprintf(p_log, "   - count: ");
+    for (size_t t = 0; t < n_classes; t++)
+    {
+        printf("%5d ", *(counts + t)); fprintf(p_log, "%5d ", *(counts + t));
+    }
+    printf("\n"); fprintf(p_log, "\n");
+    
+}
+
+
+void view_class_rrh(
+    struct df_rr_h *p_rr_h,
+    int nrow_rr_d
+)
+{
+    int n_classes = 0;
+    for (size_t i = 0; i < nrow_rr_d; i++)
+    {
+        if ((p_rr_h + i)->class > n_classes)
+        {
+            n_classes = (p_rr_h + i)->class;
+        }
+    }
+    n_classes += 1;  // the total number of classes the time series is categorized into. 
+
+    int *counts;
+    counts = (int *)malloc(sizeof(int) * n_classes);
+    for (size_t i = 0; i < n_classes; i++)
+    {
+        // initialize 
+        *(counts + i) = 0;
+    }
+
+    for (size_t t = 0; t < n_classes; t++)
+    {
+        for (size_t i = 0; i < nrow_rr_d; i++)
+        {
+            if ((p_rr_h + i)->class == t)
+            {
+                *(counts + t) += 1;
+            }
+        }
+    }
+    
+    /**********************************
+     * print the counts of each class to screen
+     */
+    printf("* class-counts:\n   - class: "); fprintf(p_log, "* class-counts:\n   - class: ");
+    for (size_t t = 0; t < n_classes; t++)
+    {
+        printf("%5d ", t + 1); fprintf(p_log, "%5d ", t + 1);
+    }
+    printf("\n"); fprintf(p_log, "\n");
+
+    printf("   - count: "); fprintf(p_log, "   - count: ");
+    for (size_t t = 0; t < n_classes; t++)
+    {
+        printf("%5d ", *(counts + t)); fprintf(p_log, "%5d ", *(counts + t));
+    }
+    printf("\n"); fprintf(p_log, "\n");
+}
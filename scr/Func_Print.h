@@ -23,6 +23,19 @@ void Print_hly(
     int ndays_h
 );
 
+/********
+ * view (print to screen) the classes of the time series
+ * ****/
+void view_class_rrd(
+    struct df_rr_d *p_rr_d,
+    int nrow_rr_d
+);
+
+void view_class_rrh(
+    struct df_rr_h *p_rr_h,
+    int nrow_rr_d
+);
+
 
 #endif
 
@@ -8,10 +8,13 @@
  * DESCRIPTION:  compuate the SSIM between two images. 
  *               The SSIM represents how close the two images are to each other.
  * DESCRIP-END.
- * FUNCTIONS:    meanSSIM(); mean(); StandardDeviation(); covariance()
- *               isNODATA();
+ * FUNCTIONS:    meanSSIM(); meanSSIM_cached(); SSIM_combine(); SSIM_pow(); 
+ *               image_stats(); mean(); StandardDeviation(); covariance(); 
+ *               isNODATA(); SSIM_L(); SSIM_cross(); SSIM_cross_tile();
  * 
  * COMMENTS:
+ * meanSSIM() is the reference implementation (five passes over the images);
+ * meanSSIM_cached() is the fast variant used in disaggregation
  * 
  * REFERENCEs:
  * All about Structural Similarity Index (SSIM): Theory + Code in PyTorch
@@ -35,7 +38,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include "def_struct.h"
 #include "Func_SSIM.h"
+#include "Func_CPU.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SSIM_X86
+#include <immintrin.h>
+#endif
 
 
 double meanSSIM(
@@ -62,22 +72,145 @@ double meanSSIM(
 
     // printf("image1_mean: %f,image2_mean: %f,image1_sd: %f,image2_sd: %f,image_cov: %f\n",
     //        image1_mean, image2_mean, image1_sd, image2_sd, image_cov);
+    return SSIM_combine(image1_mean, image2_mean, image1_sd, image2_sd, image_cov, L, k, power);
+}
+
+double meanSSIM_cached(
+    double *image1,
+    double *image2,
+    struct SSIM_stats *stats1,
+    struct SSIM_stats *stats2,
+    double NODATA,
+    int size,
+    double *k,
+    double *power
+)
+{
+    /*************
+     * Description:
+     *      the same SSIM as meanSSIM(), with the per-image statistics
+     *      (mean, sd, max and counts) taken from the precomputed stats;
+     *      only the covariance (cross term) is computed here;
+     *      identical to meanSSIM() with the scalar code, within 1e-12 (absolute)
+     *      with AVX2 / AVX-512 (the cross term summed in another order): see test_SSIM.c
+     * ***********/
+    if (stats1->counts <= 1 || stats2->counts <= 1)
+    {
+        printf("NULL: an empty image is detected!\n");
+        exit(1);
+    }
+    double L;
+    L = (stats1->max > stats2->max) ? stats1->max : stats2->max;
+
+    double image_cov;
+    image_cov = 1 / ((double) stats1->counts - 1) * SSIM_cross(
+        image1, image2, NODATA, size, stats1->mean, stats2->mean);
+    return SSIM_combine(stats1->mean, stats2->mean, stats1->sd, stats2->sd, image_cov, L, k, power);
+}
+
+double SSIM_combine(
+    double image1_mean,
+    double image2_mean,
+    double image1_sd,
+    double image2_sd,
+    double image_cov,
+    double L,
+    double *k,
+    double *power
+)
+{
+    /*************
+     * Description:
+     *      combine the luminance, contrast and structure terms into SSIM
+     * ***********/
     double SSIM_l, SSIM_c, SSIM_s, SSIM;
     double C[3] = {0, 0, 0};
+    double kL;
     for (size_t i = 0; i < 3; i++)
     {
-        C[i] = pow(*(k + i) * L, 2);
+        kL = *(k + i) * L;
+        C[i] = kL * kL;  // (k * L)^2; identical to pow(k * L, 2)
     }
     // printf("L:%f, C1:%f, C2:%f, C3:%f\n", L, C[0], C[1], C[2]);
 
-    SSIM_l = (2 * image1_mean * image2_mean + C[0]) / (pow(image1_mean, 2) + pow(image2_mean, 2) + C[0]);
-    SSIM_c = (2 * image1_sd * image2_sd + C[1]) / (pow(image1_sd, 2) + pow(image2_sd, 2) + C[1]);
+    SSIM_l = (2 * image1_mean * image2_mean + C[0]) / (image1_mean * image1_mean + image2_mean * image2_mean + C[0]);
+    SSIM_c = (2 * image1_sd * image2_sd + C[1]) / (image1_sd * image1_sd + image2_sd * image2_sd + C[1]);
     SSIM_s = (image_cov + C[2]) / (image1_sd * image2_sd + C[2]);
-    SSIM = pow(SSIM_l, *(power + 0)) * pow(SSIM_c, *(power + 1)) * pow(SSIM_s, *(power + 2));
+    SSIM = SSIM_pow(SSIM_l, *(power + 0)) * SSIM_pow(SSIM_c, *(power + 1)) * SSIM_pow(SSIM_s, *(power + 2));
     // printf("SSIM_l:%f, SSIM_c:%f, SSIM_s:%f, SSIM:%f\n", SSIM_l, SSIM_c, SSIM_s, SSIM);
     return SSIM;
 }
 
+double SSIM_pow(
+    double x,
+    double p
+)
+{
+    /*************
+     * Description:
+     *      x to the power of p, with fast paths for the small integer exponents 
+     *      (SSIM_POWER is 1,1,1 in most applications);
+     *      for p = 0, 1, 2 the result is identical to pow()
+     * ***********/
+    if (p == 1.0)
+    {
+        return x;
+    }
+    if (p >= 0.0 && p <= 8.0 && p == (double)(int)p)
+    {
+        double y = 1.0;
+        for (int i = 0; i < (int)p; i++)
+        {
+            y *= x;
+        }
+        return y;
+    }
+    return pow(x, p);
+}
+
+void image_stats(
+    double *image,
+    double NODATA,
+    int size,
+    struct SSIM_stats *stats
+)
+{
+    /*************
+     * Description:
+     *      derive the SSIM statistics of one image: 
+     *      mean, standard deviation, maximum and the number of valid values;
+     *      the arithmetic follows mean() and StandardDeviation(),
+     *      but an empty image is not an error here (only when it is compared)
+     * ***********/
+    int counts = 0;
+    double sum = 0.0;
+    double square_sum = 0.0;
+    double max = 0.0;
+    for (size_t i = 0; i < size; i++)
+    {
+        if (*(image + i) > max)
+        {
+            max = *(image + i);
+        }
+        if (isNODATA(*(image + i), NODATA) == 0)
+        {
+            counts += 1;
+            sum += *(image + i);
+        }
+    }
+    stats->counts = counts;
+    stats->max = max;
+    stats->mean = (counts > 0) ? sum / (double) counts : 0.0;
+    for (size_t i = 0; i < size; i++)
+    {
+        if (isNODATA(*(image + i), NODATA) == 0)
+        {
+            square_sum += pow((*(image + i) - stats->mean), 2);
+        }
+    }
+    stats->sd = (counts > 1) ? pow(1 / ((double) counts - 1) * square_sum, 0.5) : 0.0;
+}
+
 double mean(
     double *image,
     double NODATA,
@@ -190,3 +323,350 @@ double SSIM_L(
     }
     return L;
 }
+
+/**********************************
+ * vectorized kernels:
+ * - SSIM_cross(): the cross term (covariance) around known means
+ * - SSIM_cross_tile(): the cross terms of a tile of target x candidate images
+ * each with a scalar, an AVX2 and an AVX-512 variant, 
+ * dispatched at runtime by CPU_SIMD_level()
+ * ***************************/
+
+static double SSIM_cross_scalar(
+    double *image1,
+    double *image2,
+    double NODATA,
+    int size,
+    double mean1,
+    double mean2
+)
+{
+    double sum = 0.0;
+    for (size_t i = 0; i < size; i++)
+    {
+        if (isNODATA(*(image1 + i), NODATA) == 0)
+        {
+            sum += (*(image1 + i) - mean1) * (*(image2 + i) - mean2);
+        }
+    }
+    return sum;
+}
+
+#ifdef SSIM_X86
+
+__attribute__((target("avx2,fma")))
+static double hsum_avx2(
+    __m256d v
+)
+{
+    __m128d lo, hi;
+    lo = _mm256_castpd256_pd128(v);
+    hi = _mm256_extractf128_pd(v, 1);
+    lo = _mm_add_pd(lo, hi);
+    return _mm_cvtsd_f64(_mm_add_sd(lo, _mm_unpackhi_pd(lo, lo)));
+}
+
+__attribute__((target("avx2,fma")))
+static double SSIM_cross_avx2(
+    double *image1,
+    double *image2,
+    double NODATA,
+    int size,
+    double mean1,
+    double mean2
+)
+{
+    __m256d lo = _mm256_set1_pd(NODATA - 0.01);
+    __m256d hi = _mm256_set1_pd(NODATA + 0.01);
+    __m256d m1 = _mm256_set1_pd(mean1);
+    __m256d m2 = _mm256_set1_pd(mean2);
+    __m256d acc0 = _mm256_setzero_pd();
+    __m256d acc1 = _mm256_setzero_pd();
+    __m256d v1, nd1;
+    int i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        v1 = _mm256_loadu_pd(image1 + i);
+        nd1 = _mm256_and_pd(_mm256_cmp_pd(v1, lo, _CMP_GE_OQ), _mm256_cmp_pd(v1, hi, _CMP_LE_OQ));
+        acc0 = _mm256_fmadd_pd(
+            _mm256_andnot_pd(nd1, _mm256_sub_pd(v1, m1)),
+            _mm256_sub_pd(_mm256_loadu_pd(image2 + i), m2), acc0);
+        v1 = _mm256_loadu_pd(image1 + i + 4);
+        nd1 = _mm256_and_pd(_mm256_cmp_pd(v1, lo, _CMP_GE_OQ), _mm256_cmp_pd(v1, hi, _CMP_LE_OQ));
+        acc1 = _mm256_fmadd_pd(
+            _mm256_andnot_pd(nd1, _mm256_sub_pd(v1, m1)),
+            _mm256_sub_pd(_mm256_loadu_pd(image2 + i + 4), m2), acc1);
+    }
+    for (; i + 4 <= size; i += 4)
+    {
+        v1 = _mm256_loadu_pd(image1 + i);
+        nd1 = _mm256_and_pd(_mm256_cmp_pd(v1, lo, _CMP_GE_OQ), _mm256_cmp_pd(v1, hi, _CMP_LE_OQ));
+        acc0 = _mm256_fmadd_pd(
+            _mm256_andnot_pd(nd1, _mm256_sub_pd(v1, m1)),
+            _mm256_sub_pd(_mm256_loadu_pd(image2 + i), m2), acc0);
+    }
+    return hsum_avx2(_mm256_add_pd(acc0, acc1)) +
+           SSIM_cross_scalar(image1 + i, image2 + i, NODATA, size - i, mean1, mean2);
+}
+
+__attribute__((target("avx512f")))
+static double SSIM_cross_avx512(
+    double *image1,
+    double *image2,
+    double NODATA,
+    int size,
+    double mean1,
+    double mean2
+)
+{
+    __m512d lo = _mm512_set1_pd(NODATA - 0.01);
+    __m512d hi = _mm512_set1_pd(NODATA + 0.01);
+    __m512d m1 = _mm512_set1_pd(mean1);
+    __m512d m2 = _mm512_set1_pd(mean2);
+    __m512d acc = _mm512_setzero_pd();
+    __m512d v1;
+    __mmask8 m, ok1;
+    for (int i = 0; i < size; i += 8)
+    {
+        m = (size - i >= 8) ? (__mmask8)0xFF : (__mmask8)((1u << (size - i)) - 1);
+        v1 = _mm512_maskz_loadu_pd(m, image1 + i);
+        ok1 = m & (__mmask8)~(_mm512_cmp_pd_mask(v1, lo, _CMP_GE_OQ) & _mm512_cmp_pd_mask(v1, hi, _CMP_LE_OQ));
+        acc = _mm512_fmadd_pd(
+            _mm512_maskz_sub_pd(ok1, v1, m1),
+            _mm512_sub_pd(_mm512_maskz_loadu_pd(m, image2 + i), m2), acc);
+    }
+    return _mm512_reduce_add_pd(acc);
+}
+
+__attribute__((target("avx2,fma")))
+static void SSIM_cross_2x2_avx2(
+    double **image1,
+    double *mean1,
+    double **image2,
+    double *mean2,
+    double NODATA,
+    int size,
+    double *C,
+    int ldc
+)
+{
+    /* the cross terms of 2 targets x 2 candidates: SSIM_cross_avx2() of each pair,
+     * each loaded vector used for 2 pairs */
+    __m256d lo = _mm256_set1_pd(NODATA - 0.01);
+    __m256d hi = _mm256_set1_pd(NODATA + 0.01);
+    __m256d acc[2][2][2];   // [target][candidate][half]
+    __m256d x[2], y[2], v1, nd1;
+    int r, c, h, i = 0;
+    for (r = 0; r < 2; r++)
+        for (c = 0; c < 2; c++)
+            acc[r][c][0] = acc[r][c][1] = _mm256_setzero_pd();
+    for (; i + 8 <= size; i += 8)
+    {
+        for (h = 0; h < 2; h++)
+        {
+            for (r = 0; r < 2; r++)
+            {
+                v1 = _mm256_loadu_pd(image1[r] + i + 4 * h);
+                nd1 = _mm256_and_pd(_mm256_cmp_pd(v1, lo, _CMP_GE_OQ), _mm256_cmp_pd(v1, hi, _CMP_LE_OQ));
+                x[r] = _mm256_andnot_pd(nd1, _mm256_sub_pd(v1, _mm256_set1_pd(mean1[r])));
+            }
+            for (c = 0; c < 2; c++)
+            {
+                y[c] = _mm256_sub_pd(_mm256_loadu_pd(image2[c] + i + 4 * h), _mm256_set1_pd(mean2[c]));
+            }
+            for (r = 0; r < 2; r++)
+                for (c = 0; c < 2; c++)
+                    acc[r][c][h] = _mm256_fmadd_pd(x[r], y[c], acc[r][c][h]);
+        }
+    }
+    for (; i + 4 <= size; i += 4)
+    {
+        for (r = 0; r < 2; r++)
+        {
+            v1 = _mm256_loadu_pd(image1[r] + i);
+            nd1 = _mm256_and_pd(_mm256_cmp_pd(v1, lo, _CMP_GE_OQ), _mm256_cmp_pd(v1, hi, _CMP_LE_OQ));
+            x[r] = _mm256_andnot_pd(nd1, _mm256_sub_pd(v1, _mm256_set1_pd(mean1[r])));
+        }
+        for (c = 0; c < 2; c++)
+        {
+            y[c] = _mm256_sub_pd(_mm256_loadu_pd(image2[c] + i), _mm256_set1_pd(mean2[c]));
+        }
+        for (r = 0; r < 2; r++)
+            for (c = 0; c < 2; c++)
+                acc[r][c][0] = _mm256_fmadd_pd(x[r], y[c], acc[r][c][0]);
+    }
+    for (r = 0; r < 2; r++)
+    {
+        for (c = 0; c < 2; c++)
+        {
+            C[r * ldc + c] = hsum_avx2(_mm256_add_pd(acc[r][c][0], acc[r][c][1])) +
+                SSIM_cross_scalar(image1[r] + i, image2[c] + i, NODATA, size - i, mean1[r], mean2[c]);
+        }
+    }
+}
+
+__attribute__((target("avx512f")))
+static void SSIM_cross_2x2_avx512(
+    double **image1,
+    double *mean1,
+    double **image2,
+    double *mean2,
+    double NODATA,
+    int size,
+    double *C,
+    int ldc
+)
+{
+    /* the cross terms of 2 targets x 2 candidates: SSIM_cross_avx512() of each pair */
+    __m512d lo = _mm512_set1_pd(NODATA - 0.01);
+    __m512d hi = _mm512_set1_pd(NODATA + 0.01);
+    __m512d acc[2][2];
+    __m512d x[2], y[2], v1;
+    __mmask8 m, ok1;
+    int r, c;
+    for (r = 0; r < 2; r++)
+        for (c = 0; c < 2; c++)
+            acc[r][c] = _mm512_setzero_pd();
+    for (int i = 0; i < size; i += 8)
+    {
+        m = (size - i >= 8) ? (__mmask8)0xFF : (__mmask8)((1u << (size - i)) - 1);
+        for (r = 0; r < 2; r++)
+        {
+            v1 = _mm512_maskz_loadu_pd(m, image1[r] + i);
+            ok1 = m & (__mmask8)~(_mm512_cmp_pd_mask(v1, lo, _CMP_GE_OQ) & _mm512_cmp_pd_mask(v1, hi, _CMP_LE_OQ));
+            x[r] = _mm512_maskz_sub_pd(ok1, v1, _mm512_set1_pd(mean1[r]));
+        }
+        for (c = 0; c < 2; c++)
+        {
+            y[c] = _mm512_sub_pd(_mm512_maskz_loadu_pd(m, image2[c] + i), _mm512_set1_pd(mean2[c]));
+        }
+        for (r = 0; r < 2; r++)
+            for (c = 0; c < 2; c++)
+                acc[r][c] = _mm512_fmadd_pd(x[r], y[c], acc[r][c]);
+    }
+    for (r = 0; r < 2; r++)
+        for (c = 0; c < 2; c++)
+            C[r * ldc + c] = _mm512_reduce_add_pd(acc[r][c]);
+}
+
+#endif
+
+double SSIM_cross(
+    double *image1,
+    double *image2,
+    double NODATA,
+    int size,
+    double mean1,
+    double mean2
+)
+{
+    /*************
+     * Description:
+     *      the cross term of the covariance (not yet divided by counts - 1):
+     *      sum of (image1 - mean1) * (image2 - mean2), over the valid values of image1
+     * ***********/
+#ifdef SSIM_X86
+    switch (CPU_SIMD_level())
+    {
+    case SIMD_AVX512:
+        return SSIM_cross_avx512(image1, image2, NODATA, size, mean1, mean2);
+    case SIMD_AVX2:
+        return SSIM_cross_avx2(image1, image2, NODATA, size, mean1, mean2);
+    default:
+        break;
+    }
+#endif
+    return SSIM_cross_scalar(image1, image2, NODATA, size, mean1, mean2);
+}
+
+static void SSIM_cross_2x2_scalar(
+    double **image1,
+    double *mean1,
+    double **image2,
+    double *mean2,
+    double NODATA,
+    int size,
+    double *C,
+    int ldc
+)
+{
+    /* the cross terms of 2 targets x 2 candidates: SSIM_cross_scalar() of each pair */
+    double sum[2][2] = {{0.0, 0.0}, {0.0, 0.0}};
+    double x, y0, y1;
+    for (size_t i = 0; i < size; i++)
+    {
+        y0 = *(image2[0] + i) - mean2[0];
+        y1 = *(image2[1] + i) - mean2[1];
+        for (int r = 0; r < 2; r++)
+        {
+            if (isNODATA(*(image1[r] + i), NODATA) == 0)
+            {
+                x = *(image1[r] + i) - mean1[r];
+                sum[r][0] += x * y0;
+                sum[r][1] += x * y1;
+            }
+        }
+    }
+    C[0] = sum[0][0]; C[1] = sum[0][1];
+    C[ldc] = sum[1][0]; C[ldc + 1] = sum[1][1];
+}
+
+void SSIM_cross_tile(
+    double **image1,
+    double *mean1,
+    int n1,
+    double **image2,
+    double *mean2,
+    int n2,
+    double NODATA,
+    int size,
+    double *C,
+    int ldc
+)
+{
+    /*************
+     * Description:
+     *      the cross terms of a tile: C[r][c] = SSIM_cross(image1[r], image2[c], ...),
+     *      the same values (and rounding) as one pair at a time;
+     *      register-blocked 2 x 2: each vector loaded (and centred) once for 2 pairs
+     * Parameters:
+     *      image1, mean1: n1 target images and their means
+     *      image2, mean2: n2 candidate images and their means
+     *      C: [n1][ldc] the cross terms (output)
+     * ***********/
+    void (*kernel)(double **, double *, double **, double *, double, int, double *, int);
+    kernel = SSIM_cross_2x2_scalar;
+#ifdef SSIM_X86
+    switch (CPU_SIMD_level())
+    {
+    case SIMD_AVX512:
+        kernel = SSIM_cross_2x2_avx512;
+        break;
+    case SIMD_AVX2:
+        kernel = SSIM_cross_2x2_avx2;
+        break;
+    default:
+        break;
+    }
+#endif
+    int r, c;
+    for (r = 0; r + 2 <= n1; r += 2)
+    {
+        for (c = 0; c + 2 <= n2; c += 2)
+        {
+            kernel(image1 + r, mean1 + r, image2 + c, mean2 + c, NODATA, size, C + (size_t)r * ldc + c, ldc);
+        }
+        for (; c < n2; c++)
+        {
+            C[(size_t)r * ldc + c] = SSIM_cross(image1[r], image2[c], NODATA, size, mean1[r], mean2[c]);
+            C[(size_t)(r + 1) * ldc + c] = SSIM_cross(image1[r + 1], image2[c], NODATA, size, mean1[r + 1], mean2[c]);
+        }
+    }
+    for (; r < n1; r++)
+    {
+        for (c = 0; c < n2; c++)
+        {
+            C[(size_t)r * ldc + c] = SSIM_cross(image1[r], image2[c], NODATA, size, mean1[r], mean2[c]);
+        }
+    }
+}
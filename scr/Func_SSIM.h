@@ -10,6 +10,40 @@ double meanSSIM(
     double *power
 );
 
+double meanSSIM_cached(
+    double *image1,
+    double *image2,
+    struct SSIM_stats *stats1,
+    struct SSIM_stats *stats2,
+    double NODATA,
+    int size,
+    double *k,
+    double *power
+);
+
+double SSIM_combine(
+    double image1_mean,
+    double image2_mean,
+    double image1_sd,
+    double image2_sd,
+    double image_cov,
+    double L,
+    double *k,
+    double *power
+);
+
+double SSIM_pow(
+    double x,
+    double p
+);
+
+void image_stats(
+    double *image,
+    double NODATA,
+    int size,
+    struct SSIM_stats *stats
+);
+
 double mean(
     double *image,
     double NODATA,
@@ -44,4 +78,26 @@ double SSIM_L(
     int size
 );
 
+double SSIM_cross(
+    double *image1,
+    double *image2,
+    double NODATA,
+    int size,
+    double mean1,
+    double mean2
+);
+
+void SSIM_cross_tile(
+    double **image1,
+    double *mean1,
+    int n1,
+    double **image2,
+    double *mean2,
+    int n2,
+    double NODATA,
+    int size,
+    double *C,
+    int ldc
+);
+
 #endif
\ No newline at end of file
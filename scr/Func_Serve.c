@@ -0,0 +1,452 @@
+/*
+ * SUMMARY:      Func_Serve.c
+ * USAGE:        the disaggregation server: the library loaded once, requests over a Unix socket
+ * AUTHOR:       Xiaoxiang Guan
+ * ORG:          Section Hydrology, GFZ
+ * E-MAIL:       guan@gfz-potsdam.de
+ * ORIG-DATE:    Oct-2024
+ * DESCRIPTION:  kNN_MOF_m serve <global parameter file> [socket=path]
+ *               loads the CP series and the hourly library (or its cache, FP_CACHE) once,
+ *               then answers requests on a Unix domain socket (default: kNN_MOF_m.sock);
+ *               a request is a block of text lines, ended by an empty line
+ *               (or by the end of the connection):
+ *               - daily rows as in FP_DAILY: y,m,d,values of the N_STATION sites;
+ *                 with T_CP TRUE the cp of the date is taken from FP_CP,
+ *                 or given in the row: y,m,d,cp,values (cp 0: from FP_CP);
+ *                 the reply: the rows of FP_OUT (run,y,m,d,h,values), then "END"
+ *               - PING: the reply "OK"
+ *               - RELOAD: load the library again; the reply "OK <library days>"
+ *               an invalid request gets the reply "ERROR <message>";
+ *               a connection may send any number of requests
+ * DESCRIP-END.
+ * FUNCTIONS:    Serve_command();
+ *
+ * COMMENTS:
+ * - a front end of the engine (knnmof.h, Func_Engine.c): the days of a request are
+ *   disaggregated by kNN_engine_days(), as a daily data file with these days;
+ *   with CONTINUITY > 1 the days of a request should be consecutive
+ * - the library is loaded again before a request when its sources (FP_HOURLY, FP_CP)
+ *   have changed (the key of the library cache: device, inode, size, modification time);
+ *   if that fails, the request is answered with the error and the previous library
+ *   is served until the sources change again
+ * - the connections are served one after the other
+ * - POSIX only (Unix domain sockets)
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifndef _WIN32
+#include <unistd.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+#include "def_struct.h"
+#include "knnmof.h"
+#include "Func_dataIO.h"
+#include "Func_CSV.h"
+#include "Func_Writer.h"
+#include "Func_Print.h"
+#include "Func_Serve.h"
+
+#ifndef _WIN32
+
+static void request_day(
+    struct Serve_request *p_rq,
+    int N,
+    int RUN)
+{
+    /* room for one more day in the request */
+    if (p_rq->n < p_rq->cap)
+    {
+        return;
+    }
+    int cap = (p_rq->cap > 0) ? p_rq->cap * 2 : 16;
+    p_rq->ymd = (int *)realloc(p_rq->ymd, sizeof(int) * 3 * cap);
+    p_rq->cp = (int *)realloc(p_rq->cp, sizeof(int) * cap);
+    p_rq->rr = (double *)realloc(p_rq->rr, sizeof(double) * N * cap);
+    p_rq->hourly = (double *)realloc(p_rq->hourly, sizeof(double) * 24 * N * RUN * cap);
+    if (p_rq->ymd == NULL || p_rq->cp == NULL || p_rq->rr == NULL || p_rq->hourly == NULL)
+    {
+        printf("Program terminated: cannot allocate memory for the request\n");
+        exit(1);
+    }
+    p_rq->cap = cap;
+}
+
+static int read_line(
+    FILE *fp,
+    struct Serve_request *p_rq)
+{
+    /* the next line of the request, without "\r\n"; -1: the end of the connection */
+    size_t len = 0;
+    while (fgets(p_rq->line + len, (int)(p_rq->line_cap - len), fp) != NULL)
+    {
+        len += strlen(p_rq->line + len);
+        if (len > 0 && p_rq->line[len - 1] == '\n')
+        {
+            break;
+        }
+        if (len + 1 >= p_rq->line_cap)
+        {
+            p_rq->line_cap *= 2;
+            if ((p_rq->line = (char *)realloc(p_rq->line, p_rq->line_cap)) == NULL)
+            {
+                printf("Program terminated: cannot allocate memory for the request\n");
+                exit(1);
+            }
+        }
+    }
+    if (len == 0)
+    {
+        return -1;
+    }
+    while (len > 0 && (p_rq->line[len - 1] == '\n' || p_rq->line[len - 1] == '\r'))
+    {
+        len--;
+    }
+    p_rq->line[len] = '\0';
+    return (int)len;
+}
+
+static int parse_day(
+    struct Serve_request *p_rq,
+    int N,
+    int RUN,
+    int f_cp,
+    int len,
+    char *err)
+{
+    /**************
+     * Description:
+     *      parse a daily row of the request into the next day
+     * Parameters:
+     *      f_cp: 1: the row may give the cp (T_CP: TRUE)
+     * Return:
+     *      0: done; -1: invalid (the message in err)
+     * ************/
+    const char *p = p_rq->line, *end = p_rq->line + len;
+    request_day(p_rq, N, RUN);
+    int *ymd = p_rq->ymd + (size_t)p_rq->n * 3;
+    double *rr = p_rq->rr + (size_t)p_rq->n * N;
+    int n_field = 1;
+    for (const char *q = p; q < end; q++)
+    {
+        n_field += (*q == ',');
+    }
+    p_rq->cp[p_rq->n] = 0;
+    p = CSV_int(p, end, ymd);
+    if (p != NULL) p = CSV_int(p, end, ymd + 1);
+    if (p != NULL) p = CSV_int(p, end, ymd + 2);
+    if (p != NULL && f_cp && n_field == N + 4) p = CSV_int(p, end, p_rq->cp + p_rq->n);
+    for (int j = 0; j < N && p != NULL; j++)
+    {
+        p = CSV_double(p, end, rr + j);
+    }
+    if (p == NULL || n_field < N + 3)
+    {
+        sprintf(err, "row %d: less than %d values (y,m,d%s,values)", p_rq->n + 1, N,
+                f_cp ? "[,cp]" : "");
+        return -1;
+    }
+    p_rq->n++;
+    return 0;
+}
+
+static int send_all(
+    int fd,
+    struct Out_buffer *p_ob)
+{
+    /* send the buffered reply; -1: the client is gone */
+    const char *p = p_ob->buf;
+    size_t n = p_ob->len;
+    p_ob->len = 0;
+    while (n > 0)
+    {
+        ssize_t w = send(fd, p, n, MSG_NOSIGNAL);
+        if (w <= 0)
+        {
+            return -1;
+        }
+        p += w;
+        n -= w;
+    }
+    return 0;
+}
+
+static void reply(
+    struct Out_buffer *p_ob,
+    const char *text)
+{
+    Out_buffer_write(p_ob, text, strlen(text));
+    Out_buffer_write(p_ob, "\n", 1);
+}
+
+static int disaggregate(
+    kNN_engine *e,
+    struct Serve_request *p_rq,
+    struct Out_buffer *p_ob,
+    int fd)
+{
+    /**************
+     * Description:
+     *      disaggregate the days of a request and send the rows of FP_OUT
+     * Return:
+     *      0: done; -1: the client is gone
+     * ************/
+    int N, RUN;
+    kNN_engine_info(e, &N, &RUN, NULL);
+    if (kNN_engine_days(e, p_rq->n, p_rq->ymd, p_rq->cp, p_rq->rr, p_rq->hourly) != KNN_OK)
+    {
+        Out_buffer_write(p_ob, "ERROR ", 6);
+        reply(p_ob, kNN_engine_error(e));
+        return send_all(fd, p_ob);
+    }
+    for (int d = 0; d < p_rq->n; d++)
+    {
+        struct Date date;
+        date.y = p_rq->ymd[d * 3];
+        date.m = p_rq->ymd[d * 3 + 1];
+        date.d = p_rq->ymd[d * 3 + 2];
+        for (int t = 0; t < RUN; t++)
+        {
+            Write_hours(p_ob, t + 1, date, p_rq->hourly + ((size_t)d * RUN + t) * 24 * N);
+            if (p_ob->len > p_ob->cap / 2 && send_all(fd, p_ob) != 0)
+            {
+                return -1;
+            }
+        }
+    }
+    Out_buffer_write(p_ob, "END\n", 4);
+    return send_all(fd, p_ob);
+}
+
+static int lib_reload(
+    kNN_engine *e)
+{
+    /* load the library again; if that fails (e.g. a source file being written),
+     * the previous library is served until the sources change again */
+    time_t tm;
+    int ndays_h, code;
+    time(&tm);
+    if ((code = kNN_engine_load(e)) != KNN_OK)
+    {
+        printf("------ Library not loaded again (the previous one kept): %s: %s", kNN_engine_error(e), ctime(&tm));
+        fprintf(p_log, "------ Library not loaded again (the previous one kept): %s: %s", kNN_engine_error(e), ctime(&tm));
+        fflush(stdout);
+        fflush(p_log);
+        return code;
+    }
+    kNN_engine_info(e, NULL, NULL, &ndays_h);
+    printf("------ Library loaded again: %d days: %s", ndays_h, ctime(&tm));
+    fprintf(p_log, "------ Library loaded again: %d days: %s", ndays_h, ctime(&tm));
+    fflush(stdout);
+    fflush(p_log);
+    return KNN_OK;
+}
+
+static void serve_connection(
+    kNN_engine *e,
+    struct Serve_request *p_rq,
+    int f_cp,
+    int fd)
+{
+    /**************
+     * Description:
+     *      answer the requests of one connection until it is closed
+     * ************/
+    FILE *fp_in = fdopen(dup(fd), "r");
+    struct Out_buffer ob;
+    char err[256], text[64];
+    int len, gone = 0, N, RUN, ndays_h;
+    if (fp_in == NULL)
+    {
+        return;
+    }
+    kNN_engine_info(e, &N, &RUN, NULL);
+    Out_buffer_open(&ob, NULL, N);
+    while (!gone)
+    {
+        /* one request: the lines up to an empty line or the end */
+        int n_line = 0, command = 0;
+        err[0] = '\0';
+        p_rq->n = 0;
+        while ((len = read_line(fp_in, p_rq)) > 0)
+        {
+            n_line++;
+            if (n_line == 1 && strcmp(p_rq->line, "PING") == 0)
+            {
+                command = 1;
+            }
+            else if (n_line == 1 && strcmp(p_rq->line, "RELOAD") == 0)
+            {
+                command = 2;
+            }
+            else if (command == 0 && err[0] == '\0')
+            {
+                if (n_line == 1 && kNN_engine_changed(e) && lib_reload(e) != KNN_OK)
+                {
+                    // the sources have changed, but cannot be loaded: the request fails
+                    snprintf(err, sizeof(err), "%s", kNN_engine_error(e));
+                    continue;
+                }
+                parse_day(p_rq, N, RUN, f_cp, len, err);
+            }
+        }
+        if (n_line == 0)
+        {
+            if (len < 0)
+            {
+                break;      // the end of the connection
+            }
+            continue;       // an empty request
+        }
+        if (command == 1)
+        {
+            reply(&ob, "OK");
+        }
+        else if (command == 2)
+        {
+            if (lib_reload(e) != KNN_OK)
+            {
+                Out_buffer_write(&ob, "ERROR ", 6);
+                reply(&ob, kNN_engine_error(e));
+            }
+            else
+            {
+                kNN_engine_info(e, NULL, NULL, &ndays_h);
+                sprintf(text, "OK %d", ndays_h);
+                reply(&ob, text);
+            }
+        }
+        else if (err[0] != '\0')
+        {
+            Out_buffer_write(&ob, "ERROR ", 6);
+            reply(&ob, err);
+        }
+        else
+        {
+            gone = (disaggregate(e, p_rq, &ob, fd) != 0);
+        }
+        if (!gone)
+        {
+            gone = (send_all(fd, &ob) != 0);
+        }
+        if (len < 0)
+        {
+            break;
+        }
+    }
+    Out_buffer_close(&ob);
+    fclose(fp_in);
+}
+
+int Serve_command(
+    int argc,
+    char *argv[])
+{
+    /**************
+     * Description:
+     *      the command line front end of the server:
+     *      kNN_MOF_m serve <global parameter file> [socket=path]
+     * Return:
+     *      does not return; ends with a signal (e.g. SIGTERM)
+     * ************/
+    char *FP_socket = "kNN_MOF_m.sock";
+    struct Para_global gp;
+    struct Serve_request rq;
+    struct sockaddr_un addr;
+    kNN_engine *e;
+    time_t tm;
+    int fd_listen, ndays_h;
+    if (argc < 1)
+    {
+        printf("Usage: kNN_MOF_m serve <global parameter file> [socket=path]\n");
+        exit(1);
+    }
+    for (int a = 1; a < argc; a++)
+    {
+        if (strncmp(argv[a], "socket=", 7) == 0)
+        {
+            FP_socket = argv[a] + 7;
+        } else {
+            printf("Invalid argument: %s\n", argv[a]);
+            exit(1);
+        }
+    }
+    if (strlen(FP_socket) >= sizeof(addr.sun_path))
+    {
+        printf("The socket path is too long: %s\n", FP_socket);
+        exit(1);
+    }
+    import_global(argv[0], &gp);
+    if ((p_log = fopen(gp.FP_LOG, "a+")) == NULL)
+    {
+        printf("cannot create / open log file\n");
+        exit(1);
+    }
+    if (kNN_engine_create(&e) != KNN_OK)
+    {
+        printf("Program terminated: cannot allocate memory for the engine\n");
+        exit(1);
+    }
+    if (kNN_engine_config_file(e, argv[0]) != KNN_OK || kNN_engine_load(e) != KNN_OK)
+    {
+        printf("Program terminated: %s\n", kNN_engine_error(e));
+        fprintf(p_log, "Program terminated: %s\n", kNN_engine_error(e));
+        exit(1);
+    }
+    kNN_engine_info(e, NULL, NULL, &ndays_h);
+    memset(&rq, 0, sizeof(rq));
+    rq.line_cap = MAXCHAR;
+    rq.line = (char *)malloc(rq.line_cap);
+
+    if ((fd_listen = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+    {
+        printf("Cannot create the socket\n");
+        exit(1);
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, FP_socket);
+    unlink(FP_socket);
+    if (bind(fd_listen, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd_listen, 16) != 0)
+    {
+        printf("Cannot listen on the socket: %s\n", FP_socket);
+        exit(1);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    time(&tm);
+    printf("------ Serving on %s: %d library days: %s", FP_socket, ndays_h, ctime(&tm));
+    fprintf(p_log, "------ Serving on %s: %d library days: %s", FP_socket, ndays_h, ctime(&tm));
+    fflush(stdout);
+    fflush(p_log);
+    while (1)
+    {
+        int fd = accept(fd_listen, NULL, NULL);
+        if (fd < 0)
+        {
+            continue;
+        }
+        serve_connection(e, &rq, strncmp(gp.T_CP, "TRUE", 4) == 0, fd);
+        close(fd);
+    }
+    return 0;
+}
+
+#else
+
+int Serve_command(
+    int argc,
+    char *argv[])
+{
+    printf("kNN_MOF_m serve: not available on this platform (Unix domain sockets)\n");
+    exit(1);
+}
+
+#endif
@@ -0,0 +1,9 @@
+#ifndef FUNC_SERVE
+#define FUNC_SERVE
+
+int Serve_command(
+    int argc,
+    char *argv[]
+);
+
+#endif
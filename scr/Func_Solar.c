@@ -9,6 +9,8 @@
 #include "Func_MD.h"
 #include "Func_Fragments.h"
 #include "Func_dataIO.h"
+#include "Func_Initialize.h"
+#include "Func_Disaggregate.h"
 #include "Func_SSIM.h"
 
 
@@ -16,153 +18,25 @@ void kNN_MOF_solar(
     struct df_rr_h *p_rrh,
     struct df_rr_d *p_rrd,
     struct Para_global *p_gp,
+    struct class_index *p_ci,
     double *Solar_MAX,
     int nrow_rr_d,
-    int ndays_h
+    int ndays_h,
+    FILE *fp_SSIM
 ) {
     /*******************
      * Description:
      *  algorithm: k-nearest neighbouring sampling, method-of-fragments, based on seasonality
      *  scale: daily2hourly, multiple stations simultaneously
+     *  the candidates are further filtered by the solar radiation maxima (Solar_MAX_lump_filter())
      * Parameters:
+     *  p_ci: the class index of the hourly library (candidate pools)
+     *  Solar_MAX: the maxima of solar radiation at each site
      *  nrow_rr_d: the number of rows in daily data file
      *  ndays_h: the number of observations of hourly data
+     *  fp_SSIM: the similarity file (FP_SSIM), opened; NULL: not written
      * *****************/
-    int i, j, h;
-    int class_t, class_c;
-
-    /*********
-     * order: 
-     * - 1: sort the similarity metric in decreasing order: SSIM
-     * - 0: sort the similarity metric in increasing order: Distance
-     * ******/
-    int order = 1;
-    if (strncmp(p_gp->SIMILARITY, "SSIM", 4) == 0)
-    {
-        order = 1;   // SSIM
-    } else {
-        order = 0;   // Manhattan_distance
-    }
-    struct df_rr_h df_rr_h_out; // this is a struct variable, not a struct array;
-    
-    /************
-     * CONTINUITY and skip
-     * - p_gp->CONTINUITY: 1, skip = 0;
-     * - p_gp->CONTINUITY: 3, skip = 1;
-     * - p_gp->CONTINUITY: 5, skip = 2;
-     * *************/
-    int skip = 0;
-    skip = (int)((p_gp->CONTINUITY - 1) / 2);
-    int pool_cans[MAXrow]; // the index of the candidates (a pool); the size is sufficient
-    int n_can;             // the number of candidates after all conditioning
-    int fragment;          // the index of df_rr_h structure with the final chosed fragments
-
-    FILE *p_FP_OUT;
-    if ((p_FP_OUT = fopen(p_gp->FP_OUT, "w")) == NULL)
-    {
-        printf("Program terminated: cannot create or open output file\n");
-        exit(1);
-    }
-    for (i = 0; i < nrow_rr_d; i++)
-    {
-        // iterate each target day
-        df_rr_h_out.date = (p_rrd + i)->date;
-        df_rr_h_out.rr_d = (p_rrd + i)->p_rr; 
-        df_rr_h_out.rr_h = calloc(p_gp->N_STATION, sizeof(double) * 24);  // allocate memory (stack);
-
-        if (SUN_dark(p_gp->N_STATION, (p_rrd + i)->p_rr) == 1)
-        {
-            // this is a fully cloudy day; totally dark for each site
-            n_can = -1;
-            for (j = 0; j < p_gp->N_STATION; j++)
-            {
-                for (h = 0; h < 24; h++)
-                {
-                    df_rr_h_out.rr_h[j][h] = 0.0;
-                }
-            }
-            for (size_t t = 0; t < p_gp->RUN; t++)
-            {
-                /* write the disaggregation output */
-                Write_df_rr_h(&df_rr_h_out, p_gp, p_FP_OUT, t + 1);
-            }
-            break; // next step
-        }
-
-        n_can = 0;     // number of candidates
-        class_t = (p_rrd + i)->class;
-        for (j = skip; j < ndays_h - skip; j++)
-        {
-            class_c = (p_rrh + j)->class; // the class of the candidate day
-            if (class_c == class_t)       
-            {
-                pool_cans[n_can] = j;
-                n_can += 1;
-            }
-        }
-
-        int n_can_out;
-        // Solar_MAX_class_filter(p_rrh, p_rrd + i, p_gp, Solar_MAX, pool_cans, n_can, &n_can_out);
-        Solar_MAX_lump_filter(p_rrh, p_rrd + i, p_gp, Solar_MAX, pool_cans, n_can, &n_can_out);
-
-        if (n_can_out > 0)
-        {
-            n_can = n_can_out;
-        }
-        
-        // if (n_can_out == 0)
-        // {
-        //     printf("No candidates for step: %d!\n", i);
-        //     exit(1);
-        // }
-
-        /*******************
-         * hourly maximum check
-         * ******************/
-        double *SIMI;
-        SIMI = (double *)malloc(n_can * sizeof(double)); // the SIMI between target day and candidate days
-
-        int skip_temp;
-        if (i >= skip && i < nrow_rr_d - skip)
-        {
-            skip_temp = skip;
-        } else {
-            skip_temp = 0;
-        }
-        similarity_solar(p_rrd, p_rrh, p_gp, i, pool_cans, n_can, skip_temp, order, SIMI);
-        
-        /*******
-         * sample the candidates, assign the fragments and then write the output
-         * *****/
-        int *index_fragment;
-        index_fragment = (int *)malloc(sizeof(int) * p_gp->RUN);
-        kNN_sampling(SIMI, pool_cans, order, n_can, p_gp->RUN, index_fragment);
-
-        if (p_SSIM != NULL)
-        {
-            int size_pool; // the k in kNN
-            size_pool = (int)sqrt(n_can) + 1;
-            for (j = 0; j < size_pool; j++)
-            {
-                fprintf(p_SSIM, "%d-%02d-%02d,", (p_rrd + i)->date.y, (p_rrd + i)->date.m, (p_rrd + i)->date.d);
-                fprintf(p_SSIM, "%d,%d,%f,", j, pool_cans[j], SIMI[j]);
-                fprintf(p_SSIM, "%d-%02d-%02d\n", (p_rrh + pool_cans[j])->date.y, (p_rrh + pool_cans[j])->date.m, (p_rrh + pool_cans[j])->date.d);
-            }
-        }
-
-        for (size_t t = 0; t < p_gp->RUN; t++)
-        {
-            /*assign the sampled fragments to target day (disaggregation)*/
-            Fragment_assign(p_rrh, &df_rr_h_out, p_gp, index_fragment[t]);
-            /* write the disaggregation output */
-            Write_df_rr_h(&df_rr_h_out, p_gp, p_FP_OUT, t + 1);
-        }
-
-        printf("%d-%02d-%02d: Done!\n", (p_rrd+i)->date.y, (p_rrd+i)->date.m, (p_rrd+i)->date.d);
-        free(df_rr_h_out.rr_h);  // free the memory allocated for disaggregated hourly output
-        free(SIMI);
-    }
-    fclose(p_FP_OUT);
+    kNN_MOF_days(p_rrh, p_rrd, p_gp, p_ci, Solar_MAX, nrow_rr_d, ndays_h, fp_SSIM);
 }
 
 /**********************************
@@ -302,6 +176,10 @@ void Solar_MAX_lump_derive(
     int N;
     N = p_gp->N_STATION;
     *Solar_MAX = (double *)malloc(sizeof(double) * N);
+    if (*Solar_MAX == NULL)
+    {
+        return;     // out of memory: left NULL
+    }
     for (size_t i = 0; i < N; i++)
     {
         *(*Solar_MAX + i) = 0.0;
@@ -392,104 +270,11 @@ void similarity_solar(
     int n_can,
     int skip,
     int order,
-    double *SIMI
+    double *SIMI,
+    struct SIMI_cache *p_sc
 )
 {
-    double w_image[5] = {0.08333333, 0.1666667, 0.5, 0.1666667, 0.08333333};  // CONTUNITY == 5
-    if (skip == 0)
-    {
-        // CONTUNITY == 1
-        w_image[0] = 1.0;
-    } else if (skip == 1)
-    {
-        // CONTUNITY == 3
-        w_image[0] = 0.1666667; w_image[1] = 0.6666667; w_image[2] = 0.1666667;
-    } else if (skip > 2)
-    {
-        printf("Currently CONTUNITY > 5 is not possible!\n");
-        exit(1);
-    }
-    
-    int i, s;    // iteration variable
-    double SIMI_temp;
-    /** compute mean-SIMI between target and candidate images **/
-    if (f_prep == 0)
-    {
-        // no preprocessing
-        for (i = 0; i < n_can; i++)
-        {
-            *(SIMI + i) = 0.0;
-            for (s = 0 - skip; s < 1 + skip; s++)
-            {
-                if (
-                    p_gp->VAR == 4 && order == 1 &&
-                    (SUN_dark(p_gp->N_STATION, (p_rrd + index_target + s)->p_rr) == 1 ||
-                     SUN_dark(p_gp->N_STATION, (p_rrh + pool_cans[i] + s)->rr_d) == 1))
-                {
-                    SIMI_temp = 0.0;
-                }
-                else
-                {
-                    if (order == 1)
-                    {
-                        SIMI_temp = w_image[s + skip] * meanSSIM(
-                                                            (p_rrd + index_target + s)->p_rr,
-                                                            (p_rrh + pool_cans[i] + s)->rr_d,
-                                                            p_gp->NODATA,
-                                                            p_gp->N_STATION,
-                                                            p_gp->k,
-                                                            p_gp->power);
-                    }
-                    else
-                    {
-
-                        SIMI_temp = w_image[s + skip] * Manhattan_distance(
-                                                            (p_rrd + index_target + s)->p_rr,
-                                                            (p_rrh + pool_cans[i] + s)->rr_d,
-                                                            p_gp->N_STATION);
-                    }
-                }
-                *(SIMI + i) += SIMI_temp;
-            }
-        }
-    }
-    else
-    {
-        // with preprocessing 
-        for (i = 0; i < n_can; i++)
-        {
-            *(SIMI + i) = 0.0;
-            for (s = 0 - skip; s < 1 + skip; s++)
-            {
-                if (
-                    p_gp->VAR == 4 && order == 1 &&
-                    (SUN_dark(p_gp->N_STATION, (p_rrd + index_target + s)->p_rr) == 1 ||
-                     SUN_dark(p_gp->N_STATION, (p_rrh + pool_cans[i] + s)->rr_d) == 1))
-                {
-                    SIMI_temp = 0.0;
-                }
-                else
-                {
-                    if (order == 1)
-                    {
-                        SIMI_temp = w_image[s + skip] * meanSSIM(
-                                                        (p_rrd + index_target + s)->p_rr_pre,
-                                                        (p_rrh + pool_cans[i] + s)->p_rr_pre,
-                                                        p_gp->NODATA,
-                                                        p_gp->N_STATION,
-                                                        p_gp->k,
-                                                        p_gp->power);
-                    }
-                    else
-                    {
-                        SIMI_temp = w_image[s + skip] * Manhattan_distance(
-                                                        (p_rrd + index_target + s)->p_rr_pre,
-                                                        (p_rrh + pool_cans[i] + s)->p_rr_pre,
-                                                        p_gp->N_STATION);
-                    }
-                }
-                *(SIMI + i) += SIMI_temp;
-            }
-        }
-    }
+    /** compute mean-SIMI between target and candidate images:
+     * the same weighted similarity of the window as the other variables **/
+    kNN_SSIM_similarity(p_rrd, p_rrh, p_gp, index_target, pool_cans, order, n_can, skip, SIMI, p_sc);
 }
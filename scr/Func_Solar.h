@@ -1,16 +1,15 @@
 #ifndef FUNC_SOLAR
 #define FUNC_SOLAR
 
-extern FILE *p_SSIM;
-extern int f_prep; 
-
 void kNN_MOF_solar(
     struct df_rr_h *p_rrh,
     struct df_rr_d *p_rrd,
     struct Para_global *p_gp,
+    struct class_index *p_ci,
     double *Solar_MAX,
     int nrow_rr_d,
-    int ndays_h
+    int ndays_h,
+    FILE *fp_SSIM
 );
 
 void similarity_solar(
@@ -22,7 +21,8 @@ void similarity_solar(
     int n_can,
     int skip,
     int order,
-    double *SSIM
+    double *SIMI,
+    struct SIMI_cache *p_sc
 );
 
 void Solar_MAX_class_derive(
@@ -0,0 +1,511 @@
+/*
+ * SUMMARY:      Func_Writer.c
+ * USAGE:        buffered and asynchronous writing of the output files
+ * AUTHOR:       Xiaoxiang Guan
+ * ORG:          Section Hydrology, GFZ
+ * E-MAIL:       guan@gfz-potsdam.de
+ * ORIG-DATE:    Oct-2024
+ * DESCRIPTION:  the output rows are formatted into large user-space buffers (Out_buffer);
+ *               a full buffer is handed over to a dedicated writer thread,
+ *               which writes it to the file while the next days are computed
+ *               - the filled buffers wait in a bounded lock-free queue (one producer, one consumer)
+ *               - the written buffers go back to the producer through a second such queue
+ *               - at most OUT_QUEUE buffers are in flight: when all of them are
+ *                 waiting to be written, the producer waits (back-pressure)
+ * DESCRIP-END.
+ * FUNCTIONS:    Out_buffer_open(); Out_buffer_flush(); Out_buffer_close();
+ *               Writer_start(); Writer_submit(); Writer_drain(); Writer_stop();
+ *               Writer_exit(); Writer_signal_check(); Out_stdout_reserve(); Out_open();
+ *               Out_buffer_write();
+ *
+ * COMMENTS:
+ * - without POSIX threads (HAVE_PTHREAD undefined) the buffers are written synchronously
+ * - the opened Out_buffers are registered; at exit (also exit(1) or exit(2) on errors)
+ *   the buffered rows are flushed and the writer thread finishes the queue,
+ *   so every formatted row reaches the file
+ * - the producer is the (single) thread that runs the output stage
+ * - SIGTERM / SIGINT (kill, Ctrl-C) during a run (Writer_start() to Writer_stop()) only
+ *   set a flag; the output stage ends the program with exit() after its block
+ *   (Writer_signal_check()), so the output is complete up to the last day of that block;
+ *   a binary output (BIN, BIN64) gets its header only at the end of the run:
+ *   an interrupted one is incomplete
+ * - FP_OUT "-": the output goes to the standard output (in a pipeline);
+ *   the console messages are then redirected to the standard error
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#endif
+#ifdef _WIN32
+#include <malloc.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "def_struct.h"
+#include "Func_dataIO.h"
+#include "Func_Writer.h"
+
+#define OUT_OPENED_MAX 8  // Out_buffers opened at the same time
+
+static struct Out_buffer *opened[OUT_OPENED_MAX];  // flushed at exit
+static int exit_registered = 0;
+static int exiting = 0;  // in Writer_exit(): report write errors, but do not exit() again
+static int stdout_fd = -1;  // the standard output, reserved for the data (Out_stdout_reserve())
+static volatile sig_atomic_t stop_signal = 0;  // SIGTERM or SIGINT received during a run
+
+#ifdef HAVE_PTHREAD
+struct Out_chunk
+{
+    FILE *fp;       // the file to write to
+    char *buf;      // the formatted bytes
+    size_t len;
+};
+
+/* the writer thread and its two queues; the counters only grow,
+ * the slot is counter % OUT_QUEUE */
+static struct Out_chunk filled[OUT_QUEUE];  // waiting to be written, in the order of submission
+static atomic_size_t filled_in, filled_out;
+static char *spare[OUT_QUEUE];              // written, free to be filled again
+static atomic_size_t spare_in, spare_out;
+static atomic_int writer_stop;
+static atomic_int writer_failed;
+static pthread_t writer_thread;
+static int writer_active = 0;
+
+static void writer_wait(
+    int *n_wait)
+{
+    /* back-off while a queue is empty or full: spin shortly, then sleep up to 1 ms */
+    struct timespec ts;
+    if (*n_wait < 64)
+    {
+        (*n_wait)++;
+        return;
+    }
+    ts.tv_sec = 0;
+    ts.tv_nsec = (*n_wait < 128) ? 50000 : 1000000;
+    if (*n_wait < 128)
+    {
+        (*n_wait)++;
+    }
+    nanosleep(&ts, NULL);
+}
+
+static void *writer_main(
+    void *arg)
+{
+    /**************
+     * Description:
+     *      the writer thread: write the filled buffers in the order of submission,
+     *      then return them to the spare queue
+     * ************/
+    int n_wait = 0;
+    (void)arg;
+    while (1)
+    {
+        size_t out = atomic_load_explicit(&filled_out, memory_order_relaxed);
+        if (out != atomic_load_explicit(&filled_in, memory_order_acquire))
+        {
+            struct Out_chunk *c = &filled[out % OUT_QUEUE];
+            if (!atomic_load_explicit(&writer_failed, memory_order_relaxed) &&
+                fwrite(c->buf, 1, c->len, c->fp) != c->len)
+            {
+                atomic_store(&writer_failed, 1);  // reported by the producer
+            }
+            size_t s = atomic_load_explicit(&spare_in, memory_order_relaxed);
+            spare[s % OUT_QUEUE] = c->buf;
+            atomic_store_explicit(&spare_in, s + 1, memory_order_release);
+            atomic_store_explicit(&filled_out, out + 1, memory_order_release);
+            n_wait = 0;
+        }
+        else if (atomic_load_explicit(&writer_stop, memory_order_acquire))
+        {
+            break;
+        }
+        else
+        {
+            writer_wait(&n_wait);
+        }
+    }
+    return NULL;
+}
+
+static void writer_check()
+{
+    if (atomic_load(&writer_failed))
+    {
+        atomic_store(&writer_failed, 0);
+        printf("Program terminated: cannot write the output file\n");
+        if (!exiting)
+        {
+            exit(1);
+        }
+    }
+}
+#endif
+
+static void writer_signal(
+    int sig)
+{
+    /* only note the signal: the output stage ends the program (Writer_signal_check()) */
+    stop_signal = sig;
+}
+
+void Writer_start()
+{
+    /**************
+     * Description:
+     *      start the writer thread; from now on the full Out_buffers are written
+     *      asynchronously; without it (or without POSIX threads) they are written in place;
+     *      SIGTERM and SIGINT are caught until Writer_stop() (Writer_signal_check())
+     * ************/
+    signal(SIGTERM, writer_signal);
+    signal(SIGINT, writer_signal);
+#ifdef HAVE_PTHREAD
+    int i;
+    if (writer_active)
+    {
+        return;
+    }
+    atomic_store(&filled_in, 0);
+    atomic_store(&filled_out, 0);
+    atomic_store(&spare_in, 0);
+    atomic_store(&spare_out, 0);
+    atomic_store(&writer_stop, 0);
+    atomic_store(&writer_failed, 0);
+    for (i = 0; i < OUT_QUEUE; i++)
+    {
+        spare[i] = (char *)malloc(OUT_BUFFER);
+        if (spare[i] == NULL)
+        {
+            printf("Program terminated: cannot allocate the output buffer\n");
+            exit(1);
+        }
+    }
+    atomic_store(&spare_in, OUT_QUEUE);
+    if (pthread_create(&writer_thread, NULL, writer_main, NULL) != 0)
+    {
+        // no thread: keep writing synchronously
+        for (i = 0; i < OUT_QUEUE; i++)
+        {
+            free(spare[i]);
+        }
+        return;
+    }
+    writer_active = 1;
+    if (!exit_registered)
+    {
+        atexit(Writer_exit);
+        exit_registered = 1;
+    }
+#endif
+}
+
+char *Writer_submit(
+    FILE *fp,
+    char *buf,
+    size_t len)
+{
+    /**************
+     * Description:
+     *      hand a filled buffer (OUT_BUFFER bytes) over to the writer thread
+     * Parameters:
+     *      fp: the file to write to
+     *      buf, len: the formatted bytes
+     * Return:
+     *      an empty buffer of OUT_BUFFER bytes, to be filled next;
+     *      waits while all the buffers are still queued (back-pressure)
+     * ************/
+#ifdef HAVE_PTHREAD
+    int n_wait = 0;
+    char *empty;
+    size_t s = atomic_load_explicit(&spare_out, memory_order_relaxed);
+    writer_check();
+    while (s == atomic_load_explicit(&spare_in, memory_order_acquire))
+    {
+        writer_wait(&n_wait);
+    }
+    empty = spare[s % OUT_QUEUE];
+    atomic_store_explicit(&spare_out, s + 1, memory_order_release);
+
+    size_t in = atomic_load_explicit(&filled_in, memory_order_relaxed);
+    filled[in % OUT_QUEUE].fp = fp;
+    filled[in % OUT_QUEUE].buf = buf;
+    filled[in % OUT_QUEUE].len = len;
+    atomic_store_explicit(&filled_in, in + 1, memory_order_release);
+    return empty;
+#else
+    if (len > 0 && fwrite(buf, 1, len, fp) != len)
+    {
+        printf("Program terminated: cannot write the output file\n");
+        exit(1);
+    }
+    return buf;
+#endif
+}
+
+void Writer_drain()
+{
+    /**************
+     * Description:
+     *      wait until all the submitted buffers are written
+     * ************/
+#ifdef HAVE_PTHREAD
+    int n_wait = 0;
+    if (!writer_active)
+    {
+        return;
+    }
+    while (atomic_load_explicit(&filled_out, memory_order_acquire) !=
+           atomic_load_explicit(&filled_in, memory_order_relaxed))
+    {
+        writer_wait(&n_wait);
+    }
+    writer_check();
+#endif
+}
+
+void Writer_stop()
+{
+    /**************
+     * Description:
+     *      write the queued buffers, then end the writer thread;
+     *      SIGTERM and SIGINT end the program again at once
+     * ************/
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+#ifdef HAVE_PTHREAD
+    int i;
+    if (!writer_active)
+    {
+        return;
+    }
+    Writer_drain();
+    atomic_store_explicit(&writer_stop, 1, memory_order_release);
+    pthread_join(writer_thread, NULL);
+    writer_active = 0;
+    for (i = 0; i < OUT_QUEUE; i++)
+    {
+        free(spare[i]);
+    }
+    writer_check();
+#endif
+}
+
+void Writer_exit()
+{
+    /**************
+     * Description:
+     *      registered with atexit(): flush the rows still in the opened Out_buffers
+     *      and let the writer thread finish, so that the output is complete
+     *      up to the last formatted row when the program ends (also on errors)
+     * ************/
+    int i;
+    exiting = 1;
+    for (i = 0; i < OUT_OPENED_MAX; i++)
+    {
+        if (opened[i] != NULL)
+        {
+            Out_buffer_flush(opened[i]);
+        }
+    }
+#ifdef HAVE_PTHREAD
+    if (writer_active && !pthread_equal(pthread_self(), writer_thread))
+    {
+        Writer_stop();
+    }
+#endif
+}
+
+void Writer_signal_check()
+{
+    /**************
+     * Description:
+     *      called by the output stage after each block of days: if SIGTERM or SIGINT
+     *      was received, end the program with exit(), so that Writer_exit()
+     *      writes the buffered rows (a signal itself would lose them)
+     * ************/
+    if (stop_signal != 0)
+    {
+        printf("Program terminated: interrupted (signal %d), the output is complete up to the last written day\n",
+               (int)stop_signal);
+        exit(1);
+    }
+}
+
+void Out_buffer_open(
+    struct Out_buffer *p_ob,
+    FILE *fp,
+    int N_STATION)
+{
+    /**************
+     * Description:
+     *      set up the buffered writer on an opened output file
+     * Parameters:
+     *      p_ob: the writer
+     *      fp: the output file, opened for writing
+     *      N_STATION: number of stations (values per row)
+     * ************/
+    int i;
+    p_ob->fp = fp;
+    p_ob->N = N_STATION;
+    p_ob->len = 0;
+    p_ob->cap = OUT_BUFFER;
+    p_ob->buf = (char *)malloc(p_ob->cap);
+    p_ob->stage = (double *)calloc_aligned((size_t)N_STATION * 24, sizeof(double));
+    if (p_ob->buf == NULL || p_ob->stage == NULL)
+    {
+        printf("Program terminated: cannot allocate the output buffer\n");
+        exit(1);
+    }
+    for (i = 0; i < OUT_OPENED_MAX && opened[i] != NULL; i++);
+    if (i < OUT_OPENED_MAX)
+    {
+        opened[i] = p_ob;
+    }
+    if (!exit_registered)
+    {
+        atexit(Writer_exit);
+        exit_registered = 1;
+    }
+}
+
+void Out_buffer_flush(
+    struct Out_buffer *p_ob)
+{
+    /**************
+     * Description:
+     *      pass the buffered bytes on: to the writer thread if started,
+     *      otherwise directly into the output file
+     * ************/
+    if (p_ob->len == 0)
+    {
+        return;
+    }
+#ifdef HAVE_PTHREAD
+    if (writer_active)
+    {
+        p_ob->buf = Writer_submit(p_ob->fp, p_ob->buf, p_ob->len);
+        p_ob->len = 0;
+        return;
+    }
+#endif
+    if (fwrite(p_ob->buf, 1, p_ob->len, p_ob->fp) != p_ob->len)
+    {
+        p_ob->len = 0;
+        printf("Program terminated: cannot write the output file\n");
+        if (!exiting)
+        {
+            exit(1);
+        }
+    }
+    p_ob->len = 0;
+}
+
+void Out_buffer_write(
+    struct Out_buffer *p_ob,
+    const void *data,
+    size_t len)
+{
+    /**************
+     * Description:
+     *      append raw bytes (e.g. a compressed block) to the buffered output
+     * ************/
+    const char *p = (const char *)data;
+    while (len > 0)
+    {
+        size_t n = p_ob->cap - p_ob->len;
+        if (n == 0)
+        {
+            Out_buffer_flush(p_ob);
+            continue;
+        }
+        if (n > len)
+        {
+            n = len;
+        }
+        memcpy(p_ob->buf + p_ob->len, p, n);
+        p_ob->len += n;
+        p += n;
+        len -= n;
+    }
+}
+
+void Out_buffer_close(
+    struct Out_buffer *p_ob)
+{
+    /**************
+     * Description:
+     *      flush the remaining bytes, wait until they are written and release the buffers;
+     *      the output file itself is closed by the caller
+     * ************/
+    int i;
+    Out_buffer_flush(p_ob);
+    Writer_drain();
+    for (i = 0; i < OUT_OPENED_MAX; i++)
+    {
+        if (opened[i] == p_ob)
+        {
+            opened[i] = NULL;
+        }
+    }
+    free(p_ob->buf);
+#ifdef _WIN32
+    _aligned_free(p_ob->stage);
+#else
+    free(p_ob->stage);
+#endif
+    p_ob->buf = NULL;
+    p_ob->stage = NULL;
+    p_ob->cap = 0;
+}
+
+void Out_stdout_reserve()
+{
+    /**************
+     * Description:
+     *      reserve the standard output for the disaggregated data (FP_OUT: -):
+     *      the original standard output is kept aside for Out_open(),
+     *      everything printed to the console from now on goes to the standard error;
+     *      to be called before anything is printed
+     * ************/
+    if (stdout_fd >= 0)
+    {
+        return;
+    }
+    fflush(stdout);
+    stdout_fd = dup(fileno(stdout));
+    if (stdout_fd < 0 || dup2(fileno(stderr), fileno(stdout)) < 0)
+    {
+        fprintf(stderr, "Program terminated: cannot redirect the standard output\n");
+        exit(1);
+    }
+}
+
+FILE *Out_open(
+    char fname[])
+{
+    /**************
+     * Description:
+     *      open an output file for writing
+     * Parameters:
+     *      fname: the file path and name; "-": the standard output
+     * Return:
+     *      the opened file; NULL if it cannot be created or opened
+     * ************/
+    if (strcmp(fname, "-") == 0)
+    {
+        Out_stdout_reserve();
+        return fdopen(stdout_fd, "w");
+    }
+    return fopen(fname, "w");
+}
@@ -0,0 +1,46 @@
+#ifndef FUNC_WRITER
+#define FUNC_WRITER
+
+void Out_buffer_open(
+    struct Out_buffer *p_ob,
+    FILE *fp,
+    int N_STATION
+);
+
+void Out_buffer_flush(
+    struct Out_buffer *p_ob
+);
+
+void Out_buffer_write(
+    struct Out_buffer *p_ob,
+    const void *data,
+    size_t len
+);
+
+void Out_buffer_close(
+    struct Out_buffer *p_ob
+);
+
+void Writer_start();
+
+char *Writer_submit(
+    FILE *fp,
+    char *buf,
+    size_t len
+);
+
+void Writer_drain();
+
+void Writer_stop();
+
+void Writer_exit();
+
+void Writer_signal_check();
+
+void Out_stdout_reserve();
+
+FILE *Out_open(
+    char fname[]
+);
+
+#endif
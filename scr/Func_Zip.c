@@ -0,0 +1,441 @@
+/*
+ * SUMMARY:      Func_Zip.c
+ * USAGE:        compressed columnar output in independently decodable blocks of days
+ * AUTHOR:       Xiaoxiang Guan
+ * ORG:          Section Hydrology, GFZ
+ * E-MAIL:       guan@gfz-potsdam.de
+ * ORIG-DATE:    Oct-2024
+ * DESCRIPTION:  OUT_FORMAT ZIP: a header (struct Zip_header), then blocks of days_block
+ *               target days; in a block the values are ordered [run][station][day][hour]
+ *               (one series per station column) and coded as:
+ *               - scaled integers round(value * 100), as written in the CSV output,
+ *               - the difference to the previous value, zigzag coded (small magnitudes),
+ *               - byte-shuffled: the 1st bytes of all values, then the 2nd bytes, ...
+ *               - compressed by zlib (deflate, ZIP_LEVEL)
+ *               each thread packs and compresses its own blocks (Zip_block_pack()),
+ *               the blocks are then written in the date order (Zip_block_write()):
+ *               - Zip_out_header(); Zip_work_init(); Zip_work_free(); Zip_block_pack(); Zip_block_write()
+ *               - Zip_file_open(); Zip_to_CSV(): conversion to the CSV output layout
+ *                 kNN_MOF_m convert <compressed file> [out=file]
+ * DESCRIP-END.
+ * FUNCTIONS:    Zip_days(); Zip_out_header(); Zip_work_init(); Zip_work_free();
+ *               Zip_block_pack(); Zip_block_write(); Zip_file_open(); Zip_to_CSV();
+ *
+ * COMMENTS:
+ * - a block with a value that does not fit the scaled integers (NaN, inf, |value| >= 2e7)
+ *   keeps the doubles instead (flags 1), byte-shuffled in 8 planes
+ * - the output converts back to CSV byte for byte (Value_scaled())
+ * - the coded values do not depend on the byte order; the headers are in the byte
+ *   order of the writing machine (byte_order in the header)
+ * - the file is written sequentially: FP_OUT,- (the standard output) is allowed
+ * - requires zlib (HAVE_ZLIB); otherwise OUT_FORMAT ZIP is rejected
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "def_struct.h"
+#include "Func_dataIO.h"
+#include "Func_Writer.h"
+#include "Func_Fragments.h"
+#include "Func_Initialize.h"
+#include "Func_Zip.h"
+
+#define ZIP_MAGIC "kNNMOFzc"
+
+int Zip_days(
+    struct Para_global *p_gp)
+{
+    /**************
+     * Description:
+     *      the days per block: a power of two up to DAYS_BLOCK, with at most ZIP_VALUES values
+     *      (the blocks then start at the same days for any THREADS, also in the streaming mode)
+     * ************/
+    size_t per_day = (size_t)p_gp->RUN * p_gp->N_STATION * 24;
+    int nd = 1;
+    while (nd * 2 <= DAYS_BLOCK && per_day * nd * 2 <= ZIP_VALUES)
+    {
+        nd *= 2;
+    }
+    return nd;
+}
+
+void Zip_out_header(
+    struct Para_global *p_gp,
+    int days_block,
+    struct Out_buffer *p_ob)
+{
+    /**************
+     * Description:
+     *      write the header of the compressed output
+     * ************/
+    struct Zip_header hd;
+    memset(&hd, 0, sizeof(struct Zip_header));
+    memcpy(hd.magic, ZIP_MAGIC, 8);
+    hd.version = ZIP_VERSION;
+    hd.byte_order = 0x01020304;
+    hd.N = p_gp->N_STATION;
+    hd.RUN = p_gp->RUN;
+    hd.days_block = days_block;
+    hd.scale = 100;
+    Out_buffer_write(p_ob, &hd, sizeof(struct Zip_header));
+}
+
+void Zip_work_init(
+    struct Para_global *p_gp,
+    int days_block,
+    struct Zip_work *p_zw)
+{
+    /**************
+     * Description:
+     *      allocate the scratch buffers of one compressing thread
+     * ************/
+#ifdef HAVE_ZLIB
+    p_zw->n = (size_t)p_gp->RUN * p_gp->N_STATION * 24 * days_block;
+    p_zw->v = (double *)malloc(sizeof(double) * p_zw->n);
+    p_zw->raw = (unsigned char *)malloc(8 * p_zw->n);
+    p_zw->shuf = (unsigned char *)malloc(8 * p_zw->n);
+    p_zw->zcap = compressBound((uLong)(8 * p_zw->n));
+    p_zw->zbuf = (unsigned char *)malloc(p_zw->zcap);
+    p_zw->out.rr_h = calloc(p_gp->N_STATION, sizeof(double) * 24);
+    if (p_zw->v == NULL || p_zw->raw == NULL || p_zw->shuf == NULL || p_zw->zbuf == NULL ||
+        p_zw->out.rr_h == NULL)
+    {
+        printf("Program terminated: cannot allocate memory for the compressed output\n");
+        exit(1);
+    }
+#else
+    printf("The compressed output (OUT_FORMAT: ZIP) requires zlib: not available in this build\n");
+    exit(1);
+#endif
+}
+
+void Zip_work_free(
+    struct Zip_work *p_zw)
+{
+    free(p_zw->v);
+    free(p_zw->raw);
+    free(p_zw->shuf);
+    free(p_zw->zbuf);
+    free(p_zw->out.rr_h);
+}
+
+static void shuffle(
+    const unsigned char *raw,
+    unsigned char *shuf,
+    size_t n,
+    int width)
+{
+    /* the words (width bytes, least significant first) into width byte planes */
+    for (int b = 0; b < width; b++)
+    {
+        unsigned char *plane = shuf + (size_t)b * n;
+        const unsigned char *w = raw + b;
+        for (size_t i = 0; i < n; i++)
+        {
+            plane[i] = w[(size_t)i * width];
+        }
+    }
+}
+
+static void unshuffle(
+    const unsigned char *shuf,
+    unsigned char *raw,
+    size_t n,
+    int width)
+{
+    for (int b = 0; b < width; b++)
+    {
+        const unsigned char *plane = shuf + (size_t)b * n;
+        unsigned char *w = raw + b;
+        for (size_t i = 0; i < n; i++)
+        {
+            w[(size_t)i * width] = plane[i];
+        }
+    }
+}
+
+static void word_put(
+    unsigned char *p,
+    unsigned long long w,
+    int width)
+{
+    /* the word, least significant byte first (independent of the byte order) */
+    for (int b = 0; b < width; b++)
+    {
+        p[b] = (unsigned char)(w >> (8 * b));
+    }
+}
+
+static unsigned long long word_get(
+    const unsigned char *p,
+    int width)
+{
+    unsigned long long w = 0;
+    for (int b = width - 1; b >= 0; b--)
+    {
+        w = (w << 8) | p[b];
+    }
+    return w;
+}
+
+void Zip_block_pack(
+    struct df_rr_h *p_rrh,
+    struct Para_global *p_gp,
+    struct df_rr_d *p_rrd,
+    struct kNN_day *p_day,
+    int ndays,
+    struct Zip_work *p_zw,
+    struct Zip_block *p_zb)
+{
+    /**************
+     * Description:
+     *      disaggregate ndays target days with their RUN sampled fragments,
+     *      code and compress them into one block; safe to call from parallel threads
+     * Parameters:
+     *      p_rrd, p_day: the first target day and its candidate selection (kNN_day_select())
+     *      p_zw: scratch buffers, private to the calling thread
+     *      p_zb: the block, written later in the date order (Zip_block_write())
+     * ************/
+#ifdef HAVE_ZLIB
+    int N = p_gp->N_STATION;
+    int RUN = p_gp->RUN;
+    size_t n = (size_t)RUN * N * 24 * ndays;
+    double *v = p_zw->v;
+    struct df_rr_h *p_out = &p_zw->out;
+    int j, h, k, t;
+
+    /* [run][station][day][hour] */
+    for (k = 0; k < ndays; k++)
+    {
+        p_zb->date[k] = date_key((p_rrd + k)->date);
+        p_out->date = (p_rrd + k)->date;
+        p_out->rr_d = (p_rrd + k)->p_rr;
+        for (t = 0; t < RUN; t++)
+        {
+            if ((p_day + k)->n_can < 0)
+            {
+                // dark day: no sunshine (or solar radiation) at any site
+                for (j = 0; j < N; j++)
+                {
+                    for (h = 0; h < 24; h++)
+                    {
+                        p_out->rr_h[j][h] = 0.0;
+                    }
+                }
+            } else {
+                Fragment_assign(p_rrh, p_out, p_gp, (p_day + k)->fragment[t]);
+            }
+            for (j = 0; j < N; j++)
+            {
+                memcpy(v + (((size_t)t * N + j) * ndays + k) * 24, p_out->rr_h[j], sizeof(double) * 24);
+            }
+        }
+    }
+
+    /* scaled integers: delta and zigzag coded, 4 planes */
+    int width = 4;
+    unsigned int prev = 0;
+    size_t i;
+    for (i = 0; i < n; i++)
+    {
+        int q;
+        if (!Value_scaled(v[i], &q))
+        {
+            break;
+        }
+        unsigned int d = (unsigned int)q - prev;    // modulo 2^32
+        prev = (unsigned int)q;
+        word_put(p_zw->raw + i * 4, (d << 1) ^ (0U - (d >> 31)), 4);
+    }
+    p_zb->hd.flags = 0;
+    if (i < n)
+    {
+        /* a value does not fit: the doubles, 8 planes */
+        width = 8;
+        p_zb->hd.flags = 1;
+        for (i = 0; i < n; i++)
+        {
+            unsigned long long w;
+            memcpy(&w, v + i, sizeof(double));
+            word_put(p_zw->raw + i * 8, w, 8);
+        }
+    }
+    shuffle(p_zw->raw, p_zw->shuf, n, width);
+
+    uLongf z_len = (uLongf)p_zw->zcap;
+    if (compress2(p_zw->zbuf, &z_len, p_zw->shuf, (uLong)(n * width), ZIP_LEVEL) != Z_OK)
+    {
+        printf("Program terminated: the compression of the output failed\n");
+        exit(2);
+    }
+    if (p_zb->cap < z_len)
+    {
+        p_zb->cap = z_len + z_len / 4;
+        free(p_zb->z);
+        if ((p_zb->z = (unsigned char *)malloc(p_zb->cap)) == NULL)
+        {
+            printf("Program terminated: cannot allocate memory for the compressed output\n");
+            exit(1);
+        }
+    }
+    memcpy(p_zb->z, p_zw->zbuf, z_len);
+    memcpy(p_zb->hd.magic, "kzb", 4);
+    p_zb->hd.ndays = ndays;
+    p_zb->hd.reserved = 0;
+    p_zb->hd.raw_size = (unsigned long long)n * width;
+    p_zb->hd.z_size = z_len;
+#endif
+}
+
+void Zip_block_write(
+    struct Zip_block *p_zb,
+    struct Out_buffer *p_ob)
+{
+    /**************
+     * Description:
+     *      append a packed block to the output, in the date order
+     * ************/
+    Out_buffer_write(p_ob, &p_zb->hd, sizeof(struct Zip_block_header));
+    Out_buffer_write(p_ob, p_zb->date, sizeof(int) * p_zb->hd.ndays);
+    Out_buffer_write(p_ob, p_zb->z, p_zb->hd.z_size);
+}
+
+FILE *Zip_file_open(
+    char fname[],
+    struct Zip_header *p_hd)
+{
+    /**************
+     * Description:
+     *      open a compressed output for reading and check its header
+     * Parameters:
+     *      fname: the file; "-": the standard input
+     * Return:
+     *      the file, positioned at the first block; NULL: not a compressed output (of this byte order)
+     * ************/
+    FILE *fp = (strcmp(fname, "-") == 0) ? stdin : fopen(fname, "rb");
+    if (fp == NULL)
+    {
+        return NULL;
+    }
+    if (fread(p_hd, sizeof(struct Zip_header), 1, fp) != 1 ||
+        memcmp(p_hd->magic, ZIP_MAGIC, 8) != 0 || p_hd->version != ZIP_VERSION ||
+        p_hd->byte_order != 0x01020304 || p_hd->N < 1 || p_hd->RUN < 1 || p_hd->days_block < 1)
+    {
+        if (fp != stdin)
+        {
+            fclose(fp);
+        }
+        return NULL;
+    }
+    return fp;
+}
+
+void Zip_to_CSV(
+    FILE *fp_in,
+    struct Zip_header *p_hd,
+    FILE *fp_out)
+{
+    /**************
+     * Description:
+     *      decode the compressed output block by block and write it in the CSV output layout
+     *      (rows run,y,m,d,h,values; the days in order, then the runs)
+     * Parameters:
+     *      fp_in: the compressed output after its header (Zip_file_open())
+     * ************/
+#ifdef HAVE_ZLIB
+    int N = p_hd->N;
+    int RUN = p_hd->RUN;
+    size_t n_max = (size_t)RUN * N * 24 * p_hd->days_block;
+    unsigned char *shuf = (unsigned char *)malloc(8 * n_max);
+    unsigned char *raw = (unsigned char *)malloc(8 * n_max);
+    double *v = (double *)malloc(sizeof(double) * n_max);
+    int *date = (int *)malloc(sizeof(int) * p_hd->days_block);
+    unsigned char *z = NULL;
+    size_t z_cap = 0;
+    struct df_rr_h out;
+    struct Out_buffer ob;
+    struct Zip_block_header bh;
+    if (shuf == NULL || raw == NULL || v == NULL || date == NULL)
+    {
+        printf("Program terminated: cannot allocate memory\n");
+        exit(1);
+    }
+    out.rr_h = calloc(N, sizeof(double) * 24);
+    Out_buffer_open(&ob, fp_out, N);
+    while (fread(&bh, sizeof(struct Zip_block_header), 1, fp_in) == 1)
+    {
+        int nd = bh.ndays;
+        int width = (bh.flags == 1) ? 8 : 4;
+        size_t n = (size_t)RUN * N * 24 * nd;
+        if (memcmp(bh.magic, "kzb", 4) != 0 || nd < 1 || nd > p_hd->days_block ||
+            (bh.flags != 0 && bh.flags != 1) || bh.raw_size != (unsigned long long)n * width)
+        {
+            printf("Program terminated: the compressed output is corrupt\n");
+            exit(1);
+        }
+        if (z_cap < bh.z_size)
+        {
+            z_cap = bh.z_size;
+            free(z);
+            z = (unsigned char *)malloc(z_cap);
+        }
+        uLongf raw_len = (uLongf)bh.raw_size;
+        if (z == NULL || fread(date, sizeof(int), nd, fp_in) != (size_t)nd ||
+            fread(z, 1, bh.z_size, fp_in) != bh.z_size ||
+            uncompress(shuf, &raw_len, z, (uLong)bh.z_size) != Z_OK || raw_len != bh.raw_size)
+        {
+            printf("Program terminated: the compressed output is truncated or corrupt\n");
+            exit(1);
+        }
+        unshuffle(shuf, raw, n, width);
+        if (width == 4)
+        {
+            unsigned int prev = 0;
+            for (size_t i = 0; i < n; i++)
+            {
+                unsigned int zz = (unsigned int)word_get(raw + i * 4, 4);
+                prev += (zz >> 1) ^ (0U - (zz & 1));
+                int q = (int)prev;
+                v[i] = (q == INT_MIN) ? -0.0 : q / 100.0;
+            }
+        } else {
+            for (size_t i = 0; i < n; i++)
+            {
+                unsigned long long w = word_get(raw + i * 8, 8);
+                memcpy(v + i, &w, sizeof(double));
+            }
+        }
+        for (int k = 0; k < nd; k++)
+        {
+            out.date.y = date[k] / 10000;
+            out.date.m = date[k] / 100 % 100;
+            out.date.d = date[k] % 100;
+            for (int t = 0; t < RUN; t++)
+            {
+                for (int j = 0; j < N; j++)
+                {
+                    memcpy(out.rr_h[j], v + (((size_t)t * N + j) * nd + k) * 24, sizeof(double) * 24);
+                }
+                Write_df_rr_h(&out, NULL, &ob, t + 1);
+            }
+        }
+    }
+    Out_buffer_close(&ob);
+    free(out.rr_h);
+    free(shuf);
+    free(raw);
+    free(v);
+    free(date);
+    free(z);
+#else
+    printf("The compressed output (OUT_FORMAT: ZIP) requires zlib: not available in this build\n");
+    exit(1);
+#endif
+}
@@ -0,0 +1,50 @@
+#ifndef FUNC_ZIP
+#define FUNC_ZIP
+
+int Zip_days(
+    struct Para_global *p_gp
+);
+
+void Zip_out_header(
+    struct Para_global *p_gp,
+    int days_block,
+    struct Out_buffer *p_ob
+);
+
+void Zip_work_init(
+    struct Para_global *p_gp,
+    int days_block,
+    struct Zip_work *p_zw
+);
+
+void Zip_work_free(
+    struct Zip_work *p_zw
+);
+
+void Zip_block_pack(
+    struct df_rr_h *p_rrh,
+    struct Para_global *p_gp,
+    struct df_rr_d *p_rrd,
+    struct kNN_day *p_day,
+    int ndays,
+    struct Zip_work *p_zw,
+    struct Zip_block *p_zb
+);
+
+void Zip_block_write(
+    struct Zip_block *p_zb,
+    struct Out_buffer *p_ob
+);
+
+FILE *Zip_file_open(
+    char fname[],
+    struct Zip_header *p_hd
+);
+
+void Zip_to_CSV(
+    FILE *fp_in,
+    struct Zip_header *p_hd,
+    FILE *fp_out
+);
+
+#endif
@@ -11,11 +11,15 @@
  *               and hourly rainfall data to provide fragments
  *               write data: write the outputed hourly data into ASCII-format file
  * DESCRIP-END.
- * FUNCTIONS:    import_global(); removeLeadingSpaces(); import_dfrr_d(); import_dfrr_h()
- *               import_df_cp(); Write_df_rr_h();
+ * FUNCTIONS:    import_global(); Para_global_default(); Para_global_line(); removeLeadingSpaces();
+ *               import_dfrr_d(); import_dfrr_h(); import_df_cp(); calloc_aligned(); free_aligned();
+ *               Write_df_rr_h(); Write_hours(); Write_SIMI(); Write_index();
+ *               Format_SIMI(); Format_SIMI_day();
+ *               Day_stream_open(); Day_stream_read(); Day_stream_close(); Value_scaled();
  *
  * COMMENTS:
- *
+ * the output is formatted by hand into a large user-space buffer (Out_buffer),
+ * byte-identical to the former fprintf("%.2f") output
  *
  */
 
@@ -30,9 +34,245 @@
 #include <string.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <math.h>
+#include <limits.h>
+#ifdef _WIN32
+#include <malloc.h>
+#endif
 
 #include "def_struct.h"
 #include "Func_dataIO.h"
+#include "Func_Writer.h"
+#include "Func_CSV.h"
+
+void Para_global_default(
+    struct Para_global *p_gp)
+{
+    /**************
+     * Description:
+     *      the default values of the optional global parameters
+     * ************/
+    memset(p_gp, 0, sizeof(struct Para_global));
+    p_gp->PREPROCESS = 0;
+    strcpy(p_gp->T_CP, "FALSE");
+    strcpy(p_gp->MONTH, "TRUE");
+    strcpy(p_gp->SEASON, "FALSE");
+    strcpy(p_gp->FP_SSIM, "FALSE");
+    strcpy(p_gp->SSIM_LEVEL, "FULL");
+    strcpy(p_gp->FP_CACHE, "FALSE");
+    strcpy(p_gp->STREAM, "FALSE");
+    strcpy(p_gp->OUT_FORMAT, "CSV");
+    p_gp->CONTINUITY = 1;
+    p_gp->RUN = 1;
+    p_gp->THREADS = 1;
+    p_gp->SEED = 1;
+}
+
+static char *field_next(
+    char **rest,
+    const char *delim)
+{
+    /* the next field of a row, as strtok(), but reentrant: the position is kept in rest */
+    char *p = *rest, *e;
+    if (p == NULL)
+    {
+        return NULL;
+    }
+    p += strspn(p, delim);
+    if (*p == '\0')
+    {
+        *rest = NULL;
+        return NULL;
+    }
+    e = p + strcspn(p, delim);
+    if (*e != '\0')
+    {
+        *e++ = '\0';
+    }
+    *rest = e;
+    return p;
+}
+
+int Para_global_line(
+    char row[],
+    struct Para_global *p_gp)
+{
+    /**************
+     * Description:
+     *      assign one row of the global parameter file (key,value): 
+     *      leading spaces and comments (after #) are skipped; the row is modified
+     * Return:
+     *      0: assigned, or an empty (comment) row; -1: unrecognized key or no value
+     * ************/
+    char *token, *token2, *rest = row;
+    int i;
+    removeLeadingSpaces(row);
+    if (strlen(row) <= 1 || row[0] == '#')
+    {
+        return 0;
+    }
+    for (i = 0; i < strlen(row); i++)
+    {
+        /* remove (or hide) all the characters after # */
+        if (row[i] == '#')
+        {
+            row[i] = '\0';
+            break;
+        }
+    }
+    /* assign the values to the parameter structure: key-value pairs */
+    token = field_next(&rest, ",");         // the first column: key
+    token2 = field_next(&rest, ",\r\n");    // the second column: value
+    if (token == NULL || token2 == NULL)
+    {
+        return -1;
+    }
+    /*******
+     * file path and names
+     * *****/
+    if (strncmp(token, "FP_DAILY", 8) == 0)
+    {
+        strcpy(p_gp->FP_DAILY, token2);
+    }
+    else if (strncmp(token, "FP_CP", 5) == 0)
+    {
+        strcpy(p_gp->FP_CP, token2);
+    }
+    else if (strncmp(token, "FP_HOURLY", 9) == 0)
+    {
+        strcpy(p_gp->FP_HOURLY, token2);
+    }
+    else if (strncmp(token, "FP_OUT", 6) == 0)
+    {
+        strcpy(p_gp->FP_OUT, token2);
+    }
+    else if (strncmp(token, "FP_LOG", 6) == 0)
+    {
+        strcpy(p_gp->FP_LOG, token2);
+    }
+    else if (strncmp(token, "FP_SSIM", 7) == 0)
+    {
+        strcpy(p_gp->FP_SSIM, token2);
+    }
+    else if (strncmp(token, "SSIM_LEVEL", 10) == 0)
+    {
+        strcpy(p_gp->SSIM_LEVEL, token2);
+    }
+    else if (strncmp(token, "FP_CACHE", 8) == 0)
+    {
+        strcpy(p_gp->FP_CACHE, token2);
+    }
+    else if (strncmp(token, "OUT_FORMAT", 10) == 0)
+    {
+        strcpy(p_gp->OUT_FORMAT, token2);
+    }
+    else if (strncmp(token, "STREAM", 6) == 0)
+    {
+        strcpy(p_gp->STREAM, token2);
+    }
+    else if (strncmp(token, "SIMI", 4) == 0)
+    {
+        strcpy(p_gp->SIMILARITY, token2);
+    }
+    /******
+     * covaruate variable
+     * ****/
+    // else if (strncmp(token, "FP_COV_DLY", 10) == 0)
+    // {
+    //     strcpy(p_gp->FP_COV_DLY, token2);
+    // }
+    // else if (strncmp(token, "FP_COV_HLY", 10) == 0)
+    // {
+    //     strcpy(p_gp->FP_COV_HLY, token2);
+    // }
+    /******
+     * disaggregation parameter
+     * ****/
+    else if (strncmp(token, "VAR", 3) == 0)
+    {
+        p_gp->VAR = atoi(token2); // indicate the variable type: temperature,rhu, wind, ...
+    }
+    else if (strncmp(token, "N_STATION", 9) == 0)
+    {
+        p_gp->N_STATION = atoi(token2);
+    }
+    else if (strncmp(token, "MONTH", 9) == 0)
+    {
+        strcpy(p_gp->MONTH, token2);
+    }
+    else if (strncmp(token, "SEASON", 6) == 0)
+    {
+        strcpy(p_gp->SEASON, token2);
+    }
+    else if (strncmp(token, "SUMMER_FROM", 11) == 0)
+    {
+        p_gp->SUMMER_FROM = atoi(token2);
+    }
+    else if (strncmp(token, "SUMMER_TO", 9) == 0)
+    {
+        p_gp->SUMMER_TO = atoi(token2);
+    }
+    else if (strncmp(token, "T_CP", 4) == 0)
+    {
+        strcpy(p_gp->T_CP, token2);
+    }
+    else if (strncmp(token, "CONTINUITY", 10) == 0)
+    {
+        p_gp->CONTINUITY = atoi(token2);
+    }
+    else if (strncmp(token, "NODATA", 6) == 0)
+    {
+        p_gp->NODATA = atof(token2);
+    }
+    else if (strncmp(token, "RUN", 3) == 0)
+    {
+        p_gp->RUN = atof(token2);
+    }
+    else if (strncmp(token, "THREADS", 7) == 0)
+    {
+        p_gp->THREADS = atoi(token2);
+    }
+    else if (strncmp(token, "SEED", 4) == 0)
+    {
+        p_gp->SEED = strtoull(token2, NULL, 10);
+    }
+    else if (strncmp(token, "PREP", 4) == 0)
+    {
+        p_gp->PREPROCESS = atof(token2);
+    }
+    /*******
+     * SSIM parameter
+     * *****/
+    else if (strncmp(token, "SSIM_K", 6) == 0)
+    {
+        char *v1 = field_next(&rest, ",\r");
+        char *v2 = field_next(&rest, ",\r\n");
+        if (v1 == NULL || v2 == NULL)
+        {
+            return -1;
+        }
+        p_gp->k[0] = atof(token2);
+        p_gp->k[1] = atof(v1);
+        p_gp->k[2] = atof(v2);
+    }
+    else if (strncmp(token, "SSIM_POWER", 10) == 0)
+    {
+        char *v1 = field_next(&rest, ",\r");
+        char *v2 = field_next(&rest, ",\r\n");
+        if (v1 == NULL || v2 == NULL)
+        {
+            return -1;
+        }
+        p_gp->power[0] = atof(token2);
+        p_gp->power[1] = atof(v1);
+        p_gp->power[2] = atof(v2);
+    }
+    else
+    {
+        return -1;
+    }
+    return 0;
+}
 
 void import_global(
     char fname[], struct Para_global *p_gp)
@@ -47,19 +287,10 @@ void import_global(
      * ********************/
 
     /***** initializae *****/
-    p_gp->PREPROCESS = 0;
-    strcpy(p_gp->T_CP, "FALSE");
-    strcpy(p_gp->MONTH, "TRUE");
-    strcpy(p_gp->SEASON, "FALSE");
-    strcpy(p_gp->FP_SSIM, "FALSE");
-    p_gp->CONTINUITY = 1;
-    p_gp->RUN = 1;
+    Para_global_default(p_gp);
 
     char row[MAXCHAR];
     FILE *fp;
-    char *token;
-    char *token2;
-    int i;
 
     if ((fp = fopen(fname, "r")) == NULL)
     {
@@ -71,143 +302,11 @@ void import_global(
     {
         // the fgets() function comes from <stdbool.h>
         // Reads characters from stream and stores them as a C string
-
-        /***
-         * removeLeadingSpaces():
-         * remove all the leading white spaces in the string if exist,
-         * otherwise do nothing!
-         */
-        removeLeadingSpaces(row);
-
-        if (row != NULL && strlen(row) > 1)
+        if (Para_global_line(row, p_gp) != 0)
         {
-            /*non-empty row(string)*/
-            if (row[0] != '#')
-            {
-                /* the first character of row should not be # */
-                for (i = 0; i < strlen(row); i++)
-                {
-                    /* remove (or hide) all the characters after # */
-                    if (row[i] == '#')
-                    {
-                        row[i] = '\0';
-                        break;
-                    }
-                }
-                /* assign the values to the parameter structure: key-value pairs */
-                token = strtok(row, ",");       // the first column: key
-                token2 = strtok(NULL, ",\r\n"); // the second column: value
-                /*******
-                 * file path and names
-                 * *****/
-                if (strncmp(token, "FP_DAILY", 8) == 0)
-                {
-                    strcpy(p_gp->FP_DAILY, token2);
-                }
-                else if (strncmp(token, "FP_CP", 5) == 0)
-                {
-                    strcpy(p_gp->FP_CP, token2);
-                }
-                else if (strncmp(token, "FP_HOURLY", 9) == 0)
-                {
-                    strcpy(p_gp->FP_HOURLY, token2);
-                }
-                else if (strncmp(token, "FP_OUT", 6) == 0)
-                {
-                    strcpy(p_gp->FP_OUT, token2);
-                }
-                else if (strncmp(token, "FP_LOG", 6) == 0)
-                {
-                    strcpy(p_gp->FP_LOG, token2);
-                }
-                else if (strncmp(token, "FP_SSIM", 7) == 0)
-                {
-                    strcpy(p_gp->FP_SSIM, token2);
-                }
-                else if (strncmp(token, "SIMI", 4) == 0)
-                {
-                    strcpy(p_gp->SIMILARITY, token2);
-                }
-                /******
-                 * covaruate variable
-                 * ****/
-                // else if (strncmp(token, "FP_COV_DLY", 10) == 0)
-                // {
-                //     strcpy(p_gp->FP_COV_DLY, token2);
-                // }
-                // else if (strncmp(token, "FP_COV_HLY", 10) == 0)
-                // {
-                //     strcpy(p_gp->FP_COV_HLY, token2);
-                // }
-                /******
-                 * disaggregation parameter
-                 * ****/
-                else if (strncmp(token, "VAR", 3) == 0)
-                {
-                    p_gp->VAR = atoi(token2); // indicate the variable type: temperature,rhu, wind, ...
-                }
-                else if (strncmp(token, "N_STATION", 9) == 0)
-                {
-                    p_gp->N_STATION = atoi(token2);
-                }
-                else if (strncmp(token, "MONTH", 9) == 0)
-                {
-                    strcpy(p_gp->MONTH, token2);
-                }
-                else if (strncmp(token, "SEASON", 6) == 0)
-                {
-                    strcpy(p_gp->SEASON, token2);
-                }
-                else if (strncmp(token, "SUMMER_FROM", 11) == 0)
-                {
-                    p_gp->SUMMER_FROM = atoi(token2);
-                }
-                else if (strncmp(token, "SUMMER_TO", 9) == 0)
-                {
-                    p_gp->SUMMER_TO = atoi(token2);
-                }
-                else if (strncmp(token, "T_CP", 4) == 0)
-                {
-                    strcpy(p_gp->T_CP, token2);
-                }
-                else if (strncmp(token, "CONTINUITY", 10) == 0)
-                {
-                    p_gp->CONTINUITY = atoi(token2);
-                }
-                else if (strncmp(token, "NODATA", 6) == 0)
-                {
-                    p_gp->NODATA = atof(token2);
-                }
-                else if (strncmp(token, "RUN", 3) == 0)
-                {
-                    p_gp->RUN = atof(token2);
-                }
-                else if (strncmp(token, "PREP", 4) == 0)
-                {
-                    p_gp->PREPROCESS = atof(token2);
-                }
-                /*******
-                 * SSIM parameter
-                 * *****/
-                else if (strncmp(token, "SSIM_K", 6) == 0)
-                {
-                    p_gp->k[0] = atof(token2);
-                    p_gp->k[1] = atof(strtok(NULL, ",\r"));
-                    p_gp->k[2] = atof(strtok(NULL, ",\r\n"));
-                }
-                else if (strncmp(token, "SSIM_POWER", 10) == 0)
-                {
-                    p_gp->power[0] = atof(token2);
-                    p_gp->power[1] = atof(strtok(NULL, ",\r"));
-                    p_gp->power[2] = atof(strtok(NULL, ",\r\n"));
-                }
-                else
-                {
-                    printf(
-                        "Error in opening global parameter file: unrecognized parameter field! %s", token);
-                    exit(1);
-                }
-            }
+            printf(
+                "Error in opening global parameter file: unrecognized parameter field! %s", row);
+            exit(1);
         }
     }
     fclose(fp);    
@@ -237,7 +336,8 @@ void removeLeadingSpaces(char *str)
 int import_dfrr_d(
     char FP_daily[],
     int N_STATION,
-    struct df_rr_d *p_rr_d)
+    int THREADS,
+    struct df_rr_d **p_rr_d)
 {
     /**************
      * Main:
@@ -245,157 +345,274 @@ int import_dfrr_d(
      * Parameters:
      *  FP_daily: a string, storing the file path and name of daily rr data file
      *  N_STATION: the number of rainfall stations in disaggrgeation
-     *  p_rr_d: name of structure df_rr_d array
+     *  THREADS: the number of threads parsing the rows
+     *  p_rr_d: structure df_rr_d array, allocated here (one element per row)
      * Return:
      *  output the number of days (rows)
+     * Memory:
+     *  the daily values of all the rows live in one contiguous block [nrow][N_STATION];
+     *  p_rr of each df_rr_d is a view into it
      * ****************/
-    FILE *fp_d;
-    if ((fp_d = fopen(FP_daily, "r")) == NULL)
+    struct CSV_file csv;
+    int r;
+    if ((r = CSV_open(FP_daily, &csv)) != 0)
     {
-        printf("Cannot open daily data file: %s\n", FP_daily);
+        if (r == -2)
+        {
+            printf("Program terminated: cannot allocate memory for the daily data\n");
+        } else {
+            printf("Cannot open daily data file: %s\n", FP_daily);
+        }
         exit(1);
     }
-    // struct df_rr_d df_rr_daily[10000];
-    char *token;
-    char row[MAXCHAR];
-    int i, j;
-    i = 0; // record the number of rows in the data file
-    while (fgets(row, MAXCHAR, fp_d) != NULL)
+    int nrow = csv.nrow;
+    int n_threads = (THREADS > 0) ? THREADS : 1;
+    int bad = -1;   // the first incomplete row
+    double *lib_d;  // [nrow][N_STATION]
+    lib_d = (double *)calloc_aligned((size_t)nrow * N_STATION, sizeof(double));
+    *p_rr_d = (struct df_rr_d *)calloc_aligned(nrow, sizeof(struct df_rr_d));
+    if (lib_d == NULL || *p_rr_d == NULL)
     {
-        (p_rr_d + i)->date.y = atoi(strtok(row, ",")); // df_rr_daily[i].
-        (p_rr_d + i)->date.m = atoi(strtok(NULL, ","));
-        (p_rr_d + i)->date.d = atoi(strtok(NULL, ","));
-        (p_rr_d + i)->p_rr = (double *)malloc(N_STATION * sizeof(double));
+        printf("Program terminated: cannot allocate memory for the daily data\n");
+        exit(1);
+    }
 
-        for (j = 0; j < N_STATION; j++)
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) num_threads(n_threads)
+#endif
+    for (int i = 0; i < nrow; i++)
+    {
+        const char *p = csv.data + csv.row[i];
+        const char *end = csv.data + csv.row[i + 1];
+        struct df_rr_d *p_d = *p_rr_d + i;
+        p_d->p_rr = lib_d + (size_t)i * N_STATION;
+        p = CSV_int(p, end, &p_d->date.y);
+        if (p != NULL) p = CSV_int(p, end, &p_d->date.m);
+        if (p != NULL) p = CSV_int(p, end, &p_d->date.d);
+        for (int j = 0; j < N_STATION && p != NULL; j++)
         {
-            token = strtok(NULL, ",");
-            *((p_rr_d + i)->p_rr + j) = atof(token);
+            p = CSV_double(p, end, p_d->p_rr + j);
+        }
+        if (p == NULL)
+        {
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+            if (bad < 0 || i < bad)
+            {
+                bad = i;
+            }
         }
-        i++;
     }
-    fclose(fp_d);
-    return i;
+    CSV_close(&csv);
+    if (bad >= 0)
+    {
+        printf("Program terminated: row %d of daily data file %s has less than %d values\n",
+               bad + 1, FP_daily, N_STATION);
+        exit(1);
+    }
+    return nrow;
 }
 
-int import_df_cp(
-    char fname[],
-    struct df_cp *p_df_cp)
+void Day_stream_open(
+    char FP_daily[],
+    struct Day_stream *p_ds)
 {
-    /*********************
-     * Main function:
-     *     import the circulation pattern classification results
+    /**************
+     * Description:
+     *      open the daily data for reading row by row (STREAM)
      * Parameters:
-     *     fname: the file path, together with the file name of CP data
-     * Return:
-     *     bring back struct array of cp data to main() function;
-     *     the return value of the function: the number of rows in the data file
-     *********************/
-    FILE *fp_cp;
-    char row[MAXCHAR];
-    char *token;
-    int j = 0; // from the first row
-    if ((fp_cp = fopen(fname, "r")) == NULL)
+     *      FP_daily: the file path and name; "-": the standard input
+     *      p_ds: the opened stream
+     * ************/
+    if (strcmp(FP_daily, "-") == 0)
+    {
+        p_ds->fp = stdin;
+    }
+    else if ((p_ds->fp = fopen(FP_daily, "r")) == NULL)
     {
-        printf("Cannot open cp data file: %s\n", fname);
+        printf("Cannot open daily data file: %s\n", FP_daily);
         exit(1);
     }
-    while (fgets(row, MAXCHAR, fp_cp) != NULL)
+    p_ds->fname = FP_daily;
+    p_ds->cap = MAXCHAR;
+    p_ds->line = (char *)malloc(p_ds->cap);
+    p_ds->row = 0;
+    if (p_ds->line == NULL)
     {
-        // the fgets() function comes from <stdbool.h>
-        // Reads characters from stream and stores them as a C string
-        token = strtok(row, ",");
-        p_df_cp[j].date.y = atoi(token);
-        p_df_cp[j].date.m = atoi(strtok(NULL, ","));
-        p_df_cp[j].date.d = atoi(strtok(NULL, ","));
-        p_df_cp[j].cp = atoi(strtok(NULL, ","));
-        j++;
-    }
-    fclose(fp_cp);
-    return j; // the number of rows; the last row is null
+        printf("Program terminated: cannot allocate memory for the daily data\n");
+        exit(1);
+    }
 }
 
-int import_dfrr_h(
-    int VAR,
-    char FP_hourly[],
+int Day_stream_read(
+    struct Day_stream *p_ds,
     int N_STATION,
-    struct df_rr_h *p_rr_h)
+    struct df_rr_d *p_day)
 {
     /**************
-     * Main:
-     *  import hourly rainfall observations into memory
+     * Description:
+     *      read and parse the next row of the daily data: y,m,d and N_STATION values,
+     *      in the same way as import_dfrr_d()
      * Parameters:
-     *  FP_hourly: a string, storing the file path and name of hourly rr data file
-     *  N_STATION: the number of rainfall stations in disaggrgeation
-     *  p_rr_h: name of structure df_rr_h array
+     *      p_day: the day (date and p_rr, allocated by the caller)
      * Return:
-     *  output the number of hourly observation days
-     * ****************/
-    // char FP_hourly[]="D:/kNN_MOF_cp/data/rr_obs_hourly.csv";
-    FILE *fp_h;
-    if ((fp_h = fopen(FP_hourly, "r")) == NULL)
+     *      1: a day is read; 0: the end of the data
+     * ************/
+    size_t len = 0;
+    const char *p, *end;
+    while (fgets(p_ds->line + len, (int)(p_ds->cap - len), p_ds->fp) != NULL)
+    {
+        len += strlen(p_ds->line + len);
+        if (len > 0 && p_ds->line[len - 1] == '\n')
+        {
+            break;
+        }
+        if (len + 1 >= p_ds->cap)
+        {
+            // the row is longer than the buffer: double it and read on
+            p_ds->cap *= 2;
+            p_ds->line = (char *)realloc(p_ds->line, p_ds->cap);
+            if (p_ds->line == NULL)
+            {
+                printf("Program terminated: cannot allocate memory for the daily data\n");
+                exit(1);
+            }
+        }
+    }
+    if (len == 0)
+    {
+        return 0;
+    }
+    p_ds->row++;
+    p = p_ds->line;
+    end = p_ds->line + len;
+    p = CSV_int(p, end, &p_day->date.y);
+    if (p != NULL) p = CSV_int(p, end, &p_day->date.m);
+    if (p != NULL) p = CSV_int(p, end, &p_day->date.d);
+    for (int j = 0; j < N_STATION && p != NULL; j++)
+    {
+        p = CSV_double(p, end, p_day->p_rr + j);
+    }
+    if (p == NULL)
     {
-        printf("Cannot open hourly data file: %s\n", FP_hourly);
+        printf("Program terminated: row %d of daily data file %s has less than %d values\n",
+               p_ds->row, p_ds->fname, N_STATION);
         exit(1);
     }
-    char *token;
-    char row[MAXCHAR];
-    int j, h, nrow_total, ndays;
-    int i = 0;
+    return 1;
+}
 
-    struct df_rr_h *p_df_rr_h; // pointer of df_rr_h; for iteration
-    p_df_rr_h = p_rr_h;        // initialize
-    while (fgets(row, MAXCHAR, fp_h) != NULL)
+void Day_stream_close(
+    struct Day_stream *p_ds)
+{
+    if (p_ds->fp != stdin)
     {
-        if (i % 24 == 0)
+        fclose(p_ds->fp);
+    }
+    free(p_ds->line);
+    p_ds->line = NULL;
+}
+
+int import_df_cp(
+    char fname[],
+    struct df_cp **p_df_cp,
+    char *msg,
+    size_t msg_len)
+{
+    /*********************
+     * Main function:
+     *     import the circulation pattern classification results
+     * Parameters:
+     *     fname: the file path, together with the file name of CP data
+     *     p_df_cp: the struct array of cp data, allocated here (one element per row)
+     *     msg, msg_len: the reason of a failure (-1), not printed here; msg NULL: not kept
+     * Return:
+     *     bring back struct array of cp data to main() function;
+     *     the return value of the function: the number of rows in the data file;
+     *     -1: the file cannot be read, a row is incomplete or its cp is less than 1 (nothing allocated);
+     *     -2: out of memory (nothing allocated)
+     *********************/
+    struct CSV_file csv;
+    int j;
+    if ((j = CSV_open(fname, &csv)) != 0)
+    {
+        if (j == -2)
         {
-            /* %: remainder after division (modulo division)*/
-            (p_df_rr_h->date).y = atoi(strtok(row, ","));
-            (p_df_rr_h->date).m = atoi(strtok(NULL, ","));
-            (p_df_rr_h->date).d = atoi(strtok(NULL, ","));
-            p_df_rr_h->rr_h = calloc(N_STATION, sizeof(double) * 24); // allocate memory (stack)
+            return -2;
         }
-        else
+        if (msg != NULL)
         {
-            // just skip the date (y, m, d)
-            token = strtok(row, ",");
-            token = strtok(NULL, ",");
-            token = strtok(NULL, ",");
+            snprintf(msg, msg_len, "cannot open cp data file: %s", fname);
         }
-        h = atoi(strtok(NULL, ","));
-        for (j = 0; j < N_STATION; j++)
+        return -1;
+    }
+    *p_df_cp = (struct df_cp *)calloc(csv.nrow > 0 ? csv.nrow : 1, sizeof(struct df_cp));
+    if (*p_df_cp == NULL)
+    {
+        CSV_close(&csv);
+        return -2;
+    }
+    for (j = 0; j < csv.nrow; j++)
+    {
+        const char *p = csv.data + csv.row[j];
+        const char *end = csv.data + csv.row[j + 1];
+        struct df_cp *p_cp = *p_df_cp + j;
+        p = CSV_int(p, end, &p_cp->date.y);
+        if (p != NULL) p = CSV_int(p, end, &p_cp->date.m);
+        if (p != NULL) p = CSV_int(p, end, &p_cp->date.d);
+        if (p != NULL) p = CSV_int(p, end, &p_cp->cp);
+        if (p == NULL)
         {
-            token = strtok(NULL, ",");
-            *(*(p_df_rr_h->rr_h + j) + h) = atof(token);
+            if (msg != NULL)
+            {
+                snprintf(msg, msg_len, "row %d of cp data file %s is incomplete", j + 1, fname);
+            }
+            CSV_close(&csv);
+            free(*p_df_cp);
+            *p_df_cp = NULL;
+            return -1;
         }
-        if (i % 24 == 23)
+        if (p_cp->cp < 1)
         {
-            p_df_rr_h++;
+            /* the classes are numbered from 1 (classify_day()) */
+            if (msg != NULL)
+            {
+                snprintf(msg, msg_len, "row %d of cp data file %s: cp %d is not 1 or more", j + 1, fname, p_cp->cp);
+            }
+            CSV_close(&csv);
+            free(*p_df_cp);
+            *p_df_cp = NULL;
+            return -1;
         }
-        i++;
     }
-    fclose(fp_h);
-    nrow_total = i;             // the total number of row in the data file
-    ndays = p_df_rr_h - p_rr_h; // the exact size of struct p_rr_h array
+    CSV_close(&csv);
+    return j; // the number of rows
+}
 
-    /**** aggregate the hourly into daily scale ****/
+static void aggregate_day_h(
+    int VAR,
+    int N_STATION,
+    struct df_rr_h *p_df_rr_h)
+{
+    /**************
+     * Description:
+     *      aggregate the hourly values of one day into the daily scale
+     * ************/
+    int j, h;
     if (VAR == 4)
     {
         /*******
          * VAR: sunshine duration
          * ***/
-        for (p_df_rr_h = p_rr_h; p_df_rr_h < p_rr_h + ndays; p_df_rr_h++)
+        for (j = 0; j < N_STATION; j++)
         {
-            p_df_rr_h->rr_d = (double *)malloc(N_STATION * sizeof(double)); // allocate memory (stack)
-            for (j = 0; j < N_STATION; j++)
+            *(p_df_rr_h->rr_d + j) = 0;
+            for (h = 0; h < 24; h++)
             {
-                *(p_df_rr_h->rr_d + j) = 0;
-                for (h = 0; h < 24; h++)
-                {
-                    *(p_df_rr_h->rr_d + j) += p_df_rr_h->rr_h[j][h]; // the sum (total)
-                }
-                *(p_df_rr_h->rr_d + j) /= 60; // convert the unit to hours from minutes
+                *(p_df_rr_h->rr_d + j) += p_df_rr_h->rr_h[j][h]; // the sum (total)
             }
+            *(p_df_rr_h->rr_d + j) /= 60; // convert the unit to hours from minutes
         }
     }
     else if (VAR == 5)
@@ -403,16 +620,12 @@ int import_dfrr_h(
         /*******
          * VAR: solar radiation
          * ***/
-        for (p_df_rr_h = p_rr_h; p_df_rr_h < p_rr_h + ndays; p_df_rr_h++)
+        for (j = 0; j < N_STATION; j++)
         {
-            p_df_rr_h->rr_d = (double *)malloc(N_STATION * sizeof(double)); // allocate memory (stack)
-            for (j = 0; j < N_STATION; j++)
+            *(p_df_rr_h->rr_d + j) = 0;
+            for (h = 0; h < 24; h++)
             {
-                *(p_df_rr_h->rr_d + j) = 0;
-                for (h = 0; h < 24; h++)
-                {
-                    *(p_df_rr_h->rr_d + j) += p_df_rr_h->rr_h[j][h]; // the sum (total)
-                }
+                *(p_df_rr_h->rr_d + j) += p_df_rr_h->rr_h[j][h]; // the sum (total)
             }
         }
     }
@@ -425,27 +638,410 @@ int import_dfrr_h(
          * - rhu
          * - pressure
          * ****/
-        for (p_df_rr_h = p_rr_h; p_df_rr_h < p_rr_h + ndays; p_df_rr_h++)
+        for (j = 0; j < N_STATION; j++)
+        {
+            *(p_df_rr_h->rr_d + j) = 0;
+            for (h = 0; h < 24; h++)
+            {
+                *(p_df_rr_h->rr_d + j) += p_df_rr_h->rr_h[j][h];
+            }
+            *(p_df_rr_h->rr_d + j) /= 24.0; // the average
+        }
+    }
+}
+
+static int import_day_h(
+    struct CSV_file *p_csv,
+    int index_day,
+    int N_STATION,
+    struct df_rr_h *p_df_rr_h)
+{
+    /**************
+     * Description:
+     *      parse the 24 rows (y,m,d,h,values) of one day into the library;
+     *      the date is taken from the first row
+     * Return:
+     *      -1: done; otherwise the index of the first incomplete (or invalid) row
+     * ************/
+    int r, j, h, y, m, d;
+    for (r = index_day * 24; r < index_day * 24 + 24; r++)
+    {
+        const char *p = p_csv->data + p_csv->row[r];
+        const char *end = p_csv->data + p_csv->row[r + 1];
+        p = CSV_int(p, end, &y);
+        if (p != NULL) p = CSV_int(p, end, &m);
+        if (p != NULL) p = CSV_int(p, end, &d);
+        if (p != NULL) p = CSV_int(p, end, &h);
+        if (p == NULL || h < 0 || h > 23)
+        {
+            return r;
+        }
+        if (r % 24 == 0)
+        {
+            (p_df_rr_h->date).y = y;
+            (p_df_rr_h->date).m = m;
+            (p_df_rr_h->date).d = d;
+        }
+        for (j = 0; j < N_STATION && p != NULL; j++)
+        {
+            p = CSV_double(p, end, &p_df_rr_h->rr_h[j][h]);
+        }
+        if (p == NULL)
+        {
+            return r;
+        }
+    }
+    return -1;
+}
+
+int import_dfrr_h(
+    int VAR,
+    char FP_hourly[],
+    int N_STATION,
+    int THREADS,
+    struct df_rr_h **p_rr_h,
+    char *msg,
+    size_t msg_len)
+{
+    /**************
+     * Main:
+     *  import hourly rainfall observations into memory
+     * Parameters:
+     *  FP_hourly: a string, storing the file path and name of hourly rr data file
+     *  N_STATION: the number of rainfall stations in disaggrgeation
+     *  THREADS: the number of threads parsing the days
+     *  p_rr_h: structure df_rr_h array, allocated here (one element per day)
+     *  msg, msg_len: the reason of a failure (-1), not printed here; msg NULL: not kept
+     * Return:
+     *  output the number of hourly observation days;
+     *  -1: the file cannot be read, a row is invalid or the last day incomplete (nothing allocated);
+     *  -2: out of memory (nothing allocated)
+     * Memory:
+     *  the whole library lives in two contiguous, ALIGN_BYTES-aligned blocks:
+     *  - hourly values: [ndays][N_STATION][24]
+     *  - daily aggregates: [ndays][N_STATION]
+     *  rr_h and rr_d of each df_rr_h are only views into these blocks,
+     *  so that scanning the candidates walks through memory linearly
+     * Parsing:
+     *  the file is mapped into memory and its rows indexed (CSV_open());
+     *  each day (24 rows) is then parsed and aggregated independently, in parallel
+     * ****************/
+    // char FP_hourly[]="D:/kNN_MOF_cp/data/rr_obs_hourly.csv";
+    struct CSV_file csv;
+    int i, nrow_total, ndays;
+    if ((i = CSV_open(FP_hourly, &csv)) != 0)
+    {
+        if (i == -2)
+        {
+            return -2;
+        }
+        if (msg != NULL)
+        {
+            snprintf(msg, msg_len, "cannot open hourly data file: %s", FP_hourly);
+        }
+        return -1;
+    }
+
+    /**** allocate the library store in one go ****/
+    nrow_total = csv.nrow; // the total number of row in the data file
+    if (nrow_total % 24 != 0)
+    {
+        // the last day incomplete: e.g. the file is being written
+        if (msg != NULL)
         {
-            p_df_rr_h->rr_d = (double *)malloc(N_STATION * sizeof(double)); // allocate memory (stack)
-            for (j = 0; j < N_STATION; j++)
+            snprintf(msg, msg_len, "hourly data file %s has %d rows, not whole days of 24 rows",
+                     FP_hourly, nrow_total);
+        }
+        CSV_close(&csv);
+        return -1;
+    }
+    ndays = nrow_total / 24;
+    double *lib_h; // hourly block: [ndays][N_STATION][24]
+    double *lib_d; // daily block: [ndays][N_STATION]
+    lib_h = (double *)calloc_aligned((size_t)ndays * N_STATION * 24, sizeof(double));
+    lib_d = (double *)calloc_aligned((size_t)ndays * N_STATION, sizeof(double));
+    *p_rr_h = (struct df_rr_h *)calloc_aligned(ndays, sizeof(struct df_rr_h));
+    if (lib_h == NULL || lib_d == NULL || *p_rr_h == NULL)
+    {
+        CSV_close(&csv);
+        free_aligned(lib_h);
+        free_aligned(lib_d);
+        free_aligned(*p_rr_h);
+        *p_rr_h = NULL;
+        return -2;
+    }
+    for (i = 0; i < ndays; i++)
+    {
+        (*p_rr_h + i)->rr_h = (double (*)[24])(lib_h + (size_t)i * N_STATION * 24);
+        (*p_rr_h + i)->rr_d = lib_d + (size_t)i * N_STATION;
+    }
+
+    /**** parse and aggregate the hourly into daily scale, day by day ****/
+    int n_threads = (THREADS > 0) ? THREADS : 1;
+    int bad = -1;   // the first incomplete row
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) num_threads(n_threads)
+#endif
+    for (i = 0; i < ndays; i++)
+    {
+        int r = import_day_h(&csv, i, N_STATION, *p_rr_h + i);
+        if (r >= 0)
+        {
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+            if (bad < 0 || r < bad)
             {
-                *(p_df_rr_h->rr_d + j) = 0;
-                for (h = 0; h < 24; h++)
-                {
-                    *(p_df_rr_h->rr_d + j) += p_df_rr_h->rr_h[j][h];
-                }
-                *(p_df_rr_h->rr_d + j) /= 24.0; // the average
+                bad = r;
             }
         }
+        else
+        {
+            aggregate_day_h(VAR, N_STATION, *p_rr_h + i);
+        }
+    }
+    CSV_close(&csv);
+    if (bad >= 0)
+    {
+        if (msg != NULL)
+        {
+            snprintf(msg, msg_len, "row %d of hourly data file %s is invalid or has less than %d values",
+                     bad + 1, FP_hourly, N_STATION);
+        }
+        free_aligned(lib_h);
+        free_aligned(lib_d);
+        free_aligned(*p_rr_h);
+        *p_rr_h = NULL;
+        return -1;
     }
     return ndays; // the last is null
 }
 
+void *calloc_aligned(
+    size_t n,
+    size_t size)
+{
+    /**************
+     * Description:
+     *      allocate a zero-initialized memory block of n * size bytes,
+     *      aligned to ALIGN_BYTES (one cache line); released by free_aligned()
+     * Return:
+     *      the block; NULL: out of memory
+     * ************/
+    void *p;
+    size_t bytes = n * size;
+    if (bytes == 0)
+    {
+        bytes = ALIGN_BYTES;
+    }
+    bytes = (bytes + ALIGN_BYTES - 1) / ALIGN_BYTES * ALIGN_BYTES;
+#ifdef _WIN32
+    p = _aligned_malloc(bytes, ALIGN_BYTES);
+#else
+    if (posix_memalign(&p, ALIGN_BYTES, bytes) != 0)
+    {
+        p = NULL;
+    }
+#endif
+    if (p != NULL)
+    {
+        memset(p, 0, bytes);
+    }
+    return p;
+}
+
+void free_aligned(
+    void *p)
+{
+    /* release a block of calloc_aligned() */
+#ifdef _WIN32
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+static char *format_uint(
+    char *s,
+    unsigned long long v)
+{
+    /* decimal digits of v, written at s; returns the end */
+    char tmp[24];
+    int n = 0;
+    do
+    {
+        tmp[n++] = (char)('0' + v % 10);
+        v /= 10;
+    } while (v > 0);
+    while (n > 0)
+    {
+        *s++ = tmp[--n];
+    }
+    return s;
+}
+
+static char *format_int(
+    char *s,
+    int v)
+{
+    if (v < 0)
+    {
+        *s++ = '-';
+        return format_uint(s, (unsigned long long)(-(long long)v));
+    }
+    return format_uint(s, (unsigned long long)v);
+}
+
+static char *format_02d(
+    char *s,
+    int v)
+{
+    /* as printf("%02d", v) */
+    if (v >= 0 && v < 10)
+    {
+        *s++ = '0';
+        *s++ = (char)('0' + v);
+        return s;
+    }
+    return format_int(s, v);
+}
+
+static unsigned long long round_fixed(
+    double a,
+    double scale)
+{
+    /**************
+     * Description:
+     *      n = round(a * scale) for a >= 0, a * scale < 1e15, of the exact binary value
+     *      (to nearest, ties to even), as printf() rounds
+     * COMMENTS:
+     *      the product is not exact, so it is only trusted away from the rounding
+     *      boundaries; otherwise the sign of the exact a * scale - boundary
+     *      is taken from fma() (rounded once, sign kept)
+     * ************/
+    double y = a * scale;
+    double fl = floor(y);
+    double f = y - fl;
+    double margin = y * 1e-15 + 1e-300;
+    unsigned long long n = (unsigned long long)fl;
+    if (f > margin && f < 1.0 - margin && fabs(f - 0.5) > margin)
+    {
+        if (f > 0.5)
+        {
+            n++;
+        }
+    }
+    else
+    {
+        while (n > 0 && fma(a, scale, -(double)n) < 0.0)
+        {
+            n--;
+        }
+        while (fma(a, scale, -(double)(n + 1)) >= 0.0)
+        {
+            n++;
+        }
+        double t = fma(a, scale, -((double)n + 0.5));
+        if (t > 0.0 || (t == 0.0 && (n & 1)))
+        {
+            n++;
+        }
+    }
+    return n;
+}
+
+static char *format_fixed(
+    char *s,
+    double v,
+    int prec)
+{
+    /**************
+     * Description:
+     *      write v with prec (2 or 6) decimals, identical to printf("%.2f", v) or printf("%f", v)
+     *      (the exact binary value rounded to nearest, ties to even; "-" kept for -0.00)
+     *      without locale or varargs
+     * Parameters:
+     *      s: the destination, at least 400 bytes available
+     * Return:
+     *      the end of the written text
+     * ************/
+    double scale = (prec == 2) ? 100.0 : 1000000.0;
+    unsigned long long div = (prec == 2) ? 100 : 1000000;
+    double a = fabs(v);
+    if (!(a * scale < 1e15))
+    {
+        // NaN, inf and huge values (n would not be exact in double)
+        return s + sprintf(s, "%.*f", prec, v);
+    }
+    unsigned long long n = round_fixed(a, scale);
+    if (signbit(v))
+    {
+        *s++ = '-';
+    }
+    s = format_uint(s, n / div);
+    *s++ = '.';
+    unsigned long long frac = n % div;
+    for (int k = prec - 1; k >= 0; k--)
+    {
+        s[k] = (char)('0' + frac % 10);
+        frac /= 10;
+    }
+    return s + prec;
+}
+
+int Value_scaled(
+    double v,
+    int *q)
+{
+    /**************
+     * Description:
+     *      the value as written in the CSV output (2 decimals), times 100, as an integer
+     * Parameters:
+     *      q: the scaled value; INT_MIN stands for "-0.00" (a small negative value)
+     * Return:
+     *      1: done; 0: v does not fit (NaN, inf or |v| >= 2e7)
+     * COMMENTS:
+     *      q / 100.0 (-0.0 for INT_MIN) is written again exactly as v (Write_df_rr_h())
+     * ************/
+    double a = fabs(v);
+    if (!(a < 2e7))
+    {
+        return 0;
+    }
+    long long n = (long long)round_fixed(a, 100.0);
+    if (signbit(v))
+    {
+        *q = (n == 0) ? INT_MIN : (int)-n;
+    } else {
+        *q = (int)n;
+    }
+    return 1;
+}
+
+static char *out_reserve(
+    struct Out_buffer *p_ob,
+    char *s)
+{
+    /**************
+     * Description:
+     *      make sure that at least 512 bytes (a row prefix or one value) fit after s;
+     *      otherwise pass the buffer on (Out_buffer_flush(), which may swap it)
+     * Return:
+     *      the position to continue writing at
+     * ************/
+    if (s + 512 > p_ob->buf + p_ob->cap)
+    {
+        p_ob->len = s - p_ob->buf;
+        Out_buffer_flush(p_ob);
+        s = p_ob->buf + p_ob->len;
+    }
+    return s;
+}
+
 void Write_df_rr_h(
     struct df_rr_h *p_out,
     struct Para_global *p_gp,
-    FILE *p_FP_OUT,
+    struct Out_buffer *p_ob,
     int run)
 {
     /**************
@@ -453,26 +1049,188 @@ void Write_df_rr_h(
      *      write the disaggregated results into output file (.csv)
      * Parameters:
      *      p_gp:
-     *      p_FP_OUT: a FILE pointer, pointing to the output file
-     *
+     *      p_ob: the buffered writer of the output file
+     *      run: the run index (1, 2, ..., RUN)
+     * COMMENTS:
+     *      the day is first transposed into the hour-major staging buffer,
+     *      then each row (run,y,m,d,h,values of all sites) is formatted from contiguous memory;
+     *      the number of sites is that of the writer (p_ob->N)
      * ************/
     int j, h;
-    for (h = 0; h < 24; h++)
+    int N = p_ob->N;
+    double *stage = p_ob->stage;
+    for (j = 0; j < N; j++)
     {
-        fprintf(
-            p_FP_OUT,
-            "%d,%d,%d,%d,%d,%.2f", run,
-            p_out->date.y, p_out->date.m, p_out->date.d, h,
-            p_out->rr_h[0][h]); // print the date and time (y, m, d, h), together with the value from first rr gauge (0)
+        for (h = 0; h < 24; h++)
+        {
+            stage[h * N + j] = p_out->rr_h[j][h];
+        }
+    }
+    Write_hours(p_ob, run, p_out->date, stage);
+}
+
+void Write_hours(
+    struct Out_buffer *p_ob,
+    int run,
+    struct Date date,
+    const double *rows)
+{
+    /**************
+     * Description:
+     *      write the 24 rows (run,y,m,d,h,values of all sites) of one day and run
+     * Parameters:
+     *      rows: the hourly values, hour-major [24][N] (N: p_ob->N)
+     * ************/
+    int j, h;
+    int N = p_ob->N;
 
-        for (j = 1; j < p_gp->N_STATION; j++)
+    /* the row prefix "run,y,m,d," is the same for the 24 hours */
+    char prefix[64];
+    char *e = prefix;
+    e = format_int(e, run); *e++ = ',';
+    e = format_int(e, date.y); *e++ = ',';
+    e = format_int(e, date.m); *e++ = ',';
+    e = format_int(e, date.d); *e++ = ',';
+    size_t n_prefix = e - prefix;
+
+    char *s = p_ob->buf + p_ob->len;
+    for (h = 0; h < 24; h++)
+    {
+        const double *row = rows + (size_t)h * N;
+        s = out_reserve(p_ob, s);
+        memcpy(s, prefix, n_prefix);
+        s += n_prefix;
+        s = format_int(s, h);
+        for (j = 0; j < N; j++)
         {
-            fprintf(
-                p_FP_OUT,
-                ",%.2f", p_out->rr_h[j][h]);
+            s = out_reserve(p_ob, s);
+            *s++ = ',';
+            s = format_fixed(s, row[j], 2);
         }
-        fprintf(p_FP_OUT, "\n"); // print "\n" (newline) after one row
+        *s++ = '\n'; // newline after one row
+    }
+    p_ob->len = s - p_ob->buf;
+}
+
+void Write_index(
+    struct Out_buffer *p_ob,
+    int run,
+    struct Date target,
+    int index_frag,
+    struct Date *candidate)
+{
+    /**************
+     * Description:
+     *      write one row of the index output (OUT_FORMAT: INDEX):
+     *      run,y,m,d,index_Frag,candidate
+     *      the sampled fragment instead of the 24 x N_STATION hourly values;
+     *      expanded into the hourly values by Expand_index()
+     * Parameters:
+     *      p_ob: the buffered writer of the output file
+     *      run: the run index (1, 2, ..., RUN)
+     *      index_frag: the index of the fragment in the hourly library; -1: dark day (all 0)
+     *      candidate: the date of the fragment (to check the library); NULL: dark day
+     * ************/
+    char *s = out_reserve(p_ob, p_ob->buf + p_ob->len);
+    s = format_int(s, run); *s++ = ',';
+    s = format_int(s, target.y); *s++ = ',';
+    s = format_int(s, target.m); *s++ = ',';
+    s = format_int(s, target.d); *s++ = ',';
+    s = format_int(s, index_frag); *s++ = ',';
+    if (candidate != NULL)
+    {
+        s = format_int(s, candidate->y); *s++ = '-';
+        s = format_02d(s, candidate->m); *s++ = '-';
+        s = format_02d(s, candidate->d);
+    } else {
+        *s++ = '-';
+    }
+    *s++ = '\n';
+    p_ob->len = s - p_ob->buf;
+}
+
+void Write_SIMI(
+    struct Out_buffer *p_ob,
+    struct Date target,
+    int rank,
+    int index_frag,
+    double SIMI,
+    struct Date candidate)
+{
+    /**************
+     * Description:
+     *      write one row of the similarity file (FP_SSIM):
+     *      target,ID,index_Frag,SIMI,candidate
+     * Parameters:
+     *      p_ob: the buffered writer of the similarity file
+     *      rank: the rank of the candidate (0: the nearest)
+     *      index_frag: the index of the candidate in the hourly library
+     * ************/
+    char *s = out_reserve(p_ob, p_ob->buf + p_ob->len);
+    s = Format_SIMI(s, target, rank, index_frag, SIMI, candidate);
+    p_ob->len = s - p_ob->buf;
+}
+
+char *Format_SIMI(
+    char *s,
+    struct Date target,
+    int rank,
+    int index_frag,
+    double SIMI,
+    struct Date candidate)
+{
+    /**************
+     * Description:
+     *      format one row of the similarity file (Write_SIMI()) into a plain buffer
+     * Parameters:
+     *      s: the destination, at least 512 bytes available
+     * Return:
+     *      the end of the written text
+     * ************/
+    s = format_int(s, target.y); *s++ = '-';
+    s = format_02d(s, target.m); *s++ = '-';
+    s = format_02d(s, target.d); *s++ = ',';
+    s = format_int(s, rank); *s++ = ',';
+    s = format_int(s, index_frag); *s++ = ',';
+    s = format_fixed(s, SIMI, 6); *s++ = ',';
+    s = format_int(s, candidate.y); *s++ = '-';
+    s = format_02d(s, candidate.m); *s++ = '-';
+    s = format_02d(s, candidate.d); *s++ = '\n';
+    return s;
+}
+
+char *Format_SIMI_day(
+    char *s,
+    struct Date target,
+    int n_can,
+    int k,
+    double best,
+    double kth)
+{
+    /**************
+     * Description:
+     *      format one row of the aggregated similarity file (SSIM_LEVEL: AGG):
+     *      target,n_can,k,best,kth ("NA" for best and kth without candidates)
+     * Parameters:
+     *      s: the destination, at least 1024 bytes available
+     * Return:
+     *      the end of the written text
+     * ************/
+    s = format_int(s, target.y); *s++ = '-';
+    s = format_02d(s, target.m); *s++ = '-';
+    s = format_02d(s, target.d); *s++ = ',';
+    s = format_int(s, n_can); *s++ = ',';
+    s = format_int(s, k); *s++ = ',';
+    if (k > 0)
+    {
+        s = format_fixed(s, best, 6); *s++ = ',';
+        s = format_fixed(s, kth, 6);
+    } else {
+        memcpy(s, "NA,NA", 5);
+        s += 5;
     }
+    *s++ = '\n';
+    return s;
 }
 
 void VAR_NAME(
@@ -5,34 +5,119 @@ void import_global(
     char fname[], struct Para_global *p_gp
 );
 
+void Para_global_default(
+    struct Para_global *p_gp
+);
+
+int Para_global_line(
+    char row[],
+    struct Para_global *p_gp
+);
+
 void removeLeadingSpaces(char *str);
 
 int import_dfrr_d(
     char FP_daily[], 
     int N_STATION,
-    struct df_rr_d *p_rr_d
+    int THREADS,
+    struct df_rr_d **p_rr_d
 ) ;
 
 int import_dfrr_h(
     int VAR,
     char FP_hourly[], 
     int N_STATION,
-    struct df_rr_h *p_rr_h
+    int THREADS,
+    struct df_rr_h **p_rr_h,
+    char *msg,
+    size_t msg_len
 ) ;
 
+void Day_stream_open(
+    char FP_daily[],
+    struct Day_stream *p_ds
+);
+
+int Day_stream_read(
+    struct Day_stream *p_ds,
+    int N_STATION,
+    struct df_rr_d *p_day
+);
+
+void Day_stream_close(
+    struct Day_stream *p_ds
+);
 
 int import_df_cp(
     char fname[],
-    struct df_cp *p_df_cp
+    struct df_cp **p_df_cp,
+    char *msg,
+    size_t msg_len
+);
+
+void *calloc_aligned(
+    size_t n,
+    size_t size
+);
+
+void free_aligned(
+    void *p
 );
 
 void Write_df_rr_h(
     struct df_rr_h *p_out,
     struct Para_global *p_gp,
-    FILE *p_FP_OUT,
+    struct Out_buffer *p_ob,
     int run
 );
 
+void Write_hours(
+    struct Out_buffer *p_ob,
+    int run,
+    struct Date date,
+    const double *rows
+);
+
+void Write_index(
+    struct Out_buffer *p_ob,
+    int run,
+    struct Date target,
+    int index_frag,
+    struct Date *candidate
+);
+
+void Write_SIMI(
+    struct Out_buffer *p_ob,
+    struct Date target,
+    int rank,
+    int index_frag,
+    double SIMI,
+    struct Date candidate
+);
+
+char *Format_SIMI(
+    char *s,
+    struct Date target,
+    int rank,
+    int index_frag,
+    double SIMI,
+    struct Date candidate
+);
+
+char *Format_SIMI_day(
+    char *s,
+    struct Date target,
+    int n_can,
+    int k,
+    double best,
+    double kth
+);
+
+int Value_scaled(
+    double v,
+    int *q
+);
+
 void VAR_NAME(
     int VAR,
     char VARname[]
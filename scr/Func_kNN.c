@@ -6,6 +6,7 @@
 #include <stdlib.h>
 #include <math.h>
 #include <ctype.h>
+#include <stdint.h>
 #include "def_struct.h"
 #include "Func_kNN.h"
 #include "Func_SSIM.h"
@@ -13,53 +14,148 @@
 #include "Func_dataIO.h"
 
 
-void similarity_sorting(
+int kNN_pool_size(
+    int n_can
+)
+{
+    /******
+     * the size of candidate pool in kNN algorithm (the k):
+     * sqrt(n_can) + 1, not more than n_can
+     ****/
+    int size_pool;
+    size_pool = (int)sqrt(n_can) + 1;
+    if (size_pool > n_can)
+    {
+        size_pool = n_can;
+    }
+    return size_pool;
+}
+
+static int similarity_better(
     double *similarity,
     int *pool_cans,
     int order,
-    int n_can
+    int a,
+    int b
+)
+{
+    /******
+     * whether candidate a ranks before candidate b:
+     * - order 1: larger similarity first (SSIM)
+     * - order 0: smaller similarity first (distance)
+     * ties are broken by the library day index (smaller first), NaN ranks last;
+     * the ranking therefore does not depend on the order of the pool
+     ****/
+    double sa = similarity[a];
+    double sb = similarity[b];
+    if (isnan(sa) || isnan(sb))
+    {
+        if (isnan(sa) && isnan(sb))
+        {
+            return pool_cans[a] < pool_cans[b];
+        }
+        return isnan(sb);
+    }
+    if (sa != sb)
+    {
+        return (order == 1) ? (sa > sb) : (sa < sb);
+    }
+    return pool_cans[a] < pool_cans[b];
+}
+
+static void similarity_swap(
+    double *similarity,
+    int *pool_cans,
+    int a,
+    int b
 )
 {
-    int i, j;
     int temp_c;  // temporary variable during sorting 
     double temp_d;
-    
-    if (order == 1)
+    temp_c = pool_cans[a];
+    pool_cans[a] = pool_cans[b];
+    pool_cans[b] = temp_c;
+    temp_d = similarity[a];
+    similarity[a] = similarity[b];
+    similarity[b] = temp_d;
+}
+
+static void similarity_sift(
+    double *similarity,
+    int *pool_cans,
+    int order,
+    int root,
+    int n
+)
+{
+    /* sift down in a heap of n elements, the worst candidate on the top */
+    int child;
+    while ((child = 2 * root + 1) < n)
     {
-        // sort in the decreasing order
-        for (i = 0; i < n_can - 1; i++)
+        if (child + 1 < n && similarity_better(similarity, pool_cans, order, child, child + 1))
         {
-            for (j = i + 1; j < n_can; j++)
-            {
-                if (similarity[i] < similarity[j])
-                {
-                    temp_c = pool_cans[i];
-                    pool_cans[i] = pool_cans[j];
-                    pool_cans[j] = temp_c;
-                    temp_d = similarity[i];
-                    similarity[i] = similarity[j];
-                    similarity[j] = temp_d;
-                }
-            }
+            child += 1; // the worse of the two children
         }
-    } else {
-        // sort in the increasing order
-        for (i = 0; i < n_can - 1; i++)
+        if (similarity_better(similarity, pool_cans, order, root, child))
+        {
+            similarity_swap(similarity, pool_cans, root, child);
+            root = child;
+        } else {
+            break;
+        }
+    }
+}
+
+void similarity_topk(
+    double *similarity,
+    int *pool_cans,
+    int order,
+    int n_can,
+    int k
+)
+{
+    /**************
+     * Description:
+     *      partial sorting: move the k best candidates to the front, sorted,
+     *      the order of the remaining n_can - k candidates is undefined
+     *      a heap of the k best is kept while scanning the pool: O(n_can * log(k)),
+     *      instead of sorting the whole pool
+     * Parameters:
+     *      similarity: the similarity of each candidate, reordered together with pool_cans
+     *      pool_cans: the index of the candidates
+     *      order: 1, decreasing (SSIM); 0, increasing (distance)
+     *      n_can: the number of candidates
+     *      k: the number of candidates to select
+     * ***********/
+    int i;
+    if (k > n_can)
+    {
+        k = n_can;
+    }
+    if (k <= 0)
+    {
+        return;
+    }
+    /* heap of the first k candidates */
+    for (i = k / 2 - 1; i >= 0; i--)
+    {
+        similarity_sift(similarity, pool_cans, order, i, k);
+    }
+    /* a better candidate replaces the worst one in the heap */
+    for (i = k; i < n_can; i++)
+    {
+        if (similarity_better(similarity, pool_cans, order, i, 0))
         {
-            for (j = i + 1; j < n_can; j++)
-            {
-                if (similarity[i] > similarity[j])
-                {
-                    temp_c = pool_cans[i];
-                    pool_cans[i] = pool_cans[j];
-                    pool_cans[j] = temp_c;
-                    temp_d = similarity[i];
-                    similarity[i] = similarity[j];
-                    similarity[j] = temp_d;
-                }
-            }
+            similarity_swap(similarity, pool_cans, i, 0);
+            similarity_sift(similarity, pool_cans, order, 0, k);
         }
     }
+    /* heap sort of the k winners: the worst goes to the end */
+    for (i = k - 1; i > 0; i--)
+    {
+        similarity_swap(similarity, pool_cans, 0, i);
+        similarity_sift(similarity, pool_cans, order, 0, i);
+    }
 }
 
 
@@ -69,7 +165,7 @@ void similarity_weight(
     int order,
     int n_can,
     int *size_pool,
-    double **weights
+    double *weights
 )
 {
     int i;
@@ -78,11 +174,11 @@ void similarity_weight(
      * the size of candidate pool in kNN algorithm
      *      the range of size_pool:
      *      [2, n_can]
+     * weights: provided by the caller, at least size_pool elements
      ****/
     // int size_pool;
-    *size_pool = (int)sqrt(n_can) + 1;
+    *size_pool = kNN_pool_size(n_can);
     
-    *weights = (double *)malloc(*size_pool * sizeof(double)); // a double array with the size of size_pool
     double w_sum = 0.0;
     if (order == 1)
     {
@@ -92,7 +188,7 @@ void similarity_weight(
          * **/ 
         for (i = 0; i < *size_pool; i++)
         {
-            *(*weights + i) = similarity[i] + 1;
+            *(weights + i) = similarity[i] + 1;
             w_sum += similarity[i] + 1;
         }
     } else {
@@ -102,13 +198,13 @@ void similarity_weight(
          * ***/ 
         for (i = 0; i < *size_pool; i++)
         {
-            *(*weights + i) = 1.0 / (similarity[i] + 1);  // inverse distance
+            *(weights + i) = 1.0 / (similarity[i] + 1);  // inverse distance
             w_sum += 1.0 / (similarity[i] + 1);
         }
     }
     for (i = 0; i < *size_pool; i++)
     {
-        *(*weights + i) /= w_sum; // reassignment
+        *(weights + i) /= w_sum; // reassignment
     }
 }
 
@@ -118,64 +214,143 @@ void kNN_sampling(
     int order,
     int n_can,
     int run,
+    unsigned long long seed,
+    int day,
     int *index_fragment
 )
 {
+    int size_pool;
+    size_pool = kNN_pool_size(n_can);
+    double *weights_cdf;
+    weights_cdf = (double *)malloc(sizeof(double) * (size_pool > 0 ? size_pool : 1));
+    similarity_topk(similarity, pool_cans, order, n_can, size_pool);
+    kNN_sampling_topk(similarity, pool_cans, order, n_can, run, seed, day, weights_cdf, index_fragment);
+    free(weights_cdf);
+}
 
-    similarity_sorting(similarity, pool_cans, order, n_can);
+void kNN_sampling_topk(
+    double *similarity,
+    int *pool_cans,
+    int order,
+    int n_can,
+    int run,
+    unsigned long long seed,
+    int day,
+    double *weights_cdf,
+    int *index_fragment
+)
+{
+    /**************
+     * Description:
+     *      weights and sampling of the kNN pool, 
+     *      the candidates are already selected and sorted by similarity_topk()
+     * Parameters:
+     *      n_can: the number of candidates before the selection; defines the k
+     *      run: the number of simulation runs (RUN)
+     *      seed, day: the key of the random numbers, see get_random()
+     *      weights_cdf: working array of at least k elements (no allocation per day)
+     * ***********/
     int size_pool;
-    double *weights;
-    similarity_weight(similarity, pool_cans, order, n_can, &size_pool, &weights);
+    similarity_weight(similarity, pool_cans, order, n_can, &size_pool, weights_cdf);
 
-    /* compute the empirical cdf for weights (vector) */
-    double *weights_cdf;
-    weights_cdf = malloc(size_pool * sizeof(double));
-    *(weights_cdf + 0) = weights[0]; // initialization
+    /* the empirical cdf of the weights (vector), in place */
     for (size_t i = 1; i < size_pool; i++)
     {
-        *(weights_cdf + i) = *(weights_cdf + i - 1) + weights[i];
-    }
-    /* generate a random number, then select the fragments index */
-    for (size_t t = 0; t < run; t++)
-    {
-        index_fragment[t] = weight_cdf_sample(size_pool, pool_cans, weights_cdf);
+        *(weights_cdf + i) += *(weights_cdf + i - 1);
     }
+    /* all RUN draws at once */
+    weight_cdf_sample_runs(size_pool, pool_cans, weights_cdf, run, seed, day, index_fragment);
+}
 
-    free(weights);
-    free(weights_cdf);
+static uint64_t splitmix64(
+    uint64_t x
+)
+{
+    /* the SplitMix64 mixing function */
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
 }
 
-double get_random() 
+double get_random(
+    unsigned long long seed,
+    int day,
+    int run
+) 
 {
-    return ((double)rand() / (double)RAND_MAX); 
+    /**************
+     * Description:
+     *      counter-based random number in [0, 1): a hash of (seed, target day, run)
+     *      each (day, run) has its own independent stream, which does not depend 
+     *      on the order of the calls: the ensembles are reproducible for any 
+     *      number of threads, split of the input or restart point
+     * Parameters:
+     *      seed: SEED in the global parameter file
+     *      day: the key of the target day (date_key(): yyyymmdd)
+     *      run: the simulation run
+     * ***********/
+    uint64_t z;
+    z = splitmix64((uint64_t)seed);
+    z = splitmix64(z ^ (uint64_t)(uint32_t)day);
+    z = splitmix64(z ^ (uint64_t)(uint32_t)run);
+    return (double)(z >> 11) * (1.0 / 9007199254740992.0); // 53 bits: [0, 1)
 }
 
 int weight_cdf_sample(
     int size_pool,
     int pool_cans[],
-    double *weights_cdf    
+    double *weights_cdf,
+    double rd
 ) {
+    /**************
+     * Description:
+     *      the candidate whose cdf interval (weights_cdf[i-1], weights_cdf[i]] holds rd,
+     *      by a branch-free binary search: O(log(size_pool)) per draw
+     * Parameters:
+     *      rd: a random decimal value between 0.0 and 1.0 (get_random())
+     * Return:
+     *      the sampled candidate; -1: no candidate (size_pool < 1)
+     * ***********/
+    if (size_pool <= 0)
+    {
+        return -1;
+    }
+    double *base = weights_cdf;
+    int n = size_pool;
+    int half;
     int i;
-    double rd = 0.0;  // a random decimal value between 0.0 and 1.0
-    int index_out; // the output of this function: the sampled fragment from candidates pool
-
-    // srand(time(NULL)); // randomize seed
-    rd = get_random(); // call the function to get a different value of n every time
-    if (rd <= weights_cdf[0])
+    while (n > 1)
     {
-        index_out = pool_cans[0];
+        half = n / 2;
+        base = (base[half] < rd) ? base + half : base;
+        n -= half;
     }
-    else
+    i = (int)(base - weights_cdf) + (*base < rd); // the first i with weights_cdf[i] >= rd
+    if (i >= size_pool)
     {
-        for (i = 1; i < size_pool; i++)
-        {
-            if (rd <= weights_cdf[i] && rd > weights_cdf[i - 1])
-            {
-                index_out = pool_cans[i];
-                break;
-            }
-        }
+        i = size_pool - 1; // rd beyond the last cdf value (rounding)
     }
-    return index_out;
+    return pool_cans[i];
 }
 
+void weight_cdf_sample_runs(
+    int size_pool,
+    int pool_cans[],
+    double *weights_cdf,
+    int run,
+    unsigned long long seed,
+    int day,
+    int *index_fragment
+) {
+    /**************
+     * Description:
+     *      sample the fragments of all RUN simulation runs of one target day
+     * Output:
+     *      index_fragment: RUN sampled candidates
+     * ***********/
+    for (int t = 0; t < run; t++)
+    {
+        index_fragment[t] = weight_cdf_sample(size_pool, pool_cans, weights_cdf, get_random(seed, day, t + 1));
+    }
+}
@@ -2,11 +2,16 @@
 #define FUNC_KNN
 
 
-void similarity_sorting(
+int kNN_pool_size(
+    int n_can
+);
+
+void similarity_topk(
     double *similarity,
     int *pool_cans,
     int order,
-    int n_can
+    int n_can,
+    int k
 );
 
 void similarity_weight(
@@ -15,7 +20,7 @@ void similarity_weight(
     int order,
     int n_can,
     int *size_pool,
-    double **weights
+    double *weights
 );
 
 void kNN_sampling(
@@ -24,16 +29,44 @@ void kNN_sampling(
     int order,
     int n_can,
     int run,
+    unsigned long long seed,
+    int day,
     int *index_fragment
 );
 
+void kNN_sampling_topk(
+    double *similarity,
+    int *pool_cans,
+    int order,
+    int n_can,
+    int run,
+    unsigned long long seed,
+    int day,
+    double *weights_cdf,
+    int *index_fragment
+);
 
-double get_random();
+double get_random(
+    unsigned long long seed,
+    int day,
+    int run
+);
 
 int weight_cdf_sample(
     int size_pool,
     int pool_cans[],
-    double *weights_cdf    
+    double *weights_cdf,
+    double rd
+);
+
+void weight_cdf_sample_runs(
+    int size_pool,
+    int pool_cans[],
+    double *weights_cdf,
+    int run,
+    unsigned long long seed,
+    int day,
+    int *index_fragment
 );
 
 #endif
\ No newline at end of file
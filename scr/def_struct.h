@@ -1,9 +1,27 @@
 #ifndef STRUCT_H
 #define STRUCT_H
 
-#define MAXCHAR 10000  // able to accomodate up to 3000 sites simultaneously
-#define MAXrow 100000  // almost 270 years long ts
+#define MAXCHAR 10000  // the longest line of the global parameter and CP files (data files: no limit)
 #define MAXcps 20
+#define DAYS_BLOCK 32   // target days per thread in one parallel block
+#define DAYS_CHUNK 16   // consecutive target days per thread (CONTINUITY > 1): their windows share similarities
+#define TILE_ROWS 32    // target days in one tile of the batched similarity (Func_Batch.c)
+#define TILE_COLS 64    // candidate days in one tile of the batched similarity
+#define ALIGN_BYTES 64 // alignment (cache line) of the contiguous fragment library blocks
+#define OUT_BUFFER 4194304  // bytes of the user-space output buffer (4 MB)
+#define LIB_CACHE_VERSION 2 // format version of the binary library cache (FP_CACHE)
+#define LIB_SHM_PREFIX "/kNN_MOF_m." // shared-memory library segments (FP_CACHE: SHM): the name, then the key
+#define OUT_QUEUE 4         // output buffers queued for the writer thread at most
+#define BIN_VERSION 1       // format version of the binary output (OUT_FORMAT: BIN, BIN64)
+#define ZIP_VERSION 1       // format version of the compressed output (OUT_FORMAT: ZIP)
+#define ZIP_VALUES 262144   // values in one compressed block at most (sets the days per block)
+#define ZIP_LEVEL 1         // zlib compression level of the compressed output
+#define SIMI_VERSION 1      // format version of the binary similarity file (SSIM_LEVEL: BIN)
+#define SIMI_BINS 40        // bins of the similarity histograms (SSIM_LEVEL: AGG)
+#define SIMI_AGG 1          // SSIM_LEVEL AGG: per day best and k-th similarity, pool size; histograms
+#define SIMI_FULL 2         // SSIM_LEVEL FULL: the k nearest candidates of every day (CSV)
+#define SIMI_BIN 3          // SSIM_LEVEL BIN: as FULL, in binary records
+#define DAY_NO_FIT -2       // n_can of a target day no library day fits (VAR 1, 4: a site without value)
 /******
  * the following define the structures
 */
@@ -13,6 +31,17 @@ struct Date {
     int d;
 };
 
+struct SSIM_stats
+{
+    /* 
+     * per-image statistics used in SSIM, computed once for each day
+     */
+    double mean;    // mean of the valid values
+    double sd;      // standard deviation of the valid values
+    double max;     // maximum value (not less than 0.0), for the dynamic range L
+    int counts;     // the number of valid (non-NODATA) values
+};
+
 struct df_rr_d
 {
     /* data
@@ -23,6 +52,8 @@ struct df_rr_d
     struct Date date;    
     double *p_rr;
     double *p_rr_pre;  // data series at daily scale after preprocessing
+    struct SSIM_stats stats;      // SSIM statistics of p_rr
+    struct SSIM_stats stats_pre;  // SSIM statistics of p_rr_pre
     int cp;
     int SM;         // summer or winter; 1 or 0
     int class;      // class of the day; categorized by cp, seaspn, month or ... 
@@ -42,6 +73,8 @@ struct df_rr_h
     double (*rr_h)[24];
     double *rr_d;     // daily data aggregated from hourly; (*rr_h)[24]
     double *p_rr_pre; // daily data after preprocessing
+    struct SSIM_stats stats;      // SSIM statistics of rr_d
+    struct SSIM_stats stats_pre;  // SSIM statistics of p_rr_pre
     int cp;
     int SM;
     int class;
@@ -57,6 +90,325 @@ struct df_cp
     int cp;
 };
 
+struct CP_calendar
+{
+    /*
+     * calendar index of the CP series: the row of each day,
+     * addressed by the ordinal day number (date_ordinal())
+     */
+    struct df_cp *p_cp; // the CP series
+    int first;          // ordinal day number of the earliest day
+    int n;              // days from the earliest to the latest
+    int *row;           // [n] row in p_cp of day first + k; -1: missing
+    int n_class;        // number of CP classes; 0: not conditioned on CP
+};
+
+struct class_index
+{
+    /* 
+     * CSR-style index of the hourly library days, grouped by class:
+     * the library days of class c are day[offset[c]] ... day[offset[c+1] - 1],
+     * in increasing order; the CONTINUITY border days (skip) are excluded
+     */
+    int n_class;    // number of classes in the index
+    int *offset;    // n_class + 1 offsets into day
+    int *day;       // library day indices (df_rr_h array)
+};
+
+struct kNN_day
+{
+    /*
+     * the candidate selection of one target day:
+     * computed in parallel, then sampled and written in the date order
+     */
+    int n_can;      // the number of candidates after all conditioning; -1: dark day, no fragments;
+                    // DAY_NO_FIT: no library day fits, no fragments
+    int *pool;      // the k nearest candidates (index of df_rr_h), sorted, the nearest first
+    double *SIMI;   // the similarity of these candidates
+    int *fragment;  // RUN sampled fragments (index of df_rr_h)
+    char *diag;     // the similarity diagnostics of the day (FP_SSIM), formatted in parallel
+    size_t diag_len;
+    size_t diag_cap;
+};
+
+struct Day_stream
+{
+    /*
+     * the daily data read row by row (file or standard input),
+     * instead of loaded as a whole (STREAM)
+     */
+    FILE *fp;
+    char *fname;        // for the messages
+    char *line;         // the current row; grows with the longest row
+    size_t cap;
+    int row;            // rows read so far
+};
+
+struct Expand_select
+{
+    /*
+     * the part of an index output (OUT_FORMAT: INDEX) to be expanded into hourly values
+     */
+    int RUN;            // number of runs in the index file
+    char *run;          // [RUN + 1] 1: run is selected; NULL: all runs
+    int n_station;      // number of selected stations
+    int *station;       // [n_station] the selected stations (0-based columns)
+    int from, to;       // date range, ordinal day numbers (date_ordinal()), inclusive
+};
+
+struct CSV_file
+{
+    /*
+     * a comma-separated text file loaded into memory (mmap), with the start of each row
+     */
+    char *data;     // the file content (not null-terminated)
+    size_t size;    // bytes
+    int mapped;     // 1: mapped with mmap(); 0: read into a memory block
+    int nrow;       // number of rows
+    size_t *row;    // [nrow + 1] offset of each row start; row[nrow]: size
+};
+
+struct Lib_cache_header
+{
+    /*
+     * header of the binary library cache (Func_Cache.c);
+     * the sections follow at the byte offsets, aligned to ALIGN_BYTES
+     */
+    char magic[8];          // "kNNMOFlb"
+    int version;            // LIB_CACHE_VERSION
+    int byte_order;         // 0x01020304 as written by this machine
+    int size_date;          // sizeof(struct Date)
+    int size_stats;         // sizeof(struct SSIM_stats)
+    int ndays;              // library days
+    int N;                  // stations
+    unsigned long long key; // Lib_cache_key(): sources and parameters
+    unsigned long long off_date, off_cp, off_SM, off_class, off_stats;  // per-day fields
+    unsigned long long off_rr_d;   // daily aggregates [ndays][N]
+    unsigned long long off_rr_h;   // hourly values [ndays][N][24]
+    unsigned long long off_solar;  // solar radiation maxima [N] (VAR: 5)
+    unsigned long long off_cps;    // the CP series [nrow_cp] (T_CP: TRUE)
+    unsigned long long size;       // total bytes of the file
+    int nrow_cp;            // days of the CP series; 0: not conditioned on CP
+    int pid;                // the process that wrote it (FP_CACHE SHM: a stale segment)
+};
+
+struct Bin_header
+{
+    /*
+     * header of the binary output (Func_Binary.c), 64 bytes;
+     * then ndays fixed-size records, one per day, at data + day * rec_size:
+     * the date (yyyymmdd, int, padded to 8 bytes), then the values [RUN][24][N]
+     */
+    char magic[8];          // "kNNMOFbo"
+    int version;            // BIN_VERSION
+    int byte_order;         // 0x01020304 as written by this machine
+    int dtype;              // bytes per value: 4 (float) or 8 (double)
+    int N;                  // stations
+    int RUN;                // runs
+    int ndays;              // days (records)
+    int first, last;        // the first and the last day, yyyymmdd
+    int consecutive;        // 1: the days follow each other (record of a date in O(1))
+    int reserved;
+    unsigned long long rec_size;    // bytes per record (day)
+    unsigned long long data;        // offset of the first record
+};
+
+struct Bin_out
+{
+    /*
+     * the binary output being written: every day is written at its own offset
+     * (pwrite), by any thread, in any order
+     */
+    int fd;
+    struct Bin_header hd;
+    int prev;               // ordinal day number of the previous day (the date order)
+    int failed;             // a write failed
+};
+
+struct Bin_file
+{
+    /*
+     * a binary output opened for reading (random access)
+     */
+    struct Bin_header hd;
+    const unsigned char *base;  // the mapped (or loaded) file
+    size_t size;
+    int mapped;
+};
+
+struct Zip_header
+{
+    /*
+     * header of the compressed output (Func_Zip.c), 32 bytes;
+     * then the blocks, each: struct Zip_block_header, the dates, the compressed values
+     */
+    char magic[8];          // "kNNMOFzc"
+    int version;            // ZIP_VERSION
+    int byte_order;         // 0x01020304 as written by this machine
+    int N;                  // stations
+    int RUN;                // runs
+    int days_block;         // days per block (the last one may have less)
+    int scale;              // the values are stored as round(value * scale): 100
+};
+
+struct Zip_block_header
+{
+    /*
+     * header of one compressed block of days, decodable on its own, 32 bytes
+     */
+    char magic[4];          // "kzb"
+    int ndays;              // days in the block
+    int flags;              // 0: scaled integers, delta and zigzag coded; 1: doubles (a value did not fit)
+    int reserved;
+    unsigned long long raw_size;    // bytes before compression
+    unsigned long long z_size;      // bytes of the compressed values (after ndays dates, yyyymmdd, int)
+};
+
+struct Zip_block
+{
+    /*
+     * one block being compressed (by one thread), written in the date order
+     */
+    struct Zip_block_header hd;
+    int *date;              // [days_block] yyyymmdd
+    unsigned char *z;       // the compressed values
+    size_t cap;             // capacity of z
+};
+
+struct Zip_work
+{
+    /*
+     * scratch buffers of one thread compressing a block:
+     * values [RUN][N][days][24] in the column (station) order
+     */
+    size_t n;               // values in a full block
+    double *v;              // [n] values
+    unsigned char *raw;     // [n * 8] coded values
+    unsigned char *shuf;    // [n * 8] byte-shuffled
+    unsigned char *zbuf;    // [zcap] compressed
+    size_t zcap;
+    struct df_rr_h out;     // disaggregated output of one day
+};
+
+struct SIMI_bin_header
+{
+    /*
+     * header of the binary similarity file (SSIM_LEVEL: BIN), 32 bytes;
+     * then per target day: date (yyyymmdd), k (int), k x {index_Frag, candidate (yyyymmdd), SIMI}
+     */
+    char magic[8];          // "kNNMOFsm"
+    int version;            // SIMI_VERSION
+    int byte_order;         // 0x01020304 as written by this machine
+    int order;              // 1: SSIM (larger is closer); 0: distance
+    int reserved[3];
+};
+
+struct SIMI_entry
+{
+    /* one candidate in the binary similarity file, 16 bytes */
+    int index_frag;         // the index of the candidate in the hourly library
+    int candidate;          // its date, yyyymmdd
+    double SIMI;
+};
+
+struct Out_buffer
+{
+    /*
+     * buffered writer of the disaggregated output (.csv):
+     * formatted rows are collected in buf and written with one fwrite when it is full
+     */
+    FILE *fp;       // the output file
+    char *buf;      // user-space buffer
+    size_t len;     // bytes in use
+    size_t cap;     // capacity of buf
+    int N;          // number of stations (values per row)
+    double *stage;  // [24][N] hour-major staging of one day: a row is contiguous
+};
+
+struct SIMI_diag
+{
+    /*
+     * the similarity diagnostics (FP_SSIM, Func_Diag.c):
+     * formatted per day by the parallel workers, written in the date order
+     */
+    int level;              // SIMI_AGG, SIMI_FULL or SIMI_BIN
+    int order;              // 1: SSIM; 0: distance
+    int n_threads;
+    long long *hist;        // [n_threads][SIMI_BINS + 2][3] counts of best, k-th and all k (AGG)
+    char *fname;            // FP_SSIM
+    struct Out_buffer ob;   // buffered FP_SSIM
+};
+
+struct SIMI_cache
+{
+    /*
+     * the daily similarity of (target day, library day) pairs, for the windows of
+     * CONTINUITY > 1: the window of target day i compares day i + s with library day c + s,
+     * the next target day compares the same pair with offset s - 1 (the same diagonal);
+     * each thread keeps the rows of its last CONTINUITY target days
+     */
+    int n_row;                  // CONTINUITY: target day a in row a % n_row
+    size_t n_lib;               // library days (columns)
+    int *day;                   // [n_row] the target day of each row; -1: none
+    double *D;                  // [n_row][n_lib] the similarity of the pairs; NAN: not computed
+};
+
+struct SIMI_batch
+{
+    /*
+     * the similarity of a block of target days to the candidate pools of their classes,
+     * computed in tiles of target x candidate days (Func_Batch.c) before the selection;
+     * the target days of one class (and window) form a group, the similarity of its
+     * (target, candidate) pairs a dense matrix
+     */
+    int n_block;                // target days in one block
+    int n_threads;
+    double **sim;               // [n_block] the similarity of a target day to its class pool; NULL: not batched
+    double *S;                  // the rows of sim, group after group
+    size_t S_cap;
+    double *B;                  // the daily similarity of the (target, library day) pairs of a group
+    size_t B_cap;
+    int *tgt;                   // [n_block] the target days of a group
+    int *row;                   // [n_block * CONTINUITY] the target days of the rows of B
+    int *row_map;               // [n_block + 2 * skip] the row of a target day in B; -1: none
+    int *col;                   // [n_lib] the library days of the columns of B
+    int *col_map;               // [n_lib] the column of a library day in B; -1: none
+    double *pack;               // [n_threads][(TILE_ROWS + TILE_COLS) * N_STATION] packed images
+};
+
+struct kNN_work
+{
+    /*
+     * the working state of the disaggregation loop over the target days:
+     * shared by the whole-series (kNN_MOF_days) and the streaming (kNN_MOF_stream) mode
+     */
+    int order;                  // 1: SSIM (decreasing); 0: Manhattan distance (increasing)
+    int skip;                   // (CONTINUITY - 1) / 2
+    int n_threads;
+    int n_block;                // target days in one parallel block
+    int chunk;                  // consecutive target days of one thread (DAYS_CHUNK if CONTINUITY > 1)
+    size_t n_lib;               // library days (size of the working buffers)
+    int *pool_cans;             // [n_threads][n_lib] candidate pools
+    double *SIMI;               // [n_threads][n_lib] similarity
+    struct SIMI_cache *sc;      // [n_threads] the similarity of the pairs (CONTINUITY > 1); otherwise NULL
+    struct SIMI_batch bt;       // the similarity of the days of a block (not VAR 5)
+    struct kNN_day *days;       // [n_block] the selection of the days in a block
+    struct df_rr_h out;         // the disaggregated hourly output of one day
+    FILE *fp_out;               // FP_OUT (or the standard output)
+    struct Out_buffer ob;       // buffered FP_OUT
+    int f_diag;                 // 1: the similarity diagnostics are written (FP_SSIM)
+    struct SIMI_diag dg;        // the similarity diagnostics FP_SSIM (if written)
+    int f_bin;                  // 1: binary output (OUT_FORMAT: BIN, BIN64)
+    struct Bin_out bo;          // the binary output
+    struct df_rr_h *out_t;      // [n_threads] disaggregated output of one day, per thread (binary)
+    unsigned char *rec_t;       // [n_threads][rec_size] one record, per thread (binary)
+    int day_base;               // the day (in the whole series) of index 0 of p_rrd
+    int f_zip;                  // 1: compressed output (OUT_FORMAT: ZIP)
+    int zip_days;               // days per compressed block
+    struct Zip_block *zb;       // [n_block / zip_days] the compressed blocks of a block of target days
+    struct Zip_work *zw;        // [n_threads] scratch buffers of the compression
+};
+
 struct Para_global
     {
         /* global parameters */
@@ -77,6 +429,13 @@ struct Para_global
         char FP_OUT[200];       // file path of output(hourly) precipitation from disaggregation
         char FP_LOG[200];       // file path of log file
         char FP_SSIM[200];      // file path and name to SSIM output
+        char SSIM_LEVEL[10];    // FP_SSIM content: FULL (the k nearest candidates), AGG (per day and
+                                // histograms), BIN (FULL in binary records)
+        char FP_CACHE[200];     // file path of the binary library cache; FALSE: no cache
+        char STREAM[10];        // toggle (flag), stream the daily data through a bounded window
+        char OUT_FORMAT[10];    // FP_OUT format: CSV (hourly values), INDEX (sampled fragments),
+                                // BIN or BIN64 (fixed-size binary records, float or double),
+                                // ZIP (compressed columnar blocks)
         /*****
          * the covariate (both daily and hourly) data should share the 
          * same dimension (time coverage and space or sites domain) with 
@@ -102,6 +461,8 @@ struct Para_global
         double power[3];        // 3 paras in SSIM
         double NODATA;          // nodata value
         int RUN;                // simulation runs 
+        int THREADS;            // number of threads in disaggregation
+        unsigned long long SEED;    // seed of the random numbers (fragment sampling)
         int PREPROCESS;         // preprocess the data by normalization or standardization
         /**********
          * PREPROCESS:
@@ -109,7 +470,64 @@ struct Para_global
          * 1: normalization
          * 2: standardization
          * ********/
+        double PRE_CENTER;      // preprocessing: x -> (x - PRE_CENTER) / PRE_SCALE
+        double PRE_SCALE;
     };
 
+struct kNN_lib
+{
+    /*
+     * the library of an engine context (Func_Engine.c), kept resident,
+     * loaded again when its source files change
+     */
+    unsigned long long key;     // Lib_cache_key() of the loaded sources
+    struct df_cp *df_cps;       // the CP series (T_CP); in the mapping of the cache if cached
+    int nrow_cp;
+    struct CP_calendar cal;
+    struct df_rr_h *df_hly;     // the hourly library
+    int ndays_h;
+    int cached;                 // 1: mapped from FP_CACHE (Lib_cache_load())
+    double *Solar_MAX;          // maxima of solar radiation (VAR: 5)
+    struct class_index ci;
+    int *pool_cans;             // [n_threads][ndays_h] working buffers of kNN_day_select()
+    double *SIMI;
+    struct SIMI_cache *sc;      // [n_threads] (CONTINUITY > 1); otherwise NULL
+    struct SIMI_batch bt;       // the similarity of a block of days (not VAR 5)
+};
+
+struct kNN_engine
+{
+    /*
+     * an engine context (knnmof.h): the configuration, its library and the
+     * buffers of the target days, which grow as needed; no global state
+     */
+    struct Para_global gp;
+    struct kNN_lib lib;
+    int loaded;                 // 1: lib is loaded for gp
+    unsigned long long key_failed;  // Lib_cache_key() of the sources whose load failed last; 0: none
+    int cap;                    // days allocated
+    struct df_rr_d *days;
+    double *rr;                 // [cap][N_STATION] the daily values
+    double *rr_pre;             // [cap][N_STATION] the preprocessed values (PREPROCESS)
+    struct kNN_day *sel;        // [cap] the candidate selection of each day
+    struct df_rr_h out;         // the disaggregated values of one day and run
+    char error[256];            // the message of the last error
+};
+
+struct Serve_request
+{
+    /*
+     * the target days of one request to the server, the arrays grow as needed
+     */
+    int n;                      // days in the request
+    int cap;                    // days allocated
+    int *ymd;                   // [cap][3] the dates
+    int *cp;                    // [cap] the cp (0: from FP_CP)
+    double *rr;                 // [cap][N_STATION] the daily values
+    double *hourly;             // [cap][RUN][24][N_STATION] the disaggregated values
+    char *line;                 // the current request line
+    size_t line_cap;
+};
+
 
 #endif
@@ -0,0 +1,110 @@
+#ifndef KNNMOF_H
+#define KNNMOF_H
+
+/*
+ * SUMMARY:      knnmof.h
+ * USAGE:        the C interface of the disaggregation engine (library knnmof)
+ * AUTHOR:       Xiaoxiang Guan
+ * ORG:          Section Hydrology, GFZ
+ * E-MAIL:       guan@gfz-potsdam.de
+ * ORIG-DATE:    Oct-2024
+ * DESCRIPTION:  an engine context holds a configuration, the hourly library loaded for it
+ *               and its working buffers; contexts are independent of each other and can
+ *               be used from different threads at the same time (one thread per context);
+ *               the functions return KNN_OK or an error code, and never end the process
+ *               (invalid input, unreadable files, exhausted memory)
+ *
+ *               kNN_engine *e;
+ *               kNN_engine_create(&e);
+ *               kNN_engine_config_file(e, "gp.txt");    // or kNN_engine_config(e, "VAR", "0"), ...
+ *               kNN_engine_load(e);
+ *               kNN_engine_days(e, n, ymd, NULL, daily, hourly);
+ *               kNN_engine_free(e);
+ * DESCRIP-END.
+ *
+ * COMMENTS:
+ * - the configuration keys and values are those of the global parameter file;
+ *   the keys of the files to write (FP_OUT, FP_SSIM, FP_LOG, ...) are accepted and not used
+ * - the days of one call are disaggregated as a daily data file with these days:
+ *   with CONTINUITY > 1 they should be consecutive
+ * - kNN_MOF_m serve is built on it; the batch run of kNN_MOF_m keeps its own pipeline
+ *   (see main())
+ *
+ */
+
+#define KNN_OK 0
+#define KNN_ERR_ARG 1       // an invalid argument: a NULL pointer, the number of days, the cp
+#define KNN_ERR_CONFIG 2    // an unknown parameter, or an invalid configuration
+#define KNN_ERR_FILE 3      // a source file cannot be read, or is malformed
+#define KNN_ERR_STATE 4     // no library loaded (kNN_engine_load())
+#define KNN_ERR_DATE 5      // an invalid date, or a date without cp in FP_CP
+#define KNN_ERR_DATA 6      // the daily values of a day are missing (NODATA; SSIM: less than 2 sites),
+                            // or no library day fits them (VAR 1, 4)
+#define KNN_ERR_MEMORY 7    // out of memory
+
+typedef struct kNN_engine kNN_engine;
+
+/* a new engine context, with the default configuration */
+int kNN_engine_create(
+    kNN_engine **p_e
+);
+
+void kNN_engine_free(
+    kNN_engine *e
+);
+
+/* set one parameter, as the row "key,value" of the global parameter file;
+ * a loaded library is released (load it again after the configuration) */
+int kNN_engine_config(
+    kNN_engine *e,
+    const char *key,
+    const char *value
+);
+
+/* the configuration of a global parameter file (the parameters not in it: the default) */
+int kNN_engine_config_file(
+    kNN_engine *e,
+    const char *fname
+);
+
+/* load the hourly library (FP_HOURLY), the CP series (FP_CP) or the library cache
+ * (FP_CACHE); loaded again if called again, and if that fails the library loaded
+ * before is kept */
+int kNN_engine_load(
+    kNN_engine *e
+);
+
+/* 1: the source files of the loaded library have changed since (load it again); 0: not,
+ * or they are the ones a kNN_engine_load() failed on */
+int kNN_engine_changed(
+    kNN_engine *e
+);
+
+/* the sizes of the buffers: stations (N_STATION), runs (RUN), days of the library */
+int kNN_engine_info(
+    kNN_engine *e,
+    int *N_STATION,
+    int *RUN,
+    int *ndays_lib
+);
+
+/* disaggregate n days:
+ *   ymd: [n][3] the dates (y, m, d)
+ *   cp: [n] the cp of each day (T_CP: TRUE; 0: taken from FP_CP); NULL: all from FP_CP
+ *   daily: [n][N_STATION] the daily values
+ *   hourly: [n][RUN][24][N_STATION] the disaggregated values (output) */
+int kNN_engine_days(
+    kNN_engine *e,
+    int n,
+    const int *ymd,
+    const int *cp,
+    const double *daily,
+    double *hourly
+);
+
+/* the message of the last error of the context */
+const char *kNN_engine_error(
+    kNN_engine *e
+);
+
+#endif
@@ -12,6 +12,13 @@
 #include "Func_Disaggregate.h"
 // #include "Func_Covariate.h"
 #include "Func_Solar.h"
+#include "Func_CPU.h"
+#include "Func_Cache.h"
+#include "Func_Writer.h"
+#include "Func_Expand.h"
+#include "Func_Binary.h"
+#include "Func_Diag.h"
+#include "Func_Serve.h"
 
 /****** exit description *****
  * void exit(int status);
@@ -29,9 +36,7 @@
  *
  */
 
-FILE *p_SSIM;
-FILE *p_log;  // file pointer pointing to log file
-int f_prep;   // flag for preprocessing the data with normalization or standardization
+FILE *p_log;  // file pointer pointing to log file (the front ends: Func_Print.c)
 
 /*****************
  * main function
@@ -43,6 +48,36 @@ int main(int argc, char * argv[]) {
     */
     /* char fname[100] = "D:/kNN_MOF_cp/data/global_para.txt";
         this should be the only extern input for this program */
+    if (argc > 1 && strcmp(argv[1], "expand") == 0)
+    {
+        /* kNN_MOF_m expand <global parameter file> [key=value ...]: 
+         * rebuild the hourly values from an index output (OUT_FORMAT: INDEX) */
+        return Expand_command(argc - 2, argv + 2);
+    }
+    if (argc > 1 && strcmp(argv[1], "convert") == 0)
+    {
+        /* kNN_MOF_m convert <binary file> [out=file]: binary output (OUT_FORMAT: BIN, ZIP; SSIM_LEVEL: BIN) to CSV */
+        return Bin_command(argc - 2, argv + 2);
+    }
+    if (argc > 1 && strcmp(argv[1], "serve") == 0)
+    {
+        /* kNN_MOF_m serve <global parameter file> [socket=path]: 
+         * keep the library loaded and disaggregate the days sent over a Unix socket */
+        return Serve_command(argc - 2, argv + 2);
+    }
+
+    /****** the batch run ******
+     * kNN_MOF_m serve is a front end of the engine (knnmof.h); the batch run below is not,
+     * it shares with the engine the import, initialization, selection, sampling and
+     * fragments, but keeps its own pipeline, for what the engine does not do:
+     * - PREPROCESS: the normalization (standardization) is derived from the daily data
+     *   together with the library; the engine knows the library alone
+     * - the daily data are disaggregated block by block as they are read (or streamed,
+     *   STREAM), the windows (CONTINUITY) crossing the blocks; the engine disaggregates
+     *   the days of one call into a buffer of all their hourly values
+     * - the outputs besides the hourly values: the fragment indices (OUT_FORMAT: INDEX),
+     *   the similarity (FP_SSIM), the binary records written by each thread (BIN, ZIP)
+     ****/
     time_t tm;  //datatype from <time.h>
     time(&tm);
 
@@ -56,6 +91,40 @@ int main(int argc, char * argv[]) {
     argv[1]: pointing to the second string (parameter): file path and name of global parameter file.
     */
     import_global(*(++argv), p_gp);
+    if (strcmp(p_gp->FP_OUT, "-") == 0)
+    {
+        // the output goes to the standard output: keep it free of the console messages
+        Out_stdout_reserve();
+    }
+    int f_stream = (strncmp(p_gp->STREAM, "TRUE", 4) == 0);  // stream the daily data
+    if (strncmp(p_gp->OUT_FORMAT, "CSV", 3) != 0 && strncmp(p_gp->OUT_FORMAT, "INDEX", 5) != 0 &&
+        strncmp(p_gp->OUT_FORMAT, "BIN", 3) != 0 && strncmp(p_gp->OUT_FORMAT, "ZIP", 3) != 0)
+    {
+        printf("Unknown OUT_FORMAT: %s (CSV, INDEX, BIN, BIN64 or ZIP)\n", p_gp->OUT_FORMAT);
+        exit(1);
+    }
+#ifndef HAVE_ZLIB
+    if (strncmp(p_gp->OUT_FORMAT, "ZIP", 3) == 0)
+    {
+        printf("The compressed output (OUT_FORMAT: ZIP) requires zlib: not available in this build\n");
+        exit(1);
+    }
+#endif
+    if (strncmp(p_gp->OUT_FORMAT, "BIN", 3) == 0 && strcmp(p_gp->FP_OUT, "-") == 0)
+    {
+        printf("The binary output (OUT_FORMAT: %s) is written at offsets: FP_OUT must be a file\n", p_gp->OUT_FORMAT);
+        exit(1);
+    }
+    if (strncmp(p_gp->FP_SSIM, "FALSE", 5) != 0 && Diag_level(p_gp->SSIM_LEVEL) == 0)
+    {
+        printf("Unknown SSIM_LEVEL: %s (FULL, AGG or BIN)\n", p_gp->SSIM_LEVEL);
+        exit(1);
+    }
+    if (strcmp(p_gp->FP_DAILY, "-") == 0 && !f_stream)
+    {
+        printf("The daily data from the standard input (FP_DAILY: -) require STREAM,TRUE!\n");
+        exit(1);
+    }
     char VARname[20] = ""; VAR_NAME(p_gp->VAR, VARname);
     if ((p_log = fopen(p_gp->FP_LOG, "a+")) == NULL)
     {
@@ -63,15 +132,48 @@ int main(int argc, char * argv[]) {
         exit(1);
     }
     Print_gp(p_gp);
-    f_prep = p_gp->PREPROCESS;
+    printf("SIMD: %s\n", CPU_SIMD_name(CPU_SIMD_level()));
+    fprintf(p_log, "SIMD: %s\n", CPU_SIMD_name(CPU_SIMD_level()));
+    int f_prep = p_gp->PREPROCESS;   // flag for preprocessing the data with normalization or standardization
     /******* import circulation pattern series *********/
     
-    static struct df_cp df_cps[MAXrow];
+    struct df_cp *df_cps = NULL;    // allocated by import_df_cp(), sized by the file; or in the library cache
     int nrow_cp=0;  // the number of CP data columns: 4 (y, m, d, cp)
+    char msg[256];  // the reason an input file is rejected (import_df_cp(), import_dfrr_h())
+
+    /****** the library cache: the hourly library and the CP series, mapped (shared) *******/
+    int ndays_h;
+    struct df_rr_h *df_hly;     // allocated by import_dfrr_h() or Lib_cache_load()
+    double *Solar_MAX = NULL;   // maxima of solar radiation (VAR: 5)
+    int lib_cached = 0;         // 1: the library is loaded from the binary cache
+    if (strncmp(p_gp->FP_CACHE, "FALSE", 5) != 0)
+    {
+        lib_cached = Lib_cache_load(p_gp, &df_hly, &ndays_h, &Solar_MAX, &df_cps, &nrow_cp);
+        printf("------ Library cache: %s\n", lib_cached ? "loaded" : "not found or outdated");
+        fprintf(p_log, "------ Library cache: %s\n", lib_cached ? "loaded" : "not found or outdated");
+    }
     if (strncmp(p_gp->T_CP, "TRUE", 4) == 0) {
-        nrow_cp = import_df_cp(Para_df.FP_CP, df_cps);
+        if (!lib_cached)
+        {
+            if ((nrow_cp = import_df_cp(Para_df.FP_CP, &df_cps, msg, sizeof(msg))) < 0)
+            {
+                if (nrow_cp == -2)
+                {
+                    printf("Program terminated: cannot allocate memory for cp data\n");
+                } else {
+                    printf("Program terminated: %s\n", msg);
+                }
+                exit(1);
+            }
+        }
         Print_cp(df_cps, nrow_cp);
     } 
+    struct CP_calendar cal;         // O(1) lookup of the cp by date
+    if (initialize_CP_calendar(df_cps, nrow_cp, &cal) != 0)
+    {
+        printf("Program terminated: cannot allocate memory for the CP calendar\n");
+        exit(1);
+    }
     if (strncmp(p_gp->MONTH, "TRUE", 4) == 0)
     {
         time(&tm);
@@ -86,41 +188,116 @@ int main(int argc, char * argv[]) {
     }
     
     /****** import daily rainfall data (to be disaggregated) *******/
-    static struct df_rr_d df_dly[MAXrow];
-    int nrow_rr_d;
-    nrow_rr_d = import_dfrr_d(Para_df.FP_DAILY, Para_df.N_STATION, df_dly);
-    initialize_dfrr_d(p_gp, df_dly, df_cps, nrow_rr_d, nrow_cp);
-    Print_dly(df_dly, p_gp, nrow_rr_d);
+    struct df_rr_d *df_dly = NULL;  // allocated by import_dfrr_d(), sized by the file
+    int nrow_rr_d = 0;              // streaming: read and disaggregated day by day (kNN_MOF_stream())
+    if (f_stream)
+    {
+        initialize_dfrr_d(p_gp, df_dly, &cal, nrow_rr_d);
+        printf("------ Streaming daily data: %s\n* the total classes:  %d\n", Para_df.FP_DAILY, p_gp->CLASS_N);
+        fprintf(p_log, "------ Streaming daily data: %s\n* the total classes:  %d\n", Para_df.FP_DAILY, p_gp->CLASS_N);
+    }
+    else
+    {
+        nrow_rr_d = import_dfrr_d(Para_df.FP_DAILY, Para_df.N_STATION, Para_df.THREADS, &df_dly);
+        initialize_dfrr_d(p_gp, df_dly, &cal, nrow_rr_d);
+        Print_dly(df_dly, p_gp, nrow_rr_d);
+    }
 
     /****** import hourly rainfall data (obs as fragments) *******/
-    int ndays_h;
-    static struct df_rr_h df_hly[MAXrow];
-    ndays_h = import_dfrr_h(p_gp->VAR, Para_df.FP_HOURLY, Para_df.N_STATION, df_hly);
-    initialize_dfrr_h(p_gp, df_hly, df_cps, ndays_h, nrow_cp);
+    if (!lib_cached)
+    {
+        ndays_h = import_dfrr_h(p_gp->VAR, Para_df.FP_HOURLY, Para_df.N_STATION, Para_df.THREADS, &df_hly, msg, sizeof(msg));
+        if (ndays_h < 0)
+        {
+            if (ndays_h == -2)
+            {
+                printf("Program terminated: cannot allocate memory for the hourly library\n");
+            } else {
+                printf("Program terminated: %s\n", msg);
+            }
+            exit(1);
+        }
+        int i_cp = initialize_dfrr_h(p_gp, df_hly, &cal, ndays_h);
+        if (i_cp < ndays_h)
+        {
+            printf(
+                "Program terminated: cannot find the cp class for the date %d-%02d-%02d\n",
+                df_hly[i_cp].date.y, df_hly[i_cp].date.m, df_hly[i_cp].date.d
+            );
+            exit(2);
+        }
+    }
     Print_hly(df_hly, ndays_h);
+    /****** class index of the hourly library: candidate pools *******/
+    struct class_index ci;
+    if (initialize_class_index(df_hly, ndays_h, (int)((p_gp->CONTINUITY - 1) / 2), &ci) != 0)
+    {
+        printf("Program terminated: cannot allocate memory for the class index\n");
+        exit(1);
+    }
+    if (ci.offset[ci.n_class] < 1)
+    {
+        printf("Program terminated: no candidate days in the hourly library (CONTINUITY %d)\n", p_gp->CONTINUITY);
+        exit(1);
+    }
     /****** preprocessing *******/
+    int status = 0;
     if (f_prep == 1)
     {
-        Normalize(p_gp, df_dly, df_hly, nrow_rr_d, ndays_h);
+        status = Normalize(p_gp, df_dly, df_hly, nrow_rr_d, ndays_h);
     }
     else if (f_prep == 2)
     {
-        Standardize(p_gp, df_dly, df_hly, nrow_rr_d, ndays_h);
+        status = Standardize(p_gp, df_dly, df_hly, nrow_rr_d, ndays_h);
+    }
+    if (status == -1)
+    {
+        printf((f_prep == 1) ? "Error: in normalization, max == min! \n" :
+               "Error: in standardization, no positive values or sd == 0! \n");
+        exit(2);
+    }
+    if (status == -2)
+    {
+        printf("Program terminated: cannot allocate memory for the preprocessed data\n");
+        exit(1);
+    }
+    /****** per-day SSIM statistics *******/
+    initialize_SSIM_stats(p_gp, df_dly, df_hly, nrow_rr_d, ndays_h, !lib_cached);
+    if (p_gp->VAR == 5 && Solar_MAX == NULL)
+    {
+        Solar_MAX_lump_derive(&Solar_MAX, df_hly, p_gp, ndays_h);
+        if (Solar_MAX == NULL)
+        {
+            printf("Program terminated: cannot allocate memory for the solar radiation maxima\n");
+            exit(1);
+        }
+    }
+    if (!lib_cached && strncmp(p_gp->FP_CACHE, "FALSE", 5) != 0)
+    {
+        int saved = Lib_cache_save(p_gp, df_hly, ndays_h, Solar_MAX, df_cps, nrow_cp);
+        if (saved == -2)
+        {
+            printf("Warning: FP_CACHE SHM (shared memory) is not available on this platform\n");
+        }
+        else if (saved != 0)
+        {
+            printf("Warning: cannot write the library cache: %s\n", p_gp->FP_CACHE);
+        }
     }
 
     /****** covariate *******/
-    // static struct df_rr_d df_dly_cov[MAXrow];
-    // static struct df_rr_h df_hly_cov[MAXrow];
+    // struct df_rr_d *df_dly_cov;
+    // struct df_rr_h *df_hly_cov;
     // if (p_gp->VAR == 5)
     // {
     //     /****** import covariate data *******/
     //     int VAR_cov = 0;
     //     int nrow_rr_d_cov;
-    //     nrow_rr_d_cov = import_dfrr_d(Para_df.FP_COV_DLY, Para_df.N_STATION, df_dly_cov);
+    //     nrow_rr_d_cov = import_dfrr_d(Para_df.FP_COV_DLY, Para_df.N_STATION, Para_df.THREADS, &df_dly_cov);
     //     Normalize_d(p_gp, df_dly_cov, nrow_rr_d_cov);
 
     //     int ndays_h_cov;
-    //     ndays_h_cov = import_dfrr_h(VAR_cov, Para_df.FP_COV_HLY, Para_df.N_STATION, df_hly_cov);
+    //     ndays_h_cov = import_dfrr_h(VAR_cov, Para_df.FP_COV_HLY, Para_df.N_STATION, Para_df.THREADS, &df_hly_cov);
     //     Normalize_h(p_gp, df_hly_cov, ndays_h_cov);
         
     //     if (!(nrow_rr_d == nrow_rr_d_cov && ndays_h == ndays_h_cov))
@@ -136,22 +313,38 @@ int main(int argc, char * argv[]) {
 
     /****** Disaggregation: kNN_MOF_cp *******/
 
+    FILE *p_SSIM;   // the similarity diagnostics (FP_SSIM)
     if (strncmp(p_gp->FP_SSIM, "FALSE", 5) == 0)
     {
         p_SSIM = NULL;
     }
     else 
     {
-        if ((p_SSIM = fopen(p_gp->FP_SSIM, "w")) == NULL)
+        // the header is written by Diag_open(), at the SSIM_LEVEL
+        if ((p_SSIM = fopen(p_gp->FP_SSIM, "wb")) == NULL)
         {
             printf("Cannot create / open SIMILARITY file: %s\n", p_gp->FP_SSIM);
             exit(1);
         }
-        fprintf(p_SSIM, "target,ID,index_Frag,SIMI,candidate\n");
     }
     
     printf("------ Disaggregating: ... \n");
-    if (p_gp->VAR == 5)
+    if (f_stream)
+    {
+        if (p_gp->VAR == 5)
+        {
+            Solar_MAX_lump_preview(Solar_MAX, p_gp);
+        }
+        kNN_MOF_stream(
+            df_hly,
+            p_gp,
+            &ci,
+            &cal,
+            (p_gp->VAR == 5) ? Solar_MAX : NULL,
+            ndays_h,
+            p_SSIM);
+    }
+    else if (p_gp->VAR == 5)
     {   // VAR:5  solar radiation
         // double *solar_max;
         // Solar_MAX_class_derive(&solar_max, df_hly, p_gp, ndays_h);
@@ -164,27 +357,36 @@ int main(int argc, char * argv[]) {
         //     nrow_rr_d,
         //     ndays_h);
 
-        double *Solar_MAX;
-        Solar_MAX_lump_derive(&Solar_MAX, df_hly, p_gp, ndays_h);
         Solar_MAX_lump_preview(Solar_MAX, p_gp);
 
         kNN_MOF_solar(
             df_hly,
             df_dly,
             p_gp,
+            &ci,
             Solar_MAX,
             nrow_rr_d,
-            ndays_h);
+            ndays_h,
+            p_SSIM);
     } else {
         kNN_MOF_SSIM(
             df_hly,
             df_dly,
             p_gp,
+            &ci,
             nrow_rr_d,
-            ndays_h);
+            ndays_h,
+            p_SSIM);
     }
     
-    fclose(p_SSIM);
+    if (p_SSIM != NULL)
+    {
+        fclose(p_SSIM);
+    }
+    if (f_prep != 0 && df_dly != NULL)
+    {
+        free_aligned(df_dly->p_rr_pre);  // one block (Prepro_days())
+    }
     time(&tm);
     printf("------ Disaggregation daily2hourly (Done): %s", ctime(&tm));
     fprintf(p_log, "------ Disaggregation daily2hourly (Done): %s", ctime(&tm));
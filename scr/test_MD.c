@@ -0,0 +1,125 @@
+/*
+ * SUMMARY:      test_MD.c
+ * USAGE:        ctest: the Manhattan distance variants against the scalar code
+ * AUTHOR:       Xiaoxiang Guan
+ * ORG:          Section Hydrology, GFZ
+ * E-MAIL:       guan@gfz-potsdam.de
+ * ORIG-DATE:    Oct-2024
+ * DESCRIPTION:  random image pairs (with NODATA sites) are compared
+ *               by Manhattan_distance() and Manhattan_tile(),
+ *               at each SIMD level the CPU supports (scalar, AVX2, AVX-512)
+ * DESCRIP-END.
+ * FUNCTIONS:    main();
+ *
+ * COMMENTS:
+ * the test fails (return 1) if Manhattan_distance() or Manhattan_tile() at any level
+ * differs at all from the scalar Manhattan_distance(): all of them sum in the site order;
+ * the levels not supported by the CPU are reported and skipped
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "def_struct.h"
+#include "Func_MD.h"
+#include "Func_CPU.h"
+
+#define N_IMAGE 29      // images per test set: not a multiple of the tile groups
+#define MAX_SIZE 67     // the sites: 1 to MAX_SIZE, covering the SIMD tails
+#define NODATA -9999.0
+
+static unsigned int seed = 20241002;
+
+static double rand_unit()
+{
+    /* the uniform random number in [0, 1): reproducible on any platform */
+    seed = seed * 1103515245u + 12345u;
+    return (double)((seed >> 8) & 0xFFFFFF) / 16777216.0;
+}
+
+static void image_random(
+    double *image,
+    int size
+)
+{
+    /* standardized-like image (rounding-sensitive sums): 15% NODATA sites */
+    for (int i = 0; i < size; i++)
+    {
+        image[i] = (rand_unit() < 0.15) ? NODATA : 10.0 * (rand_unit() - 0.5) / (1.0 + rand_unit());
+    }
+}
+
+int main()
+{
+    static double images[MAX_SIZE][N_IMAGE][MAX_SIZE];
+    static double ref[MAX_SIZE][N_IMAGE * N_IMAGE];
+    static double D[N_IMAGE * N_IMAGE];
+    double pack[MAX_SIZE * 8];
+    double *p_image[N_IMAGE];
+    int levels[3] = {SIMD_SCALAR, SIMD_AVX2, SIMD_AVX512};
+    int fail = 0;
+    int size, i, j, l;
+    double dis;
+
+    /* the reference: the scalar Manhattan_distance() */
+    CPU_SIMD_limit(SIMD_SCALAR);
+    for (size = 1; size <= MAX_SIZE; size++)
+    {
+        for (i = 0; i < N_IMAGE; i++)
+        {
+            image_random(images[size - 1][i], size);
+        }
+        for (i = 0; i < N_IMAGE; i++)
+        {
+            for (j = 0; j < N_IMAGE; j++)
+            {
+                ref[size - 1][i * N_IMAGE + j] =
+                    Manhattan_distance(images[size - 1][i], images[size - 1][j], NODATA, size);
+            }
+        }
+    }
+    for (l = 0; l < 3; l++)
+    {
+        if (CPU_SIMD_limit(levels[l]) != levels[l])
+        {
+            printf("%s: not supported by the CPU, skipped\n", CPU_SIMD_name(levels[l]));
+            continue;
+        }
+        for (size = 1; size <= MAX_SIZE; size++)
+        {
+            for (i = 0; i < N_IMAGE; i++)
+            {
+                p_image[i] = images[size - 1][i];
+            }
+            Manhattan_tile(p_image, N_IMAGE, p_image, N_IMAGE, NODATA, size, D, N_IMAGE, pack);
+            for (i = 0; i < N_IMAGE; i++)
+            {
+                for (j = 0; j < N_IMAGE; j++)
+                {
+                    dis = Manhattan_distance(p_image[i], p_image[j], NODATA, size);
+                    if (dis != ref[size - 1][i * N_IMAGE + j])
+                    {
+                        printf("%s, size %d, pair (%d, %d): scalar %.17g, Manhattan_distance %.17g\n",
+                               CPU_SIMD_name(levels[l]), size, i, j, ref[size - 1][i * N_IMAGE + j], dis);
+                        fail++;
+                    }
+                    if (D[i * N_IMAGE + j] != ref[size - 1][i * N_IMAGE + j])
+                    {
+                        printf("%s, size %d, pair (%d, %d): scalar %.17g, Manhattan_tile %.17g\n",
+                               CPU_SIMD_name(levels[l]), size, i, j, ref[size - 1][i * N_IMAGE + j],
+                               D[i * N_IMAGE + j]);
+                        fail++;
+                    }
+                }
+            }
+        }
+        printf("%s: compared\n", CPU_SIMD_name(levels[l]));
+    }
+    if (fail > 0)
+    {
+        printf("%d failures\n", fail);
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
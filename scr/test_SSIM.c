@@ -0,0 +1,163 @@
+/*
+ * SUMMARY:      test_SSIM.c
+ * USAGE:        ctest: the fast SSIM variants against the reference meanSSIM()
+ * AUTHOR:       Xiaoxiang Guan
+ * ORG:          Section Hydrology, GFZ
+ * E-MAIL:       guan@gfz-potsdam.de
+ * ORIG-DATE:    Oct-2024
+ * DESCRIPTION:  random image pairs (with NODATA sites and dry sites) are compared
+ *               by meanSSIM(), meanSSIM_cached() and SSIM_cross_tile(),
+ *               at each SIMD level the CPU supports (scalar, AVX2, AVX-512)
+ * DESCRIP-END.
+ * FUNCTIONS:    main();
+ *
+ * COMMENTS:
+ * the test fails (return 1) if:
+ * - meanSSIM_cached() differs from meanSSIM(): at all with the scalar code,
+ *   by more than SSIM_TOL with AVX2 / AVX-512 (the lanes summed in another order)
+ * - SSIM_cross_tile() differs from SSIM_cross() at all (the same rounding is documented)
+ * the levels not supported by the CPU are reported and skipped
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "def_struct.h"
+#include "Func_SSIM.h"
+#include "Func_CPU.h"
+
+#define N_IMAGE 64      // images per test set
+#define MAX_SIZE 67     // the sites: 2 to MAX_SIZE, covering the SIMD tails
+#define NODATA -9999.0
+#define SSIM_TOL 1e-12  // the stated agreement of meanSSIM_cached() with meanSSIM()
+
+static unsigned int seed = 20241001;
+
+static double rand_unit()
+{
+    /* the uniform random number in [0, 1): reproducible on any platform */
+    seed = seed * 1103515245u + 12345u;
+    return (double)((seed >> 8) & 0xFFFFFF) / 16777216.0;
+}
+
+static void image_random(
+    double *image,
+    int *missing,
+    int size
+)
+{
+    /* rainfall-like image: NODATA at the missing sites, 40% dry sites;
+     * the first two sites are never missing */
+    for (int i = 0; i < size; i++)
+    {
+        if (missing[i])
+        {
+            image[i] = NODATA;
+        }
+        else if (rand_unit() < 0.4)
+        {
+            image[i] = 0.0;
+        }
+        else
+        {
+            image[i] = 50.0 * rand_unit() * rand_unit();
+        }
+    }
+    if (image[0] == image[1])
+    {
+        image[1] += 0.1;  // not constant (sd > 0)
+    }
+}
+
+static int test_level(
+    int level,
+    double power[3],
+    double *max_diff
+)
+{
+    /* the number of failures at one SIMD level, with the SSIM power parameters */
+    static double images[N_IMAGE][MAX_SIZE];
+    static struct SSIM_stats stats[N_IMAGE];
+    static double C[N_IMAGE * N_IMAGE];
+    int missing[MAX_SIZE];
+    double *p_image[N_IMAGE];
+    double means[N_IMAGE];
+    double k[3] = {0.01, 0.03, 0.015};
+    double ref, fast, cross;
+    double tol = (level == SIMD_SCALAR) ? 0.0 : SSIM_TOL;
+    int fail = 0;
+    int size, i, j;
+
+    for (size = 2; size <= MAX_SIZE; size++)
+    {
+        for (i = 0; i < size; i++)
+        {
+            missing[i] = (i >= 2 && rand_unit() < 0.2);  // the same stations missing on all days
+        }
+        for (i = 0; i < N_IMAGE; i++)
+        {
+            image_random(images[i], missing, size);
+            image_stats(images[i], NODATA, size, &stats[i]);
+            p_image[i] = images[i];
+            means[i] = stats[i].mean;
+        }
+        SSIM_cross_tile(p_image, means, N_IMAGE, p_image, means, N_IMAGE, NODATA, size, C, N_IMAGE);
+        for (i = 0; i < N_IMAGE; i++)
+        {
+            for (j = 0; j < N_IMAGE; j++)
+            {
+                ref = meanSSIM(images[i], images[j], NODATA, size, k, power);
+                fast = meanSSIM_cached(images[i], images[j], &stats[i], &stats[j], NODATA, size, k, power);
+                if (fabs(fast - ref) > *max_diff)
+                {
+                    *max_diff = fabs(fast - ref);
+                }
+                if (!(fabs(fast - ref) <= tol))
+                {
+                    printf("%s, size %d, pair (%d, %d): meanSSIM %.17g, meanSSIM_cached %.17g\n",
+                           CPU_SIMD_name(level), size, i, j, ref, fast);
+                    fail++;
+                }
+                cross = SSIM_cross(images[i], images[j], NODATA, size, means[i], means[j]);
+                if (C[i * N_IMAGE + j] != cross)
+                {
+                    printf("%s, size %d, pair (%d, %d): SSIM_cross %.17g, SSIM_cross_tile %.17g\n",
+                           CPU_SIMD_name(level), size, i, j, cross, C[i * N_IMAGE + j]);
+                    fail++;
+                }
+            }
+        }
+    }
+    return fail;
+}
+
+int main()
+{
+    double powers[2][3] = {{1.0, 1.0, 1.0}, {2.0, 1.0, 3.0}};
+    int levels[3] = {SIMD_SCALAR, SIMD_AVX2, SIMD_AVX512};
+    int fail = 0;
+    double max_diff;
+
+    for (int l = 0; l < 3; l++)
+    {
+        if (CPU_SIMD_limit(levels[l]) != levels[l])
+        {
+            printf("%s: not supported by the CPU, skipped\n", CPU_SIMD_name(levels[l]));
+            continue;
+        }
+        max_diff = 0.0;
+        for (int p = 0; p < 2; p++)
+        {
+            fail += test_level(levels[l], powers[p], &max_diff);
+        }
+        printf("%s: max |meanSSIM_cached - meanSSIM| = %.3g\n", CPU_SIMD_name(levels[l]), max_diff);
+    }
+    if (fail > 0)
+    {
+        printf("%d failures\n", fail);
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
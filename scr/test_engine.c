@@ -0,0 +1,340 @@
+/*
+ * SUMMARY:      test_engine.c
+ * USAGE:        ctest: the disaggregation engine (knnmof.h) on small generated sources
+ * AUTHOR:       Xiaoxiang Guan
+ * ORG:          Section Hydrology, GFZ
+ * E-MAIL:       guan@gfz-potsdam.de
+ * ORIG-DATE:    Oct-2024
+ * DESCRIPTION:  each case writes its hourly library (and CP series) to the working
+ *               directory, configures an engine on them and checks the return codes
+ *               and the disaggregated values; a case that ends the process fails the test
+ * DESCRIP-END.
+ * FUNCTIONS:    main();
+ *
+ * COMMENTS:
+ * the cases:
+ * - sunshine (VAR 4), a class whose days do not fit the target day:
+ *   the candidates come from the whole library, with the same filter
+ * - sunshine (VAR 4), no library day fits the target day: KNN_ERR_DATA
+ * - the sources the selection cannot use, rejected when loaded (KNN_ERR_FILE):
+ *   library days not in FP_CP, a cp of 0, no hourly library, nothing to normalize or standardize,
+ *   a library day with less than 2 sites (SSIM)
+ * - a reload of a truncated FP_CP or FP_HOURLY fails (KNN_ERR_FILE),
+ *   the library loaded before is kept and gives the same values
+ * - nothing is written to the standard output
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "knnmof.h"
+
+#define N 2             // stations of the generated sources
+#define RUN 3
+#define FP_HLY "test_engine_h.csv"
+#define FP_CP "test_engine_cp.csv"
+#define FP_STDOUT "test_engine_stdout.txt"
+
+static int fail = 0;
+
+static void check(
+    int ok,
+    const char *what
+)
+{
+    /* count and report a failed check */
+    if (!ok)
+    {
+        fprintf(stderr, "FAILED: %s\n", what);
+        fail++;
+    }
+}
+
+static void hourly_day(
+    FILE *fp,
+    int y,
+    int m,
+    int d,
+    const int *sunny
+)
+{
+    /* the 24 rows of one sunshine day (minutes): 30 minutes from 8 to 15 h at the sunny sites */
+    for (int h = 0; h < 24; h++)
+    {
+        fprintf(fp, "%d,%d,%d,%d", y, m, d, h);
+        for (int j = 0; j < N; j++)
+        {
+            fprintf(fp, ",%.2f", (sunny[j] && h >= 8 && h < 16) ? 30.0 : 0.0);
+        }
+        fprintf(fp, "\n");
+    }
+}
+
+static kNN_engine *engine_open(
+    const char *extra[][2],
+    int n_extra
+)
+{
+    /* an engine for sunshine duration (VAR 4) on FP_HLY, conditioned on the season;
+     * then the extra parameters (replacing these) */
+    const char *gp[][2] = {
+        {"VAR", "4"}, {"N_STATION", "2"}, {"RUN", "3"}, {"FP_HOURLY", FP_HLY},
+        {"T_CP", "FALSE"}, {"MONTH", "FALSE"}, {"SEASON", "TRUE"},
+        {"SUMMER_FROM", "5"}, {"SUMMER_TO", "10"}, {"SIMI", "SSIM"},
+        {"SSIM_K", "0.01,0.03,0.0212"}, {"SSIM_POWER", "1,1,1"}, {"NODATA", "-999"}};
+    kNN_engine *e;
+    int n = (int)(sizeof(gp) / sizeof(gp[0]));
+    if (kNN_engine_create(&e) != KNN_OK)
+    {
+        return NULL;
+    }
+    for (int i = 0; i < n + n_extra; i++)
+    {
+        const char **kv = (i < n) ? gp[i] : extra[i - n];
+        if (kNN_engine_config(e, kv[0], kv[1]) != KNN_OK)
+        {
+            fprintf(stderr, "%s\n", kNN_engine_error(e));
+            kNN_engine_free(e);
+            return NULL;
+        }
+    }
+    return e;
+}
+
+static int load_error(
+    const char *extra[][2],
+    int n_extra,
+    const char *what
+)
+{
+    /* the code of a library load (expected to fail), its message reported */
+    kNN_engine *e = engine_open(extra, n_extra);
+    int rc;
+    if (e == NULL)
+    {
+        return -1;
+    }
+    rc = kNN_engine_load(e);
+    fprintf(stderr, "%s: %d, %s\n", what, rc, (rc != KNN_OK) ? kNN_engine_error(e) : "");
+    kNN_engine_free(e);
+    return rc;
+}
+
+static void case_sunshine_fallback()
+{
+    /* winter days: one site without sunshine; summer days: both sunny;
+     * a sunny winter target day takes its fragments from the summer days */
+    int one[N] = {1, 0}, both[N] = {1, 1};
+    FILE *fp = fopen(FP_HLY, "w");
+    for (int d = 1; d <= 10; d++)
+    {
+        hourly_day(fp, 2000, 1, d, one);
+        hourly_day(fp, 2000, 7, d, both);
+    }
+    fclose(fp);
+
+    kNN_engine *e = engine_open(NULL, 0);
+    int ymd[3] = {2001, 1, 15};
+    double daily[N] = {4.0, 3.0};
+    double hourly[RUN * 24 * N];
+    double sum;
+    int rc;
+    check(e != NULL && kNN_engine_load(e) == KNN_OK, "sunshine fallback: load");
+    rc = kNN_engine_days(e, 1, ymd, NULL, daily, hourly);
+    check(rc == KNN_OK, "sunshine fallback: disaggregated");
+    for (int t = 0; rc == KNN_OK && t < RUN; t++)
+    {
+        for (int j = 0; j < N; j++)
+        {
+            sum = 0.0;
+            for (int h = 0; h < 24; h++)
+            {
+                sum += hourly[(t * 24 + h) * N + j];
+            }
+            check(fabs(sum - daily[j] * 60.0) < 1e-6, "sunshine fallback: the daily sum of a site");
+        }
+    }
+    kNN_engine_free(e);
+}
+
+static void case_sunshine_no_fit()
+{
+    /* every library day has a site without sunshine, the target day is sunny at both */
+    int one[N] = {1, 0};
+    FILE *fp = fopen(FP_HLY, "w");
+    for (int d = 1; d <= 10; d++)
+    {
+        hourly_day(fp, 2000, 1, d, one);
+        hourly_day(fp, 2000, 7, d, one);
+    }
+    fclose(fp);
+
+    kNN_engine *e = engine_open(NULL, 0);
+    int ymd[3] = {2001, 1, 15};
+    double daily[N] = {4.0, 3.0};
+    double hourly[RUN * 24 * N];
+    check(e != NULL && kNN_engine_load(e) == KNN_OK, "sunshine no fit: load");
+    check(kNN_engine_days(e, 1, ymd, NULL, daily, hourly) == KNN_ERR_DATA, "sunshine no fit: KNN_ERR_DATA");
+    kNN_engine_free(e);
+}
+
+static void case_sources_rejected()
+{
+    /* sources the selection cannot use: rejected by kNN_engine_load(), nothing printed */
+    int both[N] = {1, 1}, none[N] = {0, 0};
+    FILE *fp = fopen(FP_HLY, "w");
+    for (int d = 1; d <= 10; d++)
+    {
+        hourly_day(fp, 2000, 12, d, both);
+    }
+    fclose(fp);
+    fp = fopen(FP_CP, "w");
+    for (int d = 1; d <= 30; d++)
+    {
+        fprintf(fp, "2000,6,%d,%d\n", d, 1 + d % 2);
+    }
+    fclose(fp);
+    const char *cp[][2] = {{"T_CP", "TRUE"}, {"FP_CP", FP_CP}};
+    check(load_error(cp, 2, "library days not in FP_CP") == KNN_ERR_FILE, "library days not in FP_CP");
+    fp = fopen(FP_CP, "w");
+    for (int d = 1; d <= 10; d++)
+    {
+        fprintf(fp, "2000,12,%d,%d\n", d, (d == 7) ? 0 : 1 + d % 2);
+    }
+    fclose(fp);
+    check(load_error(cp, 2, "cp 0 in FP_CP") == KNN_ERR_FILE, "cp 0 in FP_CP");
+    const char *missing[][2] = {{"FP_HOURLY", "test_engine_missing.csv"}};
+    check(load_error(missing, 1, "no hourly library") == KNN_ERR_FILE, "no hourly library");
+
+    fp = fopen(FP_HLY, "w");
+    for (int d = 1; d <= 10; d++)
+    {
+        hourly_day(fp, 2000, 12, d, none);
+    }
+    fclose(fp);
+    const char *prep[][2] = {{"PREP", "1"}};
+    check(load_error(prep, 1, "nothing to normalize") == KNN_ERR_FILE, "nothing to normalize");
+    prep[0][1] = "2";
+    check(load_error(prep, 1, "nothing to standardize") == KNN_ERR_FILE, "nothing to standardize");
+
+    /* air temperature; one site without data (NODATA all day): an empty SSIM image */
+    fp = fopen(FP_HLY, "w");
+    for (int d = 1; d <= 10; d++)
+    {
+        for (int h = 0; h < 24; h++)
+        {
+            fprintf(fp, "2000,12,%d,%d,%.2f,%.2f\n", d, h, 0.5 * h, (d == 5) ? -999.0 : 0.3 * h);
+        }
+    }
+    fclose(fp);
+    const char *empty[][2] = {{"VAR", "0"}};
+    check(load_error(empty, 1, "empty library image") == KNN_ERR_FILE, "empty library image");
+}
+
+static void write_reload_sources(
+    int cp_months,
+    int hly_cut
+)
+{
+    /* the library of case_reload(): 10 days in January and July, both sites sunny,
+     * the cp series of months 1 to cp_months; the hourly file without its last hly_cut bytes */
+    int both[N] = {1, 1};
+    FILE *fp = fopen(FP_CP, "w");
+    for (int m = 1; m <= cp_months; m++)
+    {
+        for (int d = 1; d <= 28; d++)
+        {
+            fprintf(fp, "2000,%d,%d,%d\n", m, d, 1 + (m + d) % 2);
+        }
+    }
+    fclose(fp);
+    fp = fopen(FP_HLY, "w+");
+    for (int d = 1; d <= 10; d++)
+    {
+        hourly_day(fp, 2000, 1, d, both);
+        hourly_day(fp, 2000, 7, d, both);
+    }
+    long size = ftell(fp);
+    char *text = (char *)malloc(size);
+    rewind(fp);
+    if (text != NULL && fread(text, 1, size, fp) == (size_t)size)
+    {
+        fclose(fp);
+        fp = fopen(FP_HLY, "w");
+        fwrite(text, 1, size - hly_cut, fp);
+    }
+    free(text);
+    fclose(fp);
+}
+
+static void case_reload()
+{
+    /* a source caught while it is rewritten (truncated): the reload fails and
+     * the library loaded before keeps serving (as kNN_MOF_m serve does) */
+    const char *cp[][2] = {{"T_CP", "TRUE"}, {"FP_CP", FP_CP}};
+    int ymd[3] = {2000, 7, 15};
+    double daily[N] = {4.0, 3.0};
+    double hourly0[RUN * 24 * N], hourly[RUN * 24 * N];
+    int n_sta, n_run, ndays;
+    write_reload_sources(12, 0);
+    kNN_engine *e = engine_open(cp, 2);
+    if (e == NULL || kNN_engine_load(e) != KNN_OK ||
+        kNN_engine_days(e, 1, ymd, NULL, daily, hourly0) != KNN_OK)
+    {
+        check(0, "reload: first load");
+        kNN_engine_free(e);
+        return;
+    }
+    const char *what[] = {
+        "reload: FP_CP truncated", "reload: FP_HOURLY truncated in a row",
+        "reload: FP_HOURLY truncated in a day", "reload: the sources restored"};
+    int cp_months[] = {6, 12, 12, 12};
+    int hly_cut[] = {0, 15, 120, 0};   // bytes: into the last row; about 5 rows (23 bytes each)
+    for (int k = 0; k < 4; k++)
+    {
+        write_reload_sources(cp_months[k], hly_cut[k]);
+        int rc = kNN_engine_load(e);
+        fprintf(stderr, "%s: %d, %s\n", what[k], rc, (rc != KNN_OK) ? kNN_engine_error(e) : "");
+        check((k < 3) ? rc == KNN_ERR_FILE : rc == KNN_OK, what[k]);
+        check(k == 3 || kNN_engine_changed(e) == 0, "reload: a failed source is not reported as changed");
+        kNN_engine_info(e, &n_sta, &n_run, &ndays);
+        check(ndays == 20, "reload: the library kept");
+        check(kNN_engine_days(e, 1, ymd, NULL, daily, hourly) == KNN_OK &&
+              memcmp(hourly, hourly0, sizeof(hourly)) == 0, "reload: the same disaggregation");
+    }
+    kNN_engine_free(e);
+}
+
+int main()
+{
+    /* the engine writes nothing to the standard output: kept in FP_STDOUT, then checked */
+    FILE *fp;
+    if (freopen(FP_STDOUT, "w", stdout) == NULL)
+    {
+        fprintf(stderr, "cannot redirect the standard output\n");
+        return 1;
+    }
+    case_sunshine_fallback();
+    case_sunshine_no_fit();
+    case_sources_rejected();
+    case_reload();
+    fflush(stdout);
+    fp = fopen(FP_STDOUT, "r");
+    check(fp != NULL && fgetc(fp) == EOF, "nothing written to the standard output");
+    if (fp != NULL)
+    {
+        fclose(fp);
+    }
+    remove(FP_HLY);
+    remove(FP_CP);
+    remove(FP_STDOUT);
+    if (fail > 0)
+    {
+        fprintf(stderr, "%d failures\n", fail);
+        return 1;
+    }
+    fprintf(stderr, "OK\n");
+    return 0;
+}